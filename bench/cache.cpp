@@ -0,0 +1,137 @@
+// Hit latency of the parse result cache (include/cache.hpp), without any socket in the way.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party bench/cache.cpp -o cache_bench -pthread
+// Usage: cache_bench <threads> <seconds> [--buffers] <file>...
+//
+// Every thread keeps probing the given files (round robin) through a shared cache, warmed up beforehand, and
+// reports the average time per probe: a path hit includes its stat(), a buffer hit its content hash.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_GIF_DETAIL
+#include <gif.hpp>
+
+#define IMAGE_EXIF_DETAIL
+#include <exif.hpp>
+
+#define IMAGE_JPG_DETAIL
+#include <jpg.hpp>
+
+#define IMAGE_BMP_DETAIL
+#include <bmp.hpp>
+
+#define IMAGE_PNG_DETAIL
+#include <png.hpp>
+
+#define IMAGE_TGA_DETAIL
+#include <tga.hpp>
+
+#define IMAGE_PSD_DETAIL
+#include <psd.hpp>
+
+#define PROBE_DETAIL
+#include <probe.hpp>
+
+#define CACHE_DETAIL
+#include <cache.hpp>
+
+using clock_type = std::chrono::steady_clock;
+
+int main(int argc, char *argv[])
+{
+  if (argc < 4) {
+    std::fprintf(stderr, "Usage: %s <threads> <seconds> [--buffers] <file>...\n", argv[0]);
+    return 1;
+  }
+
+  const size_t thread_count = std::max(1ul, std::strtoul(argv[1], nullptr, 10));
+  const double seconds = std::atof(argv[2]);
+
+  bool buffers = false;
+  std::vector<std::string> files;
+
+  for (int i = 3; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--buffers") == 0)
+      buffers = true;
+    else
+      files.emplace_back(argv[i]);
+  }
+
+  if (files.empty()) {
+    std::fprintf(stderr, "No input files\n");
+    return 1;
+  }
+
+  std::vector<std::vector<char>> contents;
+  if (buffers) {
+    for (const auto &file : files) {
+      std::ifstream stream(file, std::ios::binary);
+      contents.emplace_back(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    }
+  }
+
+  doors::cache::cache_t cache;
+
+  const auto probe = [&] (size_t k, doors::record_t *record) {
+    if (buffers)
+      cache.read(record, contents[k].data(), contents[k].size());
+    else
+      cache.read(record, files[k].c_str());
+  };
+
+  doors::record_t record;
+  for (size_t k = 0; k < files.size(); ++k)
+    probe(k, &record);
+
+  std::atomic<uint64_t> total{0};
+  std::vector<std::thread> threads;
+
+  const auto deadline = clock_type::now() + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(seconds));
+  const auto start = clock_type::now();
+
+  for (size_t t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&, t] {
+      doors::record_t record;
+      uint64_t count = 0;
+
+      // Checking the clock every 1024 probes keeps it out of the measurement
+      for (size_t next = t; clock_type::now() < deadline; ) {
+        for (size_t i = 0; i < 1024; ++i, ++next, ++count)
+          probe(next % files.size(), &record);
+      }
+
+      total.fetch_add(count);
+    });
+  }
+
+  for (auto &thread : threads)
+    thread.join();
+
+  const double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+  const uint64_t count = total.load();
+
+  std::printf("Probes: %llu (%.0f/s), %.1f ns per probe and thread\n",
+    (unsigned long long) count, count / elapsed, elapsed * 1e9 * thread_count / (double) count
+  );
+  std::printf("Cache: %llu hit(s), %llu miss(es), %llu entries, %llu byte(s)\n",
+    (unsigned long long) cache.hits(),
+    (unsigned long long) cache.misses(),
+    (unsigned long long) cache.size(),
+    (unsigned long long) cache.bytes()
+  );
+}
@@ -0,0 +1,113 @@
+// GIF decoding throughput (include/gif_decode.hpp): LZW, palette expansion and compositing, single-threaded.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party bench/gif_decode.cpp -o gif_decode_bench
+//                (add -mavx2 for the gathered palette expansion)
+// Usage: gif_decode_bench [--first] [--copy] [--repeat <n>] <file.gif>...
+//   --first       Poster frames only (the first frame fast path)
+//   --copy        Copy the whole canvas out per frame, the way decoders repainting the full canvas per frame have to
+//                 touch it: the baseline incremental compositing is up against
+//   --repeat <n>  Passes over the files (3)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_GIF_DETAIL
+#include <gif.hpp>
+
+#define IMAGE_GIF_DECODE_DETAIL
+#include <gif_decode.hpp>
+
+using clock_type = std::chrono::steady_clock;
+
+int main(int argc, char *argv[])
+{
+  namespace gif = doors::image::gif;
+
+  bool first = false;
+  bool copy = false;
+  size_t repeat = 3;
+  std::vector<std::string> names;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--first") == 0)
+      first = true;
+    else if (std::strcmp(argv[i], "--copy") == 0)
+      copy = true;
+    else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+      repeat = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    else
+      names.emplace_back(argv[i]);
+  }
+
+  if (names.empty()) {
+    std::fprintf(stderr, "Usage: %s [--first] [--copy] [--repeat <n>] <file.gif>...\n", argv[0]);
+    return 1;
+  }
+
+  gif::decoder_t decoder;
+  std::vector<gif::pixel_t> frame_copy;
+
+  uint64_t files = 0, frames = 0, frame_pixels = 0, canvas_pixels = 0, failures = 0;
+  uint64_t checksum = 0;
+
+  const auto start = clock_type::now();
+
+  for (size_t pass = 0; pass < repeat; ++pass) {
+    for (const auto &name : names) {
+      scoped_file file(name.c_str());
+
+      const doors::error_t error = decoder.decode(file,
+        [&] (size_t, const gif::GIF_frame_t &frame, const gif::pixel_t *canvas) {
+          const size_t pixels = (size_t) decoder.width() * decoder.height();
+
+          frames += 1;
+          frame_pixels += (uint64_t) frame.width * frame.height;
+          canvas_pixels += pixels;
+
+          if (copy) {
+            frame_copy.resize(pixels);
+            std::memcpy(frame_copy.data(), canvas, pixels * sizeof(gif::pixel_t));
+            checksum += frame_copy[pixels / 2];
+          }
+          else if (pixels != 0)
+            checksum += canvas[pixels / 2];
+
+          return true;
+        },
+        first ? 1 : 0
+      );
+
+      files += 1;
+      if (error != doors::error_t::None)
+        failures += 1;
+    }
+  }
+
+  const double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+  std::printf("%llu file(s), %llu frame(s), %llu failure(s) in %.3f s\n",
+    (unsigned long long) files,
+    (unsigned long long) frames,
+    (unsigned long long) failures,
+    seconds
+  );
+
+  std::printf("%.1f frames/s, %.1f Mpx/s decoded, %.1f Mpx/s of canvas shown (checksum %llx)\n",
+    (double) frames / seconds,
+    (double) frame_pixels / seconds / 1e6,
+    (double) canvas_pixels / seconds / 1e6,
+    (unsigned long long) checksum
+  );
+
+  return failures != 0 ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+// JPEG decoding throughput (include/jpg_decode.hpp), single-threaded: scaled decoding against decoding in full and
+// resizing afterwards, the way thumbnails get made otherwise.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party bench/jpg_decode.cpp -o jpg_decode_bench -pthread
+//                (add -mavx2 for the 32-byte marker scan)
+// Usage: jpg_decode_bench [--scale <n>] [--resize] [--threads <n>] [--repeat <n>] <file.jpg>...
+//   --scale <n>    1, 2, 4 or 8 (8)
+//   --resize       Decode in full, then box-filter down by the scale: the baseline scaled decoding is up against
+//   --threads <n>  Per image, restart intervals permitting (1, 0 for as many as there are cores)
+//   --repeat <n>   Passes over the files (3)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_JPG_DECODE_DETAIL
+#include <jpg_decode.hpp>
+
+using clock_type = std::chrono::steady_clock;
+
+namespace jpg = doors::image::jpg;
+
+// Averages scale x scale boxes (clipped at the edges), the output being as large as a scaled decode's.
+static void resize(const jpg::image_t &in, unsigned scale, jpg::image_t *out)
+{
+  out->width = (in.width + scale - 1) / scale;
+  out->height = (in.height + scale - 1) / scale;
+  out->channels = in.channels;
+  out->pixels.resize((size_t) out->width * out->height * out->channels);
+
+  for (uint32_t y = 0; y < out->height; ++y) {
+    const uint32_t y1 = std::min(in.height, (y + 1) * scale);
+
+    for (uint32_t x = 0; x < out->width; ++x) {
+      const uint32_t x1 = std::min(in.width, (x + 1) * scale);
+
+      for (uint8_t c = 0; c < in.channels; ++c) {
+        uint32_t sum = 0, count = 0;
+
+        for (uint32_t sy = y * scale; sy < y1; ++sy) {
+          for (uint32_t sx = x * scale; sx < x1; ++sx, ++count)
+            sum += in.pixels[((size_t) sy * in.width + sx) * in.channels + c];
+        }
+
+        out->pixels[((size_t) y * out->width + x) * out->channels + c] = (uint8_t) ((sum + count / 2) / count);
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned scale = 8;
+  bool full = false;
+  size_t threads = 1;
+  size_t repeat = 3;
+  std::vector<std::string> names;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+      scale = (unsigned) std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--resize") == 0)
+      full = true;
+    else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threads = std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+      repeat = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    else
+      names.emplace_back(argv[i]);
+  }
+
+  if (names.empty() || (scale != 1 && scale != 2 && scale != 4 && scale != 8)) {
+    std::fprintf(stderr, "Usage: %s [--scale <n>] [--resize] [--threads <n>] [--repeat <n>] <file.jpg>...\n", argv[0]);
+    return 1;
+  }
+
+  jpg::decoder_t decoder;
+  jpg::image_t image, resized;
+
+  uint64_t files = 0, bytes = 0, output_pixels = 0, failures = 0;
+  uint64_t checksum = 0;
+
+  const auto start = clock_type::now();
+
+  for (size_t pass = 0; pass < repeat; ++pass) {
+    for (const auto &name : names) {
+      scoped_file file(name.c_str());
+
+      files += 1;
+      bytes += file.size();
+      if (decoder.decode(file, &image, full ? 1 : scale, threads) != doors::error_t::None) {
+        failures += 1;
+        continue;
+      }
+
+      const jpg::image_t *output = &image;
+      if (full && scale != 1) {
+        resize(image, scale, &resized);
+        output = &resized;
+      }
+
+      output_pixels += (uint64_t) output->width * output->height;
+      if (!output->pixels.empty())
+        checksum += output->pixels[output->pixels.size() / 2];
+    }
+  }
+
+  const double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+  std::printf("%llu file(s), %llu failure(s) in %.3f s, 1/%u %s\n",
+    (unsigned long long) files,
+    (unsigned long long) failures,
+    seconds,
+    scale,
+    full ? "by resizing" : "in the DCT domain"
+  );
+
+  std::printf("%.1f files/s, %.1f MB/s of JPEG, %.1f Mpx/s out (checksum %llx)\n",
+    (double) files / seconds,
+    (double) bytes / seconds / 1e6,
+    (double) output_pixels / seconds / 1e6,
+    (unsigned long long) checksum
+  );
+
+  return failures != 0 ? 1 : 0;
+}
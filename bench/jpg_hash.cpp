@@ -0,0 +1,131 @@
+// JPEG perceptual hashing (include/system/phash.hpp) off the DC coefficients alone (decoder_t::decode_dc() in
+// include/jpg_decode.hpp) against hashing a full decode, single-threaded: throughput of both, and how far apart the
+// two hashes land for each file, the DC path being meant as a drop-in for the other one.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party bench/jpg_hash.cpp -o jpg_hash_bench -pthread
+//                (add -mavx2 for the 32-byte marker scan)
+// Usage: jpg_hash_bench [--repeat <n>] [--list] <file.jpg>...
+//   --repeat <n>  Passes over the files, for either path (3)
+//   --list        Both hashes and their distance, file by file
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/phash.hpp>
+
+#define IMAGE_JPG_DECODE_DETAIL
+#include <jpg_decode.hpp>
+
+using clock_type = std::chrono::steady_clock;
+
+namespace jpg = doors::image::jpg;
+namespace phash = doors::phash;
+
+static bool hash_dc(jpg::decoder_t &decoder, const std::string &name, uint64_t *hash)
+{
+  scoped_file file(name.c_str());
+  jpg::dc_grid_t grid;
+  if (decoder.decode_dc(file, &grid) != doors::error_t::None)
+    return false;
+
+  *hash = phash::get_dhash(grid.luma.data(), grid.columns, 1, grid.width, grid.height, grid.cell_width,
+    grid.cell_height);
+  return true;
+}
+
+static bool hash_full(jpg::decoder_t &decoder, const std::string &name, uint64_t *hash)
+{
+  scoped_file file(name.c_str());
+  jpg::image_t image;
+  if (decoder.decode(file, &image) != doors::error_t::None || image.channels == 4)
+    return false;
+
+  *hash = phash::get_dhash(image.pixels.data(), (size_t) image.width * image.channels, image.channels, image.width,
+    image.height);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t repeat = 3;
+  bool list = false;
+  std::vector<std::string> names;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+      repeat = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--list") == 0)
+      list = true;
+    else
+      names.emplace_back(argv[i]);
+  }
+
+  if (names.empty()) {
+    std::fprintf(stderr, "Usage: %s [--repeat <n>] [--list] <file.jpg>...\n", argv[0]);
+    return 1;
+  }
+
+  jpg::decoder_t decoder;
+  std::vector<uint64_t> dc_hashes(names.size()), full_hashes(names.size());
+  std::vector<bool> dc_ok(names.size()), full_ok(names.size());
+  double seconds[2] = { 0.0, 0.0 };
+
+  for (int path = 0; path < 2; ++path) {
+    const auto start = clock_type::now();
+
+    for (size_t pass = 0; pass < repeat; ++pass) {
+      for (size_t i = 0; i < names.size(); ++i) {
+        if (path == 0)
+          dc_ok[i] = hash_dc(decoder, names[i], &dc_hashes[i]);
+        else
+          full_ok[i] = hash_full(decoder, names[i], &full_hashes[i]);
+      }
+    }
+
+    seconds[path] = std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  // Distances 0 to 64, files that only one path (or neither) could hash aside
+  uint64_t histogram[65] = {};
+  uint64_t compared = 0, failures = 0, total = 0;
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!dc_ok[i] || !full_ok[i]) {
+      failures += 1;
+      if (list)
+        std::printf("%s\tfailed (%s)\n", names[i].c_str(), !dc_ok[i] ? "DC" : "full");
+      continue;
+    }
+
+    const unsigned distance = phash::get_distance(dc_hashes[i], full_hashes[i]);
+    histogram[distance] += 1;
+    compared += 1;
+    total += distance;
+
+    if (list)
+      std::printf("%s\t%016llx\t%016llx\t%u\n", names[i].c_str(), (unsigned long long) dc_hashes[i],
+        (unsigned long long) full_hashes[i], distance);
+  }
+
+  const double files = (double) names.size() * repeat;
+  std::printf("%zu file(s), %llu failure(s), %zu pass(es)\n", names.size(), (unsigned long long) failures, repeat);
+  std::printf("DC only:     %.3f s, %.1f files/s\n", seconds[0], files / seconds[0]);
+  std::printf("Full decode: %.3f s, %.1f files/s (%.1fx)\n", seconds[1], files / seconds[1], seconds[1] / seconds[0]);
+
+  std::printf("Distance DC/full: mean %.2f\n", compared != 0 ? (double) total / compared : 0.0);
+  for (unsigned d = 0; d <= 64; ++d) {
+    if (histogram[d] != 0)
+      std::printf("  %2u\t%llu\n", d, (unsigned long long) histogram[d]);
+  }
+
+  return failures != 0 ? 1 : 0;
+}
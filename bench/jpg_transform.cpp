@@ -0,0 +1,146 @@
+// Lossless JPEG transform throughput (include/jpg_transform.hpp), single-threaded, against decoding the same files to
+// pixels: a decode alone being the lower bound on a decode, rotate and re-encode, which is what the DCT domain saves.
+// Files are read into memory first, neither side pays for I/O.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party bench/jpg_transform.cpp -o jpg_transform_bench -pthread
+// Usage: jpg_transform_bench [--rotate <n>] [--optimize] [--threads <n>] [--repeat <n>] <file.jpg>...
+//   --rotate <n>   90, 180 or 270 (90)
+//   --optimize     Huffman tables built for every output
+//   --threads <n>  Per image, restart intervals permitting (1, 0 for as many as there are cores)
+//   --repeat <n>   Passes over the files, for either path (3)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_EXIF_DETAIL
+#include <exif.hpp>
+
+#define IMAGE_JPG_DECODE_DETAIL
+#include <jpg_decode.hpp>
+
+#define IMAGE_JPG_TRANSFORM_DETAIL
+#include <jpg_transform.hpp>
+
+using clock_type = std::chrono::steady_clock;
+
+namespace jpg = doors::image::jpg;
+
+static double since(clock_type::time_point start)
+{
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+  jpg::transform_options_t options;
+  options.transform = jpg::transform_t::rotate_90;
+  size_t threads = 1;
+  size_t repeat = 3;
+  std::vector<std::string> names;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--rotate") == 0 && i + 1 < argc) {
+      const unsigned long degrees = std::strtoul(argv[++i], nullptr, 10);
+      options.transform = degrees == 180 ? jpg::transform_t::rotate_180 : degrees == 270 ? jpg::transform_t::rotate_270 :
+        jpg::transform_t::rotate_90;
+    }
+    else if (std::strcmp(argv[i], "--optimize") == 0)
+      options.optimize = true;
+    else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threads = std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+      repeat = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    else
+      names.emplace_back(argv[i]);
+  }
+
+  if (names.empty()) {
+    std::fprintf(stderr, "Usage: %s [--rotate <n>] [--optimize] [--threads <n>] [--repeat <n>] <file.jpg>...\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<std::vector<uint8_t>> files;
+  uint64_t bytes = 0;
+
+  for (const auto &name : names) {
+    scoped_file file(name.c_str());
+    std::vector<uint8_t> data((size_t) file.size());
+    if (!file.valid() || file.read(data.data(), size::u8, data.size()) != data.size()) {
+      std::fprintf(stderr, "Couldn't read %s\n", name.c_str());
+      return 1;
+    }
+
+    bytes += data.size();
+    files.push_back(std::move(data));
+  }
+
+  // Transforms
+  jpg::transformer_t transformer;
+  std::vector<uint8_t> out;
+  uint64_t failures = 0, out_bytes = 0;
+
+  auto start = clock_type::now();
+  for (size_t pass = 0; pass < repeat; ++pass) {
+    for (const auto &data : files) {
+      if (transformer.transform(data.data(), data.size(), options, &out, threads) != doors::error_t::None) {
+        failures += 1;
+        continue;
+      }
+
+      out_bytes += out.size();
+    }
+  }
+
+  const double transform_seconds = since(start);
+
+  // Decodes
+  jpg::decoder_t decoder;
+  jpg::image_t image;
+  uint64_t checksum = 0;
+
+  start = clock_type::now();
+  for (size_t pass = 0; pass < repeat; ++pass) {
+    for (const auto &data : files) {
+      if (decoder.decode(data.data(), data.size(), &image, 1, threads) != doors::error_t::None) {
+        failures += 1;
+        continue;
+      }
+
+      if (!image.pixels.empty())
+        checksum += image.pixels[image.pixels.size() / 2];
+    }
+  }
+
+  const double decode_seconds = since(start);
+  const double count = (double) (files.size() * repeat);
+
+  std::printf("%zu file(s) x %zu, %llu failure(s), %.1f MB of JPEG\n", files.size(), repeat,
+    (unsigned long long) failures, (double) bytes / 1e6);
+
+  std::printf("Transform %.3f s, %.1f files/s, %.1f MB/s in, output %.1f%% of the input\n",
+    transform_seconds,
+    count / transform_seconds,
+    (double) (bytes * repeat) / transform_seconds / 1e6,
+    100.0 * (double) out_bytes / (double) (bytes * repeat)
+  );
+
+  std::printf("Decode    %.3f s, %.1f files/s, %.1f MB/s in (checksum %llx), %.2fx the transform's time\n",
+    decode_seconds,
+    count / decode_seconds,
+    (double) (bytes * repeat) / decode_seconds / 1e6,
+    (unsigned long long) checksum,
+    decode_seconds / transform_seconds
+  );
+
+  return failures != 0 ? 1 : 0;
+}
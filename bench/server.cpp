@@ -0,0 +1,204 @@
+// Load generator for the resident probe server (include/server.hpp).
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party bench/server.cpp -o server_bench -pthread
+// Usage: server_bench <socket path> <connections> <batch size> <seconds> [--buffers] [--serve <threads> [--cache <MiB>]] <file>...
+//
+// Every connection runs on its own thread and keeps sending batches made of the given files (round robin), either
+// as paths or, with --buffers, as in-memory contents. --serve starts a server within the same process first,
+// --cache puts a parse result cache (include/cache.hpp) of the given budget in front of it.
+// Reports throughput along with per-request latency percentiles.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_GIF_DETAIL
+#include <gif.hpp>
+
+#define IMAGE_EXIF_DETAIL
+#include <exif.hpp>
+
+#define IMAGE_JPG_DETAIL
+#include <jpg.hpp>
+
+#define IMAGE_BMP_DETAIL
+#include <bmp.hpp>
+
+#define IMAGE_PNG_DETAIL
+#include <png.hpp>
+
+#define IMAGE_TGA_DETAIL
+#include <tga.hpp>
+
+#define IMAGE_PSD_DETAIL
+#include <psd.hpp>
+
+#define PROBE_DETAIL
+#include <probe.hpp>
+
+#define CACHE_DETAIL
+#include <cache.hpp>
+
+#define SERVER_DETAIL
+#include <server.hpp>
+
+using clock_type = std::chrono::steady_clock;
+
+int main(int argc, char *argv[])
+{
+  if (argc < 6) {
+    std::fprintf(stderr, "Usage: %s <socket path> <connections> <batch size> <seconds> [--buffers] [--serve <threads> [--cache <MiB>]] <file>...\n", argv[0]);
+    return 1;
+  }
+
+  const char *path = argv[1];
+  const size_t connections = std::max(1ul, std::strtoul(argv[2], nullptr, 10));
+  const size_t batch = std::min(4096ul, std::max(1ul, std::strtoul(argv[3], nullptr, 10)));
+  const double seconds = std::atof(argv[4]);
+
+  bool buffers = false;
+  long serve = -1;
+  uint64_t cache_budget = 0;
+  std::vector<std::string> files;
+
+  for (int i = 5; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--buffers") == 0)
+      buffers = true;
+    else if (std::strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+      serve = std::strtol(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+      cache_budget = std::strtoull(argv[++i], nullptr, 10) << 20;
+    else
+      files.emplace_back(argv[i]);
+  }
+
+  if (files.empty()) {
+    std::fprintf(stderr, "No input files\n");
+    return 1;
+  }
+
+  std::vector<std::vector<char>> contents;
+  if (buffers) {
+    for (const auto &file : files) {
+      std::ifstream stream(file, std::ios::binary);
+      contents.emplace_back(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    }
+  }
+
+  std::unique_ptr<doors::cache::cache_t> cache;
+  std::unique_ptr<doors::server::server_t> server;
+  if (serve >= 0) {
+    doors::server::options_t options;
+    options.path = path;
+    options.threads = (size_t) serve;
+
+    if (cache_budget != 0) {
+      doors::cache::options_t cache_options;
+      cache_options.budget = cache_budget;
+      cache = std::make_unique<doors::cache::cache_t>(cache_options);
+      options.cache = cache.get();
+    }
+
+    server = std::make_unique<doors::server::server_t>(options);
+    if (server->start() != doors::error_t::None) {
+      std::fprintf(stderr, "Couldn't listen on %s\n", path);
+      return 1;
+    }
+  }
+
+  std::atomic<bool> failed{false};
+  std::vector<std::vector<uint64_t>> latencies(connections);
+  std::vector<std::thread> threads;
+
+  const auto deadline = clock_type::now() + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(seconds));
+  const auto start = clock_type::now();
+
+  for (size_t c = 0; c < connections; ++c) {
+    threads.emplace_back([&, c] {
+      doors::server::client_t client;
+      if (client.connect(path) != doors::error_t::None) {
+        failed.store(true);
+        return;
+      }
+
+      std::vector<doors::server::entry_t> entries;
+      std::vector<doors::record_t> records;
+      size_t next = c;
+
+      while (clock_type::now() < deadline) {
+        entries.clear();
+        for (size_t i = 0; i < batch; ++i, ++next) {
+          const size_t k = next % files.size();
+          entries.push_back(buffers
+            ? doors::server::entry_t::buffer(contents[k].data(), (uint32_t) contents[k].size())
+            : doors::server::entry_t::path(files[k].c_str())
+          );
+        }
+
+        const auto t = clock_type::now();
+        if (client.probe(entries, &records) != doors::error_t::None) {
+          failed.store(true);
+          return;
+        }
+
+        latencies[c].push_back((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - t).count());
+      }
+    });
+  }
+
+  for (auto &thread : threads)
+    thread.join();
+
+  const double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+
+  if (server) {
+    server->stop();
+    server->wait();
+  }
+
+  if (failed.load())
+    std::fprintf(stderr, "At least one connection failed\n");
+
+  std::vector<uint64_t> all;
+  for (const auto &l : latencies)
+    all.insert(all.end(), l.begin(), l.end());
+
+  if (all.empty())
+    return 1;
+
+  std::sort(all.begin(), all.end());
+  const auto percentile = [&all] (double p) -> double {
+    return all[std::min(all.size() - 1, (size_t) (p * (double) all.size()))] / 1000.0;
+  };
+
+  std::printf("Requests: %zu (%.0f/s), entries: %zu (%.0f/s)\n",
+    all.size(), all.size() / elapsed,
+    all.size() * batch, all.size() * batch / elapsed
+  );
+  std::printf("Latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+    percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), all.back() / 1000.0
+  );
+
+  if (cache) {
+    std::printf("Cache: %llu hit(s), %llu miss(es), %llu eviction(s)\n",
+      (unsigned long long) cache->hits(),
+      (unsigned long long) cache->misses(),
+      (unsigned long long) cache->evictions()
+    );
+  }
+
+  return failed.load() ? 1 : 0;
+}
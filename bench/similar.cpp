@@ -0,0 +1,186 @@
+// Near-duplicate search throughput (include/similar.hpp): batches of queries against an index of random 64-bit hashes,
+// multi-index hashing against a linear popcount scan over the same hashes. Half of the queries are planted (an entry
+// with a few bits flipped, up to the radius), half are random; both searches have to come up with the same matches.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party bench/similar.cpp -o similar_bench -pthread
+//                (add -mpopcnt, or -march=native, for a popcount instruction rather than a library call)
+// Usage: similar_bench [--entries <n>] [--queries <n>] [--radius <n>] [--substrings <n>] [--threads <n>] [--linear <n>]
+//                      [--index <file>]
+//   --entries <n>     Hashes in the index (10000000)
+//   --queries <n>     Per batch (10000)
+//   --radius <n>      Hamming distance (6)
+//   --substrings <n>  Tables (0: picked for the number of entries)
+//   --threads <n>     Per batch (1, 0 for as many as there are cores)
+//   --linear <n>      Queries to run through the linear scan as well, to compare against (1000)
+//   --index <file>    Saves the index there and runs the batch again over the file, memory mapped
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define SIMILAR_DETAIL
+#include <similar.hpp>
+
+using clock_type = std::chrono::steady_clock;
+
+namespace similar = doors::similar;
+
+static double since(clock_type::time_point start)
+{
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+static void run(const similar::index_t &index, const std::vector<uint64_t> &queries, unsigned radius, size_t threads,
+  std::vector<std::vector<similar::match_t>> *matches, const char *label)
+{
+  const uint64_t candidates = index.candidates();
+  const auto start = clock_type::now();
+  index.query(queries.data(), queries.size(), radius, matches, threads);
+  const double seconds = since(start);
+
+  uint64_t found = 0;
+  for (const auto &query : *matches)
+    found += query.size();
+
+  std::printf("%-12s %.3f s, %.0f queries/s, %.1f candidate(s) and %.2f match(es) per query\n",
+    label,
+    seconds,
+    (double) queries.size() / seconds,
+    (double) (index.candidates() - candidates) / (double) queries.size(),
+    (double) found / (double) queries.size()
+  );
+}
+
+int main(int argc, char *argv[])
+{
+  size_t entries = 10000000;
+  size_t query_count = 10000;
+  unsigned radius = 6;
+  similar::options_t options;
+  size_t threads = 1;
+  size_t linear = 1000;
+  const char *index_name = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--entries") == 0 && i + 1 < argc)
+      entries = std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--queries") == 0 && i + 1 < argc)
+      query_count = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+      radius = (unsigned) std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--substrings") == 0 && i + 1 < argc)
+      options.substrings = (unsigned) std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threads = std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--linear") == 0 && i + 1 < argc)
+      linear = std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--index") == 0 && i + 1 < argc)
+      index_name = argv[++i];
+    else {
+      std::fprintf(stderr, "Usage: %s [--entries <n>] [--queries <n>] [--radius <n>] [--substrings <n>] [--threads <n>] [--linear <n>] [--index <file>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  std::mt19937_64 random(42);
+  std::vector<uint64_t> hashes(entries);
+  for (auto &hash : hashes)
+    hash = random();
+
+  similar::index_t index;
+  for (uint64_t hash : hashes)
+    index.insert(hash);
+
+  auto start = clock_type::now();
+  if (index.build(options) != doors::error_t::None) {
+    std::fprintf(stderr, "Couldn't build the index\n");
+    return 1;
+  }
+
+  std::printf("%zu entries, %u substring(s), built in %.3f s\n", index.size(), index.substrings(), since(start));
+
+  std::vector<uint64_t> queries(query_count);
+  for (size_t i = 0; i < query_count; ++i) {
+    if (i % 2 != 0 || hashes.empty()) {
+      queries[i] = random();
+      continue;
+    }
+
+    uint64_t hash = hashes[(size_t) (random() % hashes.size())];
+    for (unsigned flips = (unsigned) (random() % (radius + 1)); flips != 0; --flips)
+      hash ^= 1ull << (random() % 64);
+
+    queries[i] = hash;
+  }
+
+  std::vector<std::vector<similar::match_t>> matches;
+  run(index, queries, radius, threads, &matches, "Multi-index");
+
+  // Linear scan: a radius of 64 takes everything in, the same kernel then filters by distance
+  linear = std::min(linear, queries.size());
+  start = clock_type::now();
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < linear; ++i) {
+    std::vector<similar::match_t> expected;
+    for (size_t id = 0; id < hashes.size(); ++id) {
+      const unsigned distance = (unsigned) __builtin_popcountll(hashes[id] ^ queries[i]);
+      if (distance <= radius)
+        expected.push_back(similar::match_t { (uint32_t) id, distance });
+    }
+
+    std::sort(expected.begin(), expected.end(), [] (const similar::match_t &lhs, const similar::match_t &rhs) {
+      return lhs.distance != rhs.distance ? lhs.distance < rhs.distance : lhs.id < rhs.id;
+    });
+
+    const auto &found = matches[i];
+    if (found.size() != expected.size() || !std::equal(found.begin(), found.end(), expected.begin(),
+        [] (const similar::match_t &lhs, const similar::match_t &rhs) {
+          return lhs.id == rhs.id && lhs.distance == rhs.distance;
+        }))
+      mismatches += 1;
+  }
+
+  if (linear != 0) {
+    const double seconds = since(start);
+    std::printf("%-12s %.3f s, %.0f queries/s (%zu queries, %zu mismatch(es))\n", "Linear scan", seconds,
+      (double) linear / seconds, linear, mismatches);
+  }
+
+  if (index_name != nullptr) {
+    if (index.save(index_name) != doors::error_t::None) {
+      std::fprintf(stderr, "Couldn't save %s\n", index_name);
+      return 1;
+    }
+
+    similar::index_t mapped;
+    start = clock_type::now();
+    if (mapped.open(index_name) != doors::error_t::None) {
+      std::fprintf(stderr, "Couldn't open %s\n", index_name);
+      return 1;
+    }
+
+    std::printf("Opened %s in %.3f s\n", index_name, since(start));
+
+    std::vector<std::vector<similar::match_t>> reloaded;
+    run(mapped, queries, radius, threads, &reloaded, "Mapped");
+
+    if (reloaded.size() != matches.size() || !std::equal(reloaded.begin(), reloaded.end(), matches.begin(),
+        [] (const std::vector<similar::match_t> &lhs, const std::vector<similar::match_t> &rhs) {
+          return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin(),
+            [] (const similar::match_t &a, const similar::match_t &b) { return a.id == b.id && a.distance == b.distance; });
+        }))
+      mismatches += 1;
+  }
+
+  return mismatches != 0 ? 1 : 0;
+}
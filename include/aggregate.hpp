@@ -0,0 +1,347 @@
+#if !defined(__AGGREGATE_DETAIL__)
+#define __AGGREGATE_DETAIL__
+
+// Corpus statistics instead of per-file output: every worker feeds the records it produces into an accumulator of
+// its own (no locks, no sharing, each one on its own cache lines), those get merged once the scan is over.
+//
+// Distributions of unbounded values (dimensions, aspect ratios, bytes per pixel, frame counts) go into log-linear
+// histograms, HDR-style: exact below 16, above that 16 buckets per power of two, i.e. within 1/16 (6.25%) of the
+// actual value, over the whole uint64_t range in under 1000 buckets. Bounded ones (bpp, color spaces) get a bucket
+// per value.
+//
+// Pending issue(s):
+//   Testing
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/record.hpp>
+
+namespace doors {
+  namespace aggregate {
+    class histogram_t {
+    public:
+      static constexpr const unsigned sub_bits = 4; // 16 buckets per power of two
+      static constexpr const size_t bucket_count = (64 - sub_bits + 1) << sub_bits;
+
+      void add(uint64_t value);
+      void merge(const histogram_t &other);
+
+      // Lower bound of the bucket holding the q-th quantile (q within [0; 1]), 0 when empty.
+      uint64_t quantile(double q) const;
+
+      uint64_t count() const { return total; }
+      uint64_t min() const { return total != 0 ? minimum : 0u; }
+      uint64_t max() const { return maximum; }
+      double mean() const { return total != 0 ? (double) sum / (double) total : 0.0; }
+
+      static size_t get_bucket(uint64_t value);
+      static uint64_t get_lower_bound(size_t bucket);
+
+    private:
+      std::array<uint64_t, bucket_count> buckets{};
+      uint64_t total = 0;
+      uint64_t minimum = UINT64_MAX;
+      uint64_t maximum = 0;
+      uint64_t sum = 0; // Wraps around past 2^64, mean() is only good until then
+    };
+
+    // Ratios are kept as fixed point, so they fit the histograms
+    constexpr const uint64_t ratio_scale = 1000;
+
+    struct alignas(64) accumulator_t {
+      uint64_t files = 0;
+      uint64_t bytes = 0;
+      std::array<uint64_t, 16> errors{};   // Per error_t
+      std::array<uint64_t, 8> formats{};   // Per format_t, successfully parsed only (so are the ones below)
+      std::array<uint64_t, 8> flags{};     // Per record_flags_t bit
+      std::array<std::array<uint64_t, 256>, 8> color_spaces{}; // Per format_t, format-specific codes
+      std::array<uint64_t, 256> bpp{};
+      std::array<uint64_t, 256> subsampling{}; // JPG only, record_t's code
+
+      histogram_t width;
+      histogram_t height;
+      histogram_t aspect_ratio;    // width / height, times ratio_scale (projected_aspect_ratio.f)
+      histogram_t bytes_per_pixel; // File size over width * height, times ratio_scale
+      histogram_t frames;          // GIF only
+      histogram_t quality;         // JPG only
+      histogram_t size;
+
+      void add(const record_t &record);
+      void merge(const accumulator_t &other);
+    };
+
+    class aggregator_t {
+    public:
+      // One accumulator per worker; workers are told apart by the index scan::sink_t hands over.
+      explicit aggregator_t(size_t workers);
+
+      void add(size_t worker, const record_t &record) { accumulators[worker].add(record); }
+
+      // Only once the workers are done.
+      accumulator_t merge() const;
+
+    private:
+      std::vector<accumulator_t> accumulators;
+    };
+
+    void print(std::FILE *stream, const accumulator_t &accumulator);
+  } // namespace aggregate
+} // namespace doors
+
+#endif
+
+#ifdef AGGREGATE_DETAIL
+#undef AGGREGATE_DETAIL
+
+#include <algorithm>
+#include <cmath>
+
+namespace doors {
+  namespace aggregate {
+    size_t histogram_t::get_bucket(uint64_t value)
+    {
+      constexpr uint64_t linear = 1u << sub_bits;
+      if (value < linear)
+        return (size_t) value;
+
+      const unsigned exponent = 63u - (unsigned) __CLZ64(value);
+      const uint64_t sub = (value >> (exponent - sub_bits)) & (linear - 1u);
+
+      return (size_t) ((exponent - sub_bits + 1u) << sub_bits) + (size_t) sub;
+    }
+
+    uint64_t histogram_t::get_lower_bound(size_t bucket)
+    {
+      constexpr size_t linear = 1u << sub_bits;
+      if (bucket < linear)
+        return bucket;
+
+      const unsigned exponent = (unsigned) (bucket >> sub_bits) + sub_bits - 1u;
+      const uint64_t sub = bucket & (linear - 1u);
+
+      return (linear + sub) << (exponent - sub_bits);
+    }
+
+    void histogram_t::add(uint64_t value)
+    {
+      buckets[get_bucket(value)] += 1;
+      total += 1;
+      sum += value;
+      minimum = std::min(minimum, value);
+      maximum = std::max(maximum, value);
+    }
+
+    void histogram_t::merge(const histogram_t &other)
+    {
+      for (size_t i = 0; i < bucket_count; ++i)
+        buckets[i] += other.buckets[i];
+
+      total += other.total;
+      sum += other.sum;
+      minimum = std::min(minimum, other.minimum);
+      maximum = std::max(maximum, other.maximum);
+    }
+
+    uint64_t histogram_t::quantile(double q) const
+    {
+      if (total == 0)
+        return 0u;
+
+      const uint64_t rank = std::min(total, (uint64_t) std::ceil(std::clamp(q, 0.0, 1.0) * (double) total));
+
+      uint64_t seen = 0;
+      for (size_t i = 0; i < bucket_count; ++i) {
+        seen += buckets[i];
+        if (seen >= rank && seen != 0)
+          return std::clamp(get_lower_bound(i), min(), maximum);
+      }
+
+      return maximum;
+    }
+
+    void accumulator_t::add(const record_t &record)
+    {
+      files += 1;
+      bytes += record.size;
+      errors[record.error & 15u] += 1;
+      size.add(record.size);
+
+      if (record.error != (uint8_t) error_t::None)
+        return;
+
+      const uint8_t format = record.format & 7u;
+      formats[format] += 1;
+      color_spaces[format][record.color_space] += 1;
+      bpp[record.bpp] += 1;
+
+      for (unsigned bit = 0; bit < 8; ++bit) {
+        if (record.flags & (1u << bit))
+          flags[bit] += 1;
+      }
+
+      // Dimensions are only there if they were asked for (and the file has any)
+      if (record.width != 0 && record.height != 0) {
+        width.add(record.width);
+        height.add(record.height);
+        aspect_ratio.add((uint64_t) record.width * ratio_scale / record.height);
+        bytes_per_pixel.add(record.size * ratio_scale / ((uint64_t) record.width * record.height));
+      }
+
+      if (record.format == (uint8_t) format_t::GIF && record.frames != 0)
+        frames.add(record.frames);
+
+      if (record.format == (uint8_t) format_t::JPG) {
+        if (record.quality != 0)
+          quality.add(record.quality);
+        if (record.subsampling != 0)
+          subsampling[record.subsampling] += 1;
+      }
+    }
+
+    void accumulator_t::merge(const accumulator_t &other)
+    {
+      files += other.files;
+      bytes += other.bytes;
+
+      for (size_t i = 0; i < errors.size(); ++i)
+        errors[i] += other.errors[i];
+
+      for (size_t i = 0; i < formats.size(); ++i) {
+        formats[i] += other.formats[i];
+        flags[i] += other.flags[i];
+
+        for (size_t j = 0; j < color_spaces[i].size(); ++j)
+          color_spaces[i][j] += other.color_spaces[i][j];
+      }
+
+      for (size_t i = 0; i < bpp.size(); ++i) {
+        bpp[i] += other.bpp[i];
+        subsampling[i] += other.subsampling[i];
+      }
+
+      width.merge(other.width);
+      height.merge(other.height);
+      aspect_ratio.merge(other.aspect_ratio);
+      bytes_per_pixel.merge(other.bytes_per_pixel);
+      frames.merge(other.frames);
+      quality.merge(other.quality);
+      size.merge(other.size);
+    }
+
+    aggregator_t::aggregator_t(size_t workers) : accumulators(std::max<size_t>(workers, 1u))
+    {
+    }
+
+    accumulator_t aggregator_t::merge() const
+    {
+      accumulator_t r;
+      for (const auto &accumulator : accumulators)
+        r.merge(accumulator);
+
+      return r;
+    }
+
+    static void print(std::FILE *stream, const char *name, const histogram_t &histogram, double scale = 1.0)
+    {
+      if (histogram.count() == 0)
+        return;
+
+      std::fprintf(stream, "%-16s n=%llu min=%.3g p50=%.3g p90=%.3g p99=%.3g p99.9=%.3g max=%.3g mean=%.3g\n",
+        name,
+        (unsigned long long) histogram.count(),
+        (double) histogram.min() / scale,
+        (double) histogram.quantile(0.5) / scale,
+        (double) histogram.quantile(0.9) / scale,
+        (double) histogram.quantile(0.99) / scale,
+        (double) histogram.quantile(0.999) / scale,
+        (double) histogram.max() / scale,
+        histogram.mean() / scale
+      );
+    }
+
+    void print(std::FILE *stream, const accumulator_t &accumulator)
+    {
+      static const char *flag_names[8] = {
+        "interlaced", "compressed", "animated", "duplicate", "truncated", "bit 5", "bit 6", "bit 7"
+      };
+
+      std::fprintf(stream, "files            %llu (%llu bytes)\n",
+        (unsigned long long) accumulator.files,
+        (unsigned long long) accumulator.bytes
+      );
+
+      for (size_t i = 0; i < accumulator.errors.size(); ++i) {
+        if (i != 0 && accumulator.errors[i] != 0)
+          std::fprintf(stream, "error %-10zu %llu\n", i, (unsigned long long) accumulator.errors[i]);
+      }
+
+      for (size_t format = 0; format < accumulator.formats.size(); ++format) {
+        if (accumulator.formats[format] == 0)
+          continue;
+
+        std::fprintf(stream, "format %-9s %llu (%.1f%%), color spaces:",
+          get_format_sanitized((format_t) format),
+          (unsigned long long) accumulator.formats[format],
+          100.0 * (double) accumulator.formats[format] / (double) accumulator.files
+        );
+
+        for (size_t code = 0; code < accumulator.color_spaces[format].size(); ++code) {
+          if (accumulator.color_spaces[format][code] != 0)
+            std::fprintf(stream, " %zu:%llu", code, (unsigned long long) accumulator.color_spaces[format][code]);
+        }
+
+        std::fputc('\n', stream);
+      }
+
+      for (size_t bit = 0; bit < accumulator.flags.size(); ++bit) {
+        if (accumulator.flags[bit] != 0)
+          std::fprintf(stream, "%-16s %llu\n", flag_names[bit], (unsigned long long) accumulator.flags[bit]);
+      }
+
+      std::fprintf(stream, "bpp             ");
+      for (size_t value = 0; value < accumulator.bpp.size(); ++value) {
+        if (accumulator.bpp[value] != 0)
+          std::fprintf(stream, " %zu:%llu", value, (unsigned long long) accumulator.bpp[value]);
+      }
+
+      std::fputc('\n', stream);
+
+      bool any = false;
+      for (size_t code = 0; code < accumulator.subsampling.size(); ++code) {
+        if (accumulator.subsampling[code] == 0)
+          continue;
+
+        // J:a:b where it has a name, horizontal x vertical factors otherwise
+        if (!any)
+          std::fprintf(stream, "subsampling     ");
+        any = true;
+
+        const uint16_t sanitized = get_subsampling_sanitized((uint8_t) code);
+        if (sanitized != 0)
+          std::fprintf(stream, " %u:%llu", sanitized, (unsigned long long) accumulator.subsampling[code]);
+        else
+          std::fprintf(stream, " %zux%zu:%llu", code >> 4, code & 15, (unsigned long long) accumulator.subsampling[code]);
+      }
+
+      if (any)
+        std::fputc('\n', stream);
+
+      print(stream, "width", accumulator.width);
+      print(stream, "height", accumulator.height);
+      print(stream, "aspect ratio", accumulator.aspect_ratio, (double) ratio_scale);
+      print(stream, "bytes per pixel", accumulator.bytes_per_pixel, (double) ratio_scale);
+      print(stream, "frames", accumulator.frames);
+      print(stream, "quality", accumulator.quality);
+      print(stream, "size", accumulator.size);
+    }
+  } // namespace aggregate
+} // namespace doors
+
+#endif
@@ -15,6 +15,8 @@
 #include <compiler.hpp>
 using namespace compiler;
 
+#include <system/record.hpp>
+
 namespace doors {
   namespace image {
     namespace bmp {
@@ -36,19 +38,21 @@ namespace doors {
           DIB_header_t dib;
         };
 
+        error_t read(BMP_header_t *header, scoped_file &file);
         error_t read(BMP_header_t *header, const char *name);
       } // namespace detail
 
       using namespace detail;
 
       std::unordered_map<std::string, std::any> parse(const char *name);
+      record_t to_record(const BMP_header_t &header);
     } // namespace bmp
   } // namespace image
 } // namespace doors
 
 #endif
 
-#define IMAGE_BMP_DETAIL
+// #define IMAGE_BMP_DETAIL
 
 #ifdef IMAGE_BMP_DETAIL
 #undef IMAGE_BMP_DETAIL
@@ -60,7 +64,11 @@ namespace doors {
         error_t read(BMP_header_t *header, const char *name)
         {
           scoped_file file(name);
+          return read(header, file);
+        }
 
+        error_t read(BMP_header_t *header, scoped_file &file)
+        {
           if (file.valid() && header) {
             if (std::fread(&header->bmp[0], size::c, 2, file.p) == 2)
                 header->bmp[2] = '\0';
@@ -138,6 +146,19 @@ namespace doors {
 
         return r;
       }
+
+      record_t to_record(const BMP_header_t &header)
+      {
+        record_t r = {0};
+
+        r.format = (uint8_t) format_t::BMP;
+        r.version = header.version_sanitized;
+        r.width = header.dib.width;
+        r.height = header.dib.height;
+        r.bpp = header.dib.bpp;
+
+        return r;
+      }
     } // namespace bmp
   } // namespace image
 } // namespace doors
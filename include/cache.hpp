@@ -0,0 +1,333 @@
+#if !defined(__CACHE_DETAIL__)
+#define __CACHE_DETAIL__
+
+// In-process cache of parse results for resident users (see server.hpp): the same hot images get probed over and
+// over again, re-reading them is pointless as long as their identity didn't change.
+//
+// Files are keyed by path and stat identity (see system/stat.hpp), a hit costs a stat() and no other syscall.
+// Buffers are keyed by a hash of their whole contents along with their length.
+//
+// The cache is split into shards, each behind a reader/writer lock. Eviction follows CLOCK rather than strict LRU,
+// so that a hit only has to set a reference bit under the shared lock: readers never serialize on each other.
+// The byte budget covers entries and their paths, not the bookkeeping of the underlying containers.
+//
+// Pending issue(s):
+//   Buffers are trusted on their 64-bit content hash, no byte-by-byte confirmation
+//   A single very hot entry still bounces its shard's reader count between cores (a seqlock would avoid that)
+//   Testing
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/hash.hpp>
+#include <system/record.hpp>
+#include <system/stat.hpp>
+#include <probe.hpp>
+
+namespace doors {
+  namespace cache {
+    struct options_t {
+      uint64_t budget = 64u << 20; // Bytes
+      size_t shards = 16;          // Rounded up to a power of two
+    };
+
+    class cache_t {
+    public:
+      explicit cache_t(const options_t &options = options_t());
+
+      cache_t(const cache_t &) = delete;
+      cache_t &operator=(const cache_t &) = delete;
+
+      // Drop-in replacements for probe::read(), answering from the cache whenever possible. Running out of budget
+      // is no property of the file, such records aren't kept.
+      error_t read(record_t *record, const char *name, const budget_t &budget = budget_t());
+      error_t read(record_t *record, const void *data, size_t length, const budget_t &budget = budget_t());
+
+      // Lower level access, for callers which already got the file's identity at hand.
+      bool lookup(const char *name, const stat_key_t &key, record_t *record);
+      void insert(const char *name, const stat_key_t &key, const record_t &record);
+
+      void clear();
+
+      uint64_t hits() const;
+      uint64_t misses() const;
+      uint64_t evictions() const;
+      uint64_t size() const;  // Entries
+      uint64_t bytes() const; // Charged against the budget
+
+    private:
+      struct entry_t {
+        uint64_t hash;
+        std::string name; // Empty for buffers
+        stat_key_t key;   // Buffers only fill in `size`
+        record_t record;
+        std::atomic<bool> referenced{false};
+        bool used = false;
+      };
+
+      struct alignas(64) shard_t {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<uint64_t, entry_t *> index;
+        std::vector<std::unique_ptr<entry_t>> slots; // CLOCK ring, slots are recycled but never freed
+        std::vector<uint32_t> free;
+        size_t hand = 0;
+        uint64_t bytes = 0;
+
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> evictions{0};
+      };
+
+      shard_t &get_shard(uint64_t hash) { return shards[hash & (shard_count - 1)]; }
+
+      bool lookup(uint64_t hash, const char *name, const stat_key_t &key, record_t *record);
+      void insert(uint64_t hash, const char *name, const stat_key_t &key, const record_t &record);
+      void evict(shard_t &shard, uint64_t needed);
+
+      size_t shard_count;
+      uint64_t shard_budget;
+      std::unique_ptr<shard_t[]> shards;
+    };
+  } // namespace cache
+} // namespace doors
+
+#endif
+
+#ifdef CACHE_DETAIL
+#undef CACHE_DETAIL
+
+namespace doors {
+  namespace cache {
+    namespace detail {
+      static uint64_t get_hash(const char *name, const stat_key_t &key)
+      {
+        const uint64_t seed = hash::xxh64(name, std::strlen(name));
+        return hash::xxh64(&key, sizeof key, seed);
+      }
+    } // namespace detail
+
+    cache_t::cache_t(const options_t &options)
+    {
+      shard_count = 1;
+      while (shard_count < options.shards)
+        shard_count <<= 1;
+
+      shard_budget = std::max<uint64_t>(options.budget / shard_count, 1u);
+      shards.reset(new shard_t[shard_count]);
+    }
+
+    bool cache_t::lookup(uint64_t hash, const char *name, const stat_key_t &key, record_t *record)
+    {
+      shard_t &shard = get_shard(hash);
+      {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+
+        const auto it = shard.index.find(hash);
+        if (it != shard.index.end()) {
+          entry_t &entry = *it->second;
+
+          // Different hashes never share an entry, equal ones may still be a collision
+          if (entry.key == key && entry.name == name) {
+            *record = entry.record;
+            if (!entry.referenced.load(std::memory_order_relaxed))
+              entry.referenced.store(true, std::memory_order_relaxed);
+
+            shard.hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+          }
+        }
+      }
+
+      shard.misses.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    void cache_t::evict(shard_t &shard, uint64_t needed)
+    {
+      // Two sweeps at most: the first one may only clear reference bits
+      for (size_t steps = 2 * shard.slots.size(); steps != 0 && shard.bytes + needed > shard_budget; --steps) {
+        entry_t &entry = *shard.slots[shard.hand];
+        const uint32_t slot = (uint32_t) shard.hand;
+        shard.hand = (shard.hand + 1) % shard.slots.size();
+
+        if (!entry.used)
+          continue;
+
+        if (entry.referenced.exchange(false, std::memory_order_relaxed))
+          continue;
+
+        shard.index.erase(entry.hash);
+        shard.bytes -= sizeof(entry_t) + entry.name.size();
+        shard.free.push_back(slot);
+        shard.evictions.fetch_add(1, std::memory_order_relaxed);
+
+        entry.used = false;
+        entry.name.clear();
+        entry.name.shrink_to_fit();
+      }
+    }
+
+    void cache_t::insert(uint64_t hash, const char *name, const stat_key_t &key, const record_t &record)
+    {
+      const uint64_t cost = sizeof(entry_t) + std::strlen(name);
+      if (cost > shard_budget)
+        return;
+
+      shard_t &shard = get_shard(hash);
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+      const auto it = shard.index.find(hash);
+      if (it != shard.index.end()) {
+        // Stale identity (or a collision): take the entry over in place
+        entry_t &entry = *it->second;
+        shard.bytes -= entry.name.size();
+        shard.bytes += std::strlen(name);
+        entry.name = name;
+        entry.key = key;
+        entry.record = record;
+        return;
+      }
+
+      evict(shard, cost);
+
+      entry_t *entry;
+      if (!shard.free.empty()) {
+        entry = shard.slots[shard.free.back()].get();
+        shard.free.pop_back();
+      }
+      else {
+        shard.slots.emplace_back(new entry_t);
+        entry = shard.slots.back().get();
+      }
+
+      entry->hash = hash;
+      entry->name = name;
+      entry->key = key;
+      entry->record = record;
+      entry->referenced.store(false, std::memory_order_relaxed);
+      entry->used = true;
+
+      shard.index.emplace(hash, entry);
+      shard.bytes += cost;
+    }
+
+    bool cache_t::lookup(const char *name, const stat_key_t &key, record_t *record)
+    {
+      return lookup(detail::get_hash(name, key), name, key, record);
+    }
+
+    void cache_t::insert(const char *name, const stat_key_t &key, const record_t &record)
+    {
+      insert(detail::get_hash(name, key), name, key, record);
+    }
+
+    error_t cache_t::read(record_t *record, const char *name, const budget_t &budget)
+    {
+      stat_key_t key;
+      if (record == nullptr || name == nullptr || get_stat_key(name, &key) != error_t::None)
+        return probe::read(record, name, fields_t::defaults, nullptr, budget);
+
+      const uint64_t digest = detail::get_hash(name, key);
+      if (lookup(digest, name, key, record))
+        return (error_t) record->error;
+
+      const error_t error = probe::read(record, name, fields_t::defaults, nullptr, budget);
+
+      // Failing to open the file is no property of its contents, neither is a file changing while being read
+      if (error != error_t::Other && error != error_t::BudgetExceeded && record->size == key.size)
+        insert(digest, name, key, *record);
+
+      return error;
+    }
+
+    error_t cache_t::read(record_t *record, const void *data, size_t length, const budget_t &budget)
+    {
+      if (record == nullptr || data == nullptr)
+        return probe::read(record, data, length, fields_t::defaults, nullptr, budget);
+
+      stat_key_t key = {};
+      key.size = length;
+
+      const uint64_t digest = hash::xxh64(data, length, length);
+      if (lookup(digest, "", key, record))
+        return (error_t) record->error;
+
+      const error_t error = probe::read(record, data, length, fields_t::defaults, nullptr, budget);
+      if (error != error_t::BudgetExceeded)
+        insert(digest, "", key, *record);
+
+      return error;
+    }
+
+    void cache_t::clear()
+    {
+      for (size_t i = 0; i < shard_count; ++i) {
+        shard_t &shard = shards[i];
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+        shard.index.clear();
+        shard.slots.clear();
+        shard.free.clear();
+        shard.hand = 0;
+        shard.bytes = 0;
+      }
+    }
+
+    uint64_t cache_t::hits() const
+    {
+      uint64_t count = 0;
+      for (size_t i = 0; i < shard_count; ++i)
+        count += shards[i].hits.load(std::memory_order_relaxed);
+      return count;
+    }
+
+    uint64_t cache_t::misses() const
+    {
+      uint64_t count = 0;
+      for (size_t i = 0; i < shard_count; ++i)
+        count += shards[i].misses.load(std::memory_order_relaxed);
+      return count;
+    }
+
+    uint64_t cache_t::evictions() const
+    {
+      uint64_t count = 0;
+      for (size_t i = 0; i < shard_count; ++i)
+        count += shards[i].evictions.load(std::memory_order_relaxed);
+      return count;
+    }
+
+    uint64_t cache_t::size() const
+    {
+      uint64_t count = 0;
+      for (size_t i = 0; i < shard_count; ++i) {
+        std::shared_lock<std::shared_mutex> lock(shards[i].mutex);
+        count += shards[i].index.size();
+      }
+      return count;
+    }
+
+    uint64_t cache_t::bytes() const
+    {
+      uint64_t count = 0;
+      for (size_t i = 0; i < shard_count; ++i) {
+        std::shared_lock<std::shared_mutex> lock(shards[i].mutex);
+        count += shards[i].bytes;
+      }
+      return count;
+    }
+  } // namespace cache
+} // namespace doors
+
+#endif
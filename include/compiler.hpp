@@ -7,6 +7,9 @@
 #include <filesystem>
 #include <type_traits>
 #include <functional>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
 
 #if defined(__GNUC__)
   #define __SWIZZLE64 __builtin_bswap64
@@ -14,6 +17,8 @@
   #define __SWIZZLE16 __builtin_bswap16
   #define __SWIZZLE8
 
+  #define __CLZ64 __builtin_clzll // Undefined for 0
+
   #define __PACKED_STRUCT_START struct __attribute__((__packed__))
   #define __PACKED_STRUCT_END
 
@@ -24,6 +29,9 @@
   #define __SWIZZLE16 _byteswap_ushort
   #define __SWIZZLE8
 
+  #include <intrin.h>
+  #define __CLZ64 __lzcnt64
+
   #define __PACKED_STRUCT_START __pragma(pack(push, 1)) struct
   #define __PACKED_STRUCT_END __pragma(pack(pop))
 
@@ -78,6 +86,16 @@ std::string format(const std::string& format, Args... args)
     return std::string(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
 }
 
+// Per-file work limits, guarding against hostile or corrupt files that would otherwise keep a parser busy for as
+// long as they like. Zero means unlimited.
+struct budget_t {
+  uint64_t bytes = 0;                  // Read through scoped_file, seeking past data is free
+  uint64_t seeks = 0;
+  std::chrono::microseconds time{0};   // Wall-clock, from scoped_file::limit() on
+
+  bool empty() const { return bytes == 0 && seeks == 0 && time.count() == 0; }
+};
+
 // Thin wrapper around std::FILE * allowing the use of RAII.
 // Wrapping under a std::unique_ptr<> is also an option, but a struct is more handy at keeping custom metadata information.
 struct scoped_file {
@@ -88,8 +106,80 @@ struct scoped_file {
       p = std::fopen(name, "rb");
     }
 
+    // In-memory files (e.g. uploads handed over by a server) go through the very same parsers.
+    // POSIX provides fmemopen(), everywhere else the buffer gets spilled into an anonymous temporary file.
+    scoped_file(const void *data, size_t length)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+      if (length != 0)
+        p = fmemopen(const_cast<void *>(data), length, "rb");
+#else
+      p = std::tmpfile();
+      if (p != nullptr) {
+        if (std::fwrite(data, size::u8, length, p) != length) {
+          std::fclose(p);
+          p = nullptr;
+        }
+        else
+          std::rewind(p);
+      }
+#endif
+    }
+
+    scoped_file(const scoped_file &) = delete;
+    scoped_file &operator=(const scoped_file &) = delete;
+
     bool valid() const { return p != nullptr; }
 
+    // Starts accounting afresh (whatever was read before, e.g. for hashing, doesn't count).
+    void limit(const budget_t &budget)
+    {
+      this->budget = budget;
+      bytes = 0;
+      seeks = 0;
+      polls = 0;
+      over = false;
+
+      if (budget.time.count() != 0)
+        deadline = std::chrono::steady_clock::now() + budget.time;
+    }
+
+    // Sticky once tripped. Parsers check it wherever the amount of work depends on the file's contents; the clock
+    // only gets asked every so often, byte-wise loops call this once per byte.
+    bool exceeded()
+    {
+      if (over)
+        return true;
+
+      if ((budget.bytes != 0 && bytes > budget.bytes) || (budget.seeks != 0 && seeks > budget.seeks))
+        return over = true;
+
+      if (budget.time.count() != 0 && (polls++ & 0xFF) == 0 && std::chrono::steady_clock::now() >= deadline)
+        return over = true;
+
+      return false;
+    }
+
+    // std::fread() with accounting.
+    size_t read(void *buffer, size_t size, size_t count)
+    {
+      const size_t r = std::fread(buffer, size, count, p);
+      bytes += r * size;
+
+      return r;
+    }
+
+    // Total size of the underlying file, the current position is left untouched.
+    uint64_t size()
+    {
+      const long position = std::ftell(p);
+      std::fseek(p, 0, SEEK_END);
+      const long end = std::ftell(p);
+      std::fseek(p, position, SEEK_SET);
+
+      return end < 0 ? 0u : (uint64_t) end;
+    }
+
     template <
       typename T, 
       typename = std::enable_if<!std::is_void<T>::value>
@@ -97,7 +187,7 @@ struct scoped_file {
     T byte(int count = 1)
     {
       T r{};
-      std::fread(&r, sizeof r, count, p);
+      read(&r, sizeof r, count);
 
       return r;
     }
@@ -107,13 +197,14 @@ struct scoped_file {
       std::string s;
       s.resize(length);
 
-      std::fread(&s[0], size::u8, length, p);
+      read(&s[0], size::u8, length);
 
       return s;
     }
 
     bool skip(long offset = 0, int origin = SEEK_CUR)
     {
+      ++seeks;
       return 0 == std::fseek(p, offset, origin);
     }
 
@@ -127,6 +218,15 @@ struct scoped_file {
       if (p != nullptr)
         std::fclose(p);
     }
+
+    budget_t budget;
+    uint64_t bytes = 0;  // Read so far (through the accounting members above)
+    uint64_t seeks = 0;
+
+private:
+    std::chrono::steady_clock::time_point deadline;
+    uint32_t polls = 0;
+    bool over = false;
 };
 
 template <typename T, typename = std::enable_if<std::is_enum<T>::value>>
@@ -0,0 +1,201 @@
+#if !defined(__DEDUP_DETAIL__)
+#define __DEDUP_DETAIL__
+
+// Content deduplication: byte-identical files (under different paths) get parsed only once.
+//
+// Every file is first fingerprinted by a cheap "quick" hash of its size along with its head and tail windows.
+// Only when that matches a file seen before do both get a full content hash, which has to match as well; the
+// parse result of the first one is then handed out as-is (flagged with record_flags_t::duplicate). Files no larger
+// than two windows are covered by the quick hash entirely and never need a second pass.
+//
+// Concurrent duplicates wait for the first parse to finish instead of starting their own, so that expensive parses
+// (think GIF frame counting) never run twice on the same content.
+//
+// Pending issue(s):
+//   A representative file modified during the scan lends its older result to its former duplicates.
+//   Testing
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/hash.hpp>
+#include <system/record.hpp>
+
+namespace doors {
+  namespace dedup {
+    constexpr const size_t window = 4096;
+
+    // Receives the file rewound to its beginning.
+    using parse_t = std::function<void(scoped_file &file, record_t *record)>;
+
+    class table_t {
+    public:
+      error_t read(const char *name, record_t *record, const parse_t &parse);
+
+      uint64_t duplicates() const { return duplicate_count.load(std::memory_order_relaxed); }
+      uint64_t full_hashes() const { return full_hash_count.load(std::memory_order_relaxed); }
+
+    private:
+      struct group_t {
+        std::string name; // Representative, the first file seen with this content
+        uint64_t size;
+
+        std::mutex mutex; // Guards the (lazily computed) full hash
+        bool full_known;
+        uint64_t full;
+
+        std::shared_future<record_t> result;
+      };
+
+      uint64_t get_full_hash(scoped_file &file);
+      uint64_t get_full_hash(group_t &group);
+
+      std::mutex mutex;
+      std::unordered_map<uint64_t, std::vector<std::shared_ptr<group_t>>> groups; // By quick hash, append-only
+
+      std::atomic<uint64_t> duplicate_count{0};
+      std::atomic<uint64_t> full_hash_count{0};
+    };
+  } // namespace dedup
+} // namespace doors
+
+#endif
+
+#ifdef DEDUP_DETAIL
+#undef DEDUP_DETAIL
+
+namespace doors {
+  namespace dedup {
+    namespace detail {
+      static uint64_t get_quick_hash(scoped_file &file, uint64_t size)
+      {
+        uint8_t buffer[window];
+        hash::xxh64_t state;
+        state.update(&size, sizeof size);
+
+        const size_t head = (size_t) std::min<uint64_t>(size, window);
+        if (std::fread(buffer, size::u8, head, file.p) == head)
+          state.update(buffer, head);
+
+        // The tail window never overlaps the head
+        const size_t tail = (size_t) std::min<uint64_t>(size - head, window);
+        if (tail != 0 && file.skip(-(long) tail, SEEK_END) && std::fread(buffer, size::u8, tail, file.p) == tail)
+          state.update(buffer, tail);
+
+        return state.digest();
+      }
+    } // namespace detail
+
+    uint64_t table_t::get_full_hash(scoped_file &file)
+    {
+      uint8_t buffer[64 * 1024];
+      hash::xxh64_t state(1u);
+
+      file.skip(0, SEEK_SET);
+
+      size_t count;
+      while ((count = std::fread(buffer, size::u8, sizeof buffer, file.p)) != 0)
+        state.update(buffer, count);
+
+      full_hash_count.fetch_add(1, std::memory_order_relaxed);
+
+      return state.digest();
+    }
+
+    uint64_t table_t::get_full_hash(group_t &group)
+    {
+      std::lock_guard<std::mutex> lock(group.mutex);
+
+      if (!group.full_known) {
+        scoped_file file(group.name.c_str());
+        group.full = file.valid() ? get_full_hash(file) : 0u;
+        group.full_known = true;
+      }
+
+      return group.full;
+    }
+
+    error_t table_t::read(const char *name, record_t *record, const parse_t &parse)
+    {
+      scoped_file file(name);
+
+      if (!file.valid() || record == nullptr) {
+        if (record != nullptr) {
+          *record = record_t{};
+          record->error = (uint8_t) error_t::Other;
+        }
+
+        return error_t::Other;
+      }
+
+      const uint64_t size = file.size();
+      const uint64_t quick = detail::get_quick_hash(file, size);
+
+      // Both windows cover every single byte: the quick hash is as good as a full one
+      bool full_known = size <= 2 * window;
+      uint64_t full = full_known ? quick : 0u;
+
+      std::vector<std::shared_ptr<group_t>> candidates;
+      std::promise<record_t> promise;
+
+      for (;;) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          candidates = groups[quick];
+        }
+
+        for (const auto &candidate : candidates) {
+          if (candidate->size != size)
+            continue;
+
+          if (!full_known) {
+            full = get_full_hash(file);
+            full_known = true;
+          }
+
+          const uint64_t candidate_full = size <= 2 * window ? quick : get_full_hash(*candidate);
+          if (candidate_full == full) {
+            *record = candidate->result.get();
+            record->flags |= (uint8_t) record_flags_t::duplicate;
+            duplicate_count.fetch_add(1, std::memory_order_relaxed);
+
+            return (error_t) record->error;
+          }
+        }
+
+        // No identical content yet: become the representative, unless someone else just did
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &group = groups[quick];
+        if (group.size() != candidates.size())
+          continue;
+
+        auto owner = std::make_shared<group_t>();
+        owner->name = name;
+        owner->size = size;
+        owner->full_known = full_known;
+        owner->full = full;
+        owner->result = promise.get_future().share();
+        group.push_back(std::move(owner));
+        break;
+      }
+
+      file.skip(0, SEEK_SET);
+      parse(file, record);
+      promise.set_value(*record);
+
+      return (error_t) record->error;
+    }
+  } // namespace dedup
+} // namespace doors
+
+#endif
@@ -0,0 +1,345 @@
+#if !defined(__IMAGE_EXIF_DETAIL__)
+#define __IMAGE_EXIF_DETAIL__
+
+// EXIF metadata straight off the TIFF structure inside a JPEG's APP1 segment (or any other TIFF-laid-out buffer):
+// no DOM, nothing gets copied. The reader is a view over the caller's buffer, IFDs are only located when first
+// asked for, and looking a tag up reads the tag numbers of the entries ahead of it and nothing else, so asking for
+// the orientation and the capture time touches three IFD headers and a handful of entries.
+//
+// TIFF layout: "II" (little endian) or "MM" (big endian), 42, offset of IFD0. An IFD is an entry count, 12-byte
+// entries (tag, type, count, then the value itself if it fits in 4 bytes, its offset otherwise) and the offset of
+// the next IFD (IFD1, the thumbnail's, follows IFD0). The EXIF and GPS IFDs hang off IFD0 entries. Offsets are
+// relative to the TIFF header.
+//
+// Pending issue(s):
+//   Interoperability IFD and MakerNotes aren't looked into
+//   Testing
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+namespace doors {
+  namespace image {
+    namespace exif {
+      enum class ifd_t : uint8_t {
+        IFD0,
+        EXIF,
+        GPS,
+        IFD1
+      };
+
+      enum class type_t : uint16_t {
+        BYTE = 1,
+        ASCII = 2,
+        SHORT = 3,
+        LONG = 4,
+        RATIONAL = 5,
+        SBYTE = 6,
+        UNDEFINED = 7,
+        SSHORT = 8,
+        SLONG = 9,
+        SRATIONAL = 10,
+        FLOAT = 11,
+        DOUBLE = 12
+      };
+
+      namespace tag {
+        constexpr const uint16_t orientation = 0x0112;        // IFD0, SHORT, 1-8
+        constexpr const uint16_t date_time = 0x0132;          // IFD0, ASCII "YYYY:MM:DD HH:MM:SS", last modified
+        constexpr const uint16_t exif_ifd = 0x8769;           // IFD0, LONG
+        constexpr const uint16_t gps_ifd = 0x8825;            // IFD0, LONG
+        constexpr const uint16_t date_time_original = 0x9003; // EXIF, ASCII, captured
+        constexpr const uint16_t pixel_x_dimension = 0xA002;  // EXIF, SHORT or LONG
+        constexpr const uint16_t pixel_y_dimension = 0xA003;  // EXIF, SHORT or LONG
+        constexpr const uint16_t thumbnail_offset = 0x0201;   // IFD1, LONG (JPEGInterchangeFormat)
+        constexpr const uint16_t thumbnail_length = 0x0202;   // IFD1, LONG (JPEGInterchangeFormatLength)
+      } // namespace tag
+
+      // An IFD entry, its value still in the buffer's byte order.
+      struct entry_t {
+        uint16_t tag;
+        type_t type;
+        uint32_t count;
+        const uint8_t *value; // Inline (within the entry) or wherever its offset points to, bounds already checked
+      };
+
+      class reader_t {
+      public:
+        // `data` starts at the TIFF header, i.e. past APP1's "Exif\0\0", and has to outlive the reader.
+        error_t open(const uint8_t *data, size_t size);
+
+        bool find(ifd_t ifd, uint16_t tag, entry_t *entry);
+
+        // SHORT, LONG or BYTE values (their index-th one).
+        bool get_integer(ifd_t ifd, uint16_t tag, uint32_t *value, uint32_t index = 0);
+        bool get_rational(ifd_t ifd, uint16_t tag, uint32_t *numerator, uint32_t *denominator, uint32_t index = 0);
+        // ASCII, up to the first NUL; a view into the buffer.
+        bool get_string(ifd_t ifd, uint16_t tag, std::string_view *value);
+
+        // 1 (as stored) when missing or out of range
+        uint16_t get_orientation();
+
+        // Where IFD1's JPEG thumbnail sits within the buffer, false when there's none.
+        bool get_thumbnail(const uint8_t **data, size_t *size);
+
+        bool big_endian() const { return motorola; }
+
+      private:
+        uint16_t u16(const uint8_t *p) const;
+        uint32_t u32(const uint8_t *p) const;
+
+        // Offset of the IFD, 0 when the file has none; resolved on first use.
+        uint32_t locate(ifd_t ifd);
+        bool valid_ifd(uint32_t offset) const;
+
+        const uint8_t *data = nullptr;
+        size_t size = 0;
+        bool motorola = false;
+        std::array<uint32_t, 4> offsets{};
+        uint8_t resolved = 0; // Bit per ifd_t
+      };
+
+      // Orientations 5-8 transpose the image: the displayed width is the stored height and vice versa.
+      inline bool is_transposed(uint16_t orientation)
+      {
+        return orientation >= 5 && orientation <= 8;
+      }
+
+      inline void get_display_dimensions(uint16_t orientation, uint32_t width, uint32_t height,
+        uint32_t *display_width, uint32_t *display_height)
+      {
+        *display_width = is_transposed(orientation) ? height : width;
+        *display_height = is_transposed(orientation) ? width : height;
+      }
+    } // namespace exif
+  } // namespace image
+} // namespace doors
+
+#endif
+
+#ifdef IMAGE_EXIF_DETAIL
+#undef IMAGE_EXIF_DETAIL
+
+#include <cstring>
+
+namespace doors {
+  namespace image {
+    namespace exif {
+      static size_t get_type_size(type_t type)
+      {
+        switch (type) {
+          case type_t::BYTE: case type_t::ASCII: case type_t::SBYTE: case type_t::UNDEFINED:
+            return 1;
+          case type_t::SHORT: case type_t::SSHORT:
+            return 2;
+          case type_t::LONG: case type_t::SLONG: case type_t::FLOAT:
+            return 4;
+          case type_t::RATIONAL: case type_t::SRATIONAL: case type_t::DOUBLE:
+            return 8;
+          default:
+            return 0;
+        }
+      }
+
+      uint16_t reader_t::u16(const uint8_t *p) const
+      {
+        return motorola ? (uint16_t) ((p[0] << 8) | p[1]) : (uint16_t) (p[0] | (p[1] << 8));
+      }
+
+      uint32_t reader_t::u32(const uint8_t *p) const
+      {
+        return motorola
+          ? ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3]
+          : p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+      }
+
+      error_t reader_t::open(const uint8_t *data, size_t size)
+      {
+        this->data = nullptr;
+        this->size = 0;
+        offsets = {};
+        resolved = 0;
+
+        if (data == nullptr || size < 8)
+          return error_t::InvalidFormat;
+
+        if (data[0] == 'I' && data[1] == 'I')
+          motorola = false;
+        else if (data[0] == 'M' && data[1] == 'M')
+          motorola = true;
+        else
+          return error_t::InvalidFormat;
+
+        if (u16(data + 2) != 42)
+          return error_t::InvalidFormat;
+
+        this->data = data;
+        this->size = size;
+
+        // IFD0 is needed by everything else anyway
+        offsets[(size_t) ifd_t::IFD0] = valid_ifd(u32(data + 4)) ? u32(data + 4) : 0u;
+        resolved = 1u << (size_t) ifd_t::IFD0;
+
+        return error_t::None;
+      }
+
+      bool reader_t::valid_ifd(uint32_t offset) const
+      {
+        // Past the TIFF header, and the entry count has to be there
+        return offset >= 8 && (size_t) offset + 2 <= size;
+      }
+
+      uint32_t reader_t::locate(ifd_t ifd)
+      {
+        const size_t i = (size_t) ifd;
+        if (data == nullptr)
+          return 0;
+
+        if (resolved & (1u << i))
+          return offsets[i];
+
+        resolved |= 1u << i;
+
+        uint32_t offset = 0;
+        if (ifd == ifd_t::IFD1) {
+          // Right after IFD0's entries
+          const uint32_t ifd0 = locate(ifd_t::IFD0);
+          if (ifd0 != 0) {
+            const size_t next = (size_t) ifd0 + 2 + (size_t) u16(data + ifd0) * 12;
+            if (next + 4 <= size)
+              offset = u32(data + next);
+          }
+        }
+        else {
+          uint32_t value;
+          if (get_integer(ifd_t::IFD0, ifd == ifd_t::EXIF ? tag::exif_ifd : tag::gps_ifd, &value))
+            offset = value;
+        }
+
+        // IFDs pointing back at IFD0 would only get the very same entries looked at twice, not loop
+        offsets[i] = valid_ifd(offset) ? offset : 0u;
+        return offsets[i];
+      }
+
+      bool reader_t::find(ifd_t ifd, uint16_t tag, entry_t *entry)
+      {
+        const uint32_t offset = locate(ifd);
+        if (offset == 0)
+          return false;
+
+        const size_t count = u16(data + offset);
+        const size_t first = (size_t) offset + 2;
+
+        for (size_t i = 0; i < count; ++i) {
+          if (first + (i + 1) * 12 > size)
+            return false;
+
+          const uint8_t *p = data + first + i * 12;
+
+          if (u16(p) != tag)
+            continue;
+
+          entry->tag = tag;
+          entry->type = (type_t) u16(p + 2);
+          entry->count = u32(p + 4);
+
+          const size_t type_size = get_type_size(entry->type);
+          const uint64_t length = (uint64_t) type_size * entry->count;
+          if (type_size == 0)
+            return false;
+
+          if (length <= 4)
+            entry->value = p + 8;
+          else {
+            const uint32_t at = u32(p + 8);
+            if ((uint64_t) at + length > size)
+              return false;
+
+            entry->value = data + at;
+          }
+
+          return true;
+        }
+
+        return false;
+      }
+
+      bool reader_t::get_integer(ifd_t ifd, uint16_t tag, uint32_t *value, uint32_t index)
+      {
+        entry_t entry;
+        if (!find(ifd, tag, &entry) || index >= entry.count)
+          return false;
+
+        switch (entry.type) {
+          case type_t::BYTE: case type_t::UNDEFINED:
+            *value = entry.value[index];
+            return true;
+          case type_t::SHORT:
+            *value = u16(entry.value + (size_t) index * 2);
+            return true;
+          case type_t::LONG:
+            *value = u32(entry.value + (size_t) index * 4);
+            return true;
+          default:
+            return false;
+        }
+      }
+
+      bool reader_t::get_rational(ifd_t ifd, uint16_t tag, uint32_t *numerator, uint32_t *denominator, uint32_t index)
+      {
+        entry_t entry;
+        if (!find(ifd, tag, &entry) || index >= entry.count || entry.type != type_t::RATIONAL)
+          return false;
+
+        *numerator = u32(entry.value + (size_t) index * 8);
+        *denominator = u32(entry.value + (size_t) index * 8 + 4);
+        return true;
+      }
+
+      bool reader_t::get_string(ifd_t ifd, uint16_t tag, std::string_view *value)
+      {
+        entry_t entry;
+        if (!find(ifd, tag, &entry) || entry.type != type_t::ASCII)
+          return false;
+
+        const char *s = (const char *) entry.value;
+        const void *nul = std::memchr(s, '\0', entry.count);
+
+        *value = std::string_view(s, nul != nullptr ? (size_t) ((const char *) nul - s) : entry.count);
+        return true;
+      }
+
+      uint16_t reader_t::get_orientation()
+      {
+        uint32_t orientation;
+        if (!get_integer(ifd_t::IFD0, tag::orientation, &orientation) || orientation < 1 || orientation > 8)
+          return 1u;
+
+        return (uint16_t) orientation;
+      }
+
+      bool reader_t::get_thumbnail(const uint8_t **data, size_t *size)
+      {
+        uint32_t offset, length;
+        if (!get_integer(ifd_t::IFD1, tag::thumbnail_offset, &offset) ||
+          !get_integer(ifd_t::IFD1, tag::thumbnail_length, &length))
+          return false;
+
+        if (length == 0 || (uint64_t) offset + length > this->size)
+          return false;
+
+        *data = this->data + offset;
+        *size = length;
+        return true;
+      }
+    } // namespace exif
+  } // namespace image
+} // namespace doors
+
+#endif
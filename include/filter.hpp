@@ -0,0 +1,416 @@
+#if !defined(__FILTER_DETAIL__)
+#define __FILTER_DETAIL__
+
+// Predicates pushed down into the parsers: a filter gets evaluated at every checkpoint (see system/fields.hpp) with
+// whatever is known at that point, and a file turns out rejected as soon as the known fields already decide against
+// it; an oversized-or-animated hunt mostly gets its answer out of the very first bytes.
+//
+// Grammar:
+//   expression := and ('||' and)*
+//   and        := unary ('&&' unary)*
+//   unary      := '!' unary | '(' expression ')' | field [('==' | '!=' | '<' | '<=' | '>' | '>=') value]
+//   value      := integer, optionally suffixed with k, M or G (powers of 1024), or a format name (GIF, PNG, ...)
+// A field standing on its own is true when nonzero. Fields:
+//   format, size, width, height, bpp, color_space, version, frames, layers, orientation, quality,
+//   subsampling (J:a:b as a number: 444, 422, 420, ...), preview (bytes), interlaced, compressed, animated,
+//   truncated (flags)
+// e.g. "width >= 2048 || frames > 1", "format == PNG && interlaced", "size > 8M && !(format == JPG)",
+// "quality > 80 || subsampling == 444".
+//
+// Evaluation is three-valued: a comparison on a field that isn't known yet is neither true nor false, and the
+// filter only rejects once the whole expression is definitely false.
+//
+// Pending issue(s):
+//   Testing
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/fields.hpp>
+#include <system/record.hpp>
+
+namespace doors {
+  namespace filter {
+    class filter_t {
+    public:
+      // error_t::InvalidRequest on a malformed expression, `position` then tells where parsing stopped.
+      error_t compile(const char *expression, size_t *position = nullptr);
+
+      // False only if what is known of the record already fails the predicate.
+      bool admits(const record_t &record, fields_t known) const;
+
+      // What the parsers have to find out for admits() to come to a verdict.
+      fields_t fields() const { return required; }
+
+      bool empty() const { return root < 0; }
+
+      checkpoint_t checkpoint() const;
+
+    private:
+      enum class kind_t : uint8_t { compare, truthy, negate, conjunction, disjunction };
+      enum class operator_t : uint8_t { eq, ne, lt, le, gt, ge };
+      enum class field_t : uint8_t {
+        format, size, width, height, bpp, color_space, version, frames, layers, orientation, quality, subsampling,
+        preview, interlaced, compressed, animated, truncated
+      };
+      enum class tri_t : uint8_t { no, yes, unknown };
+
+      struct node_t {
+        kind_t kind;
+        field_t field;
+        operator_t op;
+        uint64_t value;
+        int left;
+        int right;
+      };
+
+      tri_t evaluate(int node, const record_t &record, fields_t known) const;
+
+      std::vector<node_t> nodes;
+      int root = -1;
+      fields_t required = fields_t::none;
+
+      friend struct parser_t;
+    };
+  } // namespace filter
+} // namespace doors
+
+#endif
+
+#ifdef FILTER_DETAIL
+#undef FILTER_DETAIL
+
+#include <cctype>
+#include <cstring>
+
+namespace doors {
+  namespace filter {
+    // Recursive descent over the grammar above, straight into filter_t's node array
+    struct parser_t {
+      using node_t = filter_t::node_t;
+      using kind_t = filter_t::kind_t;
+      using field_t = filter_t::field_t;
+      using operator_t = filter_t::operator_t;
+
+      const char *begin;
+      const char *p;
+      filter_t &filter;
+
+      void skip()
+      {
+        while (std::isspace((unsigned char) *p))
+          ++p;
+      }
+
+      bool accept(const char *token)
+      {
+        skip();
+
+        const size_t length = std::strlen(token);
+        if (std::strncmp(p, token, length) != 0)
+          return false;
+
+        p += length;
+        return true;
+      }
+
+      std::string identifier()
+      {
+        skip();
+
+        const char *start = p;
+        while (std::isalnum((unsigned char) *p) || *p == '_')
+          ++p;
+
+        return std::string(start, p);
+      }
+
+      int add(const node_t &node)
+      {
+        filter.nodes.push_back(node);
+        return (int) filter.nodes.size() - 1;
+      }
+
+      int expression()
+      {
+        int left = conjunction();
+        while (left >= 0 && accept("||")) {
+          const int right = conjunction();
+          if (right < 0)
+            return -1;
+
+          left = add(node_t { kind_t::disjunction, field_t::format, operator_t::eq, 0, left, right });
+        }
+
+        return left;
+      }
+
+      int conjunction()
+      {
+        int left = unary();
+        while (left >= 0 && accept("&&")) {
+          const int right = unary();
+          if (right < 0)
+            return -1;
+
+          left = add(node_t { kind_t::conjunction, field_t::format, operator_t::eq, 0, left, right });
+        }
+
+        return left;
+      }
+
+      int unary()
+      {
+        if (accept("!")) {
+          // "!=" never starts an operand
+          const int operand = unary();
+          if (operand < 0)
+            return -1;
+
+          return add(node_t { kind_t::negate, field_t::format, operator_t::eq, 0, operand, -1 });
+        }
+
+        if (accept("(")) {
+          const int inner = expression();
+          if (inner < 0 || !accept(")"))
+            return -1;
+
+          return inner;
+        }
+
+        return comparison();
+      }
+
+      int comparison()
+      {
+        static const struct {
+          const char *name;
+          field_t field;
+          fields_t fields;
+        } names[] = {
+          { "format", field_t::format, fields_t::none },
+          { "size", field_t::size, fields_t::none },
+          { "width", field_t::width, fields_t::dimensions },
+          { "height", field_t::height, fields_t::dimensions },
+          { "bpp", field_t::bpp, fields_t::depth },
+          { "color_space", field_t::color_space, fields_t::depth },
+          { "version", field_t::version, fields_t::version },
+          { "frames", field_t::frames, fields_t::frames },
+          { "layers", field_t::layers, fields_t::layers },
+          { "orientation", field_t::orientation, fields_t::exif },
+          { "quality", field_t::quality, fields_t::quality },
+          { "subsampling", field_t::subsampling, fields_t::depth },
+          { "preview", field_t::preview, fields_t::preview },
+          { "interlaced", field_t::interlaced, fields_t::dimensions },
+          { "compressed", field_t::compressed, fields_t::dimensions },
+          { "animated", field_t::animated, fields_t::animation },
+          { "truncated", field_t::truncated, fields_t::trailer }
+        };
+
+        const std::string name = identifier();
+
+        node_t node = { kind_t::truthy, field_t::format, operator_t::ne, 0, -1, -1 };
+        bool found = false;
+        for (const auto &entry : names) {
+          if (name == entry.name) {
+            node.field = entry.field;
+            filter.required = filter.required | entry.fields;
+            found = true;
+            break;
+          }
+        }
+
+        if (!found)
+          return -1;
+
+        // Longest operators first
+        static const struct {
+          const char *token;
+          operator_t op;
+        } operators[] = {
+          { "==", operator_t::eq }, { "!=", operator_t::ne }, { "<=", operator_t::le },
+          { ">=", operator_t::ge }, { "<", operator_t::lt }, { ">", operator_t::gt }
+        };
+
+        for (const auto &entry : operators) {
+          if (accept(entry.token)) {
+            node.kind = kind_t::compare;
+            node.op = entry.op;
+            return value(&node.value) ? add(node) : -1;
+          }
+        }
+
+        return add(node);
+      }
+
+      bool value(uint64_t *value)
+      {
+        skip();
+
+        if (std::isdigit((unsigned char) *p)) {
+          char *end;
+          *value = std::strtoull(p, &end, 10);
+          p = end;
+
+          switch (*p) {
+            case 'k': case 'K': *value <<= 10; ++p; break;
+            case 'M': *value <<= 20; ++p; break;
+            case 'G': *value <<= 30; ++p; break;
+          }
+
+          return true;
+        }
+
+        const std::string name = identifier();
+        for (uint8_t format = (uint8_t) format_t::GIF; format <= (uint8_t) format_t::PSD; ++format) {
+          if (name == get_format_sanitized((format_t) format)) {
+            *value = format;
+            return true;
+          }
+        }
+
+        return false;
+      }
+    };
+
+    error_t filter_t::compile(const char *expression, size_t *position)
+    {
+      nodes.clear();
+      root = -1;
+      required = fields_t::none;
+
+      if (expression == nullptr)
+        return error_t::InvalidRequest;
+
+      parser_t parser = { expression, expression, *this };
+      const int node = parser.expression();
+      parser.skip();
+
+      if (position != nullptr)
+        *position = (size_t) (parser.p - parser.begin);
+
+      if (node < 0 || *parser.p != '\0') {
+        nodes.clear();
+        required = fields_t::none;
+        return error_t::InvalidRequest;
+      }
+
+      root = node;
+      return error_t::None;
+    }
+
+    filter_t::tri_t filter_t::evaluate(int index, const record_t &record, fields_t known) const
+    {
+      const node_t &node = nodes[index];
+
+      switch (node.kind) {
+        case kind_t::negate: {
+          const tri_t operand = evaluate(node.left, record, known);
+          return operand == tri_t::unknown ? tri_t::unknown : (operand == tri_t::yes ? tri_t::no : tri_t::yes);
+        }
+        case kind_t::conjunction: {
+          const tri_t left = evaluate(node.left, record, known);
+          if (left == tri_t::no)
+            return tri_t::no;
+
+          const tri_t right = evaluate(node.right, record, known);
+          if (right == tri_t::no)
+            return tri_t::no;
+
+          return left == tri_t::yes && right == tri_t::yes ? tri_t::yes : tri_t::unknown;
+        }
+        case kind_t::disjunction: {
+          const tri_t left = evaluate(node.left, record, known);
+          if (left == tri_t::yes)
+            return tri_t::yes;
+
+          const tri_t right = evaluate(node.right, record, known);
+          if (right == tri_t::yes)
+            return tri_t::yes;
+
+          return left == tri_t::no && right == tri_t::no ? tri_t::no : tri_t::unknown;
+        }
+        default:
+          break;
+      }
+
+      uint64_t value;
+      fields_t needs = fields_t::none;
+
+      switch (node.field) {
+        case field_t::format: value = record.format; break;
+        case field_t::size: value = record.size; break;
+        case field_t::width: value = record.width; needs = fields_t::dimensions; break;
+        case field_t::height: value = record.height; needs = fields_t::dimensions; break;
+        case field_t::bpp: value = record.bpp; needs = fields_t::depth; break;
+        case field_t::color_space: value = record.color_space; needs = fields_t::depth; break;
+        case field_t::version: value = record.version; needs = fields_t::version; break;
+        case field_t::frames: value = record.frames; needs = fields_t::frames; break;
+        case field_t::layers: value = record.layers; needs = fields_t::layers; break;
+        case field_t::orientation: value = record.orientation; needs = fields_t::exif; break;
+        case field_t::quality: value = record.quality; needs = fields_t::quality; break;
+        case field_t::subsampling: value = get_subsampling_sanitized(record.subsampling); needs = fields_t::depth; break;
+        case field_t::preview: value = record.preview; needs = fields_t::preview; break;
+        case field_t::interlaced:
+          value = (record.flags & (uint8_t) record_flags_t::interlaced) != 0;
+          needs = fields_t::dimensions;
+          break;
+        case field_t::compressed:
+          value = (record.flags & (uint8_t) record_flags_t::compressed) != 0;
+          needs = fields_t::dimensions;
+          break;
+        case field_t::animated:
+          value = (record.flags & (uint8_t) record_flags_t::animated) != 0;
+          needs = fields_t::frames | fields_t::animation; // Either one will do
+          break;
+        case field_t::truncated:
+          value = (record.flags & (uint8_t) record_flags_t::truncated) != 0;
+          needs = fields_t::trailer;
+          break;
+        default:
+          return tri_t::unknown;
+      }
+
+      if (needs != fields_t::none && !(known & needs))
+        return tri_t::unknown;
+
+      bool r;
+      if (node.kind == kind_t::truthy)
+        r = value != 0;
+      else {
+        switch (node.op) {
+          case operator_t::eq: r = value == node.value; break;
+          case operator_t::ne: r = value != node.value; break;
+          case operator_t::lt: r = value < node.value; break;
+          case operator_t::le: r = value <= node.value; break;
+          case operator_t::gt: r = value > node.value; break;
+          default: r = value >= node.value; break;
+        }
+      }
+
+      return r ? tri_t::yes : tri_t::no;
+    }
+
+    bool filter_t::admits(const record_t &record, fields_t known) const
+    {
+      return root < 0 || evaluate(root, record, known) != tri_t::no;
+    }
+
+    checkpoint_t filter_t::checkpoint() const
+    {
+      if (root < 0)
+        return nullptr;
+
+      return [this] (const record_t &record, fields_t known) {
+        return admits(record, known);
+      };
+    }
+  } // namespace filter
+} // namespace doors
+
+#endif
@@ -8,18 +8,24 @@
 
 // Test suite: http://code.google.com/p/imagetestsuite/ (which also covers PNG, JFIF & TIFF)
 // 
-// Since GIF contains no frame count information, a whole-file read is required to approximate the frames,
-// which is, probably slow on large files.
+// Since GIF contains no frame count information, counting frames means walking every block of the file. Blocks are
+// length-prefixed though (color tables by their declared size, extensions and LZW data as chains of sub-blocks of at
+// most 255 bytes), so the walk never has to look at pixel data byte by byte. Asking for fields_t::animation only
+// stops the walk at the second frame.
 
 #include <unordered_map>
 #include <any>
 #include <string>
+#include <vector>
 
 #include <type_traits>
 
 #include "compiler.hpp"
 using namespace compiler;
 
+#include <system/fields.hpp>
+#include <system/record.hpp>
+
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/basic_file_sink.h>
 
@@ -49,12 +55,78 @@ namespace doors {
           GIF_GCT_header_t gct;
         };
 
-        error_t read(GIF_header_t *header, const char *name);
+        // One per image descriptor, offsets are absolute. Fixed layout, it's written to disk as-is (see GIF_index_t).
+        __PACKED_STRUCT_START GIF_frame_t {
+          uint64_t descriptor;   // The image descriptor's introducer (0x2C)
+          uint64_t control;      // The graphics control extension's introducer preceding it, 0 if none
+          uint64_t palette;      // Local color table, 0 if none
+          uint64_t data;         // LZW minimum code size, followed by the image data sub-blocks
+          uint16_t left;
+          uint16_t top;
+          uint16_t width;
+          uint16_t height;
+          uint16_t delay;        // Hundredths of a second
+          uint16_t palette_size; // Local color table entries
+          int16_t transparent;   // Transparent color index, -1 if none
+          uint8_t disposal;      // 0: unspecified, 1: leave in place, 2: restore to background, 3: restore to previous
+          uint8_t interlaced;
+        };
+        __PACKED_STRUCT_END
+
+        // Frame offsets for random access: seeking to frame N, or adding up the total duration, without walking the
+        // file again. Serializable, so it can be cached next to the file; `size` tells a stale index from a good one.
+        //
+        // On disk: GIF_index_header_t, then the frames. Saved aside and renamed over.
+        struct GIF_index_t {
+          uint64_t size = 0;  // Of the file the index was built from
+          int32_t loops = -1; // NETSCAPE2.0 loop count: -1 if none (play once), 0 forever
+          std::vector<GIF_frame_t> frames;
+
+          uint64_t get_duration() const; // Hundredths of a second, a single loop
+
+          // The frame shown at `time` (hundredths of a second into a loop), frames.size() if past the end.
+          size_t get_frame(uint64_t time) const;
+
+          error_t save(const char *name) const;
+          error_t load(const char *name);
+        };
+
+        __PACKED_STRUCT_START GIF_index_header_t {
+          uint32_t magic;
+          uint16_t version;
+          uint16_t frame_size;
+          uint64_t size;
+          int32_t loops;
+          uint32_t count;
+        };
+        __PACKED_STRUCT_END
+
+        constexpr const uint32_t index_magic = 0x31494744; // "DGI1"
+        constexpr const uint16_t index_version = 1;
+
+        error_t read(GIF_header_t *header, scoped_file &file, const fields_t fields = fields_t::all,
+          const checkpoint_t &checkpoint = nullptr);
+        error_t read(GIF_header_t *header, const char *name, const fields_t fields = fields_t::all,
+          const checkpoint_t &checkpoint = nullptr);
+
+        // Walks the blocks following the global color table (where `file` has to be positioned), counting image
+        // descriptors into header->frames until the trailer, the end of the file or `limit` frames (0: no limit).
+        // Given an index, every frame gets recorded along the way.
+        error_t walk(GIF_header_t *header, scoped_file &file, uint16_t limit = 0, GIF_index_t *index = nullptr);
+
+        // Header and index in one go.
+        error_t index(GIF_index_t *index, scoped_file &file, GIF_header_t *header = nullptr);
+        error_t index(GIF_index_t *index, const char *name, GIF_header_t *header = nullptr);
+
+        // Positions `file` at the frame's graphics control extension (or its image descriptor, lacking one).
+        // Frames other than the first may only make sense composed over the previous ones, see `disposal`.
+        error_t seek(scoped_file &file, const GIF_index_t &index, size_t frame);
       } // namespace detail
 
       using namespace detail;
 
       std::unordered_map<std::string, std::any> parse(const char *name);
+      record_t to_record(const GIF_header_t &header);
     } // namespace gif
   } // namespace image
 } // namespace doors
@@ -83,15 +155,20 @@ namespace doors {
   namespace image {
     namespace gif {
       namespace detail {
+        error_t read(GIF_header_t *header, const char *name, const fields_t fields, const checkpoint_t &checkpoint)
+        {
+          scoped_file file(name);
+          return read(header, file, fields, checkpoint);
+        }
+
         // GIF is little endian
-        error_t read(GIF_header_t *header, const char *name)
+        error_t read(GIF_header_t *header, scoped_file &file, const fields_t fields, const checkpoint_t &checkpoint)
         {
 #ifdef IMAGE_GIF_DETAIL_DEBUG
           spdlog::set_pattern("[%^%l%$] %v");
           spdlog::set_level(spdlog::level::debug);
 #endif
 
-          scoped_file file(name);
           const char *signature = __SIGNATURE;
 
           if (file.valid() && header) {
@@ -130,16 +207,16 @@ namespace doors {
 
               std::fread(&header->lsd.packed, size::u8, 1, file.p);
 
-              // Contents of the packed byte (LSB ordering):
-              // Bit 0: global color table flag
-              // Bit 1-3: color resolution (obsolete)
-              // Bit 4: Sort flag (obsolete)
-              // Bit 5-7: Size of the global color table
+              // Contents of the packed byte (MSB first):
+              // Bit 7: global color table flag
+              // Bit 4-6: color resolution (obsolete)
+              // Bit 3: Sort flag (obsolete)
+              // Bit 0-2: Size of the global color table
               const auto set = std::bitset<8>(header->lsd.packed);
               header->gct.exists = set[7] == 1;
 
-              // Stuff the first 3 bits, which helps in determining how many GCT bytes to skip through
-              header->gct.size = pack<uint8_t, 8>(set, {0, 1, 2});
+              // The low 3 bits, which helps in determining how many GCT bytes to skip through
+              header->gct.size = header->lsd.packed & 0x07;
 
 #ifdef IMAGE_GIF_DETAIL_DEBUG
               spdlog::debug(
@@ -175,7 +252,7 @@ namespace doors {
                 );
 #endif
 
-                std::fseek(file.p, bytes, SEEK_CUR);
+                file.skip((long) bytes);
               }
             }
 
@@ -187,29 +264,263 @@ namespace doors {
                 // ...
             }
 
-            // Reading frame data requires a thorough read of the whole file.
-            while (!std::feof(file.p)) {
-              uint8_t magic;
-              std::fread(&magic, size::u8, 1, file.p);
-
-              // A LZW-packed frame is preceded with an image descriptor, beginning with 
-              // ',' (0x2C). The next 4 bytes contain starting origin, followed by 4 bytes of image size.
-              // It's already encoded using Intel byte order, thus require no swizzling (on x86)
-              if (magic == 0x2C) {
-                uint16_t w, h;
-                std::fseek(file.p, 4, SEEK_CUR);
-                std::fread(&w, size::u16, 1, file.p);
-                std::fread(&h, size::u16, 1, file.p);
-
-                if (w == header->lsd.width && h == header->lsd.height)
-                  header->frames += 1;
+            // Everything but the frame count is known by now
+            if (!(fields & (fields_t::frames | fields_t::animation)))
+              return error_t::None;
+
+            if (checkpoint && !checkpoint(to_record(*header), fields_t::basic))
+              return error_t::Rejected;
+
+            // Telling a still image from an animation only takes up to the second frame
+            return walk(header, file, (fields & fields_t::frames) ? 0 : 2);
+          }
+
+          return error_t::Other;
+        }
+
+        // Skips a chain of data sub-blocks, up to (and including) its zero-length terminator. Sub-blocks are read
+        // rather than sought past: at most 255 bytes each, they come out of stdio's buffer anyway.
+        static bool skip_sub_blocks(scoped_file &file)
+        {
+          uint8_t buffer[255];
+
+          for (;;) {
+            uint8_t length;
+            if (file.read(&length, size::u8, 1) != 1)
+              return false;
+
+            if (length == 0)
+              return true;
+
+            if (file.read(buffer, size::u8, length) != length)
+              return false;
+          }
+        }
+
+        error_t walk(GIF_header_t *header, scoped_file &file, uint16_t limit, GIF_index_t *index)
+        {
+          header->frames = 0;
+
+          // The graphics control extension applies to the image descriptor following it
+          GIF_frame_t pending = {0};
+          pending.transparent = -1;
+
+          while (!file.exceeded()) {
+            const long position = index != nullptr ? std::ftell(file.p) : 0;
+
+            uint8_t introducer;
+            if (file.read(&introducer, size::u8, 1) != 1)
+              break;
+
+            if (introducer == 0x3B) // Trailer
+              break;
+
+            if (introducer == 0x21) { // Extension: label, then sub-blocks (GCE, comment, application, plain text)
+              uint8_t label;
+              if (file.read(&label, size::u8, 1) != 1)
+                break;
+
+              if (index != nullptr && (label == 0xF9 || label == 0xFF)) {
+                uint8_t block[256];
+                uint8_t length;
+                if (file.read(&length, size::u8, 1) != 1 || file.read(block, size::u8, length) != length)
+                  break;
+
+                if (length == 0) // An empty extension, that was its terminator
+                  continue;
+
+                // GCE: packed byte (disposal in bits 2-4, transparency flag in bit 0), delay, transparent index
+                if (label == 0xF9 && length >= 4) {
+                  pending.control = (uint64_t) position;
+                  pending.disposal = (block[0] >> 2) & 0x07;
+                  pending.delay = (uint16_t) (block[1] | (block[2] << 8));
+                  pending.transparent = (block[0] & 0x01) ? (int16_t) block[3] : (int16_t) -1;
+                }
+
+                // NETSCAPE2.0 (or its ANIMEXTS1.0 twin): sub-block 1 holds the loop count
+                if (label == 0xFF && length == 11 &&
+                  (std::memcmp(block, "NETSCAPE2.0", 11) == 0 || std::memcmp(block, "ANIMEXTS1.0", 11) == 0)) {
+                  if (file.read(&length, size::u8, 1) != 1)
+                    break;
+
+                  if (length != 0) {
+                    if (file.read(block, size::u8, length) != length)
+                      break;
+
+                    if (length >= 3 && block[0] == 1)
+                      index->loops = block[1] | (block[2] << 8);
+                  }
+                  else
+                    continue; // That was the terminator already
+                }
               }
+
+              if (!skip_sub_blocks(file))
+                break;
+
+              continue;
             }
 
-            return error_t::None;
+            // Anything else but an image descriptor: corrupt, the frames found so far is all there is to tell
+            if (introducer != 0x2C)
+              break;
+
+            // Image descriptor: left, top, width, height (little endian), packed byte
+            uint8_t descriptor[9];
+            if (file.read(descriptor, size::u8, sizeof descriptor) != sizeof descriptor)
+              break;
+
+            // Saturating, a count wrapping around to 0 would pass an animation off as a still image
+            if (header->frames != UINT16_MAX)
+              header->frames += 1;
+
+            const uint8_t packed = descriptor[8];
+            const uint16_t palette_size = (packed & 0x80) ? (uint16_t) cpow(2, (packed & 0x07) + 1) : 0u;
+
+            if (index != nullptr) {
+              GIF_frame_t frame = pending;
+              frame.descriptor = (uint64_t) position;
+              frame.left = (uint16_t) (descriptor[0] | (descriptor[1] << 8));
+              frame.top = (uint16_t) (descriptor[2] | (descriptor[3] << 8));
+              frame.width = (uint16_t) (descriptor[4] | (descriptor[5] << 8));
+              frame.height = (uint16_t) (descriptor[6] | (descriptor[7] << 8));
+              frame.interlaced = (packed & 0x40) != 0;
+              frame.palette_size = palette_size;
+              frame.palette = palette_size != 0 ? (uint64_t) position + 10u : 0u;
+              frame.data = (uint64_t) position + 10u + palette_size * 3u;
+              index->frames.push_back(frame);
+
+              pending = GIF_frame_t{0};
+              pending.transparent = -1;
+            }
+
+            if (limit != 0 && header->frames >= limit)
+              break;
+
+            // Local color table, sized like the global one
+            if (palette_size != 0)
+              file.skip((long) palette_size * 3);
+
+            // LZW minimum code size, then the image data sub-blocks
+            uint8_t code_size;
+            if (file.read(&code_size, size::u8, 1) != 1 || !skip_sub_blocks(file))
+              break;
           }
 
-          return error_t::Other;
+          if (file.exceeded())
+            return error_t::BudgetExceeded;
+
+          return error_t::None;
+        }
+
+        error_t index(GIF_index_t *index, scoped_file &file, GIF_header_t *header)
+        {
+          if (index == nullptr)
+            return error_t::Other;
+
+          GIF_header_t local = {0};
+          if (header == nullptr)
+            header = &local;
+
+          *index = GIF_index_t();
+          if (!file.valid())
+            return error_t::Other;
+
+          index->size = file.size();
+
+          // Everything up to the global color table, the walk is on us
+          error_t error = read(header, file, fields_t::basic);
+          if (error != error_t::None)
+            return error;
+
+          return walk(header, file, 0, index);
+        }
+
+        error_t index(GIF_index_t *index, const char *name, GIF_header_t *header)
+        {
+          scoped_file file(name);
+          return gif::index(index, file, header);
+        }
+
+        error_t seek(scoped_file &file, const GIF_index_t &index, size_t frame)
+        {
+          if (!file.valid() || frame >= index.frames.size())
+            return error_t::InvalidRequest;
+
+          const GIF_frame_t &f = index.frames[frame];
+          return file.skip((long) (f.control != 0 ? f.control : f.descriptor), SEEK_SET) ? error_t::None : error_t::Other;
+        }
+
+        uint64_t GIF_index_t::get_duration() const
+        {
+          uint64_t r = 0;
+          for (const auto &frame : frames)
+            r += frame.delay;
+
+          return r;
+        }
+
+        size_t GIF_index_t::get_frame(uint64_t time) const
+        {
+          uint64_t end = 0;
+          for (size_t i = 0; i < frames.size(); ++i) {
+            end += frames[i].delay;
+            if (time < end)
+              return i;
+          }
+
+          return frames.size();
+        }
+
+        error_t GIF_index_t::save(const char *name) const
+        {
+          // Written aside and renamed over, a crash mid-write leaves the previous index intact
+          const std::string temporary = std::string(name) + ".tmp";
+          std::FILE *file = std::fopen(temporary.c_str(), "wb");
+          if (file == nullptr)
+            return error_t::Other;
+
+          const GIF_index_header_t header = {
+            index_magic, index_version, (uint16_t) sizeof(GIF_frame_t), size, loops, (uint32_t) frames.size()
+          };
+
+          bool written =
+            std::fwrite(&header, sizeof header, 1, file) == 1 &&
+            (frames.empty() || std::fwrite(frames.data(), sizeof(GIF_frame_t), frames.size(), file) == frames.size());
+
+          written = std::fclose(file) == 0 && written;
+
+          std::error_code code;
+          if (!written) {
+            std::filesystem::remove(temporary, code);
+            return error_t::Other;
+          }
+
+          std::filesystem::rename(temporary, name, code);
+          return code ? error_t::Other : error_t::None;
+        }
+
+        error_t GIF_index_t::load(const char *name)
+        {
+          scoped_file file(name);
+          if (!file.valid())
+            return error_t::Other;
+
+          GIF_index_header_t header;
+          if (file.read(&header, sizeof header, 1) != 1 || header.magic != index_magic ||
+            header.version != index_version || header.frame_size != sizeof(GIF_frame_t) ||
+            file.size() != sizeof header + (uint64_t) header.count * sizeof(GIF_frame_t))
+            return error_t::InvalidRequest;
+
+          std::vector<GIF_frame_t> r(header.count);
+          if (header.count != 0 && file.read(r.data(), sizeof(GIF_frame_t), r.size()) != r.size())
+            return error_t::InvalidRequest;
+
+          size = header.size;
+          loops = header.loops;
+          frames = std::move(r);
+
+          return error_t::None;
         }
       } // namespace detail
 
@@ -231,6 +542,21 @@ namespace doors {
 
         return r;
       }
+
+      record_t to_record(const GIF_header_t &header)
+      {
+        record_t r = {0};
+
+        r.format = (uint8_t) format_t::GIF;
+        r.version = header.version_sanitized;
+        r.width = header.lsd.width;
+        r.height = header.lsd.height;
+        r.frames = header.frames;
+        r.bpp = header.gct.exists ? (uint8_t) (header.gct.size + 1) : 0u;
+        r.flags = (uint8_t) (header.frames > 1 ? record_flags_t::animated : record_flags_t::none);
+
+        return r;
+      }
     } // namespace gif
   } // namespace image
 } // namespace doors
@@ -0,0 +1,468 @@
+#if !defined(__IMAGE_GIF_DECODE_DETAIL__)
+#define __IMAGE_GIF_DECODE_DETAIL__
+
+// GIF decoding down to RGBA pixels, on top of the frame index (see GIF_index_t in gif.hpp).
+//
+// LZW goes through fixed code tables (prefix, suffix, string length, first byte) owned by the decoder and reused for
+// every frame and file: no allocation per code, strings get written backwards straight into the output. Palette
+// expansion is a 256-entry table lookup, eight pixels per AVX2 gather when available.
+//
+// Frames are composited onto a single canvas incrementally: a frame only touches its own rectangle, and disposal
+// only undoes that rectangle again (restore to background clears it, restore to previous puts back what was saved
+// of it beforehand). The canvas is never repainted as a whole, past being cleared once per file.
+//
+// Pending issue(s):
+//   The background color is ignored, disposal 2 clears to transparent (as browsers do).
+//   Testing
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <gif.hpp>
+
+namespace doors {
+  namespace image {
+    namespace gif {
+      // R, G, B, A in memory order
+      using pixel_t = uint32_t;
+
+      // Called once per decoded frame with the canvas as it's shown at that point (width() x height(), row-major).
+      // Returning false stops decoding.
+      using frame_sink_t = std::function<bool(size_t index, const GIF_frame_t &frame, const pixel_t *canvas)>;
+
+      class decoder_t {
+      public:
+        // At most `limit` frames (0: all of them). A limit of 1 is the poster frame fast path: the walk stops right
+        // past the first frame, nothing gets saved for disposal.
+        error_t decode(scoped_file &file, const frame_sink_t &sink, size_t limit = 0);
+
+        // With an index at hand (e.g. a cached one), the file needn't be walked first.
+        error_t decode(scoped_file &file, const GIF_index_t &index, const frame_sink_t &sink, size_t limit = 0);
+
+        // Canvases (and frames) above that are turned down as InvalidGIF rather than allocated: 1 GiB worth of RGBA.
+        static constexpr const uint64_t max_pixels = 1u << 28;
+
+        uint16_t width() const { return header.lsd.width; }
+        uint16_t height() const { return header.lsd.height; }
+
+      private:
+        static constexpr const size_t max_codes = 4096;
+
+        error_t read_header(scoped_file &file);
+        error_t decode_frames(scoped_file &file, const GIF_index_t &index, const frame_sink_t &sink, size_t limit);
+        error_t read_palette(scoped_file &file, uint64_t offset, size_t entries, pixel_t *palette);
+        error_t read_data(scoped_file &file, const GIF_frame_t &frame, uint8_t *code_size);
+        size_t expand(uint8_t code_size, size_t pixels);
+        void compose(const GIF_frame_t &frame, size_t decoded, const pixel_t *palette);
+        void dispose(const GIF_frame_t &frame);
+
+        GIF_header_t header = {0};
+        GIF_index_t walked;
+
+        uint16_t prefix[max_codes];
+        uint8_t suffix[max_codes];
+        uint8_t first[max_codes];
+        uint16_t length[max_codes];
+
+        std::vector<uint8_t> data;    // The frame's LZW stream, sub-blocks joined
+        std::vector<uint8_t> indices; // Decoded, in stream order (interlaced frames aren't in row order)
+        std::vector<pixel_t> canvas;
+        std::vector<pixel_t> backup;  // What a "restore to previous" frame covered, its rectangle only
+
+        pixel_t global[256];
+        pixel_t local[256];
+      };
+    } // namespace gif
+  } // namespace image
+} // namespace doors
+
+#endif
+
+#ifdef IMAGE_GIF_DECODE_DETAIL
+#undef IMAGE_GIF_DECODE_DETAIL
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#endif
+
+namespace doors {
+  namespace image {
+    namespace gif {
+      namespace detail {
+        static inline pixel_t get_pixel(uint8_t r, uint8_t g, uint8_t b)
+        {
+          return (pixel_t) r | ((pixel_t) g << 8) | ((pixel_t) b << 16) | 0xFF000000u;
+        }
+
+        // Palette lookup of a row of indices, leaving transparent ones (-1: none) alone
+        static void expand_row(const uint8_t *source, pixel_t *destination, size_t count, const pixel_t *palette,
+          int transparent)
+        {
+          size_t i = 0;
+
+#if defined(__AVX2__)
+          const __m256i key = _mm256_set1_epi32(transparent);
+
+          for (; i + 8 <= count; i += 8) {
+            const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(source + i)));
+            __m256i color = _mm256_i32gather_epi32(reinterpret_cast<const int *>(palette), index, 4);
+
+            if (transparent >= 0) {
+              const __m256i mask = _mm256_cmpeq_epi32(index, key);
+              const __m256i previous = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(destination + i));
+              color = _mm256_blendv_epi8(color, previous, mask);
+            }
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(destination + i), color);
+          }
+#endif
+
+          if (transparent < 0) {
+            for (; i < count; ++i)
+              destination[i] = palette[source[i]];
+          }
+          else {
+            for (; i < count; ++i) {
+              if (source[i] != transparent)
+                destination[i] = palette[source[i]];
+            }
+          }
+        }
+
+        // Stream row -> canvas row of an interlaced frame: rows 0, 8, 16, ..., then 4, 12, ..., then 2, 6, ...,
+        // then 1, 3, ...
+        static size_t get_interlaced_row(size_t row, size_t height)
+        {
+          static const size_t starts[4] = { 0, 4, 2, 1 };
+          static const size_t steps[4] = { 8, 8, 4, 2 };
+
+          for (size_t pass = 0; pass < 4; ++pass) {
+            const size_t rows = height > starts[pass] ? (height - starts[pass] + steps[pass] - 1) / steps[pass] : 0u;
+            if (row < rows)
+              return starts[pass] + row * steps[pass];
+
+            row -= rows;
+          }
+
+          return height;
+        }
+      } // namespace detail
+
+      error_t decoder_t::read_header(scoped_file &file)
+      {
+        header = GIF_header_t{0};
+
+        file.skip(0, SEEK_SET);
+        const error_t error = read(&header, file, fields_t::basic);
+        if (error != error_t::None)
+          return error;
+
+        std::fill(global, global + 256, (pixel_t) 0xFF000000u);
+        if (header.gct.exists) {
+          // Right past the header (6 bytes) and the logical screen descriptor (7 bytes)
+          const error_t r = read_palette(file, 13u, (size_t) cpow(2, header.gct.size + 1), global);
+          if (r != error_t::None)
+            return r;
+        }
+
+        if ((uint64_t) header.lsd.width * header.lsd.height > max_pixels)
+          return error_t::InvalidGIF;
+
+        canvas.assign((size_t) header.lsd.width * header.lsd.height, (pixel_t) 0);
+        return error_t::None;
+      }
+
+      error_t decoder_t::read_palette(scoped_file &file, uint64_t offset, size_t entries, pixel_t *palette)
+      {
+        uint8_t rgb[256 * 3];
+
+        if (!file.skip((long) offset, SEEK_SET) || file.read(rgb, size::u8, entries * 3) != entries * 3)
+          return error_t::InvalidGIF;
+
+        for (size_t i = 0; i < entries; ++i)
+          palette[i] = detail::get_pixel(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+
+        // Indices past the table's end show up as opaque black, like they do in browsers
+        std::fill(palette + entries, palette + 256, (pixel_t) 0xFF000000u);
+        return error_t::None;
+      }
+
+      error_t decoder_t::read_data(scoped_file &file, const GIF_frame_t &frame, uint8_t *code_size)
+      {
+        data.clear();
+
+        // The LZW minimum code size comes first, sub-blocks follow
+        if (!file.skip((long) frame.data, SEEK_SET) || file.read(code_size, size::u8, 1) != 1)
+          return error_t::InvalidGIF;
+
+        for (;;) {
+          uint8_t count;
+          if (file.read(&count, size::u8, 1) != 1 || count == 0)
+            break;
+
+          const size_t offset = data.size();
+          data.resize(offset + count);
+
+          const size_t read = file.read(&data[offset], size::u8, count);
+          if (read != count) {
+            data.resize(offset + read);
+            break;
+          }
+        }
+
+        return file.exceeded() ? error_t::BudgetExceeded : error_t::None;
+      }
+
+      // Returns how many indices were decoded, which falls short of `pixels` on truncated or corrupt data
+      size_t decoder_t::expand(uint8_t code_size, size_t pixels)
+      {
+        if (indices.size() < pixels)
+          indices.resize(pixels);
+
+        if (code_size < 2 || code_size > 11)
+          return 0;
+
+        const uint16_t clear = (uint16_t) (1u << code_size);
+        const uint16_t end = clear + 1;
+
+        for (uint16_t code = 0; code < clear; ++code) {
+          prefix[code] = 0xFFFF;
+          suffix[code] = (uint8_t) code;
+          first[code] = (uint8_t) code;
+          length[code] = 1;
+        }
+
+        uint8_t *output = indices.data();
+        size_t position = 0;
+
+        uint32_t width = code_size + 1;
+        uint32_t next = end + 1;
+        int previous = -1;
+
+        const uint8_t *input = data.data();
+        const size_t available = data.size();
+        size_t consumed = 0;
+        uint64_t bits = 0;
+        uint32_t bit_count = 0;
+
+        while (position < pixels) {
+          // Refill whole bytes, codes are at most 12 bits
+          while (bit_count <= 56 && consumed < available) {
+            bits |= (uint64_t) input[consumed++] << bit_count;
+            bit_count += 8;
+          }
+
+          if (bit_count < width)
+            break;
+
+          const uint32_t code = (uint32_t) (bits & ((1u << width) - 1u));
+          bits >>= width;
+          bit_count -= width;
+
+          if (code == clear) {
+            width = code_size + 1;
+            next = end + 1;
+            previous = -1;
+            continue;
+          }
+
+          if (code == end)
+            break;
+
+          if (previous < 0) {
+            if (code >= clear)
+              break;
+
+            output[position++] = (uint8_t) code;
+            previous = (int) code;
+            continue;
+          }
+
+          uint32_t emitted;
+          if (code < next)
+            emitted = code;
+          else if (code == next && next < max_codes) {
+            // KwKwK: the code being defined right now, i.e. the previous string plus its own first byte
+            prefix[next] = (uint16_t) previous;
+            suffix[next] = first[previous];
+            first[next] = first[previous];
+            length[next] = (uint16_t) (length[previous] + 1);
+            emitted = code;
+          }
+          else
+            break;
+
+          // Written backwards, from the string's last byte to its first
+          const size_t string_length = length[emitted];
+          const size_t stop = std::min(string_length, pixels - position);
+          uint32_t walk = emitted;
+          for (size_t skipped = string_length; skipped > stop; --skipped)
+            walk = prefix[walk];
+
+          for (size_t i = stop; i > 0; --i) {
+            output[position + i - 1] = suffix[walk];
+            walk = prefix[walk];
+          }
+
+          position += stop;
+
+          if (next < max_codes) {
+            if (code != next) {
+              prefix[next] = (uint16_t) previous;
+              suffix[next] = first[code];
+              first[next] = first[previous];
+              length[next] = (uint16_t) (length[previous] + 1);
+            }
+
+            ++next;
+            if (next == (1u << width) && width < 12)
+              ++width;
+          }
+
+          previous = (int) code;
+        }
+
+        return position;
+      }
+
+      void decoder_t::dispose(const GIF_frame_t &frame)
+      {
+        const size_t canvas_width = header.lsd.width;
+        const size_t left = std::min<size_t>(frame.left, canvas_width);
+        const size_t top = std::min<size_t>(frame.top, header.lsd.height);
+        const size_t width = std::min<size_t>(frame.width, canvas_width - left);
+        const size_t height = std::min<size_t>(frame.height, header.lsd.height - top);
+
+        if (frame.disposal == 2) {
+          for (size_t y = 0; y < height; ++y)
+            std::fill_n(&canvas[(top + y) * canvas_width + left], width, (pixel_t) 0);
+        }
+        else if (frame.disposal == 3 && backup.size() >= width * height) {
+          for (size_t y = 0; y < height; ++y)
+            std::memcpy(&canvas[(top + y) * canvas_width + left], &backup[y * width], width * sizeof(pixel_t));
+        }
+      }
+
+      void decoder_t::compose(const GIF_frame_t &frame, size_t decoded, const pixel_t *palette)
+      {
+        const size_t canvas_width = header.lsd.width;
+        const size_t left = std::min<size_t>(frame.left, canvas_width);
+        const size_t top = std::min<size_t>(frame.top, header.lsd.height);
+        const size_t width = std::min<size_t>(frame.width, canvas_width - left);
+        const size_t height = std::min<size_t>(frame.height, header.lsd.height - top);
+
+        if (frame.width == 0)
+          return;
+
+        const size_t rows = decoded / frame.width;
+        const size_t remainder = decoded % frame.width;
+
+        for (size_t row = 0; row <= rows && row < frame.height; ++row) {
+          const size_t count = row < rows ? width : std::min(remainder, width);
+          if (count == 0)
+            continue;
+
+          const size_t y = frame.interlaced ? detail::get_interlaced_row(row, frame.height) : row;
+          if (y >= height)
+            continue;
+
+          detail::expand_row(&indices[row * frame.width], &canvas[(top + y) * canvas_width + left], count, palette,
+            frame.transparent);
+        }
+      }
+
+      error_t decoder_t::decode(scoped_file &file, const frame_sink_t &sink, size_t limit)
+      {
+        if (!file.valid())
+          return error_t::Other;
+
+        // Only as far as the frames asked for
+        error_t error = read_header(file);
+        if (error != error_t::None)
+          return error;
+
+        walked = GIF_index_t();
+        error = walk(&header, file, (uint16_t) std::min<size_t>(limit, UINT16_MAX), &walked);
+        if (error != error_t::None)
+          return error;
+
+        return decode_frames(file, walked, sink, limit);
+      }
+
+      error_t decoder_t::decode(scoped_file &file, const GIF_index_t &index, const frame_sink_t &sink, size_t limit)
+      {
+        if (!file.valid())
+          return error_t::Other;
+
+        const error_t error = read_header(file);
+        if (error != error_t::None)
+          return error;
+
+        return decode_frames(file, index, sink, limit);
+      }
+
+      error_t decoder_t::decode_frames(scoped_file &file, const GIF_index_t &index, const frame_sink_t &sink,
+        size_t limit)
+      {
+        const size_t count = limit != 0 ? std::min(limit, index.frames.size()) : index.frames.size();
+
+        for (size_t i = 0; i < count; ++i) {
+          const GIF_frame_t &frame = index.frames[i];
+
+          const pixel_t *palette = global;
+          if (frame.palette_size != 0) {
+            const error_t error = read_palette(file, frame.palette, frame.palette_size, local);
+            if (error != error_t::None)
+              return error;
+
+            palette = local;
+          }
+
+          if ((uint64_t) frame.width * frame.height > max_pixels)
+            return error_t::InvalidGIF;
+
+          uint8_t code_size;
+          const error_t error = read_data(file, frame, &code_size);
+          if (error != error_t::None)
+            return error;
+
+          const size_t decoded = expand(code_size, (size_t) frame.width * frame.height);
+
+          // What a "restore to previous" frame is about to paint over, a later frame needs back
+          const bool last = i + 1 == count;
+          if (frame.disposal == 3 && !last) {
+            const size_t canvas_width = header.lsd.width;
+            const size_t left = std::min<size_t>(frame.left, canvas_width);
+            const size_t top = std::min<size_t>(frame.top, header.lsd.height);
+            const size_t width = std::min<size_t>(frame.width, canvas_width - left);
+            const size_t height = std::min<size_t>(frame.height, header.lsd.height - top);
+
+            backup.resize(width * height);
+            for (size_t y = 0; y < height; ++y)
+              std::memcpy(&backup[y * width], &canvas[(top + y) * canvas_width + left], width * sizeof(pixel_t));
+          }
+
+          compose(frame, decoded, palette);
+
+          if (sink && !sink(i, frame, canvas.data()))
+            break;
+
+          if (!last)
+            dispose(frame);
+        }
+
+        return error_t::None;
+      }
+    } // namespace gif
+  } // namespace image
+} // namespace doors
+
+#endif
@@ -0,0 +1,450 @@
+#if !defined(__INCREMENTAL_DETAIL__)
+#define __INCREMENTAL_DETAIL__
+
+// Offline incremental scan for trees that can't be watched live (NFS exports, archives): every directory's identity
+// (see system/stat.hpp, mtime included) and listing are remembered from the previous run along with the records of
+// its files. A directory whose identity didn't change isn't listed again, its files' records are handed out as-is.
+//
+// Creating, deleting or renaming an entry updates its directory's mtime, but not the one of the directories above:
+// every known directory still costs a stat(), though neither a listing nor a stat() per file. Files of a directory
+// that has to be listed again are only parsed again if their own identity changed.
+// Rewriting a file in place touches nothing but the file itself, options_t::verify stats those as well.
+//
+// With a filter (see filter.hpp) reused records are judged again. Rejected files are remembered without a record and
+// parsed again next time, another filter might well want them.
+//
+// A directory modified within the same couple of seconds its previous listing was taken in is listed again, mtime
+// granularity couldn't tell both apart ("racily clean", as git calls it).
+//
+// On disk: state_header_t, then per directory its path, stat_key_t, entry count, subdirectory names and files
+// (name, stat_key_t, record_t). Saved aside and renamed over the previous state.
+//
+// Pending issue(s):
+//   Symlinked directories aren't followed (just like scan::run)
+//   Testing
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/record.hpp>
+#include <system/stat.hpp>
+#include <scan.hpp>
+
+namespace doors {
+  namespace incremental {
+    constexpr const uint32_t magic = 0x31534944; // "DIS1"
+    constexpr const uint16_t version = record_version;
+
+    __PACKED_STRUCT_START state_header_t {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t record_size;
+      int64_t time;   // When the run that saved the state started, nanoseconds since the epoch
+      uint64_t count; // Directories
+    };
+    __PACKED_STRUCT_END
+
+    struct options_t {
+      scan::options_t scan; // Workers parsing whatever changed (store, dedup, ...)
+      bool verify = false;  // Stat files of unchanged directories, catching files rewritten in place
+    };
+
+    struct statistics_t {
+      uint64_t directories = 0; // Visited
+      uint64_t listed = 0;      // Of which had to be listed again
+      uint64_t reused = 0;      // Records handed out from the previous run
+      uint64_t parsed = 0;
+    };
+
+    class state_t {
+    public:
+      // A missing or incompatible state is no error: the next run simply starts from scratch.
+      error_t load(const char *name);
+      error_t save(const char *name) const;
+
+      size_t size() const { return directories.size(); }
+
+    private:
+      friend error_t run(const std::vector<std::string> &, const options_t &, state_t *, const scan::sink_t &,
+        statistics_t *);
+
+      struct file_t {
+        std::string name; // Relative to its directory
+        stat_key_t key;
+        record_t record;
+      };
+
+      struct directory_t {
+        stat_key_t key;
+        uint64_t entries; // Files and subdirectories, as last listed
+        std::vector<std::string> directories;
+        std::vector<file_t> files;
+      };
+
+      int64_t time = 0;
+      std::unordered_map<std::string, directory_t> directories;
+    };
+
+    // Like scan::run(), updating `state` along the way. The sink gets called from the calling thread for reused
+    // records (worker 0, before any parse starts) and from the workers for fresh ones.
+    error_t run(const std::vector<std::string> &roots, const options_t &options, state_t *state,
+      const scan::sink_t &sink, statistics_t *statistics = nullptr);
+  } // namespace incremental
+} // namespace doors
+
+#endif
+
+#ifdef INCREMENTAL_DETAIL
+#undef INCREMENTAL_DETAIL
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+
+namespace doors {
+  namespace incremental {
+    namespace detail {
+      // Coarsest mtime granularity around (FAT), in nanoseconds
+      constexpr const int64_t granularity = 2000000000ll;
+
+      template <typename T>
+      static bool write(std::FILE *file, const T &value)
+      {
+        return std::fwrite(&value, sizeof value, 1, file) == 1;
+      }
+
+      template <typename T>
+      static bool read(std::FILE *file, T *value)
+      {
+        return std::fread(value, sizeof *value, 1, file) == 1;
+      }
+
+      static bool write(std::FILE *file, const std::string &value)
+      {
+        const uint32_t length = (uint32_t) value.size();
+        return write(file, length) && std::fwrite(value.data(), size::u8, length, file) == length;
+      }
+
+      static bool read(std::FILE *file, std::string *value)
+      {
+        uint32_t length;
+        if (!read(file, &length) || length > 65536)
+          return false;
+
+        value->resize(length);
+        return std::fread(&(*value)[0], size::u8, length, file) == length;
+      }
+
+      static std::string join(const std::string &directory, const std::string &name)
+      {
+        return (std::filesystem::path(directory) / name).string();
+      }
+    } // namespace detail
+
+    error_t state_t::load(const char *name)
+    {
+      time = 0;
+      directories.clear();
+
+      scoped_file file(name);
+      if (!file.valid())
+        return error_t::None;
+
+      state_header_t header;
+      if (!detail::read(file.p, &header) ||
+          header.magic != magic || header.version != version || header.record_size != sizeof(record_t))
+        return error_t::None;
+
+      for (uint64_t i = 0; i < header.count; ++i) {
+        std::string path;
+        directory_t directory;
+        uint32_t count;
+
+        if (!detail::read(file.p, &path) ||
+            !detail::read(file.p, &directory.key) ||
+            !detail::read(file.p, &directory.entries) ||
+            !detail::read(file.p, &count)) {
+          directories.clear();
+          return error_t::None;
+        }
+
+        directory.directories.resize(count);
+        for (auto &child : directory.directories) {
+          if (!detail::read(file.p, &child)) {
+            directories.clear();
+            return error_t::None;
+          }
+        }
+
+        if (!detail::read(file.p, &count)) {
+          directories.clear();
+          return error_t::None;
+        }
+
+        directory.files.resize(count);
+        for (auto &child : directory.files) {
+          if (!detail::read(file.p, &child.name) || !detail::read(file.p, &child.key) || !detail::read(file.p, &child.record)) {
+            directories.clear();
+            return error_t::None;
+          }
+        }
+
+        directories.emplace(std::move(path), std::move(directory));
+      }
+
+      time = header.time;
+
+      return error_t::None;
+    }
+
+    error_t state_t::save(const char *name) const
+    {
+      // Written aside and renamed over, a crash mid-write leaves the previous state intact
+      const std::string temporary = std::string(name) + ".tmp";
+      std::FILE *file = std::fopen(temporary.c_str(), "wb");
+      if (file == nullptr)
+        return error_t::Other;
+
+      const state_header_t header = { magic, version, (uint16_t) sizeof(record_t), time, (uint64_t) directories.size() };
+      bool written = detail::write(file, header);
+
+      for (auto it = directories.begin(); written && it != directories.end(); ++it) {
+        const directory_t &directory = it->second;
+
+        written =
+          detail::write(file, it->first) &&
+          detail::write(file, directory.key) &&
+          detail::write(file, directory.entries) &&
+          detail::write(file, (uint32_t) directory.directories.size());
+
+        for (const auto &child : directory.directories)
+          written = written && detail::write(file, child);
+
+        written = written && detail::write(file, (uint32_t) directory.files.size());
+
+        for (const auto &child : directory.files)
+          written = written && detail::write(file, child.name) && detail::write(file, child.key) && detail::write(file, child.record);
+      }
+
+      written = std::fclose(file) == 0 && written;
+
+      std::error_code code;
+      if (!written) {
+        std::filesystem::remove(temporary, code);
+        return error_t::Other;
+      }
+
+      std::filesystem::rename(temporary, name, code);
+      return code ? error_t::Other : error_t::None;
+    }
+
+    error_t run(const std::vector<std::string> &roots, const options_t &options, state_t *state,
+      const scan::sink_t &sink, statistics_t *statistics)
+    {
+      namespace fs = std::filesystem;
+      using directory_t = state_t::directory_t;
+
+      statistics_t local;
+      if (statistics == nullptr)
+        statistics = &local;
+      *statistics = statistics_t();
+
+      const int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+      ).count();
+
+      const fields_t fields = options.scan.filter != nullptr ?
+        options.scan.fields | options.scan.filter->fields() : options.scan.fields;
+
+      const auto admits = [&options] (const record_t &record) {
+        return options.scan.filter == nullptr || record.error != (uint8_t) error_t::None ||
+          options.scan.filter->admits(record, (fields_t) record.fields);
+      };
+
+      std::unordered_map<std::string, directory_t> next;
+      std::vector<std::string> files;                      // To be parsed
+      std::unordered_map<std::string, stat_key_t> keys;    // Of the above, as listed
+      std::vector<std::pair<std::string, size_t>> owners;  // Listed directory and file index, per file to be parsed
+      error_t error = error_t::None;
+
+      std::vector<std::string> stack;
+      for (const auto &root : roots) {
+        std::error_code code;
+        if (fs::is_directory(root, code))
+          stack.push_back(root);
+        else {
+          files.push_back(root);
+          owners.emplace_back(std::string(), 0u);
+        }
+      }
+
+      while (!stack.empty()) {
+        const std::string path = std::move(stack.back());
+        stack.pop_back();
+
+        stat_key_t key;
+        if (get_stat_key(path.c_str(), &key) != error_t::None)
+          continue;
+
+        ++statistics->directories;
+
+        auto previous = state->directories.find(path);
+        const bool unchanged =
+          previous != state->directories.end() &&
+          previous->second.key == key &&
+          key.mtime + detail::granularity < state->time;
+
+        if (unchanged) {
+          directory_t &directory = next.emplace(path, std::move(previous->second)).first->second;
+
+          for (const auto &child : directory.directories)
+            stack.push_back(detail::join(path, child));
+
+          for (size_t i = 0; i < directory.files.size(); ++i) {
+            auto &file = directory.files[i];
+            const std::string name = detail::join(path, file.name);
+
+            stat_key_t current = file.key;
+            const bool stale =
+              file.record.error == (uint8_t) error_t::Rejected ||
+              (file.record.fields & (uint16_t) fields) != (uint16_t) fields ||
+              (options.verify && (get_stat_key(name.c_str(), &current) != error_t::None || current != file.key));
+
+            if (stale) {
+              files.push_back(name);
+              keys[name] = current;
+              owners.emplace_back(path, i);
+              continue;
+            }
+
+            if (admits(file.record))
+              sink(0, name.c_str(), file.record);
+            ++statistics->reused;
+          }
+
+          continue;
+        }
+
+        ++statistics->listed;
+
+        directory_t directory;
+        directory.key = key;
+        directory.entries = 0;
+
+        // Files of a relisted directory which kept their identity needn't be parsed again either
+        std::unordered_map<std::string, const state_t::file_t *> known;
+        if (previous != state->directories.end()) {
+          for (const auto &file : previous->second.files)
+            known.emplace(file.name, &file);
+        }
+
+        std::error_code code;
+        fs::directory_iterator it(path, fs::directory_options::skip_permission_denied, code), end;
+        if (code) {
+          error = error_t::Other;
+          continue;
+        }
+
+        for (; it != end; it.increment(code)) {
+          if (code)
+            break;
+
+          ++directory.entries;
+          const std::string child = it->path().filename().string();
+
+          if (it->is_directory(code) && !it->is_symlink(code)) {
+            directory.directories.push_back(child);
+            stack.push_back(it->path().string());
+          }
+          else if (it->is_regular_file(code)) {
+            const std::string name = it->path().string();
+
+            stat_key_t current = {};
+            get_stat_key(name.c_str(), &current);
+
+            const auto same = known.find(child);
+            if (same != known.end() && same->second->key == current && current != stat_key_t{} &&
+                same->second->record.error != (uint8_t) error_t::Rejected &&
+                (same->second->record.fields & (uint16_t) fields) == (uint16_t) fields) {
+              directory.files.push_back(*same->second);
+              if (admits(same->second->record))
+                sink(0, name.c_str(), same->second->record);
+              ++statistics->reused;
+              continue;
+            }
+
+            directory.files.push_back(state_t::file_t { child, current, record_t{} });
+            files.push_back(name);
+            keys[name] = current;
+            owners.emplace_back(path, directory.files.size() - 1);
+          }
+        }
+
+        if (code)
+          error = error_t::Other;
+
+        next[path] = std::move(directory);
+      }
+
+      // Parsed by the pool, filed back into their directories afterwards
+      std::mutex mutex;
+      std::unordered_map<std::string, record_t> records;
+
+      const error_t parsed = scan::run(files, options.scan, [&] (size_t worker, const char *name, const record_t &record) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          records[name] = record;
+        }
+
+        sink(worker, name, record);
+      });
+
+      if (parsed != error_t::None)
+        error = parsed;
+
+      statistics->parsed = records.size();
+
+      for (size_t i = 0; i < files.size(); ++i) {
+        const auto &owner = owners[i];
+        if (owner.first.empty())
+          continue;
+
+        auto &file = next[owner.first].files[owner.second];
+        const auto it = records.find(files[i]);
+
+        if (it != records.end()) {
+          file.key = keys[files[i]];
+          file.record = it->second;
+        }
+        else if (options.scan.filter != nullptr && get_stat_key(files[i].c_str(), &file.key) == error_t::None &&
+          file.key == keys[files[i]]) {
+          file.record = record_t{};
+          file.record.error = (uint8_t) error_t::Rejected;
+        }
+        else
+          file.key = stat_key_t{}; // Vanished before being parsed
+      }
+
+      for (auto &pair : next) {
+        auto &files = pair.second.files;
+        files.erase(std::remove_if(files.begin(), files.end(), [] (const state_t::file_t &file) {
+          return file.key == stat_key_t{};
+        }), files.end());
+      }
+
+      state->directories = std::move(next);
+      state->time = time;
+
+      return error;
+    }
+  } // namespace incremental
+} // namespace doors
+
+#endif
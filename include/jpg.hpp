@@ -1,24 +1,51 @@
 #if !defined(__IMAGE_JPG_DETAIL__)
 #define __IMAGE_JPG_DETAIL__
 
+// The header is walked segment by segment (marker, then a 16-bit length covering the segment's payload) up to the
+// first frame header (SOFn, any of them), so markers showing up inside other segments' payload, e.g. in EXIF
+// thumbnails, never get mistaken for the real thing. JFIF and EXIF files alike; the JFIF fields stay zeroed when
+// there's no APP0 segment. Along the way, an EXIF APP1 segment gets handed over to exif.hpp's reader when
+// fields_t::exif is asked for (skipped otherwise): orientation and capture time.
+//
+// Embedded thumbnails (fields_t::thumbnail) are only located, the walk never gets anywhere near the scan data: EXIF's
+// IFD1 JPEG (a standalone JPEG file, servable as is), JFIF's uncompressed RGB one, JFXX's JPEG, palette or RGB one.
+// get_thumbnail() prefers EXIF's, usually the larger; read_thumbnail() fetches its bytes, get_thumbnail_pixels()
+// turns the uncompressed kinds into RGB.
+//
+// Quantization tables (fields_t::quality) get read off the DQT segments on the way to SOFn, and matched against IJG's
+// standard tables as scaled for each quality setting (libjpeg's jpeg_set_quality()): the closest one is the quality
+// estimate, exact when the tables are one of them to the last entry (libjpeg and its many derivatives). Together
+// with the chroma subsampling, straight off the frame header's sampling factors, it tells whether recompressing
+// at some quality would gain anything, without decoding a single block.
+//
+// Progressive files (SOF2 and the like) can also tell how much of them a range request has to fetch for a low-res
+// preview (fields_t::preview): the walk goes on past SOFn scan by scan, skipping through the entropy-coded data up to
+// whichever marker ends it, and notes where the first DC scan of every component is over (a 1/8 scale image), then
+// the first AC scan of the luma component (sharper luma). Sequential files draw top to bottom, they have no such
+// prefix.
+//
 // Pending issue(s):
-//   Due to the nature of EXIFs, the SOF0 block could be incorrectly identified as not containing the real
-//   size of the image. (fix this!)
-//   Convert the few remaining std::f*(FILE *) calls to utilize scoped_file instead.
+//   Quality estimates of non-IJG tables (Photoshop's, cameras') are merely the closest IJG setting
 //   Testing
 
 // Test suite: https://code.google.com/archive/p/imagetestsuite/downloads
-// Only JFIF are supported for now - support for EXIF, TIFF and other JPEG-based formats is pending.
 
 #include <unordered_map>
 #include <any>
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include <type_traits>
 
 #include <compiler.hpp>
 using namespace compiler;
 
+#include <system/fields.hpp>
+#include <system/record.hpp>
+
+#include <exif.hpp>
+
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/basic_file_sink.h>
 
@@ -27,25 +54,57 @@ namespace doors {
     namespace jpg {
       enum class JPG_validate_flags {
         SOI = 1 << 0,
-        APP0 = 1 << 1,
-        magic = 1 << 2,
-        unrecognized_SOFn = 1 << 3,
+        APP0 = 1 << 1,              // The first segment is an APPn one (JFIF's APP0, EXIF's APP1, Adobe's APP14, ...)
+        magic = 1 << 2,             // APP0 up front says JFIF, APP1 up front says Exif
+        unrecognized_SOFn = 1 << 3, // There is a frame header before the scan data
         everything = SOI | APP0 | magic | unrecognized_SOFn
       };
 
       namespace detail {
+        // Whichever SOFn came first
         struct JPG_FFC0_header_t {
+          uint8_t type; // The marker: C0 baseline, C1 extended, C2 progressive, C3 lossless, ...
           uint8_t bpp;
           uint16_t width;
           uint16_t height;
-          uint8_t color_space;
+          uint8_t color_space;      // Component count
+          uint8_t sampling[4];      // Per component (the first 4): horizontal << 4 | vertical sampling factor
+          uint8_t quantization[4];  // Per component: DQT table id
+        };
+
+        struct JPG_quality_t {
+          uint8_t estimate;         // IJG quality (1-100) the tables are closest to, 0 when unknown
+          bool exact;               // The tables are IJG's scaled ones, entry for entry
+          uint8_t defined;          // DQT table ids seen, a bit per id
+          uint16_t tables[4][64];   // Natural order (DQT has them zigzag)
+        };
+
+        // File offsets the scan data ends at (whatever follows is left out), 0 when never reached
+        struct JPG_preview_t {
+          uint64_t dc;              // Every component's first DC scan
+          uint64_t ac;              // Then the luma component's first AC scan
+        };
+
+        enum class JPG_thumbnail_format_t : uint8_t {
+          none,
+          JPEG,    // EXIF IFD1 or JFXX (0x10): SOI to EOI
+          RGB,     // JFIF or JFXX (0x13): width * height RGB triplets
+          palette  // JFXX (0x11): 256 RGB triplets, then width * height indices
+        };
+
+        struct JPG_thumbnail_t {
+          JPG_thumbnail_format_t format;
+          uint16_t width;  // JPEG ones: as their own SOFn says, 0 if it couldn't be read
+          uint16_t height;
+          uint64_t offset; // Within the file
+          uint32_t length;
         };
 
         struct JPG_header_t {
           uint8_t soi[2];
-          uint8_t app0[2];
+          uint8_t app0[2];      // The first marker past SOI
           uint16_t app0_length;
-          char jfif[5];
+          char jfif[5];         // "JFIF" or "Exif"
           uint8_t version[2];
           uint16_t version_sanitized;
           uint8_t density_unit;
@@ -54,19 +113,42 @@ namespace doors {
           uint8_t thumbnail_width;
           uint8_t thumbnail_height;
 
+          // EXIF
+          uint16_t orientation; // 1-8, 0 when there's no EXIF data
+          char date_time[20];   // DateTimeOriginal (DateTime when missing), "YYYY:MM:DD HH:MM:SS", NUL-terminated
+
+          JPG_thumbnail_t thumbnail; // fields_t::thumbnail
+          JPG_quality_t quality;     // fields_t::quality
+          JPG_preview_t preview;     // fields_t::preview, progressive files only
+
           // SOF0 block
           JPG_FFC0_header_t ffc0;
         };
 
+        // Horizontal << 4 | vertical chroma subsampling (0x22 for 4:2:0, 0x11 for none), as a record_t carries it.
+        // 0 without chroma, or when the chroma factors don't divide the luma ones.
+        uint8_t get_subsampling(const JPG_FFC0_header_t &ffc0);
+
         const JPG_validate_flags get_default_flags();
         std::unordered_map<std::string, std::any> get_default_struct();
 
-        error_t read(JPG_header_t *header, const char *name, const JPG_validate_flags flags = get_default_flags());
+        error_t read(JPG_header_t *header, scoped_file &file, const JPG_validate_flags flags = get_default_flags(),
+          const fields_t fields = fields_t::all, const checkpoint_t &checkpoint = nullptr);
+        error_t read(JPG_header_t *header, const char *name, const JPG_validate_flags flags = get_default_flags(),
+          const fields_t fields = fields_t::all, const checkpoint_t &checkpoint = nullptr);
+
+        // thumbnail->format is JPG_thumbnail_format_t::none when the file has no thumbnail.
+        error_t get_thumbnail(JPG_thumbnail_t *thumbnail, scoped_file &file);
+        error_t read_thumbnail(const JPG_thumbnail_t &thumbnail, scoped_file &file, std::vector<uint8_t> *data);
+        // RGB and palette thumbnails, `data` as read_thumbnail() left it. JPEG ones are error_t::InvalidRequest.
+        error_t get_thumbnail_pixels(const JPG_thumbnail_t &thumbnail, const std::vector<uint8_t> &data,
+          std::vector<uint8_t> *rgb);
       } // namespace detail
 
       using namespace detail;
 
       std::unordered_map<std::string, std::any> parse(const char *name);
+      record_t to_record(const JPG_header_t &header);
     } // namespace jpg
   } // namespace image
 } // namespace doors
@@ -98,211 +180,652 @@ namespace doors {
             { std::string("projected_aspect_ratio.f"), (float) 0.0f },
             { std::string("bits_per_pixel.u8"), (uint8_t) 0u },
             { std::string("color_space.u8"), (uint8_t) 0u },
-            { std::string("color_space_sanitized.s"), constant::qmark }
+            { std::string("color_space_sanitized.s"), constant::qmark },
+            { std::string("orientation.u16"), (uint16_t) 0u },
+            { std::string("display_width.u32"), (uint32_t) 0u },
+            { std::string("display_height.u32"), (uint32_t) 0u },
+            { std::string("date_time_original.s"), constant::qmark },
+            { std::string("quality.u8"), (uint8_t) 0u },
+            { std::string("quality_exact.b"), false },
+            { std::string("subsampling.s"), constant::qmark },
+            { std::string("preview_dc.u64"), (uint64_t) 0u },
+            { std::string("preview_ac.u64"), (uint64_t) 0u }
           };
 
           return r;
         }
 
+        error_t read(JPG_header_t *header, const char *name, const JPG_validate_flags flags, const fields_t fields,
+          const checkpoint_t &checkpoint)
+        {
+          scoped_file file(name);
+          return read(header, file, flags, fields, checkpoint);
+        }
+
+        // Standalone markers carry no length: TEM, RSTn (SOI and EOI are dealt with by the walk itself)
+        static bool is_standalone(uint8_t marker)
+        {
+          return marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7);
+        }
+
+        // SOF0-SOF15, except for the markers sharing the range: DHT (C4), JPG (C8) and DAC (CC)
+        static bool is_SOFn(uint8_t marker)
+        {
+          return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        }
+
+        // FF, then the marker, optionally preceded by any number of FF fill bytes. Anything else in between segments
+        // means the walk lost track.
+        static bool read_marker(scoped_file &file, uint8_t *marker)
+        {
+          uint8_t ff;
+          if (file.read(&ff, size::u8, 1) != 1 || ff != 0xFF)
+            return false;
+
+          do {
+            if (file.read(marker, size::u8, 1) != 1)
+              return false;
+          } while (*marker == 0xFF && !file.exceeded());
+
+          return *marker != 0xFF;
+        }
+
+        // Through a scan's entropy-coded data, up to the marker ending it: 0xFF followed by anything but a stuffed zero
+        // or a restart marker. The file is left at that marker, `end` tells its offset.
+        static bool skip_scan(scoped_file &file, uint64_t *end)
+        {
+          uint8_t buffer[4096];
+          long offset = std::ftell(file.p);
+          bool ff = false;
+
+          while (offset >= 0 && !file.exceeded()) {
+            const size_t count = file.read(buffer, size::u8, sizeof buffer);
+            if (count == 0)
+              return false;
+
+            for (size_t i = 0; i < count; ++i) {
+              const uint8_t byte = buffer[i];
+              if (ff && byte != 0x00 && byte != 0xFF && (byte < 0xD0 || byte > 0xD7)) {
+                *end = (uint64_t) offset + i - 1;
+                return file.skip((long) *end, SEEK_SET);
+              }
+
+              ff = byte == 0xFF;
+            }
+
+            offset += (long) count;
+          }
+
+          return false;
+        }
+
+        static void set_thumbnail(JPG_header_t *header, JPG_thumbnail_format_t format, uint16_t width, uint16_t height,
+          uint64_t offset, uint32_t length)
+        {
+          header->thumbnail.format = format;
+          header->thumbnail.width = width;
+          header->thumbnail.height = height;
+          header->thumbnail.offset = offset;
+          header->thumbnail.length = length;
+        }
+
+        // Zigzag position to natural (row-major) one
+        static const uint8_t zigzag[64] = {
+           0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+          12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+          35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+          58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+        };
+
+        // ITU-T T.81 K.1, libjpeg's jcparam.c
+        static const uint8_t standard_tables[2][64] = {
+          {
+            16,  11,  10,  16,  24,  40,  51,  61,
+            12,  12,  14,  19,  26,  58,  60,  55,
+            14,  13,  16,  24,  40,  57,  69,  56,
+            14,  17,  22,  29,  51,  87,  80,  62,
+            18,  22,  37,  56,  68, 109, 103,  77,
+            24,  35,  55,  64,  81, 104, 113,  92,
+            49,  64,  78,  87, 103, 121, 120, 101,
+            72,  92,  95,  98, 112, 100, 103,  99
+          },
+          {
+            17,  18,  24,  47,  99,  99,  99,  99,
+            18,  21,  26,  66,  99,  99,  99,  99,
+            24,  26,  56,  99,  99,  99,  99,  99,
+            47,  66,  99,  99,  99,  99,  99,  99,
+            99,  99,  99,  99,  99,  99,  99,  99,
+            99,  99,  99,  99,  99,  99,  99,  99,
+            99,  99,  99,  99,  99,  99,  99,  99,
+            99,  99,  99,  99,  99,  99,  99,  99
+          }
+        };
+
+        // DQT payload: any number of tables, each a precision/id byte then 64 8- or 16-bit entries
+        static void read_dqt(JPG_header_t *header, const uint8_t *data, size_t size)
+        {
+          for (size_t i = 0; i < size; ) {
+            const unsigned precision = data[i] >> 4, id = data[i] & 15;
+            const size_t length = precision != 0 ? 128 : 64;
+            if (id > 3 || precision > 1 || size - i - 1 < length)
+              return;
+
+            const uint8_t *entries = data + i + 1;
+            for (size_t k = 0; k < 64; ++k) {
+              header->quality.tables[id][zigzag[k]] = precision != 0 ?
+                (uint16_t) ((entries[k * 2] << 8) | entries[k * 2 + 1]) : entries[k];
+            }
+
+            header->quality.defined |= (uint8_t) (1u << id);
+            i += 1 + length;
+          }
+        }
+
+        // The quality whose scaled standard tables (jpeg_quality_scaling(), jpeg_add_quant_table()) are the least
+        // distance away from the luma table (the first component's) and the chroma one (the second's)
+        static void set_quality(JPG_header_t *header)
+        {
+          const JPG_FFC0_header_t &ffc0 = header->ffc0;
+          JPG_quality_t &quality = header->quality;
+
+          quality.estimate = 0;
+          quality.exact = false;
+
+          const unsigned luma = ffc0.quantization[0] & 3;
+          if (!(quality.defined & (1u << luma)))
+            return;
+
+          // Grayscale has no chroma table, neither do images sharing theirs
+          const unsigned chroma = ffc0.quantization[1] & 3;
+          const bool has_chroma = ffc0.color_space >= 3 && chroma != luma && (quality.defined & (1u << chroma));
+
+          uint64_t best = UINT64_MAX;
+          for (unsigned q = 1; q <= 100; ++q) {
+            const unsigned scale = q < 50 ? 5000 / q : 200 - q * 2;
+            uint64_t distance = 0;
+
+            for (unsigned t = 0; t < (has_chroma ? 2u : 1u); ++t) {
+              const uint16_t *table = quality.tables[t == 0 ? luma : chroma];
+              for (unsigned k = 0; k < 64; ++k) {
+                // force_baseline: 8-bit entries, which is what nearly everyone writes
+                const unsigned scaled = std::min(255u, std::max(1u, (standard_tables[t][k] * scale + 50) / 100));
+                distance += table[k] > scaled ? table[k] - scaled : scaled - table[k];
+              }
+            }
+
+            if (distance < best) {
+              best = distance;
+              quality.estimate = (uint8_t) q;
+            }
+          }
+
+          quality.exact = best == 0;
+        }
+
+        uint8_t get_subsampling(const JPG_FFC0_header_t &ffc0)
+        {
+          if (ffc0.color_space < 3)
+            return 0;
+
+          unsigned h = 0, v = 0;
+          for (unsigned i = 0; i < std::min<unsigned>(ffc0.color_space, 4); ++i) {
+            h = std::max(h, (unsigned) ffc0.sampling[i] >> 4);
+            v = std::max(v, (unsigned) ffc0.sampling[i] & 15);
+          }
+
+          // Cb's, Cr's is the same but for exotic files
+          const unsigned chroma_h = ffc0.sampling[1] >> 4, chroma_v = ffc0.sampling[1] & 15;
+          if (chroma_h == 0 || chroma_v == 0 || h % chroma_h != 0 || v % chroma_v != 0)
+            return 0;
+
+          return (uint8_t) ((h / chroma_h) << 4 | (v / chroma_v));
+        }
+
+        // The APP1 payload past "Exif\0\0", i.e. the TIFF structure, `position` being where it sits within the file
+        static void read_exif(JPG_header_t *header, const uint8_t *data, size_t size, uint64_t position,
+          const fields_t fields)
+        {
+          exif::reader_t reader;
+          if (reader.open(data, size) != error_t::None)
+            return;
+
+          // Taking precedence over JFIF's
+          const uint8_t *thumbnail;
+          size_t length;
+          if ((fields & fields_t::thumbnail) && reader.get_thumbnail(&thumbnail, &length))
+            set_thumbnail(header, JPG_thumbnail_format_t::JPEG, 0, 0, position + (uint64_t) (thumbnail - data),
+              (uint32_t) length);
+
+          if (!(fields & fields_t::exif))
+            return;
+
+          header->orientation = reader.get_orientation();
+
+          std::string_view date_time;
+          if (reader.get_string(exif::ifd_t::EXIF, exif::tag::date_time_original, &date_time) ||
+            reader.get_string(exif::ifd_t::IFD0, exif::tag::date_time, &date_time)) {
+            const size_t length = std::min(date_time.size(), sizeof header->date_time - 1);
+            std::memcpy(header->date_time, date_time.data(), length);
+            header->date_time[length] = '\0';
+          }
+        }
+
         // JFIF is MSB
-        error_t read(JPG_header_t *header, const char *name, const JPG_validate_flags flags)
+        error_t read(JPG_header_t *header, scoped_file &file, const JPG_validate_flags flags, const fields_t fields,
+          const checkpoint_t &checkpoint)
         {
 #ifdef IMAGE_JPG_DETAIL_DEBUG
           spdlog::set_pattern("[%^%l%$] %v");
           spdlog::set_level(spdlog::level::debug);
 #endif
 
-          scoped_file file(name);
           const char *signature = __SIGNATURE;
 
-          if (file.valid() && header) {
-            // SOI bytes (ff d8) along with APP0 segment
-            std::fread(&header->soi[0], size::u8, 2, file.p);
+          if (!file.valid() || !header)
+            return error_t::Other;
+
+          // SOI bytes (ff d8)
+          file.read(&header->soi[0], size::u8, 2);
 #ifdef IMAGE_JPG_DETAIL_DEBUG
-            spdlog::debug(
-              "[{}] SOI bytes (should be FF D8): {:X} {:X}",
-              signature,
-              header->soi[0],
-              header->soi[1]
-            );
+          spdlog::debug(
+            "[{}] SOI bytes (should be FF D8): {:X} {:X}",
+            signature,
+            header->soi[0],
+            header->soi[1]
+          );
 #endif
 
-            if (flags & JPG_validate_flags::SOI) {
-                if (header->soi[0] != 0xFF || header->soi[1] != 0xD8) {
+          if (flags & JPG_validate_flags::SOI) {
+            if (header->soi[0] != 0xFF || header->soi[1] != 0xD8) {
 #ifdef IMAGE_JPG_DETAIL_DEBUG
-                    spdlog::critical(
-                      "[{}] Incorrect SOI bytes (should be FF D8): {:X} {:X}",
-                      signature,
-                      header->soi[0],
-                      header->soi[1]
-                    );
+              spdlog::critical(
+                "[{}] Incorrect SOI bytes (should be FF D8): {:X} {:X}",
+                signature,
+                header->soi[0],
+                header->soi[1]
+              );
 #endif
-                    return error_t::InvalidJPG;
-                }
+              return error_t::InvalidJPG;
             }
+          }
 
-            std::fread(&header->app0[0], size::u8, 2, file.p);
+          // Segment by segment up to the frame header: every one of them starts with its own length, so getting past
+          // EXIF data (thumbnails included, which hold SOFn markers of their own) takes a single seek.
+          bool first = true;
+          bool exif_seen = false;
+          bool frame = false;
+          bool scans = false;
+          uint8_t components[4] = {0}; // Frame header component ids
+          uint8_t dc = 0;              // Components through their first DC scan, a bit each
+          std::vector<uint8_t> app1;
+          std::vector<uint8_t> dqt;
+
+          while (!file.exceeded()) {
+            uint8_t marker;
+            if (!read_marker(file, &marker))
+              break;
+
+            if (first) {
+              header->app0[0] = 0xFF;
+              header->app0[1] = marker;
+
+              if ((flags & JPG_validate_flags::APP0) && (marker < 0xE0 || marker > 0xEF)) {
 #ifdef IMAGE_JPG_DETAIL_DEBUG
-            spdlog::debug(
-              "[{}] APP0 bytes (should be FF E0): {:X} {:X}",
-              signature,
-              header->app0[0],
-              header->app0[1]
-            );
+                spdlog::critical(
+                  "[{}] Incorrect APPn bytes (should be FF E0-EF): {:X} {:X}",
+                  signature,
+                  header->app0[0],
+                  header->app0[1]
+                );
 #endif
+                return error_t::InvalidJPG;
+              }
+            }
 
-            if (flags & JPG_validate_flags::APP0) {
-              if (header->app0[0] != 0xFF || header->app0[1] != 0xE0) {
-#ifdef IMAGE_JPG_DETAIL_DEBUG
-                  spdlog::critical(
-                    "[{}] Incorrect APP0 bytes (should be FF E0): {:X} {:X}",
-                    signature,
-                    header->soi[0],
-                    header->soi[1]
-                  );
-#endif
-                  return error_t::InvalidJPG;
+            if (is_standalone(marker))
+              continue;
+
+            // SOS of a progressive file: component ids, spectral selection and successive approximation, then the
+            // scan data
+            if (marker == 0xDA && scans) {
+              uint16_t length;
+              uint8_t sos[1 + 4 * 2 + 3];
+              if (file.read(&length, size::u16, 1) != 1)
+                break;
+
+              length = __SWIZZLE16(length);
+              if (length < 2 + 1 + 2 + 3 || length > 2 + sizeof sos || file.read(sos, size::u8, length - 2u) != length - 2u)
+                break;
+
+              const size_t count = sos[0];
+              if (count == 0 || length != 2 + 1 + count * 2 + 3)
+                break;
+
+              uint8_t scan = 0;
+              for (size_t i = 0; i < count; ++i) {
+                for (size_t j = 0; j < std::min<size_t>(header->ffc0.color_space, 4); ++j) {
+                  if (components[j] == sos[1 + i * 2])
+                    scan |= (uint8_t) (1u << j);
+                }
               }
+
+              const uint8_t ss = sos[1 + count * 2];
+              const uint8_t ah = sos[3 + count * 2] >> 4;
+
+              uint64_t end;
+              if (!skip_scan(file, &end))
+                break;
+
+              // First passes only (no successive approximation refinement yet), AC ones past the DC ones
+              const uint8_t all = (uint8_t) ((1u << std::min<size_t>(header->ffc0.color_space, 4)) - 1u);
+              if (ah == 0 && ss == 0) {
+                dc |= scan;
+                if (header->preview.dc == 0 && (dc & all) == all)
+                  header->preview.dc = end;
+              }
+              else if (ah == 0 && header->preview.dc != 0 && (scan & 1)) {
+                header->preview.ac = end;
+                break;
+              }
+
+              continue;
             }
 
-            std::fread(&header->app0_length, size::u16, 1, file.p);
-            header->app0_length = __SWIZZLE16(header->app0_length);
+            // EOI, or SOS: entropy-coded data follows, there can't be a frame header past this point
+            if (marker == 0xD9 || marker == 0xDA)
+              break;
+
+            uint16_t length;
+            if (file.read(&length, size::u16, 1) != 1)
+              break;
+
+            // The length counts itself
+            length = __SWIZZLE16(length);
+            if (length < 2)
+              break;
+
+            long remaining = (long) length - 2;
+
 #ifdef IMAGE_JPG_DETAIL_DEBUG
             spdlog::debug(
-              "[{}] APP0 length: {} bytes",
+              "[{}] Marker FF {:X} at {}, length: {} bytes",
               signature,
-              header->app0_length
+              marker,
+              std::ftell(file.p) - 4,
+              length
             );
 #endif
 
-            if (std::fread(&header->jfif[0], sizeof(char), 5, file.p) == 5) {
-              // The JFIF identifier is already NULL-terminated.
+            if (is_SOFn(marker)) {
+              // Precision, height, width, component count
+              uint8_t sof[6];
+              if (remaining < (long) sizeof sof || file.read(sof, size::u8, sizeof sof) != sizeof sof)
+                break;
 
-              if (flags & JPG_validate_flags::magic) {
-                if (std::memcmp(header->jfif, "JFIF", 5) != 0) {
-#ifdef IMAGE_JPG_DETAIL_DEBUG
-                  spdlog::critical(
-                    "[{}] Incorrect JFIF magic (received {})",
-                    signature,
-                    header->jfif
-                  );
-#endif
-                  return error_t::InvalidJPG;
-                }
+              header->ffc0.type = marker;
+              header->ffc0.bpp = sof[0];
+              header->ffc0.height = (uint16_t) ((sof[1] << 8) | sof[2]);
+              header->ffc0.width = (uint16_t) ((sof[3] << 8) | sof[4]);
+              header->ffc0.color_space = sof[5];
+              remaining -= sizeof sof;
+
+              // Component id, sampling factors, table id
+              uint8_t component[4 * 3];
+              const size_t count = std::min<size_t>(sof[5], 4) * 3;
+              if (remaining < (long) count || file.read(component, size::u8, count) != count)
+                return error_t::None;
+
+              remaining -= (long) count;
+              for (size_t i = 0; i < count / 3; ++i) {
+                components[i] = component[i * 3];
+                header->ffc0.sampling[i] = component[i * 3 + 1];
+                header->ffc0.quantization[i] = component[i * 3 + 2];
+              }
+
+              // Tables are normally out of the way by now, they may still come between SOFn and SOS though
+              frame = true;
+              scans = (fields & fields_t::preview) && (marker & 0xF3) == 0xC2;
+              if (!scans &&
+                (!(fields & fields_t::quality) || (header->quality.defined & (1u << (header->ffc0.quantization[0] & 3))))) {
+                if (fields & fields_t::quality)
+                  set_quality(header);
+
+                return error_t::None;
               }
+
+              // Everything but the quality estimate and the preview budget is known by now
+              if (checkpoint && !checkpoint(to_record(*header), fields_t::basic))
+                return error_t::Rejected;
+
+              if (remaining != 0 && !file.skip(remaining))
+                break;
+
+              continue;
+            }
+
+            // DQT: quantization tables, read whole
+            if (marker == 0xDB && (fields & fields_t::quality)) {
+              dqt.resize((size_t) remaining);
+              if (file.read(dqt.data(), size::u8, dqt.size()) != dqt.size())
+                break;
+
+              remaining = 0;
+              read_dqt(header, dqt.data(), dqt.size());
             }
 
-            if (std::fread(&header->version[0], size::u8, 2, file.p) == 2) {
-              // Why doesn't C++11 have std::stoui()?
-              header->version_sanitized = static_cast<uint16_t>(std::stoul(
+            if (first)
+              header->app0_length = length;
+
+            // APP0: JFIF identifier, version, density and thumbnail dimensions
+            if (marker == 0xE0 && remaining >= 14) {
+              const uint64_t payload = (fields & fields_t::thumbnail) ? (uint64_t) std::ftell(file.p) : 0u;
+
+              uint8_t app0[14];
+              if (file.read(app0, size::u8, sizeof app0) != sizeof app0)
+                break;
+
+              remaining -= sizeof app0;
+
+              if (std::memcmp(app0, "JFIF", 5) == 0) {
+                std::memcpy(header->jfif, app0, 5);
+                header->version[0] = app0[5];
+                header->version[1] = app0[6];
+
+                // Why doesn't C++11 have std::stoui()?
+                header->version_sanitized = static_cast<uint16_t>(std::stoul(
                     std::to_string(header->version[0])
                   + "0"
                   + std::to_string(header->version[1])
                 ));
+
+                header->density_unit = app0[7];
+                header->density_width = (uint16_t) ((app0[8] << 8) | app0[9]);
+                header->density_height = (uint16_t) ((app0[10] << 8) | app0[11]);
+                header->thumbnail_width = app0[12];
+                header->thumbnail_height = app0[13];
 #ifdef IMAGE_JPG_DETAIL_DEBUG
-              spdlog::debug(
-                "[{}] Version: {}",
-                signature,
-                header->version_sanitized
-              );
+                spdlog::debug(
+                  "[{}] Version: {}, density unit: {}, density: {}x{}, thumbnail: {}x{}",
+                  signature,
+                  header->version_sanitized,
+                  header->density_unit,
+                  header->density_width,
+                  header->density_height,
+                  header->thumbnail_width,
+                  header->thumbnail_height
+                );
 #endif
+
+                // Uncompressed, right behind
+                const uint32_t thumbnail = 3u * header->thumbnail_width * header->thumbnail_height;
+                if ((fields & fields_t::thumbnail) && header->thumbnail.format == JPG_thumbnail_format_t::none &&
+                  thumbnail != 0 && thumbnail <= (uint32_t) remaining)
+                  set_thumbnail(header, JPG_thumbnail_format_t::RGB, header->thumbnail_width, header->thumbnail_height,
+                    payload + sizeof app0, thumbnail);
+              }
+              // JFXX: extension code, then either a JPEG or the dimensions of an uncompressed thumbnail
+              else if ((fields & fields_t::thumbnail) && header->thumbnail.format == JPG_thumbnail_format_t::none &&
+                std::memcmp(app0, "JFXX", 5) == 0) {
+                const uint32_t available = (uint32_t) remaining + sizeof app0 - 8;
+                const uint32_t pixels = (uint32_t) app0[6] * app0[7];
+
+                if (app0[5] == 0x10)
+                  set_thumbnail(header, JPG_thumbnail_format_t::JPEG, 0, 0, payload + 6, (uint32_t) remaining + 8);
+                else if (app0[5] == 0x11 && pixels != 0 && 768u + pixels <= available)
+                  set_thumbnail(header, JPG_thumbnail_format_t::palette, app0[6], app0[7], payload + 8, 768u + pixels);
+                else if (app0[5] == 0x13 && pixels != 0 && 3u * pixels <= available)
+                  set_thumbnail(header, JPG_thumbnail_format_t::RGB, app0[6], app0[7], payload + 8, 3u * pixels);
+              }
             }
+            // APP1: EXIF (or XMP, which is left alone), the first one only
+            else if (marker == 0xE1 && remaining >= 6 &&
+              (first || ((fields & (fields_t::exif | fields_t::thumbnail)) && !exif_seen))) {
+              char exif[6];
+              if (file.read(exif, size::u8, sizeof exif) != sizeof exif)
+                break;
 
-            std::fread(&header->density_unit, size::u8, 1, file.p);
+              remaining -= sizeof exif;
 
-            switch (header->density_unit) {
-              case 0x01:
-#ifdef IMAGE_JPG_DETAIL_DEBUG
-                spdlog::debug("[{}] Density Unit: Pixels/Inch", signature);
-#endif
-                break;
-              case 0x02:
-#ifdef IMAGE_JPG_DETAIL_DEBUG
-                spdlog::debug("[{}] Density Unit: Pixels/Centimeter", signature);
-#endif
+              if (std::memcmp(exif, "Exif\0", 6) == 0) {
+                if (first)
+                  std::memcpy(header->jfif, exif, 5);
 
-                break;
-              default:
-#ifdef IMAGE_JPG_DETAIL_DEBUG
-                spdlog::debug("[{}] Density Unit: Undefined", signature);
-#endif
-                ;
-            }
+                if ((fields & (fields_t::exif | fields_t::thumbnail)) && !exif_seen) {
+                  const uint64_t payload = (uint64_t) std::ftell(file.p);
 
-            std::fread(&header->density_width, size::u16, 1, file.p);
-            header->density_width = __SWIZZLE16(header->density_width);
+                  app1.resize((size_t) remaining);
+                  if (file.read(app1.data(), size::u8, app1.size()) != app1.size())
+                    break;
 
-            std::fread(&header->density_height, size::u16, 1, file.p);
-            header->density_height = __SWIZZLE16(header->density_height);
+                  remaining = 0;
+                  exif_seen = true;
+                  read_exif(header, app1.data(), app1.size(), payload, fields);
 #ifdef IMAGE_JPG_DETAIL_DEBUG
-            spdlog::debug(
-              "[{}] density_width = {}/density_height = {}",
-              signature,
-              header->density_width,
-              header->density_height
-            );
+                  spdlog::debug(
+                    "[{}] EXIF: orientation {}, date/time {}",
+                    signature,
+                    header->orientation,
+                    header->date_time
+                  );
 #endif
+                }
+              }
+            }
 
-            std::fread(&header->thumbnail_width, size::u8, 1, file.p);
-            std::fread(&header->thumbnail_height, size::u8, 1, file.p);
-#ifdef IMAGE_JPG_DETAIL_DEBUG
-            spdlog::debug(
-              "[{}] thumbnail_width = {}/thumbnail_height = {}",
-              signature,
-              header->thumbnail_width,
-              header->thumbnail_height
-            );
-#endif
-            // Scanning for the first SOF0 marker. For the case of EXIF JPEGs,
-            // the SOF0 marker could also reside from within the APP1 block.
-            while (!std::feof(file.p)) {
-              uint8_t ff, c0;
-              std::fread(&ff, size::u8, 1, file.p);
+            if (first) {
+              first = false;
 
-              if (ff == 0xFF) {
-                std::fread(&c0, size::u8, 1, file.p);
-                if (c0 == 0xC0 || c0 == 0xC2) { // Supports both baseline/progressive
-                  std::fseek(file.p, 2, SEEK_CUR);
+              if (flags & JPG_validate_flags::magic) {
+                const bool jfif = std::memcmp(header->jfif, "JFIF", 5) == 0;
+                const bool exif = std::memcmp(header->jfif, "Exif", 5) == 0;
 
+                if ((marker == 0xE0 && !jfif) || (marker == 0xE1 && !exif)) {
 #ifdef IMAGE_JPG_DETAIL_DEBUG
-                  spdlog::debug(
-                    "[{}] SOF0/SOF2 section found at {:X}/{}",
+                  spdlog::critical(
+                    "[{}] Incorrect JFIF/Exif magic (received {})",
                     signature,
-                    std::ftell(file.p),
-                    std::ftell(file.p)
+                    std::string(header->jfif, 4)
                   );
 #endif
+                  return error_t::InvalidJPG;
+                }
+              }
+            }
 
-                  std::fread(&header->ffc0.bpp, size::u8, 1, file.p);
+            // Dimensions and depth are all the SOFn marker has to offer
+            const bool exif_pending = (fields & (fields_t::exif | fields_t::thumbnail)) && !exif_seen;
+            if (!(fields & (fields_t::dimensions | fields_t::depth | fields_t::quality | fields_t::preview)) && !exif_pending)
+              return error_t::None;
 
-                  uint16_t t;
+            if (remaining != 0 && !file.skip(remaining))
+              break;
+          }
 
-                  std::fread(&t, size::u16, 1, file.p);
-                  header->ffc0.height = __SWIZZLE16(t);
+          // Still looking for the luma table (or the scans) past the frame header: whatever got found will do
+          if (frame) {
+            if (fields & fields_t::quality)
+              set_quality(header);
 
-                  std::fread(&t, size::u16, 1, file.p);
-                  header->ffc0.width = __SWIZZLE16(t);
+            return file.exceeded() ? error_t::BudgetExceeded : error_t::None;
+          }
 
-                  std::fread(&header->ffc0.color_space, size::u8, 1, file.p);
-                  return error_t::None;
-                }
-              }
-            }
+          if (file.exceeded())
+            return error_t::BudgetExceeded;
 
-            if (flags & JPG_validate_flags::unrecognized_SOFn) {
+          if (flags & JPG_validate_flags::unrecognized_SOFn) {
 #ifdef IMAGE_JPG_DETAIL_DEBUG
-              spdlog::critical(
-                "[{}] Baseline/progressive SOFn couldn't be found. Size/colorspace information couldn't be retrieved.",
-                signature
-              );
+            spdlog::critical(
+              "[{}] No SOFn segment before the scan data. Size/colorspace information couldn't be retrieved.",
+              signature
+            );
 #endif
-              return error_t::InvalidJPG;
-            }
+            return error_t::InvalidJPG;
+          }
+
+          return error_t::None;
+        }
+
+        error_t get_thumbnail(JPG_thumbnail_t *thumbnail, scoped_file &file)
+        {
+          JPG_header_t header = {0};
 
-            return error_t::None;
+          const error_t error = read(&header, file, JPG_validate_flags::SOI, fields_t::thumbnail);
+          *thumbnail = header.thumbnail;
+
+          if (error != error_t::None || thumbnail->format != JPG_thumbnail_format_t::JPEG)
+            return error;
+
+          // A JPEG file of its own: its frame header tells the dimensions
+          JPG_header_t embedded = {0};
+          if (file.skip((long) thumbnail->offset, SEEK_SET) &&
+            read(&embedded, file, JPG_validate_flags::SOI, fields_t::dimensions) == error_t::None) {
+            thumbnail->width = embedded.ffc0.width;
+            thumbnail->height = embedded.ffc0.height;
           }
 
-          return error_t::Other;
+          return file.exceeded() ? error_t::BudgetExceeded : error_t::None;
+        }
+
+        error_t read_thumbnail(const JPG_thumbnail_t &thumbnail, scoped_file &file, std::vector<uint8_t> *data)
+        {
+          if (thumbnail.format == JPG_thumbnail_format_t::none || data == nullptr)
+            return error_t::InvalidRequest;
+
+          if (!file.valid() || !file.skip((long) thumbnail.offset, SEEK_SET))
+            return error_t::Other;
+
+          data->resize(thumbnail.length);
+          if (file.read(data->data(), size::u8, data->size()) != data->size())
+            return error_t::InvalidJPG;
+
+          return error_t::None;
+        }
+
+        error_t get_thumbnail_pixels(const JPG_thumbnail_t &thumbnail, const std::vector<uint8_t> &data,
+          std::vector<uint8_t> *rgb)
+        {
+          const size_t pixels = (size_t) thumbnail.width * thumbnail.height;
+
+          switch (thumbnail.format) {
+            case JPG_thumbnail_format_t::RGB:
+              if (data.size() < pixels * 3)
+                return error_t::InvalidJPG;
+
+              rgb->assign(data.begin(), data.begin() + pixels * 3);
+              return error_t::None;
+            case JPG_thumbnail_format_t::palette: {
+              if (data.size() < 768 + pixels)
+                return error_t::InvalidJPG;
+
+              rgb->resize(pixels * 3);
+              for (size_t i = 0; i < pixels; ++i)
+                std::memcpy(&(*rgb)[i * 3], &data[(size_t) data[768 + i] * 3], 3);
+
+              return error_t::None;
+            }
+            default:
+              return error_t::InvalidRequest;
+          }
         }
       } // namespace detail
 
@@ -335,10 +858,53 @@ namespace doors {
             r["bits_per_pixel.u8"] = header.ffc0.bpp;
             r["color_space.u8"] = header.ffc0.color_space;
             r["color_space_sanitized.s"] = std::string(get_color_space_sanitized(header.ffc0.color_space));
+
+            uint32_t display_width, display_height;
+            exif::get_display_dimensions(header.orientation, header.ffc0.width, header.ffc0.height,
+              &display_width, &display_height);
+
+            r["orientation.u16"] = header.orientation;
+            r["display_width.u32"] = display_width;
+            r["display_height.u32"] = display_height;
+            if (header.date_time[0] != '\0')
+              r["date_time_original.s"] = std::string(header.date_time);
+
+            r["quality.u8"] = header.quality.estimate;
+            r["quality_exact.b"] = header.quality.exact;
+
+            r["preview_dc.u64"] = header.preview.dc;
+            r["preview_ac.u64"] = header.preview.ac;
+
+            const uint16_t subsampling = get_subsampling_sanitized(get_subsampling(header.ffc0));
+            if (subsampling != 0)
+              r["subsampling.s"] = std::to_string(subsampling / 100) + ":" + std::to_string(subsampling / 10 % 10) + ":" +
+                std::to_string(subsampling % 10);
         }
 
         return r;
       }
+
+      record_t to_record(const JPG_header_t &header)
+      {
+        record_t r = {0};
+
+        r.format = (uint8_t) format_t::JPG;
+        r.version = header.version_sanitized;
+        r.width = header.ffc0.width;
+        r.height = header.ffc0.height;
+        r.bpp = header.ffc0.bpp;
+        r.color_space = header.ffc0.color_space;
+        r.orientation = (uint8_t) header.orientation;
+        r.quality = header.quality.estimate;
+        r.subsampling = get_subsampling(header.ffc0);
+        r.preview = (uint32_t) std::min<uint64_t>(header.preview.dc, UINT32_MAX);
+
+        // SOF2, SOF6, SOF10, SOF14
+        if ((header.ffc0.type & 0xF3) == 0xC2)
+          r.flags |= (uint8_t) record_flags_t::interlaced;
+
+        return r;
+      }
     } // namespace jpg
   } // namespace image
 } // namespace doors
@@ -0,0 +1,1924 @@
+#if !defined(__IMAGE_JPG_DECODE_DETAIL__)
+#define __IMAGE_JPG_DECODE_DETAIL__
+
+// JPEG decoding down to 8-bit pixels: Huffman-coded baseline, extended and progressive images, 1 (grayscale),
+// 3 (YCbCr, RGB) or 4 (CMYK, YCCK) components, whatever sampling factors, restart intervals.
+//
+// The output can be scaled down by 2, 4 or 8 right in the DCT domain: blocks go through reduced-size IDCTs (4x4, 2x2,
+// 1x1) instead of being decoded in full and resized afterwards. At 1/8 only DC coefficients count, progressive AC
+// scans aren't even entropy-decoded then. Subsampled components get a larger IDCT rather than upsampling whenever
+// that lands them at the output's resolution (libjpeg does just the same): a 4:2:0 image at 1/2 has its chroma
+// decoded 8x8 and never upsampled.
+//
+// Huffman decoding is table-driven over the next 9 bits: code length and symbol out of one lookup, and for AC codes
+// short enough, the coefficient's extra bits along with them (run, value, bits consumed: a whole coefficient).
+//
+// Markers get looked for 32 (AVX2) or 16 (SSE2) bytes at a time (find_marker()), whether it's the end of a scan, a
+// restart marker, or all of them at once (index_markers()). Sequential images with restart intervals can then be
+// decoded on several threads: each one gets a run of intervals, starting right past the RSTn marker before it.
+//
+// Arithmetic follows libjpeg's (jidctint/jidctred IDCTs, fancy upsampling, YCbCr tables), output matches
+// libjpeg-turbo's with its defaults (JDCT_ISLOW, fancy upsampling) byte for byte.
+//
+// decode_dc() stops short of pixels altogether: the DC coefficients alone, as block means of luma, enough for a
+// perceptual hash (system/phash.hpp) at a fraction of the cost of a decode. decode_coefficients() stops even
+// earlier: quantized coefficients as stored, along with the tables, for lossless work in the DCT domain
+// (jpg_transform.hpp).
+//
+// Pending issue(s):
+//   Arithmetic coding, lossless, 12-bit samples and DNL markers are turned down (InvalidJPG)
+//   Incomplete progressive images don't get libjpeg's block smoothing, truncated ones differ from its output there
+//   Testing
+
+#include <cstdint>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+namespace doors {
+  namespace image {
+    namespace jpg {
+      struct image_t {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint8_t channels = 0;        // 1: grayscale, 3: RGB, 4: CMYK (as stored, Adobe's inverted one stays inverted)
+        std::vector<uint8_t> pixels; // Row-major, channels interleaved
+      };
+
+      // Entropy-coded data of a scan: where it starts and ends, and where each RSTn marker within it sits. Restart
+      // intervals don't depend on one another (DC predictions start over at every marker), so that's all it takes to
+      // hand them out to several threads.
+      struct JPG_scan_index_t {
+        uint64_t header = 0;            // SOS marker
+        uint64_t data = 0;              // First byte of entropy-coded data
+        uint64_t end = 0;               // The marker ending it (the file's size when truncated)
+        std::vector<uint64_t> restarts; // RSTn markers, in order
+      };
+
+      struct JPG_marker_index_t {
+        std::vector<JPG_scan_index_t> scans;
+        uint64_t eoi = 0;               // 0 when missing
+      };
+
+      // Segments get walked by their length, scan data goes through find_marker().
+      error_t index_markers(const uint8_t *data, size_t size, JPG_marker_index_t *index);
+
+      // The first marker at or past p, end when there's none. A marker is 0xFF followed by anything but 0x00 (a
+      // stuffed 0xFF) or 0xFF (fill, the marker starts at the last one). 32 (AVX2) or 16 (SSE2) bytes at a time.
+      const uint8_t *find_marker(const uint8_t *p, const uint8_t *end);
+
+      // Luma at 1/8 scale, one value per block: see decoder_t::decode_dc().
+      struct dc_grid_t {
+        uint32_t width = 0;          // Of the image, in pixels
+        uint32_t height = 0;
+        uint32_t columns = 0;        // Blocks covering the image
+        uint32_t rows = 0;
+        uint32_t cell_width = 8;     // Pixels per block: 8 unless luma is subsampled itself (16 or more then)
+        uint32_t cell_height = 8;
+        std::vector<float> luma;     // Block means (0-255, neither rounded nor clamped), row-major
+      };
+
+      // DHT's BITS and HUFFVAL: code counts per length, then symbols in code order
+      struct huffman_spec_t {
+        uint8_t counts[16] = {};
+        uint8_t symbols[256] = {};
+        bool defined = false;
+      };
+
+      struct coefficient_plane_t {
+        uint8_t id = 0;
+        uint8_t h = 1;
+        uint8_t v = 1;
+        uint8_t tq = 0;
+        uint8_t td = 0;              // Huffman tables of the last scan it was in
+        uint8_t ta = 0;
+        uint16_t q[64] = {};         // Natural order, as latched on its first scan
+        uint32_t blocks_w = 0;       // Padded to whole MCUs
+        uint32_t blocks_h = 0;
+        uint32_t used_w = 0;         // Covering the image
+        uint32_t used_h = 0;
+        std::vector<int16_t> blocks; // blocks_w * blocks_h blocks of 64 coefficients, natural order, row-major
+      };
+
+      // Quantized DCT coefficients: see decoder_t::decode_coefficients().
+      struct coefficients_t {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint8_t max_h = 1;
+        uint8_t max_v = 1;
+        bool progressive = false;
+        huffman_spec_t dc_tables[4]; // As last defined
+        huffman_spec_t ac_tables[4];
+        std::vector<coefficient_plane_t> components;
+      };
+
+      class decoder_t {
+      public:
+        // `scale` is 1, 2, 4 or 8: the image comes out ceil(width / scale) x ceil(height / scale).
+        // Sequential images with restart intervals get split across `threads` (0 picks
+        // std::thread::hardware_concurrency()) by intervals, hence by MCU rows when intervals are whole rows.
+        error_t decode(scoped_file &file, image_t *image, unsigned scale = 1, size_t threads = 1);
+        // E.g. an embedded thumbnail (see read_thumbnail() in jpg.hpp)
+        error_t decode(const uint8_t *data, size_t size, image_t *image, unsigned scale = 1, size_t threads = 1);
+
+        // Luma straight off the DC coefficients, for fingerprinting (see system/phash.hpp): no IDCT and no pixels.
+        // Progressive AC scans get skipped altogether, sequential ones are only walked through code by code, and so
+        // are chroma blocks. Grayscale, YCbCr and RGB images (InvalidRequest for CMYK).
+        error_t decode_dc(scoped_file &file, dc_grid_t *grid, size_t threads = 1);
+        error_t decode_dc(const uint8_t *data, size_t size, dc_grid_t *grid, size_t threads = 1);
+
+        // Every scan entropy-decoded into blocks, and that's all: no IDCT, no planes. What lossless transforms start
+        // from, the tables coming along so that the blocks can be coded again just the same.
+        error_t decode_coefficients(scoped_file &file, coefficients_t *coefficients, size_t threads = 1);
+        error_t decode_coefficients(const uint8_t *data, size_t size, coefficients_t *coefficients, size_t threads = 1);
+
+        // The largest scale still yielding at least target_width x target_height, 1 when none does.
+        static unsigned get_scale(uint32_t width, uint32_t height, uint32_t target_width, uint32_t target_height);
+
+        // Images above that are turned down as InvalidJPG rather than allocated
+        static constexpr const uint64_t max_pixels = 1u << 28;
+
+      private:
+        static constexpr const int fast_bits = 9;
+
+        struct huffman_t {
+          uint8_t fast[1 << fast_bits];    // Symbol index of codes up to fast_bits long, 255 for longer ones
+          int16_t fast_ac[1 << fast_bits]; // value << 8 | run << 4 | bits consumed, 0 when code + value don't fit
+          uint16_t code[256];
+          uint8_t values[256];
+          uint8_t size[257];
+          uint32_t maxcode[18];            // Past the last code of each length, left-aligned on 16 bits
+          int delta[17];                   // Code to symbol index, per length
+          bool defined;
+        };
+
+        struct component_t {
+          uint8_t id;
+          uint8_t h;
+          uint8_t v;
+          uint8_t tq;
+          uint8_t td;                         // Huffman tables of the current scan
+          uint8_t ta;
+          uint8_t ssize;                      // IDCT size: 1, 2, 4 or 8
+          uint8_t upsampling;
+          uint32_t blocks_w;                  // Padded to whole MCUs
+          uint32_t blocks_h;
+          uint32_t used_w;                    // Covering the image, what non-interleaved scans go through
+          uint32_t used_h;
+          uint32_t width;                     // Samples, once through the IDCT (libjpeg's downsampled_width)
+          uint32_t height;
+          bool latched;
+          uint16_t q[64];                     // Natural order, latched on the component's first scan
+          std::vector<int16_t> coefficients;  // Progressive (or decode_coefficients()), blocks_w * blocks_h blocks of 64
+          std::vector<int16_t> dcs;           // DC coefficients alone (decode_dc()), blocks_w * blocks_h
+          std::vector<uint8_t> plane;         // blocks_w * ssize wide
+          size_t stride;
+        };
+
+        struct bits_t {
+          const uint8_t *p;
+          const uint8_t *end;
+          uint64_t buffer;                    // Left-aligned
+          int count;
+          int padding;                        // Zero bits made up past the data, at the end of buffer
+          bool marker;                        // Ran into one: zeros from there on
+
+          // Decoding went past the data (truncated file): libjpeg leaves what follows alone, so do we
+          bool exhausted() const { return count < padding; }
+
+          void fill();
+          uint32_t get(int n);
+          int extend(int n);
+          int decode(const huffman_t &table);
+        };
+
+        // Where decoding a scan stands; one per thread when restart intervals get decoded in parallel.
+        struct cursor_t {
+          bits_t bits;
+          int dc[4];                          // DC predictions, per component of the scan
+          uint32_t eobrun;
+          uint32_t todo;                      // MCUs left before the next restart marker
+          bool insufficient;                  // Out of data, blocks past that are left as they are
+
+          cursor_t(const uint8_t *p, const uint8_t *end, uint32_t restart_interval);
+        };
+
+        error_t parse(const uint8_t *data, size_t size, unsigned scale, scoped_file *file);
+        error_t read_frame(const uint8_t *p, size_t length, uint8_t marker, unsigned scale);
+        error_t read_huffman(const uint8_t *p, size_t length);
+        error_t read_quantization(const uint8_t *p, size_t length);
+        error_t read_scan(const uint8_t *p, size_t length, const uint8_t *data, const uint8_t *end,
+          const uint8_t **next, scoped_file *file);
+        error_t decode_mcus(cursor_t &cursor, uint64_t first, uint64_t last, scoped_file *file);
+        bool decode_parallel(const uint8_t *data, const uint8_t *end, uint64_t mcus, const uint8_t **next);
+        bool decode_block(cursor_t &cursor, uint8_t index, int16_t *block);
+        bool skip_block(cursor_t &cursor, uint8_t index, int16_t *dc);
+        bool decode_block_progressive(cursor_t &cursor, uint8_t index, int16_t *block);
+        void restart(cursor_t &cursor);
+        void transform(component_t &component, const int16_t *block, uint32_t bx, uint32_t by);
+        error_t output(image_t *image);
+        error_t output(dc_grid_t *grid);
+        error_t output(coefficients_t *coefficients);
+        bool is_ycc() const;
+        const uint8_t *get_row(component_t &component, uint32_t y, uint8_t *buffer);
+
+        huffman_t dc_tables[4];
+        huffman_t ac_tables[4];
+        uint16_t quantization[4][64];
+        bool quantization_defined[4];
+
+        component_t components[4];
+        uint8_t component_count = 0;
+        uint8_t max_h = 1;
+        uint8_t max_v = 1;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t mcus_x = 0;
+        uint32_t mcus_y = 0;
+        unsigned min_ssize = 8;
+
+        bool frame = false;
+        bool progressive = false;
+        bool dc_only = false;                 // decode_dc()
+        bool coefficients_only = false;       // decode_coefficients()
+        bool jfif = false;
+        int adobe = -1;                       // APP14 transform, -1 without one
+        uint32_t restart_interval = 0;
+
+        // Current scan
+        component_t *scan[4];
+        uint8_t scan_count = 0;
+        uint8_t ss = 0;
+        uint8_t se = 63;
+        uint8_t ah = 0;
+        uint8_t al = 0;
+
+        size_t thread_count = 1;
+        std::vector<uint8_t> contents;        // The file, when decoding one
+      };
+    } // namespace jpg
+  } // namespace image
+} // namespace doors
+
+#endif
+
+#ifdef IMAGE_JPG_DECODE_DETAIL
+#undef IMAGE_JPG_DECODE_DETAIL
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <thread>
+#include <utility>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
+
+namespace doors {
+  namespace image {
+    namespace jpg {
+      namespace detail {
+        // Zigzag to natural order, with room for runs overshooting the block on corrupt data
+        static const uint8_t natural_order[64 + 16] = {
+           0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+          12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+          35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+          58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+          63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63
+        };
+
+        enum upsampling_t : uint8_t { fullsize, h2v1, h2v1_fancy, h2v2, h2v2_fancy, h1v2_fancy, generic };
+
+        static inline uint8_t clamp(int value)
+        {
+          return (uint8_t) (value < 0 ? 0 : (value > 255 ? 255 : value));
+        }
+
+        // libjpeg's fixed point: 13 fractional bits, 2 more kept in between passes
+        constexpr const int const_bits = 13;
+        constexpr const int pass1_bits = 2;
+
+        static inline int64_t descale(int64_t x, int n)
+        {
+          return (x + ((int64_t) 1 << (n - 1))) >> n;
+        }
+
+        // Post-IDCT: level shift and clamp
+        static inline uint8_t get_sample(int64_t x, int n)
+        {
+          const int64_t value = descale(x, n) + 128;
+          return (uint8_t) (value < 0 ? 0 : (value > 255 ? 255 : value));
+        }
+
+        // jidctint.c's jpeg_idct_islow
+        static void idct_8x8(const int16_t *in, const uint16_t *q, uint8_t *out, size_t stride)
+        {
+          int32_t workspace[64];
+
+          for (int c = 0; c < 8; ++c) {
+            const int16_t *i = in + c;
+            const uint16_t *k = q + c;
+            int32_t *w = workspace + c;
+
+            if (i[8] == 0 && i[16] == 0 && i[24] == 0 && i[32] == 0 && i[40] == 0 && i[48] == 0 && i[56] == 0) {
+              const int32_t dc = i[0] * k[0] * (1 << pass1_bits);
+              for (int r = 0; r < 8; ++r)
+                w[r * 8] = dc;
+              continue;
+            }
+
+            int64_t z2 = i[16] * k[16], z3 = i[48] * k[48];
+            int64_t z1 = (z2 + z3) * 4433;
+            int64_t tmp2 = z1 + z3 * -15137;
+            int64_t tmp3 = z1 + z2 * 6270;
+
+            z2 = i[0] * k[0];
+            z3 = i[32] * k[32];
+            int64_t tmp0 = (z2 + z3) * (1 << const_bits);
+            int64_t tmp1 = (z2 - z3) * (1 << const_bits);
+
+            const int64_t tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+            const int64_t tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+
+            tmp0 = i[56] * k[56];
+            tmp1 = i[40] * k[40];
+            tmp2 = i[24] * k[24];
+            tmp3 = i[8] * k[8];
+
+            z1 = tmp0 + tmp3;
+            z2 = tmp1 + tmp2;
+            z3 = tmp0 + tmp2;
+            int64_t z4 = tmp1 + tmp3;
+            const int64_t z5 = (z3 + z4) * 9633;
+
+            tmp0 *= 2446;
+            tmp1 *= 16819;
+            tmp2 *= 25172;
+            tmp3 *= 12299;
+            z1 *= -7373;
+            z2 *= -20995;
+            z3 = z3 * -16069 + z5;
+            z4 = z4 * -3196 + z5;
+
+            tmp0 += z1 + z3;
+            tmp1 += z2 + z4;
+            tmp2 += z2 + z3;
+            tmp3 += z1 + z4;
+
+            const int n = const_bits - pass1_bits;
+            w[0] = (int32_t) descale(tmp10 + tmp3, n);
+            w[56] = (int32_t) descale(tmp10 - tmp3, n);
+            w[8] = (int32_t) descale(tmp11 + tmp2, n);
+            w[48] = (int32_t) descale(tmp11 - tmp2, n);
+            w[16] = (int32_t) descale(tmp12 + tmp1, n);
+            w[40] = (int32_t) descale(tmp12 - tmp1, n);
+            w[24] = (int32_t) descale(tmp13 + tmp0, n);
+            w[32] = (int32_t) descale(tmp13 - tmp0, n);
+          }
+
+          for (int r = 0; r < 8; ++r) {
+            const int32_t *w = workspace + r * 8;
+            uint8_t *o = out + r * stride;
+            const int n = const_bits + pass1_bits + 3;
+
+            if (w[1] == 0 && w[2] == 0 && w[3] == 0 && w[4] == 0 && w[5] == 0 && w[6] == 0 && w[7] == 0) {
+              std::memset(o, get_sample(w[0], pass1_bits + 3), 8);
+              continue;
+            }
+
+            int64_t z2 = w[2], z3 = w[6];
+            int64_t z1 = (z2 + z3) * 4433;
+            int64_t tmp2 = z1 + z3 * -15137;
+            int64_t tmp3 = z1 + z2 * 6270;
+
+            int64_t tmp0 = ((int64_t) w[0] + w[4]) * (1 << const_bits);
+            int64_t tmp1 = ((int64_t) w[0] - w[4]) * (1 << const_bits);
+
+            const int64_t tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+            const int64_t tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+
+            tmp0 = w[7];
+            tmp1 = w[5];
+            tmp2 = w[3];
+            tmp3 = w[1];
+
+            z1 = tmp0 + tmp3;
+            z2 = tmp1 + tmp2;
+            z3 = tmp0 + tmp2;
+            int64_t z4 = tmp1 + tmp3;
+            const int64_t z5 = (z3 + z4) * 9633;
+
+            tmp0 *= 2446;
+            tmp1 *= 16819;
+            tmp2 *= 25172;
+            tmp3 *= 12299;
+            z1 *= -7373;
+            z2 *= -20995;
+            z3 = z3 * -16069 + z5;
+            z4 = z4 * -3196 + z5;
+
+            tmp0 += z1 + z3;
+            tmp1 += z2 + z4;
+            tmp2 += z2 + z3;
+            tmp3 += z1 + z4;
+
+            o[0] = get_sample(tmp10 + tmp3, n);
+            o[7] = get_sample(tmp10 - tmp3, n);
+            o[1] = get_sample(tmp11 + tmp2, n);
+            o[6] = get_sample(tmp11 - tmp2, n);
+            o[2] = get_sample(tmp12 + tmp1, n);
+            o[5] = get_sample(tmp12 - tmp1, n);
+            o[3] = get_sample(tmp13 + tmp0, n);
+            o[4] = get_sample(tmp13 - tmp0, n);
+          }
+        }
+
+        // jidctred.c's jpeg_idct_4x4: column and row 4 don't contribute
+        static void idct_4x4(const int16_t *in, const uint16_t *q, uint8_t *out, size_t stride)
+        {
+          int32_t workspace[32];
+
+          for (int c = 0; c < 8; ++c) {
+            if (c == 4)
+              continue;
+
+            const int16_t *i = in + c;
+            const uint16_t *k = q + c;
+            int32_t *w = workspace + c;
+
+            if (i[8] == 0 && i[16] == 0 && i[24] == 0 && i[40] == 0 && i[48] == 0 && i[56] == 0) {
+              const int32_t dc = i[0] * k[0] * (1 << pass1_bits);
+              w[0] = w[8] = w[16] = w[24] = dc;
+              continue;
+            }
+
+            const int64_t tmp0 = (int64_t) (i[0] * k[0]) * (1 << (const_bits + 1));
+            const int64_t tmp2 = (int64_t) (i[16] * k[16]) * 15137 + (int64_t) (i[48] * k[48]) * -6270;
+            const int64_t tmp10 = tmp0 + tmp2, tmp12 = tmp0 - tmp2;
+
+            const int64_t z1 = i[56] * k[56], z2 = i[40] * k[40], z3 = i[24] * k[24], z4 = i[8] * k[8];
+            const int64_t odd0 = z1 * -1730 + z2 * 11893 + z3 * -17799 + z4 * 8697;
+            const int64_t odd2 = z1 * -4176 + z2 * -4926 + z3 * 7373 + z4 * 20995;
+
+            const int n = const_bits - pass1_bits + 1;
+            w[0] = (int32_t) descale(tmp10 + odd2, n);
+            w[24] = (int32_t) descale(tmp10 - odd2, n);
+            w[8] = (int32_t) descale(tmp12 + odd0, n);
+            w[16] = (int32_t) descale(tmp12 - odd0, n);
+          }
+
+          for (int r = 0; r < 4; ++r) {
+            const int32_t *w = workspace + r * 8;
+            uint8_t *o = out + r * stride;
+            const int n = const_bits + pass1_bits + 3 + 1;
+
+            if (w[1] == 0 && w[2] == 0 && w[3] == 0 && w[5] == 0 && w[6] == 0 && w[7] == 0) {
+              std::memset(o, get_sample(w[0], pass1_bits + 3), 4);
+              continue;
+            }
+
+            const int64_t tmp0 = (int64_t) w[0] * (1 << (const_bits + 1));
+            const int64_t tmp2 = (int64_t) w[2] * 15137 + (int64_t) w[6] * -6270;
+            const int64_t tmp10 = tmp0 + tmp2, tmp12 = tmp0 - tmp2;
+
+            const int64_t z1 = w[7], z2 = w[5], z3 = w[3], z4 = w[1];
+            const int64_t odd0 = z1 * -1730 + z2 * 11893 + z3 * -17799 + z4 * 8697;
+            const int64_t odd2 = z1 * -4176 + z2 * -4926 + z3 * 7373 + z4 * 20995;
+
+            o[0] = get_sample(tmp10 + odd2, n);
+            o[3] = get_sample(tmp10 - odd2, n);
+            o[1] = get_sample(tmp12 + odd0, n);
+            o[2] = get_sample(tmp12 - odd0, n);
+          }
+        }
+
+        // jidctred.c's jpeg_idct_2x2: odd columns and rows, along with the DC, are all there is to it
+        static void idct_2x2(const int16_t *in, const uint16_t *q, uint8_t *out, size_t stride)
+        {
+          int32_t workspace[16];
+
+          for (int c = 0; c < 8; ++c) {
+            if (c == 2 || c == 4 || c == 6)
+              continue;
+
+            const int16_t *i = in + c;
+            const uint16_t *k = q + c;
+            int32_t *w = workspace + c;
+
+            if (i[8] == 0 && i[24] == 0 && i[40] == 0 && i[56] == 0) {
+              w[0] = w[8] = i[0] * k[0] * (1 << pass1_bits);
+              continue;
+            }
+
+            const int64_t tmp10 = (int64_t) (i[0] * k[0]) * (1 << (const_bits + 2));
+            const int64_t tmp0 = (int64_t) (i[56] * k[56]) * -5906 + (int64_t) (i[40] * k[40]) * 6967 +
+              (int64_t) (i[24] * k[24]) * -10426 + (int64_t) (i[8] * k[8]) * 29692;
+
+            const int n = const_bits - pass1_bits + 2;
+            w[0] = (int32_t) descale(tmp10 + tmp0, n);
+            w[8] = (int32_t) descale(tmp10 - tmp0, n);
+          }
+
+          for (int r = 0; r < 2; ++r) {
+            const int32_t *w = workspace + r * 8;
+            uint8_t *o = out + r * stride;
+
+            if (w[1] == 0 && w[3] == 0 && w[5] == 0 && w[7] == 0) {
+              o[0] = o[1] = get_sample(w[0], pass1_bits + 3);
+              continue;
+            }
+
+            const int64_t tmp10 = (int64_t) w[0] * (1 << (const_bits + 2));
+            const int64_t tmp0 = (int64_t) w[7] * -5906 + (int64_t) w[5] * 6967 + (int64_t) w[3] * -10426 +
+              (int64_t) w[1] * 29692;
+
+            const int n = const_bits + pass1_bits + 3 + 2;
+            o[0] = get_sample(tmp10 + tmp0, n);
+            o[1] = get_sample(tmp10 - tmp0, n);
+          }
+        }
+
+        static void idct_1x1(const int16_t *in, const uint16_t *q, uint8_t *out, size_t)
+        {
+          out[0] = get_sample((int64_t) in[0] * q[0], 3);
+        }
+
+        // jdcolor.c's tables: 16 fractional bits
+        struct ycc_tables_t {
+          int cr_r[256];
+          int cb_b[256];
+          int32_t cr_g[256];
+          int32_t cb_g[256];
+
+          ycc_tables_t()
+          {
+            constexpr int32_t half = 1 << 15;
+            for (int i = 0; i < 256; ++i) {
+              const int32_t x = i - 128;
+              cr_r[i] = (int) ((91881 * x + half) >> 16);  // 1.40200
+              cb_b[i] = (int) ((116130 * x + half) >> 16); // 1.77200
+              cr_g[i] = -46802 * x;                        // 0.71414
+              cb_g[i] = -22554 * x + half;                 // 0.34414
+            }
+          }
+        };
+
+        static const ycc_tables_t &get_ycc_tables()
+        {
+          static const ycc_tables_t tables;
+          return tables;
+        }
+
+        // Past the entropy-coded data starting at p: the next marker that isn't a restart one
+        static const uint8_t *skip_entropy_coded(const uint8_t *p, const uint8_t *end)
+        {
+          for (p = find_marker(p, end); p != end && p[1] >= 0xD0 && p[1] <= 0xD7; p = find_marker(p + 2, end))
+            ;
+
+          return p;
+        }
+
+        static inline unsigned get_first_bit(uint32_t mask)
+        {
+#if defined(_MSC_VER)
+          unsigned long i;
+          _BitScanForward(&i, mask);
+          return (unsigned) i;
+#else
+          return (unsigned) __builtin_ctz(mask);
+#endif
+        }
+
+        // jdsample.c's fancy upsampling: triangle filters, 3/4 nearer sample + 1/4 further one
+        static void upsample_h2v1_fancy(const uint8_t *in, uint32_t width, uint8_t *out)
+        {
+          out[0] = in[0];
+          out[1] = (uint8_t) ((in[0] * 3 + in[1] + 2) >> 2);
+
+          for (uint32_t x = 1; x + 1 < width; ++x) {
+            const int value = in[x] * 3;
+            out[x * 2] = (uint8_t) ((value + in[x - 1] + 1) >> 2);
+            out[x * 2 + 1] = (uint8_t) ((value + in[x + 1] + 2) >> 2);
+          }
+
+          out[width * 2 - 2] = (uint8_t) ((in[width - 1] * 3 + in[width - 2] + 1) >> 2);
+          out[width * 2 - 1] = in[width - 1];
+        }
+
+        // `near` is the input row the output row falls in, `far` the one above or below
+        static void upsample_h2v2_fancy(const uint8_t *near, const uint8_t *far, uint32_t width, uint8_t *out)
+        {
+          int last = near[0] * 3 + far[0];
+          int current = last;
+          int next = near[1] * 3 + far[1];
+
+          out[0] = (uint8_t) ((current * 4 + 8) >> 4);
+          out[1] = (uint8_t) ((current * 3 + next + 7) >> 4);
+
+          for (uint32_t x = 1; x < width; ++x) {
+            last = current;
+            current = next;
+            next = x + 1 < width ? near[x + 1] * 3 + far[x + 1] : current;
+
+            out[x * 2] = (uint8_t) ((current * 3 + last + 8) >> 4);
+            out[x * 2 + 1] = (uint8_t) (x + 1 < width ? (current * 3 + next + 7) >> 4 : (current * 4 + 7) >> 4);
+          }
+        }
+
+        static void upsample_h1v2_fancy(const uint8_t *near, const uint8_t *far, uint32_t width, uint8_t *out,
+          int bias)
+        {
+          for (uint32_t x = 0; x < width; ++x)
+            out[x] = (uint8_t) ((near[x] * 3 + far[x] + bias) >> 2);
+        }
+      } // namespace detail
+
+      const uint8_t *find_marker(const uint8_t *p, const uint8_t *end)
+      {
+        // 0xFF bytes are rare in entropy-coded data (each one is a marker or gets a 0x00 stuffed after it): compare a
+        // vector's worth at once, and only look at the byte following the ones found. The last byte of a vector is
+        // looked past, hence the one byte of slack.
+#if defined(__AVX2__)
+        const __m256i ff = _mm256_set1_epi8((char) 0xFF);
+
+        for (; end - p > 32; p += 32) {
+          const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+
+          for (uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, ff)); mask != 0; mask &= mask - 1) {
+            const unsigned i = detail::get_first_bit(mask);
+            if (p[i + 1] != 0x00 && p[i + 1] != 0xFF)
+              return p + i;
+          }
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        const __m128i ff = _mm_set1_epi8((char) 0xFF);
+
+        for (; end - p > 16; p += 16) {
+          const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+
+          for (uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, ff)); mask != 0; mask &= mask - 1) {
+            const unsigned i = detail::get_first_bit(mask);
+            if (p[i + 1] != 0x00 && p[i + 1] != 0xFF)
+              return p + i;
+          }
+        }
+#endif
+
+        while (end - p > 1) {
+          p = static_cast<const uint8_t *>(std::memchr(p, 0xFF, (size_t) (end - p - 1)));
+          if (p == nullptr)
+            break;
+
+          if (p[1] != 0x00 && p[1] != 0xFF)
+            return p;
+
+          ++p;
+        }
+
+        return end;
+      }
+
+      error_t index_markers(const uint8_t *data, size_t size, JPG_marker_index_t *index)
+      {
+        if (data == nullptr || index == nullptr)
+          return error_t::Other;
+
+        index->scans.clear();
+        index->eoi = 0;
+
+        if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+          return error_t::InvalidJPG;
+
+        const uint8_t *p = data + 2, *end = data + size;
+
+        while (p < end) {
+          while (p < end && *p != 0xFF)
+            ++p;
+          while (end - p > 1 && p[1] == 0xFF)
+            ++p;
+          if (end - p < 2)
+            break;
+
+          const uint8_t *at = p;
+          const uint8_t marker = p[1];
+          p += 2;
+
+          if (marker == 0xD9) {
+            index->eoi = (uint64_t) (at - data);
+            break;
+          }
+
+          if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+            continue;
+
+          if (end - p < 2)
+            break;
+
+          const size_t length = (size_t) ((p[0] << 8) | p[1]);
+          if (length < 2 || length > (size_t) (end - p))
+            return error_t::InvalidJPG;
+
+          p += length;
+          if (marker != 0xDA)
+            continue;
+
+          JPG_scan_index_t scan;
+          scan.header = (uint64_t) (at - data);
+          scan.data = (uint64_t) (p - data);
+
+          for (p = find_marker(p, end); p != end && p[1] >= 0xD0 && p[1] <= 0xD7; p = find_marker(p + 2, end))
+            scan.restarts.push_back((uint64_t) (p - data));
+
+          scan.end = (uint64_t) (p - data);
+          index->scans.push_back(std::move(scan));
+        }
+
+        return index->scans.empty() ? error_t::InvalidJPG : error_t::None;
+      }
+
+      void decoder_t::bits_t::fill()
+      {
+        while (count <= 56) {
+          uint64_t byte = 0;
+
+          if (marker || p >= end)
+            padding += 8;
+          else {
+            byte = *p;
+
+            if (byte != 0xFF)
+              ++p;
+            else if (p + 1 < end && p[1] == 0x00) // Stuffed
+              p += 2;
+            else {
+              marker = true; // Left where it is, for whoever comes next
+              padding += 8;
+              byte = 0;
+            }
+          }
+
+          buffer |= byte << (56 - count);
+          count += 8;
+        }
+      }
+
+      uint32_t decoder_t::bits_t::get(int n)
+      {
+        if (count < n)
+          fill();
+
+        const uint32_t r = (uint32_t) (buffer >> (64 - n));
+        buffer <<= n;
+        count -= n;
+
+        return r;
+      }
+
+      // Receives n bits, sign-extended as JPEG has it: the lower half of the range is negative
+      int decoder_t::bits_t::extend(int n)
+      {
+        if (n == 0)
+          return 0;
+
+        const int value = (int) get(n);
+        return value < (1 << (n - 1)) ? value - (1 << n) + 1 : value;
+      }
+
+      int decoder_t::bits_t::decode(const huffman_t &table)
+      {
+        if (count < 16)
+          fill();
+
+        const uint8_t k = table.fast[buffer >> (64 - fast_bits)];
+        if (k != 255) {
+          const int size = table.size[k];
+          buffer <<= size;
+          count -= size;
+          return table.values[k];
+        }
+
+        const uint32_t code = (uint32_t) (buffer >> 48);
+
+        int length = fast_bits + 1;
+        while (length <= 16 && code >= table.maxcode[length])
+          ++length;
+
+        if (length > 16)
+          return -1;
+
+        const int index = (int) (code >> (16 - length)) + table.delta[length];
+        if (index < 0 || index >= 256)
+          return -1;
+
+        buffer <<= length;
+        count -= length;
+        return table.values[index];
+      }
+
+      unsigned decoder_t::get_scale(uint32_t width, uint32_t height, uint32_t target_width, uint32_t target_height)
+      {
+        for (unsigned scale = 8; scale > 1; scale /= 2) {
+          if ((width + scale - 1) / scale >= target_width && (height + scale - 1) / scale >= target_height)
+            return scale;
+        }
+
+        return 1;
+      }
+
+      error_t decoder_t::decode(scoped_file &file, image_t *image, unsigned scale, size_t threads)
+      {
+        if (!file.valid() || image == nullptr)
+          return error_t::Other;
+
+        const uint64_t size = file.size();
+        if (!file.skip(0, SEEK_SET))
+          return error_t::Other;
+
+        contents.resize((size_t) size);
+        if (file.read(contents.data(), size::u8, contents.size()) != contents.size())
+          return error_t::InvalidJPG;
+
+        thread_count = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        dc_only = false;
+        coefficients_only = false;
+
+        const error_t error = parse(contents.data(), contents.size(), scale, &file);
+        return error != error_t::None ? error : output(image);
+      }
+
+      error_t decoder_t::decode(const uint8_t *data, size_t size, image_t *image, unsigned scale, size_t threads)
+      {
+        thread_count = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        dc_only = false;
+        coefficients_only = false;
+
+        if (image == nullptr)
+          return error_t::InvalidRequest;
+
+        const error_t error = parse(data, size, scale, nullptr);
+        return error != error_t::None ? error : output(image);
+      }
+
+      error_t decoder_t::decode_dc(scoped_file &file, dc_grid_t *grid, size_t threads)
+      {
+        if (!file.valid() || grid == nullptr)
+          return error_t::Other;
+
+        const uint64_t size = file.size();
+        if (!file.skip(0, SEEK_SET))
+          return error_t::Other;
+
+        contents.resize((size_t) size);
+        if (file.read(contents.data(), size::u8, contents.size()) != contents.size())
+          return error_t::InvalidJPG;
+
+        thread_count = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        dc_only = true;
+        coefficients_only = false;
+
+        const error_t error = parse(contents.data(), contents.size(), 8, &file);
+        return error != error_t::None ? error : output(grid);
+      }
+
+      error_t decoder_t::decode_dc(const uint8_t *data, size_t size, dc_grid_t *grid, size_t threads)
+      {
+        thread_count = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        dc_only = true;
+        coefficients_only = false;
+
+        if (grid == nullptr)
+          return error_t::InvalidRequest;
+
+        const error_t error = parse(data, size, 8, nullptr);
+        return error != error_t::None ? error : output(grid);
+      }
+
+      error_t decoder_t::decode_coefficients(scoped_file &file, coefficients_t *coefficients, size_t threads)
+      {
+        if (!file.valid() || coefficients == nullptr)
+          return error_t::Other;
+
+        const uint64_t size = file.size();
+        if (!file.skip(0, SEEK_SET))
+          return error_t::Other;
+
+        contents.resize((size_t) size);
+        if (file.read(contents.data(), size::u8, contents.size()) != contents.size())
+          return error_t::InvalidJPG;
+
+        thread_count = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        dc_only = false;
+        coefficients_only = true;
+
+        const error_t error = parse(contents.data(), contents.size(), 1, &file);
+        return error != error_t::None ? error : output(coefficients);
+      }
+
+      error_t decoder_t::decode_coefficients(const uint8_t *data, size_t size, coefficients_t *coefficients,
+        size_t threads)
+      {
+        thread_count = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        dc_only = false;
+        coefficients_only = true;
+
+        if (coefficients == nullptr)
+          return error_t::InvalidRequest;
+
+        const error_t error = parse(data, size, 1, nullptr);
+        return error != error_t::None ? error : output(coefficients);
+      }
+
+      // Everything up to EOI (or as far as the data goes): planes, coefficients or DC values filled in.
+      error_t decoder_t::parse(const uint8_t *data, size_t size, unsigned scale, scoped_file *file)
+      {
+        if (data == nullptr || (scale != 1 && scale != 2 && scale != 4 && scale != 8))
+          return error_t::InvalidRequest;
+
+        for (auto &table : dc_tables)
+          table.defined = false;
+        for (auto &table : ac_tables)
+          table.defined = false;
+        std::fill(std::begin(quantization_defined), std::end(quantization_defined), false);
+
+        component_count = 0;
+        frame = false;
+        progressive = false;
+        jfif = false;
+        adobe = -1;
+        restart_interval = 0;
+
+        if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+          return error_t::InvalidJPG;
+
+        const uint8_t *p = data + 2;
+        const uint8_t *end = data + size;
+        bool scanned = false;
+
+        while (p < end) {
+          // Whatever isn't a marker in between segments gets skipped (libjpeg warns and does the same)
+          while (p < end && *p != 0xFF)
+            ++p;
+          while (p < end && *p == 0xFF)
+            ++p;
+          if (p >= end)
+            break;
+
+          const uint8_t marker = *p++;
+          if (marker == 0xD9) // EOI
+            break;
+
+          if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+            continue;
+
+          if (end - p < 2)
+            break;
+
+          const size_t length = (size_t) ((p[0] << 8) | p[1]);
+          if (length < 2 || length > (size_t) (end - p))
+            return scanned ? error_t::None : error_t::InvalidJPG;
+
+          const uint8_t *segment = p + 2;
+          const size_t segment_length = length - 2;
+          error_t error = error_t::None;
+
+          switch (marker) {
+            case 0xC0: case 0xC1: case 0xC2: // Huffman: baseline, extended sequential, progressive
+              error = read_frame(segment, segment_length, marker, scale);
+              break;
+            case 0xC3: case 0xC5: case 0xC6: case 0xC7: // Lossless, hierarchical
+            case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF: // Arithmetic coding
+              error = error_t::InvalidJPG;
+              break;
+            case 0xC4:
+              error = read_huffman(segment, segment_length);
+              break;
+            case 0xDB:
+              error = read_quantization(segment, segment_length);
+              break;
+            case 0xDD:
+              if (segment_length >= 2)
+                restart_interval = (uint32_t) ((segment[0] << 8) | segment[1]);
+              break;
+            case 0xE0:
+              if (segment_length >= 5 && std::memcmp(segment, "JFIF", 5) == 0)
+                jfif = true;
+              break;
+            case 0xEE:
+              if (segment_length >= 12 && std::memcmp(segment, "Adobe", 5) == 0)
+                adobe = segment[11];
+              break;
+            case 0xDA: {
+              const uint8_t *next;
+              error = read_scan(segment, segment_length, p + length, end, &next, file);
+              if (error != error_t::None)
+                return error;
+
+              scanned = true;
+              p = next;
+              continue;
+            }
+            default:
+              break;
+          }
+
+          if (error != error_t::None)
+            return error;
+
+          p += length;
+        }
+
+        // Truncated files still show whatever made it
+        return scanned ? error_t::None : error_t::InvalidJPG;
+      }
+
+      error_t decoder_t::read_frame(const uint8_t *p, size_t length, uint8_t marker, unsigned scale)
+      {
+        if (frame || length < 6)
+          return error_t::InvalidJPG;
+
+        // 8-bit samples only; a height of 0 would be defined by a DNL marker later on
+        height = (uint32_t) ((p[1] << 8) | p[2]);
+        width = (uint32_t) ((p[3] << 8) | p[4]);
+        component_count = p[5];
+
+        if (p[0] != 8 || width == 0 || height == 0 || (uint64_t) width * height > max_pixels)
+          return error_t::InvalidJPG;
+
+        if (component_count == 0 || component_count > 4 || length < 6 + (size_t) component_count * 3)
+          return error_t::InvalidJPG;
+
+        progressive = marker == 0xC2;
+        max_h = max_v = 1;
+
+        for (uint8_t i = 0; i < component_count; ++i) {
+          component_t &component = components[i];
+          const uint8_t *c = p + 6 + i * 3;
+
+          component.id = c[0];
+          component.h = c[1] >> 4;
+          component.v = c[1] & 15;
+          component.tq = c[2];
+
+          if (component.h < 1 || component.h > 4 || component.v < 1 || component.v > 4 || component.tq > 3)
+            return error_t::InvalidJPG;
+
+          max_h = std::max(max_h, component.h);
+          max_v = std::max(max_v, component.v);
+        }
+
+        mcus_x = (width + 8u * max_h - 1) / (8u * max_h);
+        mcus_y = (height + 8u * max_v - 1) / (8u * max_v);
+        min_ssize = 8 / scale;
+
+        for (uint8_t i = 0; i < component_count; ++i) {
+          component_t &component = components[i];
+
+          // Subsampled components: a larger IDCT as long as that doesn't overshoot the output's resolution
+          unsigned ssize = min_ssize;
+          while (!dc_only && ssize < 8 && (max_h * min_ssize) % (component.h * ssize * 2) == 0 &&
+            (max_v * min_ssize) % (component.v * ssize * 2) == 0)
+            ssize *= 2;
+
+          component.ssize = (uint8_t) ssize;
+          component.blocks_w = mcus_x * component.h;
+          component.blocks_h = mcus_y * component.v;
+          component.used_w = ((width * component.h + max_h - 1) / max_h + 7) / 8;
+          component.used_h = ((height * component.v + max_v - 1) / max_v + 7) / 8;
+          component.width = (uint32_t) (((uint64_t) width * component.h * ssize + max_h * 8u - 1) / (max_h * 8u));
+          component.height = (uint32_t) (((uint64_t) height * component.v * ssize + max_v * 8u - 1) / (max_v * 8u));
+          component.latched = false;
+          component.stride = (size_t) component.blocks_w * ssize;
+
+          const uint64_t blocks = (uint64_t) component.blocks_w * component.blocks_h;
+
+          if (dc_only) {
+            component.plane.clear();
+            component.coefficients.clear();
+            component.dcs.assign((size_t) blocks, 0);
+          }
+          else if (coefficients_only) {
+            component.plane.clear();
+            component.dcs.clear();
+            component.coefficients.assign((size_t) (blocks * 64), 0);
+          }
+          else {
+            component.plane.assign((size_t) (component.stride * component.blocks_h * ssize), 0);
+            component.dcs.clear();
+
+            if (progressive)
+              component.coefficients.assign((size_t) (blocks * 64), 0);
+            else
+              component.coefficients.clear();
+          }
+
+          // jdsample.c's choice of upsampler
+          const unsigned h_in = component.h * ssize / min_ssize, v_in = component.v * ssize / min_ssize;
+          const bool fancy = min_ssize > 1 && component.width > 2;
+
+          if (h_in == max_h && v_in == max_v)
+            component.upsampling = detail::fullsize;
+          else if (h_in * 2 == max_h && v_in == max_v)
+            component.upsampling = fancy ? detail::h2v1_fancy : detail::h2v1;
+          else if (h_in * 2 == max_h && v_in * 2 == max_v)
+            component.upsampling = fancy ? detail::h2v2_fancy : detail::h2v2;
+          else if (h_in == max_h && v_in * 2 == max_v && min_ssize > 1)
+            component.upsampling = detail::h1v2_fancy;
+          else if (max_h % h_in == 0 && max_v % v_in == 0)
+            component.upsampling = detail::generic;
+          else
+            return error_t::InvalidJPG;
+        }
+
+        frame = true;
+        return error_t::None;
+      }
+
+      error_t decoder_t::read_huffman(const uint8_t *p, size_t length)
+      {
+        while (length >= 17) {
+          const uint8_t tc = p[0] >> 4, th = p[0] & 15;
+          if (tc > 1 || th > 3)
+            return error_t::InvalidJPG;
+
+          size_t total = 0;
+          for (int i = 0; i < 16; ++i)
+            total += p[1 + i];
+
+          if (total > 256 || length < 17 + total)
+            return error_t::InvalidJPG;
+
+          huffman_t &table = tc == 0 ? dc_tables[th] : ac_tables[th];
+          std::memcpy(table.values, p + 17, total);
+
+          // Canonical codes, shortest first
+          size_t k = 0;
+          for (int i = 0; i < 16; ++i) {
+            for (int j = 0; j < p[1 + i]; ++j)
+              table.size[k++] = (uint8_t) (i + 1);
+          }
+          table.size[k] = 0;
+
+          uint32_t code = 0;
+          k = 0;
+          for (int j = 1; j <= 16; ++j) {
+            table.delta[j] = (int) k - (int) code;
+
+            while (table.size[k] == j)
+              table.code[k++] = (uint16_t) code++;
+
+            if (code > (1u << j))
+              return error_t::InvalidJPG;
+
+            table.maxcode[j] = code << (16 - j);
+            code <<= 1;
+          }
+          table.maxcode[17] = 0xFFFFFFFFu;
+
+          std::memset(table.fast, 255, sizeof table.fast);
+          for (size_t i = 0; i < k; ++i) {
+            const int size = table.size[i];
+            if (size <= fast_bits) {
+              const int first = table.code[i] << (fast_bits - size);
+              std::memset(table.fast + first, (int) i, (size_t) 1 << (fast_bits - size));
+            }
+          }
+
+          // Whole AC coefficients: run/size symbol plus its extra bits, both within the lookahead
+          for (int i = 0; i < (1 << fast_bits); ++i) {
+            table.fast_ac[i] = 0;
+
+            const uint8_t index = table.fast[i];
+            if (tc == 0 || index == 255)
+              continue;
+
+            const int rs = table.values[index];
+            const int run = rs >> 4, magnitude = rs & 15, size = table.size[index];
+
+            if (magnitude != 0 && size + magnitude <= fast_bits) {
+              int value = ((i << size) & ((1 << fast_bits) - 1)) >> (fast_bits - magnitude);
+              if (value < (1 << (magnitude - 1)))
+                value += 1 - (1 << magnitude);
+
+              if (value >= -128 && value <= 127)
+                table.fast_ac[i] = (int16_t) (value * 256 + run * 16 + size + magnitude);
+            }
+          }
+
+          table.defined = true;
+
+          p += 17 + total;
+          length -= 17 + total;
+        }
+
+        return length == 0 ? error_t::None : error_t::InvalidJPG;
+      }
+
+      error_t decoder_t::read_quantization(const uint8_t *p, size_t length)
+      {
+        while (length >= 65) {
+          const uint8_t pq = p[0] >> 4, tq = p[0] & 15;
+          const size_t size = pq != 0 ? 129 : 65;
+
+          if (pq > 1 || tq > 3 || length < size)
+            return error_t::InvalidJPG;
+
+          for (int i = 0; i < 64; ++i) {
+            quantization[tq][detail::natural_order[i]] =
+              pq != 0 ? (uint16_t) ((p[1 + i * 2] << 8) | p[2 + i * 2]) : p[1 + i];
+          }
+
+          quantization_defined[tq] = true;
+
+          p += size;
+          length -= size;
+        }
+
+        return length == 0 ? error_t::None : error_t::InvalidJPG;
+      }
+
+      decoder_t::cursor_t::cursor_t(const uint8_t *p, const uint8_t *end, uint32_t restart_interval)
+        : bits{ p, end, 0, 0, 0, false }, dc{}, eobrun(0), todo(restart_interval), insufficient(false)
+      {
+      }
+
+      void decoder_t::restart(cursor_t &cursor)
+      {
+        bits_t &bits = cursor.bits;
+
+        // Where the reader stopped, or a little further when it hadn't got to the marker yet
+        const uint8_t *p = bits.marker ? bits.p : find_marker(bits.p, bits.end);
+
+        while (p + 1 < bits.end && p[0] == 0xFF && p[1] == 0xFF)
+          ++p;
+
+        // Anything but RSTn (e.g. EOI of a truncated file) is left for the reader to run into again
+        const bool found = p + 1 < bits.end && p[1] >= 0xD0 && p[1] <= 0xD7;
+        if (found)
+          p += 2;
+
+        bits.p = p;
+        bits.buffer = 0;
+        bits.count = 0;
+        bits.padding = 0;
+        bits.marker = false;
+
+        std::fill(std::begin(cursor.dc), std::end(cursor.dc), 0);
+        cursor.eobrun = 0;
+        cursor.insufficient = cursor.insufficient && !found;
+      }
+
+      bool decoder_t::decode_block(cursor_t &cursor, uint8_t index, int16_t *block)
+      {
+        bits_t &bits = cursor.bits;
+        const component_t &component = *scan[index];
+        const huffman_t &dc = dc_tables[component.td];
+        const huffman_t &ac = ac_tables[component.ta];
+
+        std::memset(block, 0, sizeof(int16_t) * 64);
+
+        const int t = bits.decode(dc);
+        if (t < 0 || t > 11)
+          return false;
+
+        cursor.dc[index] += bits.extend(t);
+        block[0] = (int16_t) cursor.dc[index];
+
+        int k = 1;
+        do {
+          if (bits.count < 16)
+            bits.fill();
+
+          const int fast = ac.fast_ac[bits.buffer >> (64 - fast_bits)];
+          if (fast != 0) {
+            k += (fast >> 4) & 15;
+            const int consumed = fast & 15;
+            bits.buffer <<= consumed;
+            bits.count -= consumed;
+            block[detail::natural_order[k++]] = (int16_t) (fast >> 8);
+            continue;
+          }
+
+          const int rs = bits.decode(ac);
+          if (rs < 0)
+            return false;
+
+          const int s = rs & 15, r = rs >> 4;
+          if (s == 0) {
+            if (rs != 0xF0) // EOB
+              break;
+
+            k += 16;
+          }
+          else {
+            k += r;
+            block[detail::natural_order[k++]] = (int16_t) bits.extend(s);
+          }
+        } while (k < 64);
+
+        return true;
+      }
+
+      // decode_block() minus the AC coefficients: their codes and extra bits get consumed, nothing more.
+      bool decoder_t::skip_block(cursor_t &cursor, uint8_t index, int16_t *dc)
+      {
+        bits_t &bits = cursor.bits;
+        const component_t &component = *scan[index];
+        const huffman_t &ac = ac_tables[component.ta];
+
+        const int t = bits.decode(dc_tables[component.td]);
+        if (t < 0 || t > 11)
+          return false;
+
+        cursor.dc[index] += bits.extend(t);
+        *dc = (int16_t) cursor.dc[index];
+
+        for (int k = 1; k < 64; ) {
+          if (bits.count < 16)
+            bits.fill();
+
+          const int fast = ac.fast_ac[bits.buffer >> (64 - fast_bits)];
+          if (fast != 0) {
+            k += ((fast >> 4) & 15) + 1;
+            bits.buffer <<= fast & 15;
+            bits.count -= fast & 15;
+            continue;
+          }
+
+          const int rs = bits.decode(ac);
+          if (rs < 0)
+            return false;
+
+          const int s = rs & 15, r = rs >> 4;
+          if (s == 0) {
+            if (rs != 0xF0) // EOB
+              break;
+
+            k += 16;
+          }
+          else {
+            k += r + 1;
+            bits.get(s);
+          }
+        }
+
+        return true;
+      }
+
+      // Spectral selection (ss..se) and successive approximation (ah, al), G.1.2
+      bool decoder_t::decode_block_progressive(cursor_t &cursor, uint8_t index, int16_t *block)
+      {
+        bits_t &bits = cursor.bits;
+        const component_t &component = *scan[index];
+        uint32_t &eobrun = cursor.eobrun;
+
+        if (ss == 0) {
+          if (ah == 0) {
+            const int t = bits.decode(dc_tables[component.td]);
+            if (t < 0 || t > 11)
+              return false;
+
+            cursor.dc[index] += bits.extend(t);
+            block[0] = (int16_t) (cursor.dc[index] * (1 << al));
+          }
+          else if (bits.get(1))
+            block[0] = (int16_t) (block[0] | (1 << al));
+
+          return true;
+        }
+
+        const huffman_t &ac = ac_tables[component.ta];
+
+        if (ah == 0) {
+          if (eobrun != 0) {
+            --eobrun;
+            return true;
+          }
+
+          for (int k = ss; k <= se; ) {
+            const int rs = bits.decode(ac);
+            if (rs < 0)
+              return false;
+
+            const int s = rs & 15, r = rs >> 4;
+            if (s == 0) {
+              if (r < 15) {
+                eobrun = (1u << r) - 1;
+                if (r != 0)
+                  eobrun += bits.get(r);
+                break;
+              }
+
+              k += 16;
+            }
+            else {
+              k += r;
+              block[detail::natural_order[k++]] = (int16_t) (bits.extend(s) * (1 << al));
+            }
+          }
+
+          return true;
+        }
+
+        // Refinement: one more bit of every coefficient already nonzero, newly nonzero ones placed along the way
+        const int bit = 1 << al;
+        int k = ss;
+
+        const auto refine = [&] (int16_t *coefficient) {
+          if (bits.get(1) && (*coefficient & bit) == 0)
+            *coefficient = (int16_t) (*coefficient + (*coefficient > 0 ? bit : -bit));
+        };
+
+        if (eobrun == 0) {
+          for (; k <= se; ) {
+            const int rs = bits.decode(ac);
+            if (rs < 0)
+              return false;
+
+            int s = rs & 15, r = rs >> 4;
+            if (s == 0) {
+              if (r < 15) {
+                eobrun = 1u << r;
+                if (r != 0)
+                  eobrun += bits.get(r);
+                break; // The rest of the block is refined below, as part of the run
+              }
+              // ZRL: 16 zeros, nothing placed
+            }
+            else {
+              if (s != 1)
+                return false;
+
+              s = bits.get(1) ? bit : -bit;
+            }
+
+            for (; k <= se; ++k) {
+              int16_t *coefficient = &block[detail::natural_order[k]];
+              if (*coefficient != 0)
+                refine(coefficient);
+              else if (r-- == 0) {
+                if (s != 0)
+                  *coefficient = (int16_t) s;
+                ++k;
+                break;
+              }
+            }
+          }
+        }
+
+        if (eobrun != 0) {
+          for (; k <= se; ++k) {
+            int16_t *coefficient = &block[detail::natural_order[k]];
+            if (*coefficient != 0)
+              refine(coefficient);
+          }
+
+          --eobrun;
+        }
+
+        return true;
+      }
+
+      void decoder_t::transform(component_t &component, const int16_t *block, uint32_t bx, uint32_t by)
+      {
+        uint8_t *out = component.plane.data() + (size_t) by * component.ssize * component.stride +
+          (size_t) bx * component.ssize;
+
+        switch (component.ssize) {
+          case 8: detail::idct_8x8(block, component.q, out, component.stride); break;
+          case 4: detail::idct_4x4(block, component.q, out, component.stride); break;
+          case 2: detail::idct_2x2(block, component.q, out, component.stride); break;
+          default: detail::idct_1x1(block, component.q, out, component.stride); break;
+        }
+      }
+
+      error_t decoder_t::read_scan(const uint8_t *p, size_t length, const uint8_t *data, const uint8_t *end,
+        const uint8_t **next, scoped_file *file)
+      {
+        if (!frame || length < 1)
+          return error_t::InvalidJPG;
+
+        scan_count = p[0];
+        if (scan_count == 0 || scan_count > component_count || length < 4 + (size_t) scan_count * 2)
+          return error_t::InvalidJPG;
+
+        for (uint8_t i = 0; i < scan_count; ++i) {
+          const uint8_t id = p[1 + i * 2], tables = p[2 + i * 2];
+
+          scan[i] = nullptr;
+          for (uint8_t j = 0; j < component_count; ++j) {
+            if (components[j].id == id)
+              scan[i] = &components[j];
+          }
+
+          if (scan[i] == nullptr)
+            return error_t::InvalidJPG;
+
+          scan[i]->td = (tables >> 4) & 3;
+          scan[i]->ta = tables & 3;
+        }
+
+        const uint8_t *parameters = p + 1 + scan_count * 2;
+        ss = parameters[0];
+        se = parameters[1];
+        ah = parameters[2] >> 4;
+        al = parameters[2] & 15;
+
+        if (progressive) {
+          if (ss > 63 || se > 63 || ss > se || (ss == 0 && se != 0) || (ss != 0 && scan_count != 1) || al > 13)
+            return error_t::InvalidJPG;
+        }
+        else {
+          ss = 0;
+          se = 63;
+          ah = al = 0;
+        }
+
+        // Tables have to be there by now; quantization ones get latched on a component's first scan
+        for (uint8_t i = 0; i < scan_count; ++i) {
+          component_t &component = *scan[i];
+          const bool dc = ss == 0 && ah == 0, ac = se != 0 || !progressive;
+
+          if ((dc && !dc_tables[component.td].defined) || (ac && !ac_tables[component.ta].defined))
+            return error_t::InvalidJPG;
+
+          if (!component.latched) {
+            if (!quantization_defined[component.tq])
+              return error_t::InvalidJPG;
+
+            std::memcpy(component.q, quantization[component.tq], sizeof component.q);
+            component.latched = true;
+          }
+
+        }
+
+        // 1/8 scale: AC scans don't change a thing
+        if (progressive && ss != 0 && scan[0]->ssize == 1) {
+          *next = detail::skip_entropy_coded(data, end);
+          return error_t::None;
+        }
+
+        // MCUs of the scan; non-interleaved ones are a block each, only those covering the image
+        const uint64_t mcus = scan_count == 1 ? (uint64_t) scan[0]->used_w * scan[0]->used_h : (uint64_t) mcus_x * mcus_y;
+
+        if (!progressive && restart_interval != 0 && thread_count > 1 && decode_parallel(data, end, mcus, next))
+          return file != nullptr && file->exceeded() ? error_t::BudgetExceeded : error_t::None;
+
+        cursor_t cursor(data, end, restart_interval);
+
+        const error_t error = decode_mcus(cursor, 0, mcus, file);
+        if (error != error_t::None)
+          return error;
+
+        *next = detail::skip_entropy_coded(cursor.bits.p, end);
+        return error_t::None;
+      }
+
+      // MCUs first to last (excluded) of the scan, the cursor being where first starts.
+      error_t decoder_t::decode_mcus(cursor_t &cursor, uint64_t first, uint64_t last, scoped_file *file)
+      {
+        int16_t local[64];
+
+        const auto process = [&] (uint8_t index, uint32_t bx, uint32_t by) {
+          component_t &component = *scan[index];
+
+          if (dc_only) {
+            // Only ever DC scans when progressive, AC ones get skipped at 1/8
+            int16_t *dc = component.dcs.data() + (size_t) by * component.blocks_w + bx;
+            return cursor.insufficient || (progressive ? decode_block_progressive(cursor, index, dc) :
+              skip_block(cursor, index, dc));
+          }
+
+          if (!progressive && !coefficients_only) {
+            if (cursor.insufficient)
+              std::memset(local, 0, sizeof local);
+            else if (!decode_block(cursor, index, local))
+              return false;
+
+            transform(component, local, bx, by);
+            return true;
+          }
+
+          int16_t *block = component.coefficients.data() + ((size_t) by * component.blocks_w + bx) * 64;
+          if (!progressive)
+            return cursor.insufficient || decode_block(cursor, index, block);
+
+          return cursor.insufficient || decode_block_progressive(cursor, index, block);
+        };
+
+        const uint32_t row = scan_count == 1 ? scan[0]->used_w : mcus_x;
+
+        for (uint64_t mcu = first; mcu < last; ++mcu) {
+          cursor.insufficient = cursor.insufficient || cursor.bits.exhausted();
+
+          if (restart_interval != 0) {
+            if (cursor.todo == 0) {
+              restart(cursor);
+              cursor.todo = restart_interval;
+            }
+
+            --cursor.todo;
+          }
+
+          const uint32_t mx = (uint32_t) (mcu % row), my = (uint32_t) (mcu / row);
+          bool valid = true;
+
+          if (scan_count == 1)
+            valid = process(0, mx, my);
+          else {
+            for (uint8_t i = 0; i < scan_count && valid; ++i) {
+              const component_t &component = *scan[i];
+
+              for (uint32_t y = 0; y < component.v && valid; ++y) {
+                for (uint32_t x = 0; x < component.h && valid; ++x)
+                  valid = process(i, mx * component.h + x, my * component.v + y);
+              }
+            }
+          }
+
+          if (!valid)
+            return error_t::InvalidJPG;
+
+          if (mx + 1 == row && file != nullptr && file->exceeded())
+            return error_t::BudgetExceeded;
+        }
+
+        return error_t::None;
+      }
+
+      // Restart intervals handed out to threads in contiguous runs. False when the markers aren't all there in
+      // sequence or an interval doesn't decode (truncated or corrupt data): a single cursor then goes through the scan
+      // again, resyncing as it goes.
+      bool decoder_t::decode_parallel(const uint8_t *data, const uint8_t *end, uint64_t mcus, const uint8_t **next)
+      {
+        const uint64_t intervals = (mcus + restart_interval - 1) / restart_interval;
+        if (intervals < 2)
+          return false;
+
+        std::vector<const uint8_t *> starts;
+        starts.reserve((size_t) intervals);
+        starts.push_back(data);
+
+        for (const uint8_t *p = data; starts.size() < intervals; ) {
+          p = find_marker(p, end);
+          if (p == end || p[1] != 0xD0 + ((starts.size() - 1) & 7))
+            return false;
+
+          p += 2;
+          starts.push_back(p);
+        }
+
+        const size_t workers = (size_t) std::min<uint64_t>(thread_count, intervals);
+        std::vector<std::thread> pool;
+        std::vector<error_t> errors(workers, error_t::None);
+
+        for (size_t w = 0; w < workers; ++w) {
+          const uint64_t first = intervals * w / workers, last = intervals * (w + 1) / workers;
+
+          pool.emplace_back([this, &starts, &errors, end, mcus, w, first, last] {
+            cursor_t cursor(starts[(size_t) first], end, restart_interval);
+            errors[w] = decode_mcus(cursor, first * restart_interval, std::min(mcus, last * restart_interval), nullptr);
+          });
+        }
+
+        for (auto &thread : pool)
+          thread.join();
+
+        // Past the last interval
+        *next = detail::skip_entropy_coded(starts.back(), end);
+
+        return std::all_of(errors.begin(), errors.end(), [] (error_t error) { return error == error_t::None; });
+      }
+
+      const uint8_t *decoder_t::get_row(component_t &component, uint32_t y, uint8_t *buffer)
+      {
+        const uint8_t *plane = component.plane.data();
+        const size_t stride = component.stride;
+        const uint32_t last = component.height - 1;
+
+        switch (component.upsampling) {
+          case detail::fullsize:
+            return plane + (size_t) y * stride;
+          case detail::h2v1_fancy:
+            detail::upsample_h2v1_fancy(plane + (size_t) y * stride, component.width, buffer);
+            return buffer;
+          case detail::h2v2_fancy: {
+            const uint32_t near = y / 2;
+            const uint32_t far = (y & 1) ? std::min(near + 1, last) : (near == 0 ? 0 : near - 1);
+            detail::upsample_h2v2_fancy(plane + (size_t) near * stride, plane + (size_t) far * stride,
+              component.width, buffer);
+            return buffer;
+          }
+          case detail::h1v2_fancy: {
+            const uint32_t near = y / 2;
+            const uint32_t far = (y & 1) ? std::min(near + 1, last) : (near == 0 ? 0 : near - 1);
+            detail::upsample_h1v2_fancy(plane + (size_t) near * stride, plane + (size_t) far * stride,
+              component.width, buffer, (y & 1) ? 2 : 1);
+            return buffer;
+          }
+          default: {
+            // Plain replication
+            const unsigned h_factor = max_h * min_ssize / (component.h * component.ssize);
+            const unsigned v_factor = max_v * min_ssize / (component.v * component.ssize);
+            const uint8_t *row = plane + (size_t) (y / v_factor) * stride;
+
+            for (uint32_t x = 0; x < component.width; ++x)
+              std::memset(buffer + (size_t) x * h_factor, row[x], h_factor);
+
+            return buffer;
+          }
+        }
+      }
+
+      // 3 components: YCbCr unless said otherwise (jdapimin.c's guesswork), 4: CMYK or YCCK
+      bool decoder_t::is_ycc() const
+      {
+        if (component_count == 3) {
+          const bool rgb_ids = components[0].id == 'R' && components[1].id == 'G' && components[2].id == 'B';
+          return jfif || (adobe >= 0 ? adobe != 0 : !rgb_ids);
+        }
+
+        return component_count == 4 && adobe == 2;
+      }
+
+      // Blocks handed over as they are, tables turned back into DHT's terms
+      error_t decoder_t::output(coefficients_t *coefficients)
+      {
+        const auto get_spec = [] (const huffman_t &table, huffman_spec_t *spec) {
+          *spec = huffman_spec_t();
+          spec->defined = table.defined;
+          if (!table.defined)
+            return;
+
+          for (size_t k = 0; table.size[k] != 0; ++k) {
+            spec->counts[table.size[k] - 1] += 1;
+            spec->symbols[k] = table.values[k];
+          }
+        };
+
+        coefficients->width = width;
+        coefficients->height = height;
+        coefficients->max_h = max_h;
+        coefficients->max_v = max_v;
+        coefficients->progressive = progressive;
+
+        for (int i = 0; i < 4; ++i) {
+          get_spec(dc_tables[i], &coefficients->dc_tables[i]);
+          get_spec(ac_tables[i], &coefficients->ac_tables[i]);
+        }
+
+        coefficients->components.resize(component_count);
+        for (uint8_t i = 0; i < component_count; ++i) {
+          component_t &component = components[i];
+          coefficient_plane_t &plane = coefficients->components[i];
+
+          // Never scanned: no quantization table to go with it
+          if (!component.latched)
+            return error_t::InvalidJPG;
+
+          plane.id = component.id;
+          plane.h = component.h;
+          plane.v = component.v;
+          plane.tq = component.tq;
+          plane.td = component.td;
+          plane.ta = component.ta;
+          std::memcpy(plane.q, component.q, sizeof plane.q);
+          plane.blocks_w = component.blocks_w;
+          plane.blocks_h = component.blocks_h;
+          plane.used_w = component.used_w;
+          plane.used_h = component.used_h;
+          // Traded rather than moved: a decoder and a coefficients_t kept across files keep reusing the same buffers
+          plane.blocks.swap(component.coefficients);
+        }
+
+        return error_t::None;
+      }
+
+      // A block's mean sample is DC * Q0 / 8 + 128 (A.3.3), the level shift included.
+      error_t decoder_t::output(dc_grid_t *grid)
+      {
+        const bool ycc = is_ycc();
+        if (component_count != 1 && (component_count != 3 || (!ycc && (components[1].h != components[0].h ||
+          components[1].v != components[0].v || components[2].h != components[0].h ||
+          components[2].v != components[0].v))))
+          return error_t::InvalidRequest;
+
+        const bool rgb = component_count == 3 && !ycc;
+        const component_t &luma = components[0];
+
+        // Components never scanned stay mid-gray
+        const auto level = [] (const component_t &component, size_t b) {
+          return component.latched ? (float) (component.dcs[b] * component.q[0]) / 8.0f : 0.0f;
+        };
+
+        grid->width = width;
+        grid->height = height;
+        grid->columns = luma.used_w;
+        grid->rows = luma.used_h;
+        grid->cell_width = 8 * max_h / luma.h;
+        grid->cell_height = 8 * max_v / luma.v;
+        grid->luma.resize((size_t) grid->columns * grid->rows);
+
+        for (uint32_t by = 0; by < grid->rows; ++by) {
+          for (uint32_t bx = 0; bx < grid->columns; ++bx) {
+            const size_t b = (size_t) by * luma.blocks_w + bx;
+            float value = level(luma, b);
+
+            // Same sampling for all three, so the blocks line up
+            if (rgb)
+              value = 0.299f * value + 0.587f * level(components[1], b) + 0.114f * level(components[2], b);
+
+            grid->luma[(size_t) by * grid->columns + bx] = value + 128.0f;
+          }
+        }
+
+        return error_t::None;
+      }
+
+      error_t decoder_t::output(image_t *image)
+      {
+        // Progressive images only go through the IDCT once every scan is in
+        if (progressive) {
+          for (uint8_t i = 0; i < component_count; ++i) {
+            component_t &component = components[i];
+            if (!component.latched)
+              continue;
+
+            for (uint32_t by = 0; by < component.used_h; ++by) {
+              for (uint32_t bx = 0; bx < component.used_w; ++bx)
+                transform(component, component.coefficients.data() + ((size_t) by * component.blocks_w + bx) * 64,
+                  bx, by);
+            }
+          }
+        }
+
+        const uint32_t out_width = (width + 8 / min_ssize - 1) / (8 / min_ssize);
+        const uint32_t out_height = (height + 8 / min_ssize - 1) / (8 / min_ssize);
+
+        if (component_count != 1 && component_count != 3 && component_count != 4)
+          return error_t::InvalidJPG;
+
+        const bool ycc = is_ycc();
+
+        image->width = out_width;
+        image->height = out_height;
+        image->channels = component_count == 1 ? 1 : (component_count == 3 ? 3 : 4);
+        image->pixels.resize((size_t) out_width * out_height * image->channels);
+
+        std::vector<uint8_t> buffers((size_t) component_count * (out_width + 64) * 4);
+        const uint8_t *rows[4];
+
+        const detail::ycc_tables_t &tables = detail::get_ycc_tables();
+
+        for (uint32_t y = 0; y < out_height; ++y) {
+          for (uint8_t i = 0; i < component_count; ++i)
+            rows[i] = get_row(components[i], y, buffers.data() + (size_t) i * (out_width + 64) * 4);
+
+          uint8_t *out = image->pixels.data() + (size_t) y * out_width * image->channels;
+
+          if (component_count == 1)
+            std::memcpy(out, rows[0], out_width);
+          else if (!ycc) {
+            for (uint32_t x = 0; x < out_width; ++x) {
+              for (uint8_t i = 0; i < component_count; ++i)
+                *out++ = rows[i][x];
+            }
+          }
+          else if (component_count == 3) {
+            const uint8_t *luma = rows[0], *cb = rows[1], *cr = rows[2];
+
+            for (uint32_t x = 0; x < out_width; ++x, out += 3) {
+              out[0] = detail::clamp(luma[x] + tables.cr_r[cr[x]]);
+              out[1] = detail::clamp(luma[x] + ((tables.cb_g[cb[x]] + tables.cr_g[cr[x]]) >> 16));
+              out[2] = detail::clamp(luma[x] + tables.cb_b[cb[x]]);
+            }
+          }
+          else {
+            const uint8_t *luma = rows[0], *cb = rows[1], *cr = rows[2];
+
+            // YCCK: inverted RGB, K passes through
+            for (uint32_t x = 0; x < out_width; ++x, out += 4) {
+              out[0] = detail::clamp(255 - (luma[x] + tables.cr_r[cr[x]]));
+              out[1] = detail::clamp(255 - (luma[x] + ((tables.cb_g[cb[x]] + tables.cr_g[cr[x]]) >> 16)));
+              out[2] = detail::clamp(255 - (luma[x] + tables.cb_b[cb[x]]));
+              out[3] = rows[3][x];
+            }
+          }
+        }
+
+        return error_t::None;
+      }
+    } // namespace jpg
+  } // namespace image
+} // namespace doors
+
+#endif
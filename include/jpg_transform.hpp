@@ -0,0 +1,799 @@
+#if !defined(__IMAGE_JPG_TRANSFORM_DETAIL__)
+#define __IMAGE_JPG_TRANSFORM_DETAIL__
+
+// Lossless JPEG transforms: rotations by 90, 180 and 270 degrees, flips, transpositions and crops, carried out on the
+// quantized DCT coefficients (decoder_t::decode_coefficients(), see jpg_decode.hpp) and entropy-coded again. Nothing
+// goes through an IDCT or an FDCT, so there's no generation loss, and it takes a fraction of a decode and re-encode.
+//
+// Blocks move around the grid as the pixels would. Within a block, transposing swaps the coefficients' horizontal
+// and vertical frequencies, and mirroring negates the odd frequencies along that axis (their cosines are
+// antisymmetric over the block). That is exact on whole blocks, hence on whole MCUs: an edge the transform brings to
+// the top or the left has to fall on an MCU boundary, otherwise its partial MCU gets trimmed off (jpegtran's -trim)
+// or the request is turned down. Crops are taken once transformed, their top left corner rounded down to an MCU
+// boundary (jpegtran's -crop does the same); their right and bottom edges are free.
+//
+// The output is a sequential file with a single interleaved scan, baseline whenever its tables allow. Sequential
+// inputs keep their Huffman tables unless one of them lacks a code the transformed blocks need (transposing changes
+// the zigzag runs); that table, or every table for progressive inputs or when asked to, gets built off the symbol
+// frequencies instead (K.2, libjpeg's jpeg_gen_optimal_table()). Quantization tables stay the original ones,
+// transposed along with the blocks.
+// APPn and COM segments are carried over as they are, EXIF orientation reset to 1 on request.
+//
+// The definitions need jpg_decode.hpp's (IMAGE_JPG_DECODE_DETAIL) and exif.hpp's in the same build.
+//
+// Pending issue(s):
+//   EXIF thumbnails aren't transformed along
+//   No restart intervals and no progressive output
+//   Testing
+
+#include <cstdint>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#include <exif.hpp>
+#include <jpg_decode.hpp>
+
+namespace doors {
+  namespace image {
+    namespace jpg {
+      // As EXIF names them: transpose mirrors across the top-left to bottom-right diagonal, transverse across the
+      // other one. Rotations are clockwise.
+      enum class transform_t : uint8_t {
+        none,
+        flip_horizontal,
+        flip_vertical,
+        transpose,
+        transverse,
+        rotate_90,
+        rotate_180,
+        rotate_270
+      };
+
+      struct transform_options_t {
+        transform_t transform = transform_t::none;
+        uint32_t crop_x = 0;            // Of the transformed image, rounded down to an MCU boundary
+        uint32_t crop_y = 0;
+        uint32_t crop_width = 0;        // 0: up to the edge
+        uint32_t crop_height = 0;
+        bool trim = true;               // Partial MCUs an edge transform can't move dropped, InvalidRequest otherwise
+        bool optimize = false;          // Huffman tables built for the output even where the original ones would do
+        bool metadata = true;           // APPn and COM segments carried over
+        bool reset_orientation = false; // EXIF orientation set to 1, along with get_transform()'s transform
+      };
+
+      // What displays an image stored with that EXIF orientation (1-8) upright; none for anything else.
+      transform_t get_transform(uint16_t orientation);
+
+      // EXIF orientation of a JPEG file in memory, 1 (as stored) when it has none.
+      uint16_t get_orientation(const uint8_t *data, size_t size);
+
+      // Worth keeping across files, as decoder_t is: its buffers get reused
+      class transformer_t {
+      public:
+        // The transformed file into `out`. `threads` as decoder_t::decode() takes them.
+        error_t transform(scoped_file &file, const transform_options_t &options, std::vector<uint8_t> *out,
+          size_t threads = 1);
+        error_t transform(const uint8_t *data, size_t size, const transform_options_t &options,
+          std::vector<uint8_t> *out, size_t threads = 1);
+
+      private:
+        decoder_t decoder;
+        coefficients_t coefficients;
+        std::vector<uint32_t> symbols; // Recorded by the first pass over the blocks, coded by the second one
+        std::vector<uint8_t> contents;
+      };
+    } // namespace jpg
+  } // namespace image
+} // namespace doors
+
+#endif
+
+#ifdef IMAGE_JPG_TRANSFORM_DETAIL
+#undef IMAGE_JPG_TRANSFORM_DETAIL
+
+#include <algorithm>
+#include <cstring>
+
+namespace doors {
+  namespace image {
+    namespace jpg {
+      namespace detail {
+        // Where an output block comes from: the grid gets transposed first, then mirrored
+        struct block_map_t {
+          bool transposed;
+          bool flip_x;
+          bool flip_y;
+        };
+
+        static block_map_t get_block_map(transform_t transform)
+        {
+          switch (transform) {
+            case transform_t::flip_horizontal: return { false, true, false };
+            case transform_t::flip_vertical: return { false, false, true };
+            case transform_t::transpose: return { true, false, false };
+            case transform_t::transverse: return { true, true, true };
+            case transform_t::rotate_90: return { true, true, false };
+            case transform_t::rotate_180: return { false, true, true };
+            case transform_t::rotate_270: return { true, false, true };
+            default: return { false, false, false };
+          }
+        }
+
+        // A component of the output: the source's blocks, picked and reordered as they get coded
+        struct transformed_plane_t {
+          const coefficient_plane_t *component;
+          uint8_t h;
+          uint8_t v;
+          uint8_t td;
+          uint8_t ta;
+          uint32_t blocks_w;
+          uint32_t blocks_h;
+          uint32_t grid_w;  // Source blocks, transposed: whole MCUs along the mirrored axes
+          uint32_t grid_h;
+          uint32_t bx0;     // The crop's first block
+          uint32_t by0;
+        };
+
+        // Per symbol, size 0 when the table has no code for it
+        struct encoder_table_t {
+          uint16_t code[256];
+          uint8_t size[256];
+        };
+
+        // False for a table decoders turn down (libjpeg's jpeg_make_d_derived_tbl() does): more codes than their
+        // lengths leave room for, or DC symbols past 15.
+        static bool get_codes(const huffman_spec_t &spec, bool dc, encoder_table_t *table)
+        {
+          std::memset(table->size, 0, sizeof table->size);
+
+          uint32_t code = 0;
+          size_t k = 0;
+          for (int length = 1; length <= 16; ++length) {
+            for (int i = 0; i < spec.counts[length - 1]; ++i, ++k) {
+              if (k >= 256 || code >= (1u << length) || (dc && spec.symbols[k] > 15))
+                return false;
+
+              table->code[spec.symbols[k]] = (uint16_t) code++;
+              table->size[spec.symbols[k]] = (uint8_t) length;
+            }
+
+            code <<= 1;
+          }
+
+          return true;
+        }
+
+        // K.2: Huffman's procedure with an extra symbol of frequency 1 holding the all-ones code point, then code
+        // lengths brought down to 16 bits (K.3).
+        static void get_optimal_spec(const uint32_t *frequencies, huffman_spec_t *spec)
+        {
+          int64_t frequency[257];
+          int size[257] = {0};
+          int others[257];
+
+          for (int i = 0; i < 256; ++i)
+            frequency[i] = frequencies[i];
+          frequency[256] = 1;
+          std::fill(std::begin(others), std::end(others), -1);
+
+          for (;;) {
+            // The two least frequent, the higher symbol winning ties (the reserved one gets the longest code)
+            int c1 = -1, c2 = -1;
+            for (int i = 0; i <= 256; ++i) {
+              if (frequency[i] != 0 && (c1 < 0 || frequency[i] <= frequency[c1]))
+                c1 = i;
+            }
+            for (int i = 0; i <= 256; ++i) {
+              if (frequency[i] != 0 && i != c1 && (c2 < 0 || frequency[i] <= frequency[c2]))
+                c2 = i;
+            }
+
+            if (c2 < 0)
+              break;
+
+            frequency[c1] += frequency[c2];
+            frequency[c2] = 0;
+
+            for (size[c1] += 1; others[c1] >= 0; size[c1] += 1)
+              c1 = others[c1];
+            others[c1] = c2;
+            for (size[c2] += 1; others[c2] >= 0; size[c2] += 1)
+              c2 = others[c2];
+          }
+
+          int counts[258] = {0};
+          for (int i = 0; i <= 256; ++i) {
+            if (size[i] != 0)
+              counts[size[i]] += 1;
+          }
+
+          // Two codes off a length too long, one of them moving a level up, the other one joining a shorter prefix
+          for (int length = 257; length > 16; --length) {
+            while (counts[length] > 0) {
+              int j = length - 2;
+              while (j > 0 && counts[j] == 0)
+                --j;
+
+              counts[length] -= 2;
+              counts[length - 1] += 1;
+              counts[j + 1] += 2;
+              counts[j] -= 1;
+            }
+          }
+
+          int longest = 16;
+          while (longest > 0 && counts[longest] == 0)
+            --longest;
+          counts[longest] -= 1;
+
+          *spec = huffman_spec_t();
+          spec->defined = true;
+          for (int length = 1; length <= 16; ++length)
+            spec->counts[length - 1] = (uint8_t) counts[length];
+
+          // Shortest codes to the most frequent symbols, as sized before the limiting
+          size_t k = 0;
+          for (int length = 1; length <= 256; ++length) {
+            for (int i = 0; i < 256; ++i) {
+              if (size[i] == length)
+                spec->symbols[k++] = (uint8_t) i;
+            }
+          }
+        }
+
+        // Bits of a value's magnitude category (F.1.2.1), 0 for 0
+        static inline int get_category(int value)
+        {
+          const uint64_t magnitude = (uint64_t) (value < 0 ? -value : value);
+          return magnitude != 0 ? 64 - (int) __CLZ64(magnitude) : 0;
+        }
+
+        // Symbols as recorded for the second pass: table (DC 0-3, AC 4-7), symbol, count of extra bits, extra bits
+        static inline uint32_t pack_symbol(int table, int symbol, int count, int bits)
+        {
+          return (uint32_t) table << 28 | (uint32_t) symbol << 20 | (uint32_t) count << 16 | ((uint32_t) bits & 0xFFFF);
+        }
+
+        // Zigzag order through a transformed block
+        struct block_order_t {
+          uint8_t source[64];   // The source coefficient (natural order) at each position
+          int8_t sign[64];      // Negated or not
+          uint8_t position[64]; // And back, the position of each source coefficient
+        };
+
+        // A block's nonzero coefficients as bits, natural order
+        static inline uint64_t get_nonzero(const int16_t *block)
+        {
+          uint64_t mask = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+          const __m128i zero = _mm_setzero_si128();
+          for (int i = 0; i < 64; i += 16) {
+            const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + i));
+            const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + i + 8));
+            const __m128i zeros = _mm_packs_epi16(_mm_cmpeq_epi16(low, zero), _mm_cmpeq_epi16(high, zero));
+            mask |= (uint64_t) (uint16_t) ~_mm_movemask_epi8(zeros) << i;
+          }
+#else
+          for (int i = 0; i < 64; ++i)
+            mask |= (uint64_t) (block[i] != 0) << i;
+#endif
+
+          return mask;
+        }
+
+        // F.1.2: the DC difference's category, then run/size symbols, ZRL and EOB, counted and recorded. False for
+        // values 8-bit coding has no category for.
+        static bool code_block(const int16_t *block, const block_order_t &order, int dc_table, int ac_table,
+          int *prediction, uint32_t (*frequencies)[256], std::vector<uint32_t> *symbols)
+        {
+          const int difference = block[0] - *prediction;
+          *prediction = block[0];
+
+          int category = get_category(difference);
+          if (category > 11)
+            return false;
+
+          frequencies[dc_table][category] += 1;
+          symbols->push_back(pack_symbol(dc_table, category, category, difference < 0 ? difference - 1 : difference));
+
+          // Only the nonzero AC coefficients get visited, as bits by zigzag position, the first one on top: runs come
+          // off leading zero counts
+          uint64_t nonzero = 0;
+          for (uint64_t source = get_nonzero(block) & ~(uint64_t) 1; source != 0; ) {
+            const int n = 63 - (int) __CLZ64(source);
+            source ^= (uint64_t) 1 << n;
+            nonzero |= (uint64_t) 1 << (63 - order.position[n]);
+          }
+
+          int last = 0;
+          while (nonzero != 0) {
+            const int k = (int) __CLZ64(nonzero);
+            nonzero ^= (uint64_t) 1 << (63 - k);
+
+            int run = k - last - 1;
+            for (; run > 15; run -= 16) {
+              frequencies[ac_table][0xF0] += 1;
+              symbols->push_back(pack_symbol(ac_table, 0xF0, 0, 0));
+            }
+
+            const int value = block[order.source[k]] * order.sign[k];
+            category = get_category(value);
+            if (category > 10)
+              return false;
+
+            frequencies[ac_table][run << 4 | category] += 1;
+            symbols->push_back(pack_symbol(ac_table, run << 4 | category, category, value < 0 ? value - 1 : value));
+            last = k;
+          }
+
+          if (last != 63) {
+            frequencies[ac_table][0x00] += 1;
+            symbols->push_back(pack_symbol(ac_table, 0x00, 0, 0));
+          }
+
+          return true;
+        }
+
+        // Blocks in scan order: MCU by MCU when interleaved, row by row for a single component
+        static bool code_planes(const std::vector<transformed_plane_t> &planes, const block_map_t &map, uint32_t mcus_x,
+          uint32_t mcus_y, const block_order_t &order, uint32_t (*frequencies)[256], std::vector<uint32_t> *symbols)
+        {
+          static const int16_t zeros[64] = {};
+          int predictions[4] = {0};
+
+          const auto code = [&] (size_t index, uint32_t bx, uint32_t by) {
+            const transformed_plane_t &plane = planes[index];
+            const coefficient_plane_t &component = *plane.component;
+
+            const int64_t tx = (int64_t) plane.bx0 + bx, ty = (int64_t) plane.by0 + by;
+            const int64_t ux = map.flip_x ? (int64_t) plane.grid_w - 1 - tx : tx;
+            const int64_t uy = map.flip_y ? (int64_t) plane.grid_h - 1 - ty : ty;
+            const int64_t sx = map.transposed ? uy : ux, sy = map.transposed ? ux : uy;
+
+            // Padding past the source's blocks is coded as zeros
+            const int16_t *block = zeros;
+            if (sx >= 0 && sy >= 0 && sx < component.blocks_w && sy < component.blocks_h)
+              block = component.blocks.data() + ((size_t) sy * component.blocks_w + (size_t) sx) * 64;
+
+            return code_block(block, order, plane.td, 4 + plane.ta, &predictions[index], frequencies, symbols);
+          };
+
+          if (planes.size() == 1) {
+            for (uint32_t by = 0; by < planes[0].blocks_h; ++by) {
+              for (uint32_t bx = 0; bx < planes[0].blocks_w; ++bx) {
+                if (!code(0, bx, by))
+                  return false;
+              }
+            }
+
+            return true;
+          }
+
+          for (uint32_t my = 0; my < mcus_y; ++my) {
+            for (uint32_t mx = 0; mx < mcus_x; ++mx) {
+              for (size_t i = 0; i < planes.size(); ++i) {
+                for (uint32_t y = 0; y < planes[i].v; ++y) {
+                  for (uint32_t x = 0; x < planes[i].h; ++x) {
+                    if (!code(i, mx * planes[i].h + x, my * planes[i].v + y))
+                      return false;
+                  }
+                }
+              }
+            }
+          }
+
+          return true;
+        }
+
+        // Entropy-coded data: MSB first, 0xFF stuffed with a 0x00, the last byte padded with ones. A code goes in
+        // along with its extra bits, 27 bits at the most, and bits go out 32 at a time, byte by byte only when one of
+        // them needs stuffing (libjpeg-turbo's jchuff.c does the same). Room is made for a chunk of symbols at a time,
+        // every byte stuffed at worst, then written through a plain pointer.
+        static void put_symbols(const std::vector<uint32_t> &symbols, const encoder_table_t *tables,
+          std::vector<uint8_t> *out)
+        {
+          uint64_t buffer = 0;
+          int count = 0;
+
+          const auto put_byte = [] (uint8_t *&p, uint8_t byte) {
+            *p++ = byte;
+            if (byte == 0xFF)
+              *p++ = 0x00;
+          };
+
+          for (size_t i = 0; i < symbols.size(); ) {
+            const size_t end = std::min(symbols.size(), i + 4096), start = out->size();
+            out->resize(start + (end - i) * 8 + 16);
+
+            uint8_t *p = out->data() + start;
+            for (; i < end; ++i) {
+              const uint32_t symbol = symbols[i];
+              const encoder_table_t &table = tables[symbol >> 28];
+              const uint32_t value = symbol >> 20 & 0xFF, extra = symbol >> 16 & 0xF;
+
+              buffer = buffer << (table.size[value] + extra) | (uint64_t) table.code[value] << extra |
+                (symbol & ((1u << extra) - 1u));
+              count += table.size[value] + (int) extra;
+
+              if (count < 32)
+                continue;
+
+              count -= 32;
+              const uint32_t word = (uint32_t) (buffer >> count);
+
+              // Any 0xFF byte: one whose complement has a zero byte
+              if (((~word - 0x01010101u) & word & 0x80808080u) == 0) {
+                p[0] = (uint8_t) (word >> 24);
+                p[1] = (uint8_t) (word >> 16);
+                p[2] = (uint8_t) (word >> 8);
+                p[3] = (uint8_t) word;
+                p += 4;
+              }
+              else {
+                for (int shift = 24; shift >= 0; shift -= 8)
+                  put_byte(p, (uint8_t) (word >> shift));
+              }
+            }
+
+            if (i == symbols.size()) {
+              for (; count >= 8; count -= 8)
+                put_byte(p, (uint8_t) (buffer >> (count - 8)));
+
+              if (count != 0)
+                put_byte(p, (uint8_t) (buffer << (8 - count) | (0xFFu >> count)));
+            }
+
+            out->resize((size_t) (p - out->data()));
+          }
+        }
+
+        static void put_u16(std::vector<uint8_t> *out, size_t value)
+        {
+          out->push_back((uint8_t) (value >> 8));
+          out->push_back((uint8_t) value);
+        }
+
+        static void put_marker(std::vector<uint8_t> *out, uint8_t marker, size_t length)
+        {
+          out->push_back(0xFF);
+          out->push_back(marker);
+          put_u16(out, length + 2);
+        }
+
+        // APPn and COM segments ahead of the first scan, as they are
+        static void copy_metadata(const uint8_t *data, size_t size, const transform_options_t &options,
+          std::vector<uint8_t> *out)
+        {
+          for (size_t p = 2; p + 4 <= size; ) {
+            if (data[p] != 0xFF)
+              break;
+
+            const uint8_t marker = data[p + 1];
+            if (marker == 0xFF || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+              p += marker == 0xFF ? 1 : 2;
+              continue;
+            }
+
+            if (marker == 0xDA || marker == 0xD9)
+              break;
+
+            const size_t length = (size_t) ((data[p + 2] << 8) | data[p + 3]);
+            if (length < 2 || p + 2 + length > size)
+              break;
+
+            if ((marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE) {
+              const size_t start = out->size();
+              out->insert(out->end(), data + p, data + p + 2 + length);
+
+              // EXIF's orientation, a SHORT right within its IFD entry
+              if (options.reset_orientation && marker == 0xE1 && length >= 8 &&
+                std::memcmp(data + p + 4, "Exif\0", 6) == 0) {
+                uint8_t *tiff = out->data() + start + 10;
+
+                exif::reader_t reader;
+                exif::entry_t entry;
+                if (reader.open(tiff, length - 8) == error_t::None &&
+                  reader.find(exif::ifd_t::IFD0, exif::tag::orientation, &entry) &&
+                  entry.type == exif::type_t::SHORT && entry.count >= 1) {
+                  uint8_t *value = tiff + (entry.value - tiff);
+                  value[0] = reader.big_endian() ? 0 : 1;
+                  value[1] = reader.big_endian() ? 1 : 0;
+                }
+              }
+            }
+
+            p += 2 + length;
+          }
+        }
+
+        static error_t write_transformed(const uint8_t *data, size_t size, const coefficients_t &coefficients,
+          const transform_options_t &options, std::vector<uint32_t> *symbols, std::vector<uint8_t> *out)
+        {
+          const size_t count = coefficients.components.size();
+          if (count == 0 || count > 4)
+            return error_t::InvalidJPG;
+
+          // A single component is coded block by block, whatever its sampling factors say
+          const bool single = count == 1;
+          const uint32_t max_h = single ? 1 : coefficients.max_h, max_v = single ? 1 : coefficients.max_v;
+          const block_map_t map = get_block_map(options.transform);
+
+          // Edges brought to the top or the left have to be whole MCUs
+          uint32_t width = coefficients.width, height = coefficients.height;
+          const bool align_x = map.transposed ? map.flip_y : map.flip_x;
+          const bool align_y = map.transposed ? map.flip_x : map.flip_y;
+
+          if (align_x && width % (8 * max_h) != 0) {
+            if (!options.trim || width < 8 * max_h)
+              return error_t::InvalidRequest;
+
+            width -= width % (8 * max_h);
+          }
+
+          if (align_y && height % (8 * max_v) != 0) {
+            if (!options.trim || height < 8 * max_v)
+              return error_t::InvalidRequest;
+
+            height -= height % (8 * max_v);
+          }
+
+          const uint32_t full_width = map.transposed ? height : width, full_height = map.transposed ? width : height;
+          const uint32_t mcu_w = 8 * (map.transposed ? max_v : max_h), mcu_h = 8 * (map.transposed ? max_h : max_v);
+
+          const uint32_t x0 = options.crop_x - options.crop_x % mcu_w, y0 = options.crop_y - options.crop_y % mcu_h;
+          if (x0 >= full_width || y0 >= full_height)
+            return error_t::InvalidRequest;
+
+          const uint32_t out_width = options.crop_width != 0 ?
+            (uint32_t) std::min<uint64_t>((uint64_t) options.crop_width + (options.crop_x - x0), full_width - x0) :
+            full_width - x0;
+          const uint32_t out_height = options.crop_height != 0 ?
+            (uint32_t) std::min<uint64_t>((uint64_t) options.crop_height + (options.crop_y - y0), full_height - y0) :
+            full_height - y0;
+
+          const uint32_t mcus_x = (out_width + mcu_w - 1) / mcu_w, mcus_y = (out_height + mcu_h - 1) / mcu_h;
+
+          // Within a block: the source coefficient and its sign, per output coefficient
+          uint8_t source[64];
+          int8_t sign[64];
+          for (int v = 0; v < 8; ++v) {
+            for (int u = 0; u < 8; ++u) {
+              source[v * 8 + u] = (uint8_t) (map.transposed ? u * 8 + v : v * 8 + u);
+              sign[v * 8 + u] = (int8_t) (((map.flip_x && (u & 1)) != (map.flip_y && (v & 1))) ? -1 : 1);
+            }
+          }
+
+          // The same in zigzag order, as blocks get coded
+          block_order_t order;
+          for (int k = 0; k < 64; ++k) {
+            order.source[k] = source[natural_order[k]];
+            order.sign[k] = sign[natural_order[k]];
+            order.position[order.source[k]] = (uint8_t) k;
+          }
+
+          // Original Huffman tables where they'll do; otherwise luma gets tables 0, chroma (or whatever) tables 1
+          const bool original = !coefficients.progressive && !options.optimize;
+
+          std::vector<transformed_plane_t> planes(count);
+          for (size_t i = 0; i < count; ++i) {
+            const coefficient_plane_t &component = coefficients.components[i];
+            transformed_plane_t &plane = planes[i];
+
+            const uint32_t h = single ? 1 : component.h, v = single ? 1 : component.v;
+
+            plane.component = &component;
+            plane.h = (uint8_t) (map.transposed ? v : h);
+            plane.v = (uint8_t) (map.transposed ? h : v);
+            plane.td = original ? (uint8_t) (component.td & 3) : (uint8_t) (i == 0 ? 0 : 1);
+            plane.ta = original ? (uint8_t) (component.ta & 3) : (uint8_t) (i == 0 ? 0 : 1);
+            plane.blocks_w = single ? (out_width + 7) / 8 : mcus_x * plane.h;
+            plane.blocks_h = single ? (out_height + 7) / 8 : mcus_y * plane.v;
+            plane.grid_w = map.transposed ? height / (8 * max_v) * v : width / (8 * max_h) * h;
+            plane.grid_h = map.transposed ? width / (8 * max_h) * h : height / (8 * max_v) * v;
+            plane.bx0 = x0 / mcu_w * plane.h;
+            plane.by0 = y0 / mcu_h * plane.v;
+          }
+
+          // One pass over the blocks, symbols counted and recorded: whether the original tables have every code
+          // needed, the tables otherwise; then the recorded symbols only get coded
+          uint32_t frequencies[8][256] = {};
+          symbols->clear();
+
+          if (!code_planes(planes, map, mcus_x, mcus_y, order, frequencies, symbols))
+            return error_t::InvalidJPG;
+
+          // DC tables 0-3, AC tables 4-7
+          huffman_spec_t specs[8];
+          encoder_table_t tables[8];
+          bool used[8] = {};
+
+          for (const auto &plane : planes) {
+            used[plane.td] = true;
+            used[4 + plane.ta] = true;
+          }
+
+          for (int table = 0; table < 8; ++table) {
+            if (!used[table])
+              continue;
+
+            const huffman_spec_t &spec = table < 4 ? coefficients.dc_tables[table] : coefficients.ac_tables[table - 4];
+            bool complete = original && spec.defined;
+
+            if (complete) {
+              complete = get_codes(spec, table < 4, &tables[table]);
+              for (int symbol = 0; symbol < 256 && complete; ++symbol)
+                complete = frequencies[table][symbol] == 0 || tables[table].size[symbol] != 0;
+            }
+
+            if (complete)
+              specs[table] = spec;
+            else {
+              get_optimal_spec(frequencies[table], &specs[table]);
+              get_codes(specs[table], table < 4, &tables[table]);
+            }
+          }
+
+          // Quantization tables by id, the first component using each one having latched it
+          const uint16_t *quantization[4] = {};
+          bool baseline = true;
+
+          for (size_t i = 0; i < count; ++i) {
+            const uint8_t tq = coefficients.components[i].tq & 3;
+            if (quantization[tq] == nullptr)
+              quantization[tq] = coefficients.components[i].q;
+
+            baseline = baseline && planes[i].td < 2 && planes[i].ta < 2;
+          }
+
+          out->clear();
+          out->reserve(size);
+          out->push_back(0xFF);
+          out->push_back(0xD8);
+
+          if (options.metadata)
+            copy_metadata(data, size, options, out);
+
+          for (uint8_t tq = 0; tq < 4; ++tq) {
+            if (quantization[tq] == nullptr)
+              continue;
+
+            const bool wide = std::any_of(quantization[tq], quantization[tq] + 64, [] (uint16_t q) { return q > 255; });
+            baseline = baseline && !wide;
+
+            put_marker(out, 0xDB, 1 + 64 * (wide ? 2 : 1));
+            out->push_back((uint8_t) ((wide ? 0x10 : 0x00) | tq));
+
+            // Transposed along with the coefficients they scale
+            for (int k = 0; k < 64; ++k) {
+              const uint16_t q = quantization[tq][order.source[k]];
+              if (wide)
+                out->push_back((uint8_t) (q >> 8));
+              out->push_back((uint8_t) q);
+            }
+          }
+
+          put_marker(out, baseline ? 0xC0 : 0xC1, 6 + count * 3);
+          out->push_back(8);
+          put_u16(out, out_height);
+          put_u16(out, out_width);
+          out->push_back((uint8_t) count);
+          for (const auto &plane : planes) {
+            out->push_back(plane.component->id);
+            out->push_back((uint8_t) (plane.h << 4 | plane.v));
+            out->push_back((uint8_t) (plane.component->tq & 3));
+          }
+
+          for (int table = 0; table < 8; ++table) {
+            if (!used[table])
+              continue;
+
+            const huffman_spec_t &spec = specs[table];
+            size_t total = 0;
+            for (int length = 0; length < 16; ++length)
+              total += spec.counts[length];
+
+            put_marker(out, 0xC4, 17 + total);
+            out->push_back((uint8_t) ((table >> 2) << 4 | (table & 3)));
+            out->insert(out->end(), spec.counts, spec.counts + 16);
+            out->insert(out->end(), spec.symbols, spec.symbols + total);
+          }
+
+          put_marker(out, 0xDA, 1 + count * 2 + 3);
+          out->push_back((uint8_t) count);
+          for (const auto &plane : planes) {
+            out->push_back(plane.component->id);
+            out->push_back((uint8_t) (plane.td << 4 | plane.ta));
+          }
+          out->push_back(0);
+          out->push_back(63);
+          out->push_back(0);
+
+          put_symbols(*symbols, tables, out);
+
+          out->push_back(0xFF);
+          out->push_back(0xD9);
+          return error_t::None;
+        }
+      } // namespace detail
+
+      transform_t get_transform(uint16_t orientation)
+      {
+        switch (orientation) {
+          case 2: return transform_t::flip_horizontal;
+          case 3: return transform_t::rotate_180;
+          case 4: return transform_t::flip_vertical;
+          case 5: return transform_t::transpose;
+          case 6: return transform_t::rotate_90;
+          case 7: return transform_t::transverse;
+          case 8: return transform_t::rotate_270;
+          default: return transform_t::none;
+        }
+      }
+
+      uint16_t get_orientation(const uint8_t *data, size_t size)
+      {
+        for (size_t p = 2; data != nullptr && p + 4 <= size; ) {
+          if (data[p] != 0xFF)
+            break;
+
+          const uint8_t marker = data[p + 1];
+          if (marker == 0xFF || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            p += marker == 0xFF ? 1 : 2;
+            continue;
+          }
+
+          const size_t length = (size_t) ((data[p + 2] << 8) | data[p + 3]);
+          if (marker == 0xDA || marker == 0xD9 || length < 2 || p + 2 + length > size)
+            break;
+
+          if (marker == 0xE1 && length >= 8 && std::memcmp(data + p + 4, "Exif\0", 6) == 0) {
+            exif::reader_t reader;
+            if (reader.open(data + p + 10, length - 8) == error_t::None)
+              return reader.get_orientation();
+          }
+
+          p += 2 + length;
+        }
+
+        return 1;
+      }
+
+      error_t transformer_t::transform(scoped_file &file, const transform_options_t &options, std::vector<uint8_t> *out,
+        size_t threads)
+      {
+        if (!file.valid() || out == nullptr)
+          return error_t::Other;
+
+        const uint64_t size = file.size();
+        if (!file.skip(0, SEEK_SET))
+          return error_t::Other;
+
+        contents.resize((size_t) size);
+        if (file.read(contents.data(), size::u8, contents.size()) != contents.size())
+          return error_t::InvalidJPG;
+
+        return transform(contents.data(), contents.size(), options, out, threads);
+      }
+
+      error_t transformer_t::transform(const uint8_t *data, size_t size, const transform_options_t &options,
+        std::vector<uint8_t> *out, size_t threads)
+      {
+        if (data == nullptr || out == nullptr)
+          return error_t::InvalidRequest;
+
+        const error_t error = decoder.decode_coefficients(data, size, &coefficients, threads);
+        if (error != error_t::None)
+          return error;
+
+        return detail::write_transformed(data, size, coefficients, options, &symbols, out);
+      }
+    } // namespace jpg
+  } // namespace image
+} // namespace doors
+
+#endif
@@ -1,6 +1,12 @@
 #if !defined(__IMAGE_PNG_DETAIL__)
 #define __IMAGE_PNG_DETAIL__
 
+// Adam7 interlaced files can also tell how much of them a range request has to fetch for a low-res preview
+// (fields_t::preview): passes 1 to 3 make up a quarter of the image both ways, and their filtered rows come first in
+// the IDAT stream. The stream gets inflated from the first IDAT chunk on, across the ones that follow, only counting
+// the output (no window is kept, back-references merely add their length), until those rows are in: the byte of the
+// file the last of their bits came from is where the preview is done.
+//
 // Pending issue(s):
 //   CMF byte read isn't working at the moment.
 //   Convert the few remaining std::f*(FILE *) calls to utilize scoped_file instead.
@@ -43,11 +49,16 @@
 
 #include <unordered_map>
 #include <any>
+#include <algorithm>
+#include <cstring>
 #include <string>
 
 #include <compiler.hpp>
 using namespace compiler;
 
+#include <system/fields.hpp>
+#include <system/record.hpp>
+
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/basic_file_sink.h>
 
@@ -97,14 +108,20 @@ namespace doors {
           PNG_chunk_count_header_t chunks;
 
           uint8_t compression_level;
+
+          uint64_t preview; // fields_t::preview, Adam7 files only: file offset past passes 1 to 3, 0 if never reached
         };
 
-        error_t read(PNG_header_t *header, const char *name);
+        error_t read(PNG_header_t *header, scoped_file &file, const fields_t fields = fields_t::all,
+          const checkpoint_t &checkpoint = nullptr);
+        error_t read(PNG_header_t *header, const char *name, const fields_t fields = fields_t::all,
+          const checkpoint_t &checkpoint = nullptr);
       } // namespace detail
 
       using namespace detail;
 
       std::unordered_map<std::string, std::any> parse(const char *name);
+      record_t to_record(const PNG_header_t &header);
     } // namespace png
   } // namespace image
 } // namespace doors
@@ -120,11 +137,341 @@ namespace doors {
       namespace detail {
         static constexpr const uint8_t magic[8] = { 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a };
 
+        // The IDAT chunks' data as a single stream, LSB first as DEFLATE has it. Chunk boundaries get crossed on the
+        // way (CRCs unchecked), anything but another IDAT chunk ends the stream.
+        struct PNG_idat_reader_t {
+          scoped_file &file;
+          uint32_t left;          // Bytes of the current chunk not buffered yet
+          uint64_t offset = 0;    // File offset of buffer[0]
+          size_t position = 0;
+          size_t count = 0;
+          uint32_t bits = 0;
+          unsigned bit_count = 0;
+          uint8_t buffer[4096];
+
+          PNG_idat_reader_t(scoped_file &file, uint32_t length) : file(file), left(length) {}
+
+          // File offset past the last byte any bit was taken from
+          uint64_t get_offset() const { return offset + position; }
+
+          bool get_byte(uint8_t *byte)
+          {
+            while (position == count) {
+              if (left == 0) {
+                uint8_t chunk[12];
+                if (file.exceeded() || file.read(chunk, size::u8, sizeof chunk) != sizeof chunk ||
+                  std::memcmp(chunk + 8, "IDAT", 4) != 0)
+                  return false;
+
+                // CRC of the chunk before, then the next one's length
+                left = (uint32_t) chunk[4] << 24 | (uint32_t) chunk[5] << 16 | (uint32_t) chunk[6] << 8 | chunk[7];
+              }
+
+              const long start = std::ftell(file.p);
+              count = file.read(buffer, size::u8, std::min<size_t>(left, sizeof buffer));
+              if (start < 0 || (count == 0 && left != 0))
+                return false;
+
+              offset = (uint64_t) start;
+              position = 0;
+              left -= (uint32_t) count;
+            }
+
+            *byte = buffer[position++];
+            return true;
+          }
+
+          bool get_bits(unsigned n, uint32_t *value)
+          {
+            while (bit_count < n) {
+              uint8_t byte;
+              if (!get_byte(&byte))
+                return false;
+
+              bits |= (uint32_t) byte << bit_count;
+              bit_count += 8;
+            }
+
+            *value = bits & ((1u << n) - 1u);
+            bits >>= n;
+            bit_count -= n;
+            return true;
+          }
+        };
+
+        // Canonical Huffman code: code count per length, then symbols ordered by code
+        struct PNG_huffman_t {
+          uint16_t count[16];
+          uint16_t symbol[288];
+        };
+
+        // False when over-subscribed; incomplete codes are let through, their unused codes fail to decode
+        static bool build(PNG_huffman_t *huffman, const uint8_t *lengths, unsigned n)
+        {
+          uint16_t offsets[16];
+          std::memset(huffman->count, 0, sizeof huffman->count);
+
+          for (unsigned i = 0; i < n; ++i)
+            huffman->count[lengths[i]] += 1;
+
+          int left = 1;
+          for (unsigned length = 1; length < 16; ++length) {
+            left = left * 2 - huffman->count[length];
+            if (left < 0)
+              return false;
+          }
+
+          offsets[1] = 0;
+          for (unsigned length = 1; length < 15; ++length)
+            offsets[length + 1] = (uint16_t) (offsets[length] + huffman->count[length]);
+
+          for (unsigned i = 0; i < n; ++i) {
+            if (lengths[i] != 0)
+              huffman->symbol[offsets[lengths[i]]++] = (uint16_t) i;
+          }
+
+          return true;
+        }
+
+        // A bit at a time, codes being packed MSB first (as in zlib's puff.c): -1 on a bad code or the stream's end
+        static int decode(PNG_idat_reader_t &reader, const PNG_huffman_t &huffman)
+        {
+          int code = 0, first = 0, index = 0;
+
+          for (unsigned length = 1; length < 16; ++length) {
+            uint32_t bit;
+            if (!reader.get_bits(1, &bit))
+              return -1;
+
+            code |= (int) bit;
+            const int count = huffman.count[length];
+            if (code - count < first)
+              return huffman.symbol[index + (code - first)];
+
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+          }
+
+          return -1;
+        }
+
+        // Bytes the filtered rows (a filter type byte each) of Adam7 passes 1 to 3 take up, 0 for an invalid IHDR
+        static uint64_t get_preview_size(const PNG_IHDR_header_t &ihdr)
+        {
+          unsigned channels;
+          switch (ihdr.color_type) {
+            case 0: case 3: channels = 1; break;
+            case 2: channels = 3; break;
+            case 4: channels = 2; break;
+            case 6: channels = 4; break;
+            default: return 0;
+          }
+
+          // Starting column and row, then the steps
+          static constexpr const uint8_t passes[3][4] = { { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 } };
+
+          uint64_t size = 0;
+          for (const auto &pass : passes) {
+            const uint64_t columns = ihdr.width > pass[0] ? (ihdr.width - pass[0] + pass[2] - 1u) / pass[2] : 0u;
+            const uint64_t rows = ihdr.height > pass[1] ? (ihdr.height - pass[1] + pass[3] - 1u) / pass[3] : 0u;
+
+            // Empty passes have no filter type bytes either
+            if (columns != 0 && rows != 0)
+              size += rows * (1u + (columns * channels * ihdr.bpp + 7u) / 8u);
+          }
+
+          return size;
+        }
+
+        // Inflates the IDAT stream (the file at the first chunk's data, `length` bytes of it) until `size` bytes came out:
+        // the file offset past the last byte needed, 0 when the stream ends (or breaks) before that.
+        static uint64_t get_preview(scoped_file &file, uint32_t length, uint64_t size)
+        {
+          static constexpr const uint16_t length_base[29] = {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+          };
+          static constexpr const uint8_t length_extra[29] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+          };
+          static constexpr const uint16_t distance_base[30] = {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+            6145, 8193, 12289, 16385, 24577
+          };
+          static constexpr const uint8_t distance_extra[30] = {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+          };
+          static constexpr const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+          PNG_idat_reader_t reader(file, length);
+          PNG_huffman_t literals, distances;
+          uint8_t lengths[288 + 32];
+          uint64_t out = 0;
+          uint32_t value;
+
+          // zlib header (CMF, FLG), no preset dictionary for PNG
+          if (size == 0 || !reader.get_bits(16, &value) || (value & 0x0F) != 8 || (value & 0x2000) != 0)
+            return 0;
+
+          for (;;) {
+            uint32_t last, type;
+            if (file.exceeded() || !reader.get_bits(1, &last) || !reader.get_bits(2, &type))
+              return 0;
+
+            // Stored: byte aligned, the length and its complement, then as many bytes as they are
+            if (type == 0) {
+              reader.bits = 0;
+              reader.bit_count = 0;
+
+              uint8_t header[4];
+              for (auto &byte : header) {
+                if (!reader.get_byte(&byte))
+                  return 0;
+              }
+
+              const uint32_t stored = header[0] | (uint32_t) header[1] << 8;
+              if (stored != (~(header[2] | (uint32_t) header[3] << 8) & 0xFFFF))
+                return 0;
+
+              for (uint32_t i = 0; i < stored; ++i) {
+                uint8_t byte;
+                if (!reader.get_byte(&byte))
+                  return 0;
+
+                if (++out >= size)
+                  return reader.get_offset();
+              }
+            }
+            else if (type == 1 || type == 2) {
+              unsigned literal_count = 288, distance_count = 30;
+
+              if (type == 1) {
+                std::memset(lengths, 8, 144);
+                std::memset(lengths + 144, 9, 112);
+                std::memset(lengths + 256, 7, 24);
+                std::memset(lengths + 280, 8, 8);
+                std::memset(lengths + 288, 5, 30);
+              }
+              else {
+                uint32_t hlit, hdist, hclen;
+                if (!reader.get_bits(5, &hlit) || !reader.get_bits(5, &hdist) || !reader.get_bits(4, &hclen))
+                  return 0;
+
+                literal_count = hlit + 257;
+                distance_count = hdist + 1;
+                if (literal_count > 286 || distance_count > 30)
+                  return 0;
+
+                // Code length code lengths, then the literal/length and distance code lengths as a single run
+                uint8_t code_lengths[19] = {0};
+                for (uint32_t i = 0; i < hclen + 4; ++i) {
+                  if (!reader.get_bits(3, &value))
+                    return 0;
+
+                  code_lengths[order[i]] = (uint8_t) value;
+                }
+
+                PNG_huffman_t code;
+                if (!build(&code, code_lengths, 19))
+                  return 0;
+
+                for (unsigned i = 0; i < literal_count + distance_count;) {
+                  const int symbol = decode(reader, code);
+                  if (symbol < 0)
+                    return 0;
+
+                  if (symbol < 16) {
+                    lengths[i++] = (uint8_t) symbol;
+                    continue;
+                  }
+
+                  uint8_t repeated = 0;
+                  uint32_t repeat;
+                  if (symbol == 16) {
+                    if (i == 0 || !reader.get_bits(2, &repeat))
+                      return 0;
+
+                    repeated = lengths[i - 1];
+                    repeat += 3;
+                  }
+                  else if (symbol == 17) {
+                    if (!reader.get_bits(3, &repeat))
+                      return 0;
+
+                    repeat += 3;
+                  }
+                  else {
+                    if (!reader.get_bits(7, &repeat))
+                      return 0;
+
+                    repeat += 11;
+                  }
+
+                  if (i + repeat > literal_count + distance_count)
+                    return 0;
+
+                  std::memset(lengths + i, repeated, repeat);
+                  i += repeat;
+                }
+
+                // No end of block code, no way out of the block
+                if (lengths[256] == 0)
+                  return 0;
+              }
+
+              if (!build(&literals, lengths, literal_count) || !build(&distances, lengths + literal_count, distance_count))
+                return 0;
+
+              for (;;) {
+                int symbol = decode(reader, literals);
+                if (symbol < 0)
+                  return 0;
+
+                if (symbol == 256)
+                  break;
+
+                if (symbol < 256)
+                  out += 1;
+                else {
+                  symbol -= 257;
+                  if (symbol >= 29 || !reader.get_bits(length_extra[symbol], &value))
+                    return 0;
+
+                  const uint32_t copy = length_base[symbol] + value;
+
+                  symbol = decode(reader, distances);
+                  if (symbol < 0 || symbol >= 30 || !reader.get_bits(distance_extra[symbol], &value))
+                    return 0;
+
+                  // Nothing to copy from this far back
+                  if (distance_base[symbol] + value > out)
+                    return 0;
+
+                  out += copy;
+                }
+
+                if (out >= size)
+                  return reader.get_offset();
+              }
+            }
+            else
+              return 0;
+
+            if (last)
+              return 0;
+          }
+        }
+
+        error_t read(PNG_header_t *header, const char *name, const fields_t fields, const checkpoint_t &checkpoint)
+        {
+          scoped_file file(name);
+          return read(header, file, fields, checkpoint);
+        }
+
         // PNG is MSB, swizzling the bytes before reading.
-        error_t read(PNG_header_t *header, const char *name)
+        error_t read(PNG_header_t *header, scoped_file &file, const fields_t fields, const checkpoint_t &checkpoint)
         {
           const char *signature = __SIGNATURE;
-          scoped_file file(name);
 #ifdef IMAGE_PNG_DETAIL_DEBUG
           spdlog::set_pattern("[%^%l%$] %v");
           spdlog::set_level(spdlog::level::debug);
@@ -183,8 +530,16 @@ namespace doors {
             );
 #endif
 
+            // IHDR holds everything but the chunk census (and the preview, off the IDAT stream)
+            const bool preview = (fields & fields_t::preview) && header->ihdr.interlacing_type == 1;
+            if (!(fields & fields_t::chunks) && !preview)
+              return error_t::None;
+
+            if (checkpoint && !checkpoint(to_record(*header), fields_t::basic))
+              return error_t::Rejected;
+
             // Get the rest chunks
-            while (!std::feof(file.p)) {
+            while (!file.exceeded()) {
 #ifdef IMAGE_PNG_DETAIL_DEBUG
               /*
               spdlog::debug(
@@ -197,9 +552,8 @@ namespace doors {
               uint32_t length;
               char name[5];
 
-              if (std::fread(&length, size::u32, 1, file.p) == 1) {
+              if (file.read(&length, size::u32, 1) == 1 && file.read(&name, sizeof(char), 4) == 4) {
                 length = __SWIZZLE32(length);
-                std::fread(&name, sizeof(char), 4, file.p);
                 name[4] = '\0';
 
 #ifdef IMAGE_PNG_DETAIL_DEBUG
@@ -213,8 +567,9 @@ namespace doors {
 #endif
 
                 if (std::strcmp(name, "IDAT") == 0) {
-                  // There can be multiple IDAT chunks
-                  header->chunks.idat += 1;
+                  // There can be multiple IDAT chunks, as many as to overflow the count (which then sticks)
+                  if (header->chunks.idat != UINT16_MAX)
+                    header->chunks.idat += 1;
                   uint32_t idat_position = std::ftell(file.p) - 4u;
 #ifdef IMAGE_PNG_DETAIL_DEBUG
                   if (header->chunks.idat <= IMAGE_PNG_DETAIL_MAXIMUM_IDAT_COUNT) {
@@ -241,8 +596,8 @@ namespace doors {
 #endif
                   // Only determining DEFLATE-compressed information from the first IDAT section should be enough
                   if (header->chunks.idat == 1) {
-                      uint8_t zlib_header[2];
-                      std::fread(&zlib_header[0], size::u8, 2, file.p);
+                      uint8_t zlib_header[2] = {0};
+                      file.read(&zlib_header[0], size::u8, 2);
                       std::fseek(file.p, -size::u8 * 2, SEEK_CUR);
 
                       // http://www.libpng.org/pub/png/spec/1.2/PNG-Compression.html
@@ -285,6 +640,18 @@ namespace doors {
                       );
 #endif
                   }
+
+                  // Back to the chunk walk right after, from the first chunk's data on
+                  if (preview && header->chunks.idat == 1) {
+                    const long position = std::ftell(file.p);
+                    header->preview = get_preview(file, length, get_preview_size(header->ihdr));
+
+                    if (!(fields & fields_t::chunks))
+                      return file.exceeded() ? error_t::BudgetExceeded : error_t::None;
+
+                    if (position < 0 || !file.skip(position, SEEK_SET))
+                      break;
+                  }
                 }
                 else if (std::strcmp(name, "PLTE") == 0) {
                   header->chunks.plte += 1;
@@ -317,7 +684,9 @@ namespace doors {
                   header->chunks.hist += 1;
                 }
 
-                std::fseek(file.p, length + 4, SEEK_CUR);
+                // Nothing may follow IEND
+                if (header->chunks.iend != 0 || !file.skip((long) length + 4))
+                  break;
 #ifdef IMAGE_PNG_DETAIL_DEBUG
                 /*
                 spdlog::debug(
@@ -328,9 +697,12 @@ namespace doors {
                 */
 #endif
               }
+              else
+                break;
             }
 
-            std::fclose(file.p);
+            if (file.exceeded())
+              return error_t::BudgetExceeded;
 
             return error_t::None;
           }
@@ -388,10 +760,27 @@ namespace doors {
             r.insert({ std::string("chunks.unordered_map<s, u16>"), chunks });
 
             r.insert({ std::string("deflate_compression_level.u8"), header.compression_level });
+            r.insert({ std::string("preview.u64"), header.preview });
         }
 
         return r;
       }
+
+      record_t to_record(const PNG_header_t &header)
+      {
+        record_t r = {0};
+
+        r.format = (uint8_t) format_t::PNG;
+        r.version = 1u;
+        r.width = header.ihdr.width;
+        r.height = header.ihdr.height;
+        r.bpp = header.ihdr.bpp;
+        r.color_space = header.ihdr.color_type;
+        r.flags = (uint8_t) (header.ihdr.interlacing_type == 1 ? record_flags_t::interlaced : record_flags_t::none);
+        r.preview = (uint32_t) std::min<uint64_t>(header.preview, UINT32_MAX);
+
+        return r;
+      }
     } // namespace png
   } // namespace image
 } // namespace doors
@@ -0,0 +1,315 @@
+#if !defined(__PROBE_DETAIL__)
+#define __PROBE_DETAIL__
+
+// Format dispatch: sniffs the magic bytes of a file (or of an in-memory buffer) and routes it to the matching
+// parser, either as the usual string-keyed map or as a flat record_t.
+//
+// The format parsers have to be compiled within the same translation unit, thus IMAGE_GIF_DETAIL,
+// IMAGE_JPG_DETAIL, ... must be defined before their headers are first included (see main.cpp).
+//
+// Pending issue(s):
+//   TGA carries no magic bytes: v1.0 files are only recognized through their extension, which in-memory
+//   buffers don't have.
+//   Testing
+
+#include <unordered_map>
+#include <any>
+#include <string>
+#include <cstring>
+#include <cctype>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/fields.hpp>
+#include <system/record.hpp>
+
+#include <gif.hpp>
+#include <jpg.hpp>
+#include <png.hpp>
+#include <bmp.hpp>
+#include <tga.hpp>
+#include <psd.hpp>
+
+namespace doors {
+  namespace probe {
+    // Leaves the file positioned at its very beginning.
+    format_t identify(scoped_file &file, const char *name = nullptr);
+    format_t identify(const char *name);
+
+    // Only the requested fields are guaranteed to be filled in, record_t::fields tells which ones these were.
+    // The checkpoint (if any) is consulted before parsing starts, whenever the parser is about to read on, and once
+    // everything's known; a file it turns down ends up with error_t::Rejected.
+    // A file running out of its budget ends up with error_t::BudgetExceeded and no fields at all. Opened files go
+    // by whatever scoped_file::limit() they were given.
+    error_t read(record_t *record, scoped_file &file, const char *name = nullptr, const fields_t fields = fields_t::defaults,
+      const checkpoint_t &checkpoint = nullptr);
+    error_t read(record_t *record, const char *name, const fields_t fields = fields_t::defaults,
+      const checkpoint_t &checkpoint = nullptr, const budget_t &budget = budget_t());
+    error_t read(record_t *record, const void *data, size_t length, const fields_t fields = fields_t::defaults,
+      const checkpoint_t &checkpoint = nullptr, const budget_t &budget = budget_t());
+
+    std::unordered_map<std::string, std::any> parse(const char *name);
+  } // namespace probe
+} // namespace doors
+
+#endif
+
+#ifdef PROBE_DETAIL
+#undef PROBE_DETAIL
+
+namespace doors {
+  namespace probe {
+    static bool has_extension(const char *name, const char *extension)
+    {
+      if (name == nullptr)
+        return false;
+
+      const size_t length = std::strlen(name);
+      const size_t extension_length = std::strlen(extension);
+      if (length < extension_length)
+        return false;
+
+      for (size_t i = 0; i < extension_length; ++i) {
+        if (std::tolower((unsigned char) name[length - extension_length + i]) != extension[i])
+          return false;
+      }
+
+      return true;
+    }
+
+    // Whatever the format expects to find at the very end: GIF's trailer, PNG's IEND chunk (CRC included, it never
+    // changes), JPG's EOI. Padding encoders or transfers add past it is tolerated, anything else counts as truncation.
+    // BMP and uncompressed TGA tell their size upfront instead (see read()), PSD has no terminator at all.
+    static bool is_truncated(scoped_file &file, format_t format, uint64_t size)
+    {
+      constexpr long window = 64;
+      uint8_t tail[window];
+
+      if (format != format_t::GIF && format != format_t::PNG && format != format_t::JPG)
+        return false;
+
+      const long length = size < (uint64_t) window ? (long) size : window;
+      if (length == 0 || !file.skip(-length, SEEK_END) || file.read(tail, size::u8, (size_t) length) != (size_t) length)
+        return true;
+
+      long end = length;
+      while (format != format_t::PNG && end > 0 && tail[end - 1] == 0x00)
+        --end;
+
+      switch (format) {
+        case format_t::GIF:
+          return end < 1 || tail[end - 1] != 0x3B;
+        case format_t::JPG:
+          return end < 2 || tail[end - 2] != 0xFF || tail[end - 1] != 0xD9;
+        case format_t::PNG: {
+          static const uint8_t iend[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xAE, 0x42, 0x60, 0x82 };
+
+          // Trailing garbage is common enough, IEND merely has to show up within the window
+          for (long i = length - (long) sizeof iend; i >= 0; --i) {
+            if (std::memcmp(tail + i, iend, sizeof iend) == 0)
+              return false;
+          }
+
+          return true;
+        }
+        default:
+          return false;
+      }
+    }
+
+    format_t identify(scoped_file &file, const char *name)
+    {
+      if (!file.valid())
+        return format_t::Unknown;
+
+      uint8_t magic[4] = {0};
+      const size_t count = std::fread(&magic[0], size::u8, sizeof magic, file.p);
+      file.skip(0, SEEK_SET);
+
+      if (count >= 4 && std::memcmp(magic, "GIF8", 4) == 0)
+        return format_t::GIF;
+
+      if (count >= 4 && std::memcmp(magic, "\x89PNG", 4) == 0)
+        return format_t::PNG;
+
+      if (count >= 4 && std::memcmp(magic, "8BPS", 4) == 0)
+        return format_t::PSD;
+
+      if (count >= 2 && magic[0] == 0xFF && magic[1] == 0xD8)
+        return format_t::JPG;
+
+      if (count >= 2 && magic[0] == 'B' && magic[1] == 'M')
+        return format_t::BMP;
+
+      if (has_extension(name, ".tga"))
+        return format_t::TGA;
+
+      // Targa v2.0 at least ends with a recognizable footer
+      constexpr long v2_footer_length = 18;
+      if (file.skip(-v2_footer_length, SEEK_END)) {
+        const std::string footer = file.string(v2_footer_length);
+        file.skip(0, SEEK_SET);
+
+        if (std::memcmp(footer.c_str(), "TRUEVISION-XFILE.", v2_footer_length) == 0)
+          return format_t::TGA;
+      }
+
+      file.skip(0, SEEK_SET);
+
+      return format_t::Unknown;
+    }
+
+    format_t identify(const char *name)
+    {
+      scoped_file file(name);
+      return identify(file, name);
+    }
+
+    error_t read(record_t *record, scoped_file &file, const char *name, const fields_t fields,
+      const checkpoint_t &checkpoint)
+    {
+      if (record == nullptr)
+        return error_t::Other;
+
+      *record = record_t{};
+
+      if (!file.valid()) {
+        record->error = (uint8_t) error_t::Other;
+        return error_t::Other;
+      }
+
+      const format_t format = identify(file, name);
+      const uint64_t size = file.size();
+      error_t error = error_t::InvalidFormat;
+      bool truncated = false;
+
+      // Parsers only know about their own fields, format and size get filled in on their way through
+      checkpoint_t partial;
+      if (checkpoint) {
+        record->format = (uint8_t) format;
+        record->size = size;
+
+        if (!checkpoint(*record, fields_t::none)) {
+          record->error = (uint8_t) error_t::Rejected;
+          return error_t::Rejected;
+        }
+
+        partial = [&checkpoint, format, size] (const record_t &known, fields_t fields) {
+          record_t r = known;
+          r.format = (uint8_t) format;
+          r.size = size;
+          return checkpoint(r, fields);
+        };
+      }
+
+      switch (format) {
+        case format_t::GIF: {
+          image::gif::GIF_header_t header = {0};
+          if ((error = image::gif::read(&header, file, fields, partial)) == error_t::None)
+            *record = image::gif::to_record(header);
+          break;
+        }
+        case format_t::JPG: {
+          image::jpg::JPG_header_t header = {0};
+          if ((error = image::jpg::read(&header, file, image::jpg::get_default_flags(), fields, partial)) == error_t::None)
+            *record = image::jpg::to_record(header);
+          break;
+        }
+        case format_t::PNG: {
+          image::png::PNG_header_t header = {0};
+          if ((error = image::png::read(&header, file, fields, partial)) == error_t::None)
+            *record = image::png::to_record(header);
+          break;
+        }
+        case format_t::BMP: {
+          image::bmp::BMP_header_t header = {0};
+          if ((error = image::bmp::read(&header, file)) == error_t::None)
+            *record = image::bmp::to_record(header);
+
+          truncated = header.size > size;
+          break;
+        }
+        case format_t::TGA: {
+          image::tga::TGA_header_t header = {0};
+          if ((error = image::tga::read(&header, file, fields, partial)) == error_t::None)
+            *record = image::tga::to_record(header);
+
+          // Uncompressed image data has a fixed size (the v2.0 footer may or may not follow it)
+          if (error == error_t::None && header.type >= 1 && header.type <= 3) {
+            const uint64_t expected = 18u + header.length +
+              (header.paletted ? (uint64_t) header.palette_colors * ((header.palette_depth + 7u) / 8u) : 0u) +
+              (uint64_t) header.size[0] * header.size[1] * ((header.bpp + 7u) / 8u);
+
+            truncated = expected > size;
+          }
+
+          break;
+        }
+        case format_t::PSD: {
+          image::psd::PSD_header_t header = {0};
+          if ((error = image::psd::read(&header, file, fields, partial)) == error_t::None)
+            *record = image::psd::to_record(header);
+          break;
+        }
+        default:
+          break;
+      }
+
+      record->format = (uint8_t) format;
+      record->size = size;
+      record->fields = (uint16_t) (error == error_t::BudgetExceeded ? fields_t::none : fields);
+
+      // Truncated files often fail to parse to begin with, they get flagged all the same
+      if ((fields & fields_t::trailer) && format != format_t::Unknown && error != error_t::BudgetExceeded &&
+        error != error_t::Rejected && (truncated || is_truncated(file, format, size)))
+        record->flags |= (uint8_t) record_flags_t::truncated;
+
+      if (error == error_t::None && checkpoint && !checkpoint(*record, fields))
+        error = error_t::Rejected;
+
+      record->error = (uint8_t) error;
+
+      return error;
+    }
+
+    error_t read(record_t *record, const char *name, const fields_t fields, const checkpoint_t &checkpoint,
+      const budget_t &budget)
+    {
+      scoped_file file(name);
+      file.limit(budget);
+      return read(record, file, name, fields, checkpoint);
+    }
+
+    error_t read(record_t *record, const void *data, size_t length, const fields_t fields,
+      const checkpoint_t &checkpoint, const budget_t &budget)
+    {
+      scoped_file file(data, length);
+      file.limit(budget);
+      return read(record, file, nullptr, fields, checkpoint);
+    }
+
+    std::unordered_map<std::string, std::any> parse(const char *name)
+    {
+      switch (identify(name)) {
+        case format_t::GIF:
+          return image::gif::parse(name);
+        case format_t::JPG:
+          return image::jpg::parse(name);
+        case format_t::PNG:
+          return image::png::parse(name);
+        case format_t::BMP:
+          return image::bmp::parse(name);
+        case format_t::TGA:
+          return image::tga::parse(name);
+        case format_t::PSD:
+          return image::psd::parse(name);
+        default:
+          return {};
+      }
+    }
+  } // namespace probe
+} // namespace doors
+
+#endif
@@ -5,6 +5,12 @@
 #include <any>
 #include <string>
 
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/fields.hpp>
+#include <system/record.hpp>
+
 namespace doors {
   namespace image {
     namespace psd {
@@ -20,40 +26,53 @@ namespace doors {
           uint16_t layers;
         };
 
-        error_t read(PSD_header_t *header, const char *name);
+        error_t read(PSD_header_t *header, scoped_file &file, const fields_t fields = fields_t::all,
+          const checkpoint_t &checkpoint = nullptr);
+        error_t read(PSD_header_t *header, const char *name, const fields_t fields = fields_t::all,
+          const checkpoint_t &checkpoint = nullptr);
       } // namespace detail
 
       using namespace detail;
 
       std::unordered_map<std::string, std::any> parse(const char *name);
+      record_t to_record(const PSD_header_t &header);
     } // namespace psd
   } // namespace image
 } // namespace doors
 
 #endif
 
-// #ifdef IMAGE_PSD_DETAIL
-// #undef IMAGE_PSD_DETAIL
+#ifdef IMAGE_PSD_DETAIL
+#undef IMAGE_PSD_DETAIL
 
 namespace doors {
   namespace image {
     namespace psd {
       namespace detail {
-        error_t read(PSD_header_t *header, const char *name)
+        error_t read(PSD_header_t *header, const char *name, const fields_t fields, const checkpoint_t &checkpoint)
         {
-          std::FILE *f = std::fopen(name, "rb");
+          scoped_file file(name);
+          return read(header, file, fields, checkpoint);
+        }
 
-          if (f && header) {
+        error_t read(PSD_header_t *header, scoped_file &file, const fields_t fields, const checkpoint_t &checkpoint)
+        {
+          std::FILE *f = file.p;
+
+          if (file.valid() && header) {
             if(std::fread(&header->psd[0], sizeof(char), 4, f) == 4) {
               header->psd[4] = '\0';
             }
 
-            uint16_t dummy;
-            if (std::fread(&dummy, sizeof(uint16_t), 1, f) != 1) {
+            // 1: PSD, 2: PSB (large documents), which widens the section lengths below to 64 bits
+            uint16_t version;
+            if (std::fread(&version, sizeof(uint16_t), 1, f) != 1) {
               return error_t::InvalidPSD;
             }
 
-            std::printf("%i\n", __SWIZZLE16(dummy));
+            version = __SWIZZLE16(version);
+            if (version != 1 && version != 2)
+              return error_t::InvalidPSD;
 
             std::fseek(f, 6, SEEK_CUR);
             if (std::fread(&header->channels, sizeof(uint16_t), 1, f) == 1)
@@ -73,64 +92,65 @@ namespace doors {
             if (std::fread(&color_space, sizeof(uint16_t), 1, f) == 1)
               header->color_space = (uint8_t) __SWIZZLE16(color_space);
 
-            // Color Mode Data Section
-            uint32_t color_data_length;
-            std::fread(&color_data_length, sizeof(uint32_t), 1, f);
-            std::fseek(f, color_data_length, SEEK_CUR);
-
-            // Image Resources Section
-            bool lul = false;
-            int count = 0;
+            // The layer count lies past two variable-length sections
+            if (!(fields & fields_t::layers))
+              return error_t::None;
 
-            while (!lul) {
-              printf("Current location: %i\n", std::ftell(f));
-              uint32_t size = 0u;
-              std::fread(&size, sizeof(uint32_t), 1, f);
+            if (checkpoint && !checkpoint(to_record(*header), fields_t::basic))
+              return error_t::Rejected;
 
-              char image_resource_header[5];
-              std::fread(&image_resource_header, sizeof(char), 4, f);
-              image_resource_header[4] = '\0';
-
-              count += 1;
-              printf("Count: %i (at %i)\n", count, std::ftell(f));
-              printf("Section length: %i\n", __SWIZZLE32(size));
-              printf("First 4 bytes: %s\n", image_resource_header);
-
-              if (std::string(image_resource_header) == "8BIM") {
-                /*
-                std::fseek(f, 2, SEEK_CUR);
-                std::fseek(f, 2, SEEK_CUR);
-
-                uint32_t image_resource_length;
-                std::fread(&image_resource_length, sizeof(uint32_t), 1, f);
+            // Color Mode Data and Image Resources sections are both length-prefixed: no need to walk through the
+            // resources one by one, a corrupt resource can't send us anywhere.
+            for (int section = 0; section < 2; ++section) {
+              uint32_t length;
+              if (file.read(&length, sizeof(uint32_t), 1) != 1 || !file.skip((long) __SWIZZLE32(length)))
+                return error_t::InvalidPSD;
+            }
 
-                std::printf("%i\n", image_resource_length);
+            // Layer and Mask Information Section, then the Layer Info within
+            const auto read_length = [&file, version] (uint64_t *length) {
+              if (version == 1) {
+                uint32_t t;
+                if (file.read(&t, sizeof(uint32_t), 1) != 1)
+                  return false;
 
-                std::fseek(f, image_resource_length, SEEK_CUR);
-                */
-                std::fseek(f, -4, SEEK_CUR);
-                std::fseek(f, __SWIZZLE32(size) + 8, SEEK_CUR);
+                *length = __SWIZZLE32(t);
               }
               else {
-                lul = true;
+                uint64_t t;
+                if (file.read(&t, sizeof(uint64_t), 1) != 1)
+                  return false;
+
+                *length = __SWIZZLE64(t);
               }
-            }
 
-            // Layer and Mask Information Section
-            uint32_t layer_block_length;
-            std::fread(&layer_block_length, sizeof(uint32_t), 1, f);
+              return true;
+            };
 
-            uint32_t layer_section_length;
-            std::fread(&layer_section_length, sizeof(uint32_t), 1, f);
+            uint64_t layer_block_length, layer_section_length;
+            if (!read_length(&layer_block_length))
+              return error_t::InvalidPSD;
+
+            header->layers = 0;
+            if (layer_block_length == 0u)
+              return error_t::None;
+
+            if (!read_length(&layer_section_length))
+              return error_t::InvalidPSD;
 
-            uint16_t layer_length;
-            std::fread(&layer_length, sizeof(uint16_t), 1, f);
+            if (layer_section_length == 0u)
+              return error_t::None;
 
-            printf("%i %i\n", __SWIZZLE16(layer_length), std::ftell(f));
+            // Negative if the first alpha channel holds the merged result's transparency
+            int16_t layer_count;
+            if (file.read(&layer_count, sizeof(int16_t), 1) != 1)
+              return error_t::InvalidPSD;
 
-            header->layers = __SWIZZLE16(layer_length);
+            layer_count = (int16_t) __SWIZZLE16((uint16_t) layer_count);
+            header->layers = (uint16_t) (layer_count < 0 ? -layer_count : layer_count);
 
-            std::fclose(f);
+            if (file.exceeded())
+              return error_t::BudgetExceeded;
 
             return error_t::None;
           }
@@ -194,8 +214,22 @@ namespace doors {
 
         return r;
       }
+
+      record_t to_record(const PSD_header_t &header)
+      {
+        record_t r = {0};
+
+        r.format = (uint8_t) format_t::PSD;
+        r.width = header.width;
+        r.height = header.height;
+        r.layers = header.layers;
+        r.bpp = header.bpp;
+        r.color_space = header.color_space;
+
+        return r;
+      }
     } // namespace psd
   } // namespace image
 } // namespace doors
 
-// #endif
+#endif
@@ -0,0 +1,311 @@
+#if !defined(__RING_DETAIL__)
+#define __RING_DETAIL__
+
+// Shared-memory result ring: fixed-size slots holding a record_t and its path, exchanged between processes without
+// any serialization. The ring lives either in a named POSIX shared memory object (/dev/shm on Linux) or in an
+// anonymous memfd whose descriptor gets inherited by (or passed over to) the consumer.
+//
+// It's a bounded multi-producer/multi-consumer queue (D. Vyukov's design): every slot carries a sequence number,
+// producers and consumers claim positions through their own cursor with a single CAS, no locks involved. Both
+// cursors sit on separate cache lines. std::atomic<uint64_t> being lock-free (and thus address-free), it works
+// across processes mapping the ring at different addresses.
+//
+// Pending issue(s):
+//   Windows support (CreateFileMapping)
+//   Testing
+
+#include <atomic>
+#include <cstring>
+#include <string>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/record.hpp>
+
+namespace doors {
+  namespace ring {
+    constexpr const uint32_t magic = 0x31525244; // "DRR1"
+    constexpr const uint16_t version = record_version;
+
+    constexpr const size_t slot_size = 512;
+    constexpr const size_t path_capacity = slot_size - 8 - sizeof(record_t) - 2;
+
+    struct slot_t {
+      std::atomic<uint64_t> sequence;
+      record_t record;
+      uint16_t path_length;       // Length of the original path, anything above path_capacity got truncated
+      char path[path_capacity];   // NOT NUL-terminated
+
+      bool truncated() const { return path_length > path_capacity; }
+    };
+
+    static_assert(sizeof(slot_t) == slot_size, "slot_t is shared between processes");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Cross-process atomics must be lock-free");
+
+    struct header_t {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t slot_size;
+      uint64_t capacity; // Power of two
+
+      alignas(64) std::atomic<uint64_t> enqueue;
+      alignas(64) std::atomic<uint64_t> dequeue;
+      alignas(64) std::atomic<uint32_t> finished; // Set once the producer(s) are done
+    };
+
+    class ring_t {
+    public:
+      ring_t() = default;
+      ~ring_t();
+
+      ring_t(const ring_t &) = delete;
+      ring_t &operator=(const ring_t &) = delete;
+
+      // Producer side. `capacity` gets rounded up to a power of two.
+      error_t create(const char *name, uint64_t capacity); // Named, shm_open()
+      error_t create(uint64_t capacity);                   // Anonymous, memfd_create() (Linux), see fd()
+
+      // Consumer side.
+      error_t open(const char *name);
+      error_t open(int fd);
+
+      int fd() const { return descriptor; }
+      bool valid() const { return header != nullptr; }
+
+      // False when the ring is full.
+      bool push(const char *name, const record_t &record);
+
+      // Spins (yielding) until a slot frees up.
+      void push_wait(const char *name, const record_t &record);
+
+      // Invokes `f(const slot_t &)` on the oldest slot in place, false when the ring is empty.
+      template <typename F>
+      bool pop(F &&f);
+
+      void finish();
+      bool finished() const;
+      bool empty() const;
+
+    private:
+      error_t map(int fd, bool initialize, uint64_t capacity);
+
+      int descriptor = -1;
+      std::string name;  // Set when this side created a named ring, unlinked on destruction
+      header_t *header = nullptr;
+      slot_t *slots = nullptr;
+      size_t length = 0;
+    };
+
+    template <typename F>
+    bool ring_t::pop(F &&f)
+    {
+      const uint64_t mask = header->capacity - 1;
+      uint64_t position = header->dequeue.load(std::memory_order_relaxed);
+
+      for (;;) {
+        slot_t &slot = slots[position & mask];
+        const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        const int64_t difference = (int64_t) sequence - (int64_t) (position + 1);
+
+        if (difference == 0) {
+          if (header->dequeue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            f(static_cast<const slot_t &>(slot));
+            slot.sequence.store(position + mask + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (difference < 0)
+          return false;
+        else
+          position = header->dequeue.load(std::memory_order_relaxed);
+      }
+    }
+  } // namespace ring
+} // namespace doors
+
+#endif
+
+#ifdef RING_DETAIL
+#undef RING_DETAIL
+
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace doors {
+  namespace ring {
+    ring_t::~ring_t()
+    {
+      if (header != nullptr)
+        ::munmap(header, length);
+
+      if (descriptor != -1)
+        ::close(descriptor);
+
+      if (!name.empty())
+        ::shm_unlink(name.c_str());
+    }
+
+    error_t ring_t::map(int fd, bool initialize, uint64_t capacity)
+    {
+      if (initialize) {
+        uint64_t rounded = 1;
+        while (rounded < capacity)
+          rounded <<= 1;
+        capacity = rounded;
+
+        length = sizeof(header_t) + capacity * sizeof(slot_t);
+        if (::ftruncate(fd, (off_t) length) != 0)
+          return error_t::Other;
+      }
+      else {
+        struct stat status;
+        if (::fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(header_t))
+          return error_t::InvalidFormat;
+
+        length = (size_t) status.st_size;
+      }
+
+      void *p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED)
+        return error_t::Other;
+
+      descriptor = fd;
+      header = static_cast<header_t *>(p);
+      slots = reinterpret_cast<slot_t *>(static_cast<uint8_t *>(p) + sizeof(header_t));
+
+      if (initialize) {
+        // ftruncate() zero-fills, only the non-zero fields need setting up
+        header->version = version;
+        header->slot_size = (uint16_t) slot_size;
+        header->capacity = capacity;
+        for (uint64_t i = 0; i < capacity; ++i)
+          slots[i].sequence.store(i, std::memory_order_relaxed);
+
+        // Consumers check the magic last, publish it once everything else is in place
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = magic;
+      }
+      else if (header->magic != magic || header->version != version || header->slot_size != slot_size ||
+               length < sizeof(header_t) + header->capacity * sizeof(slot_t)) {
+        ::munmap(header, length);
+        header = nullptr;
+        slots = nullptr;
+        descriptor = -1;
+        return error_t::InvalidFormat;
+      }
+
+      return error_t::None;
+    }
+
+    error_t ring_t::create(const char *name, uint64_t capacity)
+    {
+      const int fd = ::shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (fd == -1)
+        return error_t::Other;
+
+      const error_t error = map(fd, true, capacity);
+      if (error != error_t::None) {
+        ::close(fd);
+        ::shm_unlink(name);
+        return error;
+      }
+
+      this->name = name;
+
+      return error_t::None;
+    }
+
+    error_t ring_t::create(uint64_t capacity)
+    {
+#if defined(__linux__)
+      const int fd = ::memfd_create("doors-ring", 0);
+      if (fd == -1)
+        return error_t::Other;
+
+      const error_t error = map(fd, true, capacity);
+      if (error != error_t::None)
+        ::close(fd);
+
+      return error;
+#else
+      return error_t::Other;
+#endif
+    }
+
+    error_t ring_t::open(const char *name)
+    {
+      const int fd = ::shm_open(name, O_RDWR, 0);
+      if (fd == -1)
+        return error_t::Other;
+
+      const error_t error = map(fd, false, 0);
+      if (error != error_t::None)
+        ::close(fd);
+
+      return error;
+    }
+
+    error_t ring_t::open(int fd)
+    {
+      return map(fd, false, 0);
+    }
+
+    bool ring_t::push(const char *name, const record_t &record)
+    {
+      const uint64_t mask = header->capacity - 1;
+      uint64_t position = header->enqueue.load(std::memory_order_relaxed);
+
+      for (;;) {
+        slot_t &slot = slots[position & mask];
+        const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        const int64_t difference = (int64_t) sequence - (int64_t) position;
+
+        if (difference == 0) {
+          if (header->enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            const size_t length = std::strlen(name);
+
+            slot.record = record;
+            slot.path_length = (uint16_t) (length > UINT16_MAX ? UINT16_MAX : length);
+            std::memcpy(slot.path, name, length < path_capacity ? length : path_capacity);
+
+            slot.sequence.store(position + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (difference < 0)
+          return false;
+        else
+          position = header->enqueue.load(std::memory_order_relaxed);
+      }
+    }
+
+    void ring_t::push_wait(const char *name, const record_t &record)
+    {
+      while (!push(name, record))
+        std::this_thread::yield();
+    }
+
+    void ring_t::finish()
+    {
+      header->finished.store(1, std::memory_order_release);
+    }
+
+    bool ring_t::finished() const
+    {
+      return header->finished.load(std::memory_order_acquire) != 0;
+    }
+
+    bool ring_t::empty() const
+    {
+      return header->dequeue.load(std::memory_order_acquire) >= header->enqueue.load(std::memory_order_acquire);
+    }
+  } // namespace ring
+} // namespace doors
+
+#endif
@@ -0,0 +1,250 @@
+#if !defined(__SCAN_DETAIL__)
+#define __SCAN_DETAIL__
+
+// Multi-threaded directory scan: the calling thread walks the roots, a pool of workers probes every regular file
+// and hands its record_t over to a sink. Output modes (text, shared-memory ring, ...) are nothing but sinks.
+//
+// Whenever a store (see store.hpp) is given, files whose identity didn't change since they were last recorded
+// aren't even opened. Its implementation (STORE_DETAIL) has to be compiled within the same translation unit.
+// Likewise with a dedup table (see dedup.hpp, DEDUP_DETAIL): byte-identical files are parsed only once.
+// A filter (see filter.hpp, FILTER_DETAIL) is pushed down into the parsers, files failing it never reach the sink.
+//
+// Pending issue(s):
+//   Symlinked directories aren't followed.
+//   Testing
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/fields.hpp>
+#include <system/record.hpp>
+#include <system/stat.hpp>
+#include <dedup.hpp>
+#include <filter.hpp>
+#include <probe.hpp>
+#include <store.hpp>
+
+namespace doors {
+  namespace scan {
+    struct options_t {
+      size_t threads = 0;             // 0 picks std::thread::hardware_concurrency()
+      store::store_t *store = nullptr; // Persistent cache, optional
+      dedup::table_t *dedup = nullptr; // Content deduplication, optional
+      fields_t fields = fields_t::defaults; // What the parsers have to find out (see system/fields.hpp)
+      const filter::filter_t *filter = nullptr; // Predicate pushdown, optional
+      budget_t budget;                  // Per file (see compiler.hpp), unlimited by default
+    };
+
+    // Called concurrently from the workers; `worker` (< the effective thread count) tells them apart, which lets a
+    // sink keep per-thread state without any locking.
+    using sink_t = std::function<void(size_t worker, const char *name, const record_t &record)>;
+
+    // Roots may be directories (walked recursively) or plain files.
+    error_t run(const std::vector<std::string> &roots, const options_t &options, const sink_t &sink);
+
+    // A single file, the way run() probes every file it finds. error_t::Rejected if it fails options.filter.
+    error_t read(record_t *record, const std::string &name, const options_t &options);
+
+    size_t get_thread_count(const options_t &options);
+  } // namespace scan
+} // namespace doors
+
+#endif
+
+#ifdef SCAN_DETAIL
+#undef SCAN_DETAIL
+
+namespace doors {
+  namespace scan {
+    namespace detail {
+      // Paths travel in batches, one lock round trip per batch instead of per file
+      constexpr const size_t batch_size = 64;
+      constexpr const size_t maximum_batches = 256;
+
+      struct queue_t {
+        std::mutex mutex;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+        std::deque<std::vector<std::string>> batches;
+        bool done = false;
+
+        void push(std::vector<std::string> &&batch)
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          not_full.wait(lock, [this] { return batches.size() < maximum_batches; });
+          batches.push_back(std::move(batch));
+          not_empty.notify_one();
+        }
+
+        bool pop(std::vector<std::string> *batch)
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          not_empty.wait(lock, [this] { return done || !batches.empty(); });
+
+          if (batches.empty())
+            return false;
+
+          *batch = std::move(batches.front());
+          batches.pop_front();
+          not_full.notify_one();
+
+          return true;
+        }
+
+        void finish()
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          done = true;
+          not_empty.notify_all();
+        }
+      };
+
+      // The filter's own fields come on top of whatever was asked for, or it could never come to a verdict
+      static fields_t get_fields(const options_t &options)
+      {
+        return options.filter != nullptr ? options.fields | options.filter->fields() : options.fields;
+      }
+
+      static void parse(const std::string &name, const options_t &options, record_t *record)
+      {
+        const fields_t fields = get_fields(options);
+        const checkpoint_t checkpoint = options.filter != nullptr ? options.filter->checkpoint() : nullptr;
+
+        if (options.dedup == nullptr) {
+          probe::read(record, name.c_str(), fields, checkpoint, options.budget);
+          return;
+        }
+
+        // Every duplicate is judged by the same filter, sharing a rejection is fine. Hashing doesn't count against
+        // the budget, it's sequential and linear in the file's size by nature.
+        options.dedup->read(name.c_str(), record, [&name, fields, &checkpoint, &options] (scoped_file &file, record_t *record) {
+          file.limit(options.budget);
+          probe::read(record, file, name.c_str(), fields, checkpoint);
+        });
+      }
+
+      static void process(const std::string &name, const options_t &options, record_t *record)
+      {
+        const fields_t fields = get_fields(options);
+
+        stat_key_t key;
+        if (options.store == nullptr || get_stat_key(name.c_str(), &key) != error_t::None) {
+          parse(name, options, record);
+          return;
+        }
+
+        // A record parsed for fewer fields than asked for is as good as none
+        if (options.store->lookup(key, record) && (record->fields & (uint16_t) fields) == (uint16_t) fields) {
+          if (options.filter != nullptr && record->error == (uint8_t) error_t::None &&
+            !options.filter->admits(*record, (fields_t) record->fields))
+            record->error = (uint8_t) error_t::Rejected;
+
+          return;
+        }
+
+        parse(name, options, record);
+
+        // Failing to open the file is no property of its contents, neither is a file changing while being read;
+        // a rejection is only a property of the filter at hand, running out of budget one of the budget
+        if (record->error != (uint8_t) error_t::Other && record->error != (uint8_t) error_t::Rejected &&
+          record->error != (uint8_t) error_t::BudgetExceeded && record->size == key.size)
+          options.store->insert(key, *record);
+      }
+    } // namespace detail
+
+    error_t read(record_t *record, const std::string &name, const options_t &options)
+    {
+      detail::process(name, options, record);
+      return (error_t) record->error;
+    }
+
+    size_t get_thread_count(const options_t &options)
+    {
+      return options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    error_t run(const std::vector<std::string> &roots, const options_t &options, const sink_t &sink)
+    {
+      namespace fs = std::filesystem;
+
+      detail::queue_t queue;
+      std::vector<std::thread> workers;
+
+      const size_t threads = get_thread_count(options);
+      for (size_t worker = 0; worker < threads; ++worker) {
+        workers.emplace_back([&queue, &options, &sink, worker] {
+          std::vector<std::string> batch;
+          record_t record;
+
+          while (queue.pop(&batch)) {
+            for (const auto &name : batch) {
+              detail::process(name, options, &record);
+              if (record.error != (uint8_t) error_t::Rejected)
+                sink(worker, name.c_str(), record);
+            }
+          }
+        });
+      }
+
+      error_t error = error_t::None;
+      std::vector<std::string> batch;
+      batch.reserve(detail::batch_size);
+
+      const auto enqueue = [&queue, &batch] (std::string &&name) {
+        batch.push_back(std::move(name));
+        if (batch.size() == detail::batch_size) {
+          queue.push(std::move(batch));
+          batch = std::vector<std::string>();
+          batch.reserve(detail::batch_size);
+        }
+      };
+
+      for (const auto &root : roots) {
+        std::error_code code;
+
+        if (fs::is_regular_file(root, code)) {
+          enqueue(std::string(root));
+          continue;
+        }
+
+        fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, code), end;
+        if (code) {
+          error = error_t::Other;
+          continue;
+        }
+
+        for (; it != end; it.increment(code)) {
+          if (code)
+            break;
+
+          if (it->is_regular_file(code))
+            enqueue(it->path().string());
+        }
+
+        if (code)
+          error = error_t::Other;
+      }
+
+      if (!batch.empty())
+        queue.push(std::move(batch));
+
+      queue.finish();
+      for (auto &worker : workers)
+        worker.join();
+
+      return error;
+    }
+  } // namespace scan
+} // namespace doors
+
+#endif
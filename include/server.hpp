@@ -0,0 +1,675 @@
+#if !defined(__SERVER_DETAIL__)
+#define __SERVER_DETAIL__
+
+// Resident probe server: answers batched probe requests over a Unix domain socket from a warm process, so that
+// callers no longer pay for process setup on every single file. Worker threads and their buffers are created once
+// and reused across requests; an idle connection costs a pollfd, not a thread.
+//
+// Pending issue(s):
+//   Windows support (AF_UNIX is available through <afunix.h> since Windows 10 1803, but isn't wired up yet)
+//   Testing
+//
+// Wire protocol (little endian, every structure is packed):
+//   Request:  request_header_t, followed by `count` times an entry_header_t and its `length` payload bytes.
+//             A path payload is NOT NUL-terminated, a buffer payload holds the complete file contents.
+//   Response: response_header_t, followed by `count` record_t (see system/record.hpp) in request order.
+//             Per-entry failures are reported through record_t::error, a malformed request closes the connection.
+// A connection carries any number of request/response round trips, one at a time.
+//
+// An optional cache (see cache.hpp, CACHE_DETAIL has to be compiled within the same translation unit) answers
+// repeated probes of unchanged files and buffers without parsing them again.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/record.hpp>
+#include <cache.hpp>
+#include <probe.hpp>
+
+#include <spdlog/spdlog.h>
+
+namespace doors {
+  namespace server {
+    constexpr const uint32_t request_magic = 0x31515244;  // "DRQ1"
+    constexpr const uint32_t response_magic = 0x31535244; // "DRS1"
+
+    // Covers record_t's layout as well, thus bumped along with record_version.
+    constexpr const uint16_t protocol_version = record_version;
+
+    enum class entry_kind_t : uint8_t {
+      path,
+      buffer
+    };
+
+    __PACKED_STRUCT_START request_header_t {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t count;
+    };
+    __PACKED_STRUCT_END
+
+    __PACKED_STRUCT_START entry_header_t {
+      uint8_t kind; // entry_kind_t
+      uint8_t reserved[3];
+      uint32_t length;
+    };
+    __PACKED_STRUCT_END
+
+    __PACKED_STRUCT_START response_header_t {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t count;
+    };
+    __PACKED_STRUCT_END
+
+    struct options_t {
+      std::string path;                      // Socket path, a stale socket left behind is replaced
+      size_t threads = 0;                    // Worker threads, 0 picks std::thread::hardware_concurrency()
+      uint16_t max_batch = 4096;             // Entries per request
+      uint32_t max_entry_length = 64u << 20; // Bytes per path/buffer entry
+      int timeout = 5000;                    // Milliseconds a client has to send a whole request in
+      cache::cache_t *cache = nullptr;       // Parse result cache, optional
+      budget_t budget;                       // Per entry, keeps a hostile upload from stalling its worker
+    };
+
+    class server_t {
+    public:
+      explicit server_t(const options_t &options);
+      ~server_t();
+
+      error_t start();
+      void stop();
+      void wait();
+
+      uint64_t requests() const { return request_count.load(std::memory_order_relaxed); }
+      uint64_t entries() const { return entry_count.load(std::memory_order_relaxed); }
+
+    private:
+      // Scratch space owned by a single worker, kept warm across requests
+      struct worker_t {
+        std::vector<uint8_t> payload;
+        std::vector<uint8_t> response;
+        std::string path;
+      };
+
+      void dispatch();
+      void work();
+      bool serve(int connection, worker_t &worker);
+
+      options_t options;
+      int listener = -1;
+      int wake[2] = { -1, -1 };
+      std::atomic<bool> running{false};
+
+      std::thread dispatcher;
+      std::vector<std::thread> workers;
+
+      std::mutex mutex;
+      std::condition_variable ready;
+      std::deque<int> pending;  // Readable connections waiting for a worker
+      std::vector<int> handed;  // Connections handed back to the dispatcher once their request got answered
+
+      std::atomic<uint64_t> request_count{0};
+      std::atomic<uint64_t> entry_count{0};
+    };
+
+    struct entry_t {
+      entry_kind_t kind;
+      const void *data;
+      uint32_t length;
+
+      static entry_t path(const char *name);
+      static entry_t buffer(const void *data, uint32_t length);
+    };
+
+    // Client side of the protocol, a single connection. Not thread-safe: use one client_t per thread.
+    class client_t {
+    public:
+      client_t() = default;
+      ~client_t();
+
+      client_t(const client_t &) = delete;
+      client_t &operator=(const client_t &) = delete;
+
+      error_t connect(const char *path);
+      void close();
+      bool connected() const { return connection != -1; }
+
+      error_t probe(const std::vector<entry_t> &entries, std::vector<record_t> *records);
+
+    private:
+      int connection = -1;
+      std::vector<uint8_t> frame; // Request headers, reused across calls
+    };
+  } // namespace server
+} // namespace doors
+
+#endif
+
+#ifdef SERVER_DETAIL
+#undef SERVER_DETAIL
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+namespace doors {
+  namespace server {
+    namespace detail {
+      static bool read_all(int fd, void *data, size_t length)
+      {
+        uint8_t *p = static_cast<uint8_t *>(data);
+
+        while (length != 0) {
+          const ssize_t count = ::recv(fd, p, length, 0);
+          if (count > 0) {
+            p += count;
+            length -= (size_t) count;
+          }
+          else if (count < 0 && errno == EINTR)
+            continue;
+          else
+            return false; // EOF, timeout or a genuine error
+        }
+
+        return true;
+      }
+
+      // As above, giving up at `deadline` however the bytes trickle in: SO_RCVTIMEO only bounds each recv()
+      static bool read_all(int fd, void *data, size_t length, std::chrono::steady_clock::time_point deadline)
+      {
+        uint8_t *p = static_cast<uint8_t *>(data);
+
+        while (length != 0) {
+          const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()
+          ).count();
+          if (remaining <= 0)
+            return false;
+
+          struct pollfd descriptor = { fd, POLLIN, 0 };
+          const int ready = ::poll(&descriptor, 1, (int) std::min<long long>(remaining, INT_MAX));
+          if (ready < 0 && errno == EINTR)
+            continue;
+          if (ready <= 0)
+            return false;
+
+          const ssize_t count = ::recv(fd, p, length, MSG_DONTWAIT);
+          if (count > 0) {
+            p += count;
+            length -= (size_t) count;
+          }
+          else if (count < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+          else
+            return false;
+        }
+
+        return true;
+      }
+
+      static bool write_all(int fd, struct iovec *vector, size_t count)
+      {
+        while (count != 0) {
+          const size_t chunk = count < (size_t) IOV_MAX ? count : (size_t) IOV_MAX;
+
+          struct msghdr message = {};
+          message.msg_iov = vector;
+          message.msg_iovlen = chunk;
+
+#if defined(MSG_NOSIGNAL)
+          ssize_t written = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+#else
+          ssize_t written = ::sendmsg(fd, &message, 0);
+#endif
+          if (written < 0) {
+            if (errno == EINTR)
+              continue;
+
+            return false;
+          }
+
+          // Step over whatever got written, partially written vectors are adjusted in place
+          while (count != 0 && written >= (ssize_t) vector->iov_len) {
+            written -= (ssize_t) vector->iov_len;
+            ++vector;
+            --count;
+          }
+
+          if (count != 0) {
+            vector->iov_base = static_cast<uint8_t *>(vector->iov_base) + written;
+            vector->iov_len -= (size_t) written;
+          }
+        }
+
+        return true;
+      }
+
+      static bool write_all(int fd, const void *data, size_t length)
+      {
+        struct iovec vector = { const_cast<void *>(data), length };
+        return write_all(fd, &vector, 1);
+      }
+
+      static bool fill_address(struct sockaddr_un *address, const char *path)
+      {
+        std::memset(address, 0, sizeof *address);
+        address->sun_family = AF_UNIX;
+
+        if (path == nullptr || std::strlen(path) >= sizeof address->sun_path)
+          return false;
+
+        std::strcpy(address->sun_path, path);
+
+        return true;
+      }
+    } // namespace detail
+
+    server_t::server_t(const options_t &options)
+      : options(options)
+    {
+      if (this->options.threads == 0)
+        this->options.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    server_t::~server_t()
+    {
+      stop();
+      wait();
+    }
+
+    error_t server_t::start()
+    {
+#ifdef SERVER_DETAIL_DEBUG
+      spdlog::set_pattern("[%^%l%$] %v");
+      spdlog::set_level(spdlog::level::debug);
+
+      const char *signature = __SIGNATURE;
+#endif
+
+      struct sockaddr_un address;
+      if (running.load() || !detail::fill_address(&address, options.path.c_str()))
+        return error_t::Other;
+
+      // Only ever replace a leftover socket, never a regular file that happens to share the name
+      struct stat status;
+      if (::stat(options.path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+        ::unlink(options.path.c_str());
+
+      listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+      if (listener == -1)
+        return error_t::Other;
+
+      ::fcntl(listener, F_SETFD, FD_CLOEXEC);
+      ::fcntl(listener, F_SETFL, ::fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+      if (::bind(listener, (struct sockaddr *) &address, sizeof address) != 0 ||
+          ::listen(listener, SOMAXCONN) != 0 ||
+          ::pipe(wake) != 0) {
+#ifdef SERVER_DETAIL_DEBUG
+        spdlog::critical(
+          "[{}] Couldn't listen on {}: {}",
+          signature,
+          options.path,
+          std::strerror(errno)
+        );
+#endif
+        ::close(listener);
+        listener = -1;
+        return error_t::Other;
+      }
+
+      for (int fd : wake)
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      ::fcntl(wake[0], F_SETFL, ::fcntl(wake[0], F_GETFL) | O_NONBLOCK);
+
+      running.store(true);
+      dispatcher = std::thread(&server_t::dispatch, this);
+      for (size_t i = 0; i < options.threads; ++i)
+        workers.emplace_back(&server_t::work, this);
+
+#ifdef SERVER_DETAIL_DEBUG
+      spdlog::debug(
+        "[{}] Listening on {} with {} worker(s)",
+        signature,
+        options.path,
+        options.threads
+      );
+#endif
+
+      return error_t::None;
+    }
+
+    void server_t::stop()
+    {
+      if (!running.exchange(false))
+        return;
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.notify_all();
+      }
+
+      const uint8_t byte = 0;
+      (void) !::write(wake[1], &byte, 1);
+    }
+
+    void server_t::wait()
+    {
+      if (dispatcher.joinable())
+        dispatcher.join();
+
+      for (auto &worker : workers) {
+        if (worker.joinable())
+          worker.join();
+      }
+      workers.clear();
+
+      for (int connection : pending)
+        ::close(connection);
+      pending.clear();
+
+      for (int connection : handed)
+        ::close(connection);
+      handed.clear();
+
+      if (listener != -1) {
+        ::close(listener);
+        ::unlink(options.path.c_str());
+        listener = -1;
+      }
+
+      for (int &fd : wake) {
+        if (fd != -1)
+          ::close(fd);
+        fd = -1;
+      }
+    }
+
+    // Polls the listening socket along with every idle connection; a connection becomes a worker's business only
+    // while a request is actually pending on it.
+    void server_t::dispatch()
+    {
+      std::vector<int> idle;
+      std::vector<int> next;
+      std::vector<struct pollfd> descriptors;
+
+      while (running.load()) {
+        descriptors.clear();
+        descriptors.push_back({ wake[0], POLLIN, 0 });
+        descriptors.push_back({ listener, POLLIN, 0 });
+        for (int connection : idle)
+          descriptors.push_back({ connection, POLLIN, 0 });
+
+        if (::poll(descriptors.data(), descriptors.size(), -1) < 0) {
+          if (errno == EINTR)
+            continue;
+
+          break;
+        }
+
+        next.clear();
+        for (size_t i = 2; i < descriptors.size(); ++i) {
+          const auto &descriptor = descriptors[i];
+
+          if (descriptor.revents & POLLNVAL)
+            continue;
+
+          if (descriptor.revents & (POLLIN | POLLHUP | POLLERR)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(descriptor.fd);
+            ready.notify_one();
+          }
+          else
+            next.push_back(descriptor.fd);
+        }
+
+        if (descriptors[0].revents & POLLIN) {
+          uint8_t drain[64];
+          while (::read(wake[0], drain, sizeof drain) > 0)
+            ;
+
+          std::lock_guard<std::mutex> lock(mutex);
+          next.insert(next.end(), handed.begin(), handed.end());
+          handed.clear();
+        }
+
+        if (descriptors[1].revents & POLLIN) {
+          int connection;
+          while ((connection = ::accept(listener, nullptr, nullptr)) != -1) {
+            ::fcntl(connection, F_SETFD, FD_CLOEXEC);
+
+            struct timeval timeout = { options.timeout / 1000, (options.timeout % 1000) * 1000 };
+            ::setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+            ::setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+#if defined(SO_NOSIGPIPE)
+            const int one = 1;
+            ::setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof one);
+#endif
+            next.push_back(connection);
+          }
+        }
+
+        idle.swap(next);
+      }
+
+      for (int connection : idle)
+        ::close(connection);
+    }
+
+    void server_t::work()
+    {
+      worker_t worker;
+
+      for (;;) {
+        int connection;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          ready.wait(lock, [this] { return !running.load() || !pending.empty(); });
+
+          if (!running.load())
+            return;
+
+          connection = pending.front();
+          pending.pop_front();
+        }
+
+        if (serve(connection, worker)) {
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            handed.push_back(connection);
+          }
+
+          const uint8_t byte = 0;
+          (void) !::write(wake[1], &byte, 1);
+        }
+        else
+          ::close(connection);
+      }
+    }
+
+    // Answers exactly one request, false whenever the connection should be dropped.
+    bool server_t::serve(int connection, worker_t &worker)
+    {
+      // The whole request has to be in by then. Time spent parsing entries is the server's, not the client's: it
+      // moves the deadline along.
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeout);
+
+      request_header_t request;
+      if (!detail::read_all(connection, &request, sizeof request, deadline))
+        return false;
+
+      if (request.magic != request_magic || request.version != protocol_version || request.count > options.max_batch)
+        return false;
+
+      worker.response.resize(sizeof(response_header_t) + request.count * sizeof(record_t));
+
+      response_header_t response = { response_magic, protocol_version, request.count };
+      std::memcpy(worker.response.data(), &response, sizeof response);
+
+      for (uint16_t i = 0; i < request.count; ++i) {
+        entry_header_t entry;
+        if (!detail::read_all(connection, &entry, sizeof entry, deadline) || entry.length > options.max_entry_length)
+          return false;
+
+        worker.payload.resize(entry.length);
+        if (!detail::read_all(connection, worker.payload.data(), entry.length, deadline))
+          return false;
+
+        const auto parsing = std::chrono::steady_clock::now();
+        record_t record;
+        switch ((entry_kind_t) entry.kind) {
+          case entry_kind_t::path:
+            worker.path.assign(reinterpret_cast<const char *>(worker.payload.data()), entry.length);
+            if (options.cache != nullptr)
+              options.cache->read(&record, worker.path.c_str(), options.budget);
+            else
+              probe::read(&record, worker.path.c_str(), fields_t::defaults, nullptr, options.budget);
+            break;
+          case entry_kind_t::buffer:
+            if (options.cache != nullptr)
+              options.cache->read(&record, worker.payload.data(), entry.length, options.budget);
+            else
+              probe::read(&record, worker.payload.data(), entry.length, fields_t::defaults, nullptr, options.budget);
+            break;
+          default:
+            record = record_t{};
+            record.error = (uint8_t) error_t::InvalidRequest;
+            break;
+        }
+
+        std::memcpy(worker.response.data() + sizeof response + i * sizeof record, &record, sizeof record);
+        deadline += std::chrono::steady_clock::now() - parsing;
+      }
+
+      request_count.fetch_add(1, std::memory_order_relaxed);
+      entry_count.fetch_add(request.count, std::memory_order_relaxed);
+
+      return detail::write_all(connection, worker.response.data(), worker.response.size());
+    }
+
+    entry_t entry_t::path(const char *name)
+    {
+      return entry_t { entry_kind_t::path, name, (uint32_t) std::strlen(name) };
+    }
+
+    entry_t entry_t::buffer(const void *data, uint32_t length)
+    {
+      return entry_t { entry_kind_t::buffer, data, length };
+    }
+
+    client_t::~client_t()
+    {
+      close();
+    }
+
+    error_t client_t::connect(const char *path)
+    {
+      close();
+
+      struct sockaddr_un address;
+      if (!detail::fill_address(&address, path))
+        return error_t::Other;
+
+      connection = ::socket(AF_UNIX, SOCK_STREAM, 0);
+      if (connection == -1)
+        return error_t::Other;
+
+      ::fcntl(connection, F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+      const int one = 1;
+      ::setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof one);
+#endif
+
+      if (::connect(connection, (struct sockaddr *) &address, sizeof address) != 0) {
+        close();
+        return error_t::Other;
+      }
+
+      return error_t::None;
+    }
+
+    void client_t::close()
+    {
+      if (connection != -1)
+        ::close(connection);
+
+      connection = -1;
+    }
+
+    error_t client_t::probe(const std::vector<entry_t> &entries, std::vector<record_t> *records)
+    {
+      if (!connected() || records == nullptr)
+        return error_t::Other;
+
+      if (entries.size() > UINT16_MAX)
+        return error_t::InvalidRequest;
+
+      // Headers are laid out back to back in `frame`, payloads are sent straight from the caller's memory.
+      frame.resize(sizeof(request_header_t) + entries.size() * sizeof(entry_header_t));
+
+      const request_header_t request = { request_magic, protocol_version, (uint16_t) entries.size() };
+      std::memcpy(frame.data(), &request, sizeof request);
+
+      std::vector<struct iovec> vector;
+      vector.reserve(1 + entries.size() * 2);
+      vector.push_back({ frame.data(), sizeof request });
+
+      for (size_t i = 0; i < entries.size(); ++i) {
+        uint8_t *p = frame.data() + sizeof request + i * sizeof(entry_header_t);
+
+        entry_header_t entry = {};
+        entry.kind = (uint8_t) entries[i].kind;
+        entry.length = entries[i].length;
+        std::memcpy(p, &entry, sizeof entry);
+
+        vector.push_back({ p, sizeof entry });
+        if (entries[i].length != 0)
+          vector.push_back({ const_cast<void *>(entries[i].data), entries[i].length });
+      }
+
+      if (!detail::write_all(connection, vector.data(), vector.size())) {
+        close();
+        return error_t::Other;
+      }
+
+      response_header_t response;
+      if (!detail::read_all(connection, &response, sizeof response) ||
+          response.magic != response_magic ||
+          response.version != protocol_version ||
+          response.count != entries.size()) {
+        close();
+        return error_t::InvalidRequest;
+      }
+
+      records->resize(response.count);
+      if (!detail::read_all(connection, records->data(), response.count * sizeof(record_t))) {
+        close();
+        return error_t::Other;
+      }
+
+      return error_t::None;
+    }
+  } // namespace server
+} // namespace doors
+
+#endif
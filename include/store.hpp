@@ -0,0 +1,429 @@
+#if !defined(__STORE_DETAIL__)
+#define __STORE_DETAIL__
+
+// Persistent metadata cache keyed by file identity (see system/stat.hpp), letting a re-scan skip opening every
+// file whose (device, inode, size, mtime) didn't change since the last run.
+//
+// On disk, a store is made of two files:
+//   <name>      Snapshot: file_header_t followed by entry_t sorted by key, memory mapped and binary searched.
+//   <name>.log  Append-only update log: file_header_t followed by entry_t in insertion order. It's read back into
+//               an in-memory overlay on open; a torn trailing entry (crash mid-write) is simply ignored.
+// compact() merges the log into a new snapshot (written aside, then renamed over the old one) and truncates the log.
+// close() does so by itself once the log has grown past compaction_threshold() entries.
+//
+// Pending issue(s):
+//   Stale entries (files gone or changed) are only dropped by compact(true), which keeps whatever got looked up
+//   or inserted since open().
+//   Testing
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/record.hpp>
+#include <system/stat.hpp>
+
+namespace doors {
+  namespace store {
+    constexpr const uint32_t magic = 0x31545344; // "DST1"
+    constexpr const uint16_t version = record_version;
+
+    __PACKED_STRUCT_START file_header_t {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t entry_size;
+      uint64_t count; // Snapshot only, logs are counted by their length
+    };
+    __PACKED_STRUCT_END
+
+    __PACKED_STRUCT_START entry_t {
+      stat_key_t key;
+      record_t record;
+    };
+    __PACKED_STRUCT_END
+
+    class store_t {
+    public:
+      store_t() = default;
+      ~store_t();
+
+      store_t(const store_t &) = delete;
+      store_t &operator=(const store_t &) = delete;
+
+      // Creates the store whenever it doesn't exist yet.
+      error_t open(const char *name);
+      void close();
+
+      // Both are safe to call from any number of threads.
+      bool lookup(const stat_key_t &key, record_t *record);
+      error_t insert(const stat_key_t &key, const record_t &record);
+
+      error_t flush();
+      error_t compact(bool prune = false);
+
+      size_t size() const;
+      size_t compaction_threshold() const;
+
+      uint64_t hits() const { return hit_count.load(std::memory_order_relaxed); }
+      uint64_t misses() const { return miss_count.load(std::memory_order_relaxed); }
+
+    private:
+      struct overlay_t {
+        record_t record;
+        std::atomic<uint8_t> touched{0};
+      };
+
+      error_t map();
+      void unmap();
+      error_t open_log(bool truncate);
+
+      std::string name;
+
+      // Snapshot mapping
+      const entry_t *entries = nullptr;
+      size_t count = 0;
+      void *mapping = nullptr;
+      size_t mapping_length = 0;
+#if defined(_WIN32)
+      void *file_handle = nullptr;
+      void *mapping_handle = nullptr;
+#endif
+      std::unique_ptr<std::atomic<uint8_t>[]> touched;
+
+      mutable std::shared_mutex mutex;
+      std::unordered_map<stat_key_t, overlay_t, stat_key_hash_t> overlay;
+      std::FILE *log = nullptr;
+
+      std::atomic<uint64_t> hit_count{0};
+      std::atomic<uint64_t> miss_count{0};
+    };
+  } // namespace store
+} // namespace doors
+
+#endif
+
+#ifdef STORE_DETAIL
+#undef STORE_DETAIL
+
+#include <algorithm>
+#include <filesystem>
+#include <vector>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+namespace doors {
+  namespace store {
+    namespace detail {
+      static bool sync(std::FILE *file)
+      {
+        if (std::fflush(file) != 0)
+          return false;
+
+#if defined(_WIN32)
+        return ::_commit(::_fileno(file)) == 0;
+#else
+        return ::fsync(::fileno(file)) == 0;
+#endif
+      }
+    } // namespace detail
+
+    store_t::~store_t()
+    {
+      close();
+    }
+
+    error_t store_t::map()
+    {
+      std::error_code code;
+      if (!std::filesystem::exists(name, code))
+        return error_t::None; // Nothing compacted yet
+
+#if defined(_WIN32)
+      ::HANDLE file = ::CreateFileA(name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (file == INVALID_HANDLE_VALUE)
+        return error_t::Other;
+
+      ::LARGE_INTEGER length;
+      ::GetFileSizeEx(file, &length);
+      ::HANDLE view = length.QuadPart != 0 ? ::CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+      mapping = view != nullptr ? ::MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0) : nullptr;
+      mapping_length = (size_t) length.QuadPart;
+      file_handle = file;
+      mapping_handle = view;
+#else
+      const int fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd == -1)
+        return error_t::Other;
+
+      mapping_length = (size_t) ::lseek(fd, 0, SEEK_END);
+      mapping = mapping_length != 0 ? ::mmap(nullptr, mapping_length, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+      ::close(fd);
+
+      if (mapping == MAP_FAILED)
+        mapping = nullptr;
+#endif
+
+      if (mapping == nullptr || mapping_length < sizeof(file_header_t)) {
+        unmap();
+        return error_t::InvalidFormat;
+      }
+
+      const file_header_t *header = static_cast<const file_header_t *>(mapping);
+      if (header->magic != magic || header->version != version || header->entry_size != sizeof(entry_t) ||
+          header->count > (mapping_length - sizeof(file_header_t)) / sizeof(entry_t)) {
+        unmap();
+        return error_t::InvalidFormat;
+      }
+
+      entries = reinterpret_cast<const entry_t *>(static_cast<const uint8_t *>(mapping) + sizeof(file_header_t));
+      count = (size_t) header->count;
+
+      touched.reset(new std::atomic<uint8_t>[count]);
+      for (size_t i = 0; i < count; ++i)
+        touched[i].store(0, std::memory_order_relaxed);
+
+      return error_t::None;
+    }
+
+    void store_t::unmap()
+    {
+#if defined(_WIN32)
+      if (mapping != nullptr)
+        ::UnmapViewOfFile(mapping);
+      if (mapping_handle != nullptr)
+        ::CloseHandle(mapping_handle);
+      if (file_handle != nullptr)
+        ::CloseHandle(file_handle);
+
+      file_handle = nullptr;
+      mapping_handle = nullptr;
+#else
+      if (mapping != nullptr)
+        ::munmap(mapping, mapping_length);
+#endif
+
+      mapping = nullptr;
+      mapping_length = 0;
+      entries = nullptr;
+      count = 0;
+      touched.reset();
+    }
+
+    error_t store_t::open_log(bool truncate)
+    {
+      const std::string log_name = name + ".log";
+
+      if (log != nullptr)
+        std::fclose(log);
+
+      log = std::fopen(log_name.c_str(), truncate ? "wb" : "ab");
+      if (log == nullptr)
+        return error_t::Other;
+
+      std::fseek(log, 0, SEEK_END);
+      if (std::ftell(log) == 0) {
+        const file_header_t header = { magic, version, (uint16_t) sizeof(entry_t), 0u };
+        std::fwrite(&header, sizeof header, 1, log);
+      }
+
+      return error_t::None;
+    }
+
+    error_t store_t::open(const char *name)
+    {
+      close();
+
+      std::unique_lock<std::shared_mutex> lock(mutex);
+      this->name = name;
+
+      // An incompatible snapshot (older record_t layout, ...) is as good as none, the log gets rebuilt alongside.
+      bool compatible = true;
+      if (map() == error_t::InvalidFormat)
+        compatible = false;
+
+      const std::string log_name = this->name + ".log";
+      if (compatible) {
+        scoped_file file(log_name.c_str());
+        if (file.valid()) {
+          file_header_t header;
+          if (std::fread(&header, sizeof header, 1, file.p) == 1 &&
+              header.magic == magic && header.version == version && header.entry_size == sizeof(entry_t)) {
+            entry_t entry;
+            while (std::fread(&entry, sizeof entry, 1, file.p) == 1)
+              overlay[entry.key].record = entry.record;
+          }
+          else
+            compatible = false;
+        }
+      }
+
+      if (!compatible) {
+        unmap();
+        overlay.clear();
+
+        std::error_code code;
+        std::filesystem::remove(this->name, code);
+      }
+
+      return open_log(!compatible);
+    }
+
+    void store_t::close()
+    {
+      if (log == nullptr && mapping == nullptr)
+        return;
+
+      if (overlay.size() > compaction_threshold())
+        compact();
+
+      std::unique_lock<std::shared_mutex> lock(mutex);
+
+      if (log != nullptr)
+        std::fclose(log);
+      log = nullptr;
+
+      unmap();
+      overlay.clear();
+    }
+
+    bool store_t::lookup(const stat_key_t &key, record_t *record)
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+
+      const auto it = overlay.find(key);
+      if (it != overlay.end()) {
+        *record = it->second.record;
+        it->second.touched.store(1, std::memory_order_relaxed);
+        hit_count.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+
+      const entry_t *end = entries + count;
+      const entry_t *entry = std::lower_bound(entries, end, key, [] (const entry_t &lhs, const stat_key_t &rhs) {
+        return lhs.key < rhs;
+      });
+
+      if (entry != end && entry->key == key) {
+        *record = entry->record;
+        touched[entry - entries].store(1, std::memory_order_relaxed);
+        hit_count.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+
+      miss_count.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    error_t store_t::insert(const stat_key_t &key, const record_t &record)
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex);
+
+      if (log == nullptr)
+        return error_t::Other;
+
+      overlay_t &value = overlay[key];
+      value.record = record;
+      value.touched.store(1, std::memory_order_relaxed);
+
+      const entry_t entry = { key, record };
+      return std::fwrite(&entry, sizeof entry, 1, log) == 1 ? error_t::None : error_t::Other;
+    }
+
+    error_t store_t::flush()
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex);
+      return log != nullptr && std::fflush(log) == 0 ? error_t::None : error_t::Other;
+    }
+
+    error_t store_t::compact(bool prune)
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex);
+
+      if (log == nullptr)
+        return error_t::Other;
+
+      std::vector<entry_t> merged;
+      merged.reserve(count + overlay.size());
+
+      for (size_t i = 0; i < count; ++i) {
+        if (prune && touched[i].load(std::memory_order_relaxed) == 0)
+          continue;
+
+        // Same identity in both means an unchanged file that got re-inserted, the overlay wins all the same
+        if (overlay.find(entries[i].key) == overlay.end())
+          merged.push_back(entries[i]);
+      }
+
+      for (const auto &pair : overlay) {
+        if (prune && pair.second.touched.load(std::memory_order_relaxed) == 0)
+          continue;
+
+        merged.push_back(entry_t { pair.first, pair.second.record });
+      }
+
+      std::sort(merged.begin(), merged.end(), [] (const entry_t &lhs, const entry_t &rhs) {
+        return lhs.key < rhs.key;
+      });
+
+      // Written aside and renamed over, readers never observe a half-written snapshot
+      const std::string temporary = name + ".tmp";
+      std::FILE *file = std::fopen(temporary.c_str(), "wb");
+      if (file == nullptr)
+        return error_t::Other;
+
+      const file_header_t header = { magic, version, (uint16_t) sizeof(entry_t), (uint64_t) merged.size() };
+      const bool written =
+        std::fwrite(&header, sizeof header, 1, file) == 1 &&
+        std::fwrite(merged.data(), sizeof(entry_t), merged.size(), file) == merged.size() &&
+        detail::sync(file);
+      std::fclose(file);
+
+      std::error_code code;
+      if (!written) {
+        std::filesystem::remove(temporary, code);
+        return error_t::Other;
+      }
+
+      unmap();
+      std::filesystem::rename(temporary, name, code);
+      if (code) {
+        map();
+        return error_t::Other;
+      }
+
+      overlay.clear();
+      const error_t error = open_log(true);
+      if (error != error_t::None)
+        return error;
+
+      return map();
+    }
+
+    size_t store_t::size() const
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+      return count + overlay.size();
+    }
+
+    size_t store_t::compaction_threshold() const
+    {
+      return std::max<size_t>(4096u, count / 8u);
+    }
+  } // namespace store
+} // namespace doors
+
+#endif
@@ -1,25 +1,33 @@
 #pragma once
 
-enum class error_t {
-  None,
-  InvalidFormat,
-  Other,
+// error_t lives inside doors:: since glibc's <errno.h> already typedefs a global error_t (as int)
+// whenever _GNU_SOURCE is defined, which g++ always does.
+namespace doors {
+  enum class error_t {
+    None,
+    InvalidFormat,
+    Other,
 
-  InvalidGIF,
-  InvalidJPG,
-  InvalidPNG,
-  InvalidPSD,
-  InvalidTGA
-};
+    InvalidGIF,
+    InvalidJPG,
+    InvalidPNG,
+    InvalidPSD,
+    InvalidTGA,
+
+    InvalidRequest,
+    Rejected, // Failed a filter (see filter.hpp) before being fully parsed
+    BudgetExceeded // Ran out of its budget_t (see compiler.hpp) before being fully parsed
+  };
+} // namespace doors
 
 struct error_message_t {
-  error_t error;
+  doors::error_t error;
   char *message;
 };
 
 error_message_t errors[] = {
   error_message_t {
-    error_t::None,
+    doors::error_t::None,
     "Nothing In Your Eyes"
   }
 };
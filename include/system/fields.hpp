@@ -0,0 +1,100 @@
+#pragma once
+
+// Field projection: which parts of a record_t the caller actually cares about. Parsers stop reading as soon as the
+// requested fields are known, whatever lies beyond (GIF frames, PNG chunks, the TGA footer, PSD resources) is only
+// walked when asked for.
+//
+// Fields living in a format's fixed header come for free and are always filled in; the bits below only make a
+// difference where getting a field means reading on. `defaults` is what scans, the server and the cache go by: every
+// field but the preview budget, which costs a walk through scan data and has to be asked for.
+//
+// Parsers may also be handed a checkpoint, called with whatever they know so far whenever they're about to read
+// on. Returning false has them give up right away with error_t::Rejected (see filter.hpp).
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/record.hpp>
+
+namespace doors {
+  enum class fields_t : uint16_t {
+    none = 0,
+    dimensions = 1 << 0, // Width, height (JPG: the SOFn marker has to be found)
+    depth = 1 << 1,      // Bits per pixel, color space (ditto)
+    frames = 1 << 2,     // GIF frame count along with the animated flag: a walk through every block
+    layers = 1 << 3,     // PSD layer count: a walk past the image resources
+    version = 1 << 4,    // TGA version (and extension area): a seek to the footer
+    chunks = 1 << 5,     // PNG chunk census, DEFLATE level: a walk through every chunk
+    trailer = 1 << 6,    // Truncation check (record_flags_t::truncated): a single read off the file's tail
+    animation = 1 << 7,  // GIF animated flag alone: the block walk stops at the second frame (frames is then 1 or 2)
+    exif = 1 << 8,       // JPG orientation, capture time: the APP1 segment gets read instead of skipped
+    thumbnail = 1 << 9,  // JPG embedded thumbnail location (JPG_header_t only): ditto, the walk goes on up to SOFn
+    quality = 1 << 10,   // JPG quality estimate: DQT segments get read instead of skipped, the walk goes on up to SOFn
+    preview = 1 << 11,   // Preview byte budget: progressive JPG scan data gets skipped through, Adam7 PNG IDAT inflated
+
+    basic = dimensions | depth,
+    defaults = 0xFFFF & ~preview,
+    all = 0xFFFF
+  };
+
+  // `record` is partial: format and size are always known, anything else only as far as `known` says.
+  using checkpoint_t = std::function<bool(const record_t &record, fields_t known)>;
+
+  // Comma-separated names, e.g. "dimensions,frames"; "basic", "defaults" and "all" are accepted as well.
+  inline bool parse_fields(const char *list, fields_t *fields)
+  {
+    static const struct {
+      const char *name;
+      fields_t value;
+    } names[] = {
+      { "dimensions", fields_t::dimensions },
+      { "depth", fields_t::depth },
+      { "frames", fields_t::frames },
+      { "layers", fields_t::layers },
+      { "version", fields_t::version },
+      { "chunks", fields_t::chunks },
+      { "trailer", fields_t::trailer },
+      { "animation", fields_t::animation },
+      { "exif", fields_t::exif },
+      { "thumbnail", fields_t::thumbnail },
+      { "quality", fields_t::quality },
+      { "preview", fields_t::preview },
+      { "basic", fields_t::basic },
+      { "defaults", fields_t::defaults },
+      { "all", fields_t::all }
+    };
+
+    if (list == nullptr || fields == nullptr)
+      return false;
+
+    fields_t r = fields_t::none;
+
+    while (*list != '\0') {
+      const char *end = std::strchr(list, ',');
+      const size_t length = end != nullptr ? (size_t) (end - list) : std::strlen(list);
+
+      bool found = false;
+      for (const auto &entry : names) {
+        if (std::strlen(entry.name) == length && std::strncmp(entry.name, list, length) == 0) {
+          r = r | entry.value;
+          found = true;
+          break;
+        }
+      }
+
+      if (!found)
+        return false;
+
+      list += length;
+      if (*list == ',')
+        ++list;
+    }
+
+    *fields = r;
+    return true;
+  }
+} // namespace doors
@@ -0,0 +1,157 @@
+#pragma once
+
+// In-tree XXH64 (https://github.com/Cyan4973/xxHash, xxhash.h spec v0.1.1), one-shot as well as streaming.
+// Fast and well distributed, but NOT cryptographic: good for spotting identical contents, not for adversaries.
+
+#include <cstdint>
+#include <cstring>
+
+namespace doors {
+  namespace hash {
+    namespace detail {
+      constexpr const uint64_t prime1 = 0x9E3779B185EBCA87ull;
+      constexpr const uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+      constexpr const uint64_t prime3 = 0x165667B19E3779F9ull;
+      constexpr const uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+      constexpr const uint64_t prime5 = 0x27D4EB2F165667C5ull;
+
+      inline uint64_t rotl(uint64_t x, int r)
+      {
+        return (x << r) | (x >> (64 - r));
+      }
+
+      // Unaligned little endian loads (the hash is defined on little endian words)
+      inline uint64_t read64(const uint8_t *p)
+      {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof v);
+        return v;
+      }
+
+      inline uint32_t read32(const uint8_t *p)
+      {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof v);
+        return v;
+      }
+
+      inline uint64_t round(uint64_t accumulator, uint64_t input)
+      {
+        accumulator += input * prime2;
+        accumulator = rotl(accumulator, 31);
+        return accumulator * prime1;
+      }
+
+      inline uint64_t merge(uint64_t accumulator, uint64_t value)
+      {
+        accumulator ^= round(0, value);
+        return accumulator * prime1 + prime4;
+      }
+
+      inline uint64_t finalize(uint64_t h, const uint8_t *p, size_t length)
+      {
+        for (; length >= 8; p += 8, length -= 8) {
+          h ^= round(0, read64(p));
+          h = rotl(h, 27) * prime1 + prime4;
+        }
+
+        if (length >= 4) {
+          h ^= (uint64_t) read32(p) * prime1;
+          h = rotl(h, 23) * prime2 + prime3;
+          p += 4;
+          length -= 4;
+        }
+
+        for (; length > 0; ++p, --length) {
+          h ^= (uint64_t) *p * prime5;
+          h = rotl(h, 11) * prime1;
+        }
+
+        h ^= h >> 33;
+        h *= prime2;
+        h ^= h >> 29;
+        h *= prime3;
+        h ^= h >> 32;
+
+        return h;
+      }
+    } // namespace detail
+
+    struct xxh64_t {
+      uint64_t v[4];
+      uint64_t total = 0;
+      uint8_t buffer[32];
+      size_t buffered = 0;
+      uint64_t seed;
+
+      explicit xxh64_t(uint64_t seed = 0)
+        : seed(seed)
+      {
+        v[0] = seed + detail::prime1 + detail::prime2;
+        v[1] = seed + detail::prime2;
+        v[2] = seed;
+        v[3] = seed - detail::prime1;
+      }
+
+      void update(const void *data, size_t length)
+      {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        total += length;
+
+        if (buffered + length < 32) {
+          std::memcpy(buffer + buffered, p, length);
+          buffered += length;
+          return;
+        }
+
+        if (buffered != 0) {
+          const size_t fill = 32 - buffered;
+          std::memcpy(buffer + buffered, p, fill);
+          stripe(buffer);
+          p += fill;
+          length -= fill;
+          buffered = 0;
+        }
+
+        for (; length >= 32; p += 32, length -= 32)
+          stripe(p);
+
+        std::memcpy(buffer, p, length);
+        buffered = length;
+      }
+
+      uint64_t digest() const
+      {
+        uint64_t h;
+
+        if (total >= 32) {
+          h = detail::rotl(v[0], 1) + detail::rotl(v[1], 7) + detail::rotl(v[2], 12) + detail::rotl(v[3], 18);
+          for (const uint64_t lane : v)
+            h = detail::merge(h, lane);
+        }
+        else
+          h = seed + detail::prime5;
+
+        h += total;
+
+        return detail::finalize(h, buffer, buffered);
+      }
+
+    private:
+      void stripe(const uint8_t *p)
+      {
+        v[0] = detail::round(v[0], detail::read64(p));
+        v[1] = detail::round(v[1], detail::read64(p + 8));
+        v[2] = detail::round(v[2], detail::read64(p + 16));
+        v[3] = detail::round(v[3], detail::read64(p + 24));
+      }
+    };
+
+    inline uint64_t xxh64(const void *data, size_t length, uint64_t seed = 0)
+    {
+      xxh64_t state(seed);
+      state.update(data, length);
+      return state.digest();
+    }
+  } // namespace hash
+} // namespace doors
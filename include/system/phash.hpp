@@ -0,0 +1,132 @@
+#pragma once
+
+// Perceptual hashing: dHash (difference hash) over a 9x8 luma grid, 64 bits telling whether each cell is brighter
+// than its right neighbour. Recompression, scaling and mild color changes leave most bits alone, so near-duplicates
+// are a small Hamming distance apart (get_distance()): 0-5 close to certainly the same picture, over 10 a different
+// one.
+//
+// The grid is an area average of whatever comes in, which need not be pixels: JPEG block means straight off the DC
+// coefficients (jpg::decoder_t::decode_dc(), cells of 8x8 pixels or more) hash about the same as the full decode
+// does, differences being down to the edge blocks and rounding.
+//
+// Pending issue(s):
+//   No rotation or mirroring invariance
+//   Testing
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace doors {
+  namespace phash {
+    constexpr const unsigned grid_width = 9;
+    constexpr const unsigned grid_height = 8;
+
+    namespace detail {
+      // Weights of source cells [0, count) of size cell (the last one clipped to total) in each of size out bins
+      struct axis_t {
+        std::vector<uint32_t> first;
+        std::vector<uint32_t> last;
+        std::vector<double> weights;  // out x count
+      };
+
+      inline void get_axis(axis_t *axis, uint32_t count, uint32_t cell, uint32_t total, unsigned out)
+      {
+        axis->first.assign(out, 0);
+        axis->last.assign(out, 0);
+        axis->weights.assign((size_t) out * count, 0.0);
+
+        for (unsigned i = 0; i < out; ++i) {
+          const double begin = (double) total * i / out, end = (double) total * (i + 1) / out;
+
+          axis->first[i] = std::min(count - 1, (uint32_t) (begin / cell));
+          axis->last[i] = std::min(count - 1, (uint32_t) ((end - 1e-9) / cell));
+
+          for (uint32_t j = axis->first[i]; j <= axis->last[i]; ++j) {
+            const double from = std::max(begin, (double) j * cell);
+            const double to = std::min(end, std::min((double) total, (double) (j + 1) * cell));
+            axis->weights[(size_t) i * count + j] = std::max(0.0, to - from);
+          }
+        }
+      }
+    } // namespace detail
+
+    // samples: columns x rows (stride apart, in elements), each standing for cell_width x cell_height pixels of a
+    // width x height image; 1 channel (luma) or 3 (RGB, weighted as BT.601 luma). 0 when the image is empty.
+    template<typename T>
+    uint64_t get_dhash(const T *samples, size_t stride, unsigned channels, uint32_t width, uint32_t height,
+      uint32_t cell_width = 1, uint32_t cell_height = 1)
+    {
+      if (width == 0 || height == 0 || cell_width == 0 || cell_height == 0 || (channels != 1 && channels != 3))
+        return 0;
+
+      const uint32_t columns = (width + cell_width - 1) / cell_width;
+      const uint32_t rows = (height + cell_height - 1) / cell_height;
+
+      detail::axis_t x_axis, y_axis;
+      detail::get_axis(&x_axis, columns, cell_width, width, grid_width);
+      detail::get_axis(&y_axis, rows, cell_height, height, grid_height);
+
+      const auto get = [&] (uint32_t x, uint32_t y) {
+        const T *p = samples + (size_t) y * stride + (size_t) x * channels;
+        return channels == 1 ? (double) p[0] : 0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2];
+      };
+
+      // Rows first, only those some grid row overlaps
+      std::vector<double> horizontal((size_t) rows * grid_width, 0.0);
+      std::vector<bool> needed(rows, false);
+      for (unsigned gy = 0; gy < grid_height; ++gy) {
+        for (uint32_t y = y_axis.first[gy]; y <= y_axis.last[gy]; ++y)
+          needed[y] = true;
+      }
+
+      for (uint32_t y = 0; y < rows; ++y) {
+        if (!needed[y])
+          continue;
+
+        for (unsigned gx = 0; gx < grid_width; ++gx) {
+          double sum = 0.0;
+          for (uint32_t x = x_axis.first[gx]; x <= x_axis.last[gx]; ++x)
+            sum += x_axis.weights[(size_t) gx * columns + x] * get(x, y);
+
+          horizontal[(size_t) y * grid_width + gx] = sum;
+        }
+      }
+
+      double grid[grid_height][grid_width];
+      for (unsigned gy = 0; gy < grid_height; ++gy) {
+        for (unsigned gx = 0; gx < grid_width; ++gx) {
+          double sum = 0.0;
+          for (uint32_t y = y_axis.first[gy]; y <= y_axis.last[gy]; ++y)
+            sum += y_axis.weights[(size_t) gy * rows + y] * horizontal[(size_t) y * grid_width + gx];
+
+          grid[gy][gx] = sum;
+        }
+      }
+
+      uint64_t hash = 0;
+      for (unsigned gy = 0; gy < grid_height; ++gy) {
+        for (unsigned gx = 0; gx + 1 < grid_width; ++gx) {
+          if (grid[gy][gx] > grid[gy][gx + 1])
+            hash |= 1ull << (gy * 8 + gx);
+        }
+      }
+
+      return hash;
+    }
+
+    // Hamming distance, bits that differ
+    inline unsigned get_distance(uint64_t a, uint64_t b)
+    {
+#if defined(_MSC_VER)
+      return (unsigned) __popcnt64(a ^ b);
+#else
+      return (unsigned) __builtin_popcountll(a ^ b);
+#endif
+    }
+  } // namespace phash
+} // namespace doors
@@ -0,0 +1,98 @@
+#pragma once
+
+// Fixed-size, typed summary of a parsed image.
+// The string-keyed std::unordered_map<std::string, std::any> returned by parse() is handy for printing, but
+// anything crossing a process boundary (sockets, shared memory, on-disk caches) wants a flat record instead.
+// record_t is packed and laid out little endian, so it can be written out as-is.
+
+#include <cstdint>
+
+#include <compiler.hpp>
+
+namespace doors {
+  enum class format_t : uint8_t {
+    Unknown,
+    GIF,
+    JPG,
+    PNG,
+    BMP,
+    TGA,
+    PSD
+  };
+
+  enum class record_flags_t : uint8_t {
+    none = 0,
+    interlaced = 1 << 0, // PNG Adam7, progressive JPEG
+    compressed = 1 << 1, // TGA RLE
+    animated = 1 << 2,   // More than a single GIF frame
+    duplicate = 1 << 3,  // Same contents as a file recorded before (see dedup.hpp)
+    truncated = 1 << 4   // Missing its terminator, only looked for along with fields_t::trailer
+  };
+
+  // Bump whenever record_t's layout changes, or a new fields_t bit makes records recorded before it incomplete;
+  // persisted/transmitted records carry it along.
+  constexpr const uint16_t record_version = 6;
+
+  __PACKED_STRUCT_START record_t {
+    uint8_t format;       // format_t
+    uint8_t error;        // error_t
+    uint16_t version;     // The format's version_sanitized.u16
+    uint32_t width;
+    uint32_t height;
+    uint64_t size;        // File (or buffer) size in bytes
+    uint16_t frames;      // GIF frames
+    uint16_t layers;      // PSD layers
+    uint8_t bpp;
+    uint8_t color_space;  // Format-specific color space/type code
+    uint8_t flags;        // record_flags_t
+    uint16_t fields;      // fields_t the parser was asked for (see system/fields.hpp)
+    uint8_t orientation;  // EXIF orientation (1-8, 1 when the EXIF data has none), 0 without EXIF data
+    uint8_t quality;      // JPG quality estimate off its DQT tables (1-100), 0 when unknown
+    uint8_t subsampling;  // JPG chroma subsampling, horizontal << 4 | vertical (0x22: 4:2:0), 0 without chroma
+    uint32_t preview;     // File prefix a low-res preview needs (progressive JPG, Adam7 PNG), 0 when there is none
+  };
+  __PACKED_STRUCT_END
+
+  static_assert(sizeof(record_t) == 36, "record_t is part of the wire/disk format");
+
+  // record_t::subsampling in J:a:b notation, as a number: 444, 422, 420, 440, 411 or 410; 0 for anything else.
+  inline uint16_t get_subsampling_sanitized(uint8_t subsampling)
+  {
+    switch (subsampling) {
+      case 0x11:
+        return 444;
+      case 0x21:
+        return 422;
+      case 0x22:
+        return 420;
+      case 0x12:
+        return 440;
+      case 0x41:
+        return 411;
+      case 0x42:
+        return 410;
+      default:
+        return 0;
+    }
+  }
+
+  inline const char *get_format_sanitized(format_t format)
+  {
+    switch (format) {
+      case format_t::GIF:
+        return "GIF";
+      case format_t::JPG:
+        return "JPG";
+      case format_t::PNG:
+        return "PNG";
+      case format_t::BMP:
+        return "BMP";
+      case format_t::TGA:
+        return "TGA";
+      case format_t::PSD:
+        return "PSD";
+      default:
+        return "Unknown";
+    }
+  }
+} // namespace doors
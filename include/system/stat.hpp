@@ -0,0 +1,95 @@
+#pragma once
+
+// File identity as seen by the filesystem, without opening the file: (device, inode, size, mtime).
+// Whenever any of these change, whatever got parsed out of the file before has to be considered stale.
+//
+// Windows has no inode to offer without opening the file (GetFileInformationByHandle), a hash of the path takes
+// its place there.
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <system/error.hpp>
+
+namespace doors {
+  struct stat_key_t {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime; // Nanoseconds since the epoch (100ns resolution on Windows)
+
+    bool operator==(const stat_key_t &rhs) const
+    {
+      return device == rhs.device && inode == rhs.inode && size == rhs.size && mtime == rhs.mtime;
+    }
+
+    bool operator!=(const stat_key_t &rhs) const { return !(*this == rhs); }
+
+    bool operator<(const stat_key_t &rhs) const
+    {
+      if (device != rhs.device) return device < rhs.device;
+      if (inode != rhs.inode) return inode < rhs.inode;
+      if (size != rhs.size) return size < rhs.size;
+      return mtime < rhs.mtime;
+    }
+  };
+
+  static_assert(sizeof(stat_key_t) == 32, "stat_key_t gets persisted as-is");
+
+  struct stat_key_hash_t {
+    size_t operator()(const stat_key_t &key) const
+    {
+      uint64_t h = key.inode * 0x9E3779B97F4A7C15ull;
+      h ^= (key.device + 0x632BE59BD9B4E019ull) + (h << 6) + (h >> 2);
+      h ^= (key.size + 0x8CB92BA72F3D8DD7ull) + (h << 6) + (h >> 2);
+      h ^= ((uint64_t) key.mtime + 0x2545F4914F6CDD1Dull) + (h << 6) + (h >> 2);
+      return (size_t) h;
+    }
+  };
+
+  inline error_t get_stat_key(const char *name, stat_key_t *key)
+  {
+    if (name == nullptr || key == nullptr)
+      return error_t::Other;
+
+#if defined(_WIN32)
+    ::WIN32_FILE_ATTRIBUTE_DATA data;
+    if (::GetFileAttributesExA(name, GetFileExInfoStandard, &data) == 0)
+      return error_t::Other;
+
+    // FNV-1a of the path in place of the inode
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (const char *p = name; *p != '\0'; ++p)
+      h = (h ^ (uint8_t) *p) * 0x100000001B3ull;
+
+    const uint64_t ticks = (uint64_t) data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime;
+
+    key->device = 0u;
+    key->inode = h;
+    key->size = (uint64_t) data.nFileSizeHigh << 32 | data.nFileSizeLow;
+    key->mtime = (int64_t) (ticks - 116444736000000000ull) * 100; // FILETIME counts 100ns since 1601
+#else
+    struct stat status;
+    if (::stat(name, &status) != 0)
+      return error_t::Other;
+
+    key->device = (uint64_t) status.st_dev;
+    key->inode = (uint64_t) status.st_ino;
+    key->size = (uint64_t) status.st_size;
+#if defined(__APPLE__)
+    key->mtime = (int64_t) status.st_mtimespec.tv_sec * 1000000000 + status.st_mtimespec.tv_nsec;
+#else
+    key->mtime = (int64_t) status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+#endif
+#endif
+
+    return error_t::None;
+  }
+} // namespace doors
@@ -15,6 +15,9 @@
 #include <compiler.hpp>
 using namespace compiler;
 
+#include <system/fields.hpp>
+#include <system/record.hpp>
+
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/basic_file_sink.h>
 
@@ -63,19 +66,23 @@ namespace doors {
           TGA_extension_header_t extension;
         };
 
-        error_t read(TGA_header_t *header, const char *name);
+        error_t read(TGA_header_t *header, scoped_file &file, const fields_t fields = fields_t::all,
+          const checkpoint_t &checkpoint = nullptr);
+        error_t read(TGA_header_t *header, const char *name, const fields_t fields = fields_t::all,
+          const checkpoint_t &checkpoint = nullptr);
       } // namespace detail
 
       using namespace detail;
 
       std::unordered_map<std::string, std::any> parse(const char *name);
+      record_t to_record(const TGA_header_t &header);
     } // namespace gif
   } // namespace image
 } // namespace doors
 
 #endif
 
-#define IMAGE_TGA_DETAIL
+// #define IMAGE_TGA_DETAIL
 
 #ifdef IMAGE_TGA_DETAIL
 #undef IMAGE_TGA_DETAIL
@@ -84,14 +91,19 @@ namespace doors {
   namespace image {
     namespace tga {
       namespace detail {
-        error_t read(TGA_header_t *header, const char *name)
+        error_t read(TGA_header_t *header, const char *name, const fields_t fields, const checkpoint_t &checkpoint)
+        {
+          scoped_file file(name);
+          return read(header, file, fields, checkpoint);
+        }
+
+        error_t read(TGA_header_t *header, scoped_file &file, const fields_t fields, const checkpoint_t &checkpoint)
         {
 #ifdef IMAGE_TGA_DETAIL_DEBUG
           spdlog::set_pattern("[%^%l%$] %v");
           spdlog::set_level(spdlog::level::debug);
 #endif
 
-          scoped_file file(name);
           const char *signature = __SIGNATURE;
 
           if (file.valid() && header) {
@@ -146,6 +158,14 @@ namespace doors {
             );
 #endif
 
+            // Without the footer, all there is to tell is "at least v1.0"
+            header->version = 1;
+            if (!(fields & fields_t::version))
+              return error_t::None;
+
+            if (checkpoint && !checkpoint(to_record(*header), fields_t::basic))
+              return error_t::Rejected;
+
             // Identifying Targa version requires seeking through the whole file, because version 2 writes
             // the "TRUEVISION-XFILE." string at the end of the file (which lies within the optional footer section).
             // It is **optional**, so if the encoder doesn't write out the footer bytes, there would be no way of identifying
@@ -161,7 +181,6 @@ namespace doors {
 
                 file.skip((long) - v2_footer_length - 8);
                 uint32_t extension = file.byte<uint32_t>();
-                printf("%i %i\n", extension, sizeof(TGA_extension_header_t));
 
                 if (extension != 0) {
                   file.skip(extension, SEEK_SET);
@@ -250,6 +269,23 @@ namespace doors {
 
         return r;
       }
+
+      record_t to_record(const TGA_header_t &header)
+      {
+        record_t r = {0};
+
+        r.format = (uint8_t) format_t::TGA;
+        r.version = header.version;
+        r.width = header.size[0];
+        r.height = header.size[1];
+        r.bpp = header.bpp;
+        r.color_space = header.type;
+
+        // Image types 9-11 are the RLE variants of 1-3
+        r.flags = (uint8_t) (header.type >= 9 ? record_flags_t::compressed : record_flags_t::none);
+
+        return r;
+      }
     } // namespace gif
   } // namespace image
 } // namespace doors
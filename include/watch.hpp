@@ -0,0 +1,485 @@
+#if !defined(__WATCH_DETAIL__)
+#define __WATCH_DETAIL__
+
+// Live metadata index: scans the roots once, then follows inotify for creates, writes, renames and deletions and
+// re-parses only what actually changed. Events are debounced per path, a burst of writes to the same file (or a
+// file being copied in chunk by chunk) results in a single re-parse once the path stayed quiet for a while.
+//
+// Should the kernel's event queue overflow, every root gets scanned again and the index reconciled with it.
+// The implementation of scan.hpp (SCAN_DETAIL, along with whatever it depends on) has to be compiled within the
+// same translation unit.
+//
+// Pending issue(s):
+//   Linux only; fanotify (FAN_MARK_FILESYSTEM, whole mounts without a watch per directory) needs CAP_SYS_ADMIN
+//   Every directory costs a watch, fs.inotify.max_user_watches may have to be raised for large trees
+//   Re-parses run on the watching thread, one at a time
+//   Testing
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/inotify.h>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/record.hpp>
+#include <scan.hpp>
+
+#include <spdlog/spdlog.h>
+
+namespace doors {
+  namespace watch {
+    enum class change_kind_t : uint8_t {
+      updated, // New or modified file, `record` holds its current metadata
+      removed  // Deleted or moved away, `record` holds its last known metadata
+    };
+
+    // Never called concurrently, but from the scanning workers as well as from the watching thread.
+    using change_t = std::function<void(change_kind_t kind, const char *name, const record_t &record)>;
+
+    struct options_t {
+      scan::options_t scan;    // Used by the initial scan and by every re-parse (store, dedup, ...)
+      uint32_t debounce = 250; // Milliseconds a path has to stay quiet before it gets re-parsed
+    };
+
+    class watcher_t {
+    public:
+      ~watcher_t();
+
+      // Scans the roots (every record is reported as updated), then keeps following them on a thread of its own.
+      error_t start(const std::vector<std::string> &roots, const options_t &options, const change_t &change);
+      void stop();
+      void wait();
+
+      bool lookup(const char *name, record_t *record) const;
+      size_t size() const;
+
+      uint64_t events() const { return event_count.load(std::memory_order_relaxed); }
+      uint64_t parses() const { return parse_count.load(std::memory_order_relaxed); }
+      uint64_t resyncs() const { return resync_count.load(std::memory_order_relaxed); }
+
+    private:
+      using clock_type = std::chrono::steady_clock;
+
+      void run();
+      void resync();
+      void add_watches(const std::string &directory);
+      void remove_watches(const std::string &directory);
+      void handle(const struct inotify_event &event);
+      void flush();
+      void update(const std::string &name);
+      void remove(const std::string &name, bool subtree);
+
+      std::vector<std::string> roots;
+      options_t options;
+      change_t change;
+
+      int notify = -1;
+      int wake[2] = { -1, -1 };
+      std::atomic<bool> running{false};
+      std::thread thread;
+
+      std::unordered_map<int, std::string> watches; // Watch descriptor to path, watching thread only
+      std::unordered_map<std::string, clock_type::time_point> pending;
+
+      mutable std::shared_mutex mutex; // Guards the index, serializes `change`
+      std::unordered_map<std::string, record_t> index;
+
+      std::atomic<uint64_t> event_count{0};
+      std::atomic<uint64_t> parse_count{0};
+      std::atomic<uint64_t> resync_count{0};
+    };
+  } // namespace watch
+} // namespace doors
+
+#endif
+
+#ifdef WATCH_DETAIL
+#undef WATCH_DETAIL
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace doors {
+  namespace watch {
+    namespace detail {
+      constexpr const uint32_t directory_mask =
+        IN_CREATE | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE |
+        IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+      // Roots may be plain files, watched on their own
+      constexpr const uint32_t file_mask = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+      static bool same(const record_t &lhs, const record_t &rhs)
+      {
+        return std::memcmp(&lhs, &rhs, sizeof lhs) == 0;
+      }
+
+      static bool within(const std::string &name, const std::string &directory)
+      {
+        return name.size() > directory.size() &&
+          name.compare(0, directory.size(), directory) == 0 &&
+          name[directory.size()] == '/';
+      }
+    } // namespace detail
+
+    watcher_t::~watcher_t()
+    {
+      stop();
+      wait();
+    }
+
+    error_t watcher_t::start(const std::vector<std::string> &roots, const options_t &options, const change_t &change)
+    {
+#ifdef WATCH_DETAIL_DEBUG
+      spdlog::set_pattern("[%^%l%$] %v");
+      spdlog::set_level(spdlog::level::debug);
+
+      const char *signature = __SIGNATURE;
+#endif
+
+      if (running.load())
+        return error_t::Other;
+
+      this->roots = roots;
+      this->options = options;
+      this->change = change;
+
+      notify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (notify == -1 || ::pipe(wake) != 0) {
+#ifdef WATCH_DETAIL_DEBUG
+        spdlog::critical(
+          "[{}] Couldn't set up inotify: {}",
+          signature,
+          std::strerror(errno)
+        );
+#endif
+        return error_t::Other;
+      }
+
+      for (int fd : wake)
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      ::fcntl(wake[0], F_SETFL, ::fcntl(wake[0], F_GETFL) | O_NONBLOCK);
+
+      // Watches come first: whatever changes while the initial scan is running is queued up by the kernel.
+      resync();
+
+      running.store(true);
+      thread = std::thread(&watcher_t::run, this);
+
+#ifdef WATCH_DETAIL_DEBUG
+      spdlog::debug(
+        "[{}] Watching {} file(s) through {} watch(es)",
+        signature,
+        index.size(),
+        watches.size()
+      );
+#endif
+
+      return error_t::None;
+    }
+
+    void watcher_t::stop()
+    {
+      if (!running.exchange(false))
+        return;
+
+      const uint8_t byte = 0;
+      (void) !::write(wake[1], &byte, 1);
+    }
+
+    void watcher_t::wait()
+    {
+      if (thread.joinable())
+        thread.join();
+
+      if (notify != -1) {
+        ::close(notify);
+        notify = -1;
+      }
+
+      for (int &fd : wake) {
+        if (fd != -1)
+          ::close(fd);
+        fd = -1;
+      }
+
+      watches.clear();
+      pending.clear();
+    }
+
+    bool watcher_t::lookup(const char *name, record_t *record) const
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+
+      const auto it = index.find(name);
+      if (it == index.end())
+        return false;
+
+      *record = it->second;
+      return true;
+    }
+
+    size_t watcher_t::size() const
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+      return index.size();
+    }
+
+    // (Re)builds the watches and the index from scratch, reporting differences only.
+    void watcher_t::resync()
+    {
+      namespace fs = std::filesystem;
+
+      resync_count.fetch_add(1, std::memory_order_relaxed);
+
+      for (const auto &root : roots) {
+        std::error_code code;
+        if (fs::is_directory(root, code))
+          add_watches(root);
+        else {
+          const int wd = ::inotify_add_watch(notify, root.c_str(), detail::file_mask);
+          if (wd != -1)
+            watches[wd] = root;
+        }
+      }
+
+      std::unordered_set<std::string> seen;
+      scan::run(roots, options.scan, [this, &seen] (size_t, const char *name, const record_t &record) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        seen.emplace(name);
+
+        auto it = index.find(name);
+        if (it != index.end() && detail::same(it->second, record))
+          return;
+
+        index[name] = record;
+        change(change_kind_t::updated, name, record);
+      });
+
+      std::unique_lock<std::shared_mutex> lock(mutex);
+      for (auto it = index.begin(); it != index.end(); ) {
+        if (seen.count(it->first) != 0) {
+          ++it;
+          continue;
+        }
+
+        change(change_kind_t::removed, it->first.c_str(), it->second);
+        it = index.erase(it);
+      }
+
+      parse_count.fetch_add(seen.size(), std::memory_order_relaxed);
+    }
+
+    void watcher_t::add_watches(const std::string &directory)
+    {
+      namespace fs = std::filesystem;
+
+      const auto add = [this] (const std::string &name) {
+        const int wd = ::inotify_add_watch(notify, name.c_str(), detail::directory_mask);
+        if (wd != -1)
+          watches[wd] = name;
+#ifdef WATCH_DETAIL_DEBUG
+        else
+          spdlog::warn("Couldn't watch {}: {}", name, std::strerror(errno));
+#endif
+      };
+
+      add(directory);
+
+      std::error_code code;
+      fs::recursive_directory_iterator it(directory, fs::directory_options::skip_permission_denied, code), end;
+      for (; !code && it != end; it.increment(code)) {
+        if (it->is_directory(code) && !it->is_symlink(code))
+          add(it->path().string());
+      }
+    }
+
+    void watcher_t::remove_watches(const std::string &directory)
+    {
+      for (auto it = watches.begin(); it != watches.end(); ) {
+        if (it->second == directory || detail::within(it->second, directory)) {
+          ::inotify_rm_watch(notify, it->first);
+          it = watches.erase(it);
+        }
+        else
+          ++it;
+      }
+    }
+
+    void watcher_t::run()
+    {
+      alignas(struct inotify_event) char buffer[64 * 1024];
+
+      while (running.load()) {
+        // Sleep until the next pending path settles, or forever when there's none
+        int timeout = -1;
+        if (!pending.empty()) {
+          auto earliest = clock_type::time_point::max();
+          for (const auto &entry : pending)
+            earliest = std::min(earliest, entry.second);
+
+          const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(earliest - clock_type::now()).count();
+          timeout = (int) std::max<int64_t>(0, left + 1);
+        }
+
+        struct pollfd descriptors[] = { { wake[0], POLLIN, 0 }, { notify, POLLIN, 0 } };
+        if (::poll(descriptors, 2, timeout) < 0 && errno != EINTR)
+          break;
+
+        if (descriptors[1].revents & POLLIN) {
+          ssize_t length;
+          while ((length = ::read(notify, buffer, sizeof buffer)) > 0) {
+            for (char *p = buffer; p < buffer + length; ) {
+              const auto &event = *reinterpret_cast<const struct inotify_event *>(p);
+              handle(event);
+              p += sizeof(struct inotify_event) + event.len;
+            }
+          }
+        }
+
+        flush();
+      }
+    }
+
+    void watcher_t::handle(const struct inotify_event &event)
+    {
+      event_count.fetch_add(1, std::memory_order_relaxed);
+
+      if (event.mask & IN_Q_OVERFLOW) {
+        // Lost events: nothing but a full pass tells what happened
+        pending.clear();
+        resync();
+        return;
+      }
+
+      const auto it = watches.find(event.wd);
+      if (it == watches.end())
+        return;
+
+      if (event.mask & IN_IGNORED) {
+        watches.erase(it);
+        return;
+      }
+
+      const std::string name = event.len != 0 ? it->second + "/" + event.name : it->second;
+
+      if (event.mask & IN_ISDIR) {
+        if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+          // Watched before being listed, files created in between show up either way
+          add_watches(name);
+
+          namespace fs = std::filesystem;
+          std::error_code code;
+          fs::recursive_directory_iterator entry(name, fs::directory_options::skip_permission_denied, code), end;
+          for (; !code && entry != end; entry.increment(code)) {
+            if (entry->is_regular_file(code))
+              pending[entry->path().string()] = clock_type::now();
+          }
+        }
+        else if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+          remove_watches(name);
+          remove(name, true);
+        }
+
+        return;
+      }
+
+      if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // A watched directory (or file root) went away, its parent (if watched) reports the details
+        pending[name] = clock_type::now();
+        return;
+      }
+
+      // Anything else, deletions included, gets settled by looking at the path once it stayed quiet
+      pending[name] = clock_type::now() + std::chrono::milliseconds(options.debounce);
+    }
+
+    void watcher_t::flush()
+    {
+      const auto now = clock_type::now();
+
+      std::vector<std::string> ready;
+      for (auto it = pending.begin(); it != pending.end(); ) {
+        if (it->second <= now) {
+          ready.push_back(it->first);
+          it = pending.erase(it);
+        }
+        else
+          ++it;
+      }
+
+      for (const auto &name : ready) {
+        struct stat status;
+        if (::lstat(name.c_str(), &status) == 0 && S_ISREG(status.st_mode))
+          update(name);
+        else
+          remove(name, false);
+      }
+    }
+
+    void watcher_t::update(const std::string &name)
+    {
+      record_t record;
+      scan::read(&record, name, options.scan);
+      parse_count.fetch_add(1, std::memory_order_relaxed);
+
+      // A file that stopped passing the filter leaves the index as if it were gone
+      if (record.error == (uint8_t) error_t::Rejected) {
+        remove(name, false);
+        return;
+      }
+
+      std::unique_lock<std::shared_mutex> lock(mutex);
+
+      auto it = index.find(name);
+      if (it != index.end() && detail::same(it->second, record))
+        return;
+
+      index[name] = record;
+      change(change_kind_t::updated, name.c_str(), record);
+    }
+
+    void watcher_t::remove(const std::string &name, bool subtree)
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex);
+
+      if (!subtree) {
+        auto it = index.find(name);
+        if (it != index.end()) {
+          change(change_kind_t::removed, name.c_str(), it->second);
+          index.erase(it);
+        }
+
+        return;
+      }
+
+      for (auto it = index.begin(); it != index.end(); ) {
+        if (detail::within(it->first, name)) {
+          change(change_kind_t::removed, it->first.c_str(), it->second);
+          it = index.erase(it);
+        }
+        else
+          ++it;
+      }
+    }
+  } // namespace watch
+} // namespace doors
+
+#endif
@@ -16,6 +16,9 @@ using namespace compiler;
 #define IMAGE_GIF_DETAIL_DEBUG
 #include <gif.hpp>
 
+#define IMAGE_EXIF_DETAIL
+#include <exif.hpp>
+
 #define IMAGE_JPG_DETAIL
 #define IMAGE_JPG_DETAIL_DEBUG
 #include <jpg.hpp>
@@ -230,6 +233,12 @@ static void jpg(const char *name)
   printf("Bits per pixel: %i\n", std::any_cast<uint8_t>(v["bits_per_pixel.u8"]));
   printf("Color space: %i\n", std::any_cast<uint8_t>(v["color_space.u8"]));
   printf("Color space (sanitized): %s\n", std::any_cast<std::string>(v["color_space_sanitized.s"]).c_str());
+  printf("Quality (estimate): %i%s\n", std::any_cast<uint8_t>(v["quality.u8"]),
+    std::any_cast<bool>(v["quality_exact.b"]) ? " (IJG tables)" : "");
+  printf("Chroma subsampling: %s\n", std::any_cast<std::string>(v["subsampling.s"]).c_str());
+  printf("Preview bytes (DC, AC scans): %llu, %llu\n",
+    (unsigned long long) std::any_cast<uint64_t>(v["preview_dc.u64"]),
+    (unsigned long long) std::any_cast<uint64_t>(v["preview_ac.u64"]));
 }
 
 static void bmp(const char *name)
@@ -271,6 +280,7 @@ static void png(const char *name)
 
   printf("IHDR CRC: %x\n", std::any_cast<uint32_t>(v["ihdr_crc.u32"]));
   printf("Interlacing: %i\n", std::any_cast<bool>(v["interlaced.b"]));
+  printf("Preview bytes (Adam7 passes 1-3): %llu\n", (unsigned long long) std::any_cast<uint64_t>(v["preview.u64"]));
 }
 
 static void psd(const char *name)
@@ -0,0 +1,100 @@
+// Resident probe daemon, see include/server.hpp for the wire protocol.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party tools/doorsd.cpp -o doorsd -pthread
+// Usage: doorsd <socket path> [threads] [cache budget in MiB, 0 disables it (64)] [per-entry deadline in ms, 0 disables it (250)]
+//
+// SIGINT/SIGTERM shut the server down gracefully, removing the socket.
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <pthread.h>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_GIF_DETAIL
+#include <gif.hpp>
+
+#define IMAGE_EXIF_DETAIL
+#include <exif.hpp>
+
+#define IMAGE_JPG_DETAIL
+#include <jpg.hpp>
+
+#define IMAGE_BMP_DETAIL
+#include <bmp.hpp>
+
+#define IMAGE_PNG_DETAIL
+#include <png.hpp>
+
+#define IMAGE_TGA_DETAIL
+#include <tga.hpp>
+
+#define IMAGE_PSD_DETAIL
+#include <psd.hpp>
+
+#define PROBE_DETAIL
+#include <probe.hpp>
+
+#define CACHE_DETAIL
+#include <cache.hpp>
+
+#define SERVER_DETAIL
+#include <server.hpp>
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <socket path> [threads] [cache MiB] [deadline ms]\n", argv[0]);
+    return 1;
+  }
+
+  doors::server::options_t options;
+  options.path = argv[1];
+  options.threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 0u;
+  options.budget.time = std::chrono::milliseconds(argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 250u);
+
+  doors::cache::options_t cache_options;
+  cache_options.budget = (argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 64u) << 20;
+
+  doors::cache::cache_t cache(cache_options);
+  if (cache_options.budget != 0)
+    options.cache = &cache;
+
+  // Blocked before any thread is spawned, so that every thread inherits the mask and only sigwait() sees them.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  doors::server::server_t server(options);
+  if (server.start() != doors::error_t::None) {
+    std::fprintf(stderr, "Couldn't listen on %s\n", options.path.c_str());
+    return 1;
+  }
+
+  int signal;
+  sigwait(&signals, &signal);
+
+  server.stop();
+  server.wait();
+
+  std::printf("Served %llu request(s), %llu entries\n",
+    (unsigned long long) server.requests(),
+    (unsigned long long) server.entries()
+  );
+
+  if (options.cache != nullptr) {
+    std::printf("Cache: %llu hit(s), %llu miss(es), %llu eviction(s)\n",
+      (unsigned long long) cache.hits(),
+      (unsigned long long) cache.misses(),
+      (unsigned long long) cache.evictions()
+    );
+  }
+}
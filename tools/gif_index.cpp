@@ -0,0 +1,71 @@
+// GIF frame index (see GIF_index_t in include/gif.hpp): builds it, or loads it when a cached one is still good,
+// then lists the frames along with the total duration.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party tools/gif_index.cpp -o gif-index
+// Usage: gif-index <file.gif> [index file, loaded if it matches the GIF's size, (re)written otherwise]
+
+#include <cstdio>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_GIF_DETAIL
+#include <gif.hpp>
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <file.gif> [index file]\n", argv[0]);
+    return 1;
+  }
+
+  namespace gif = doors::image::gif;
+
+  scoped_file file(argv[1]);
+  if (!file.valid()) {
+    std::fprintf(stderr, "Couldn't open %s\n", argv[1]);
+    return 1;
+  }
+
+  gif::GIF_index_t index;
+  bool cached = argc > 2 && index.load(argv[2]) == doors::error_t::None && index.size == file.size();
+
+  if (!cached) {
+    if (gif::index(&index, file) != doors::error_t::None) {
+      std::fprintf(stderr, "Couldn't index %s\n", argv[1]);
+      return 1;
+    }
+
+    if (argc > 2 && index.save(argv[2]) != doors::error_t::None)
+      std::fprintf(stderr, "Couldn't save index %s\n", argv[2]);
+  }
+
+  for (size_t i = 0; i < index.frames.size(); ++i) {
+    const auto &frame = index.frames[i];
+
+    std::printf("%zu\tdescriptor=%llu\tcontrol=%llu\tpalette=%llu(%u)\tdata=%llu\t%ux%u+%u+%u\tdelay=%u\tdisposal=%u\ttransparent=%d%s\n",
+      i,
+      (unsigned long long) frame.descriptor,
+      (unsigned long long) frame.control,
+      (unsigned long long) frame.palette,
+      frame.palette_size,
+      (unsigned long long) frame.data,
+      frame.width, frame.height, frame.left, frame.top,
+      frame.delay,
+      frame.disposal,
+      frame.transparent,
+      frame.interlaced ? "\tinterlaced" : ""
+    );
+  }
+
+  std::printf("%zu frame(s), %.2f s, loops=%d%s\n",
+    index.frames.size(),
+    (double) index.get_duration() / 100.0,
+    index.loops,
+    cached ? " (cached)" : ""
+  );
+
+  return 0;
+}
@@ -0,0 +1,69 @@
+// JPEG marker index (see JPG_marker_index_t in include/jpg_decode.hpp): lists every scan with where its entropy-coded
+// data starts and ends and how many restart intervals it holds, the RSTn offsets themselves with --restarts.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party tools/jpg_index.cpp -o jpg-index -pthread
+//                (add -mavx2 for the 32-byte marker scan)
+// Usage: jpg-index [--restarts] <file.jpg>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_JPG_DECODE_DETAIL
+#include <jpg_decode.hpp>
+
+int main(int argc, char *argv[])
+{
+  const bool restarts = argc > 2 && std::strcmp(argv[1], "--restarts") == 0;
+  const char *name = argv[argc - 1];
+
+  if (argc < 2 || (argc > 2 && !restarts)) {
+    std::fprintf(stderr, "Usage: %s [--restarts] <file.jpg>\n", argv[0]);
+    return 1;
+  }
+
+  namespace jpg = doors::image::jpg;
+
+  scoped_file file(name);
+  if (!file.valid()) {
+    std::fprintf(stderr, "Couldn't open %s\n", name);
+    return 1;
+  }
+
+  std::vector<uint8_t> data((size_t) file.size());
+  if (file.read(data.data(), size::u8, data.size()) != data.size()) {
+    std::fprintf(stderr, "Couldn't read %s\n", name);
+    return 1;
+  }
+
+  jpg::JPG_marker_index_t index;
+  if (jpg::index_markers(data.data(), data.size(), &index) != doors::error_t::None) {
+    std::fprintf(stderr, "Couldn't index %s\n", name);
+    return 1;
+  }
+
+  for (size_t i = 0; i < index.scans.size(); ++i) {
+    const auto &scan = index.scans[i];
+
+    std::printf("%zu\theader=%llu\tdata=%llu\tend=%llu\tintervals=%zu\n",
+      i,
+      (unsigned long long) scan.header,
+      (unsigned long long) scan.data,
+      (unsigned long long) scan.end,
+      scan.restarts.size() + 1
+    );
+
+    if (restarts) {
+      for (uint64_t offset : scan.restarts)
+        std::printf("\tRST%u=%llu\n", data[(size_t) offset + 1] - 0xD0u, (unsigned long long) offset);
+    }
+  }
+
+  std::printf("eoi=%llu\n", (unsigned long long) index.eoi);
+  return 0;
+}
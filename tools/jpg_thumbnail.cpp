@@ -0,0 +1,82 @@
+// Embedded JPEG thumbnail extraction (see get_thumbnail() in include/jpg.hpp): EXIF and JFXX JPEG thumbnails get
+// written out as they are, uncompressed JFIF/JFXX ones as a binary PPM. The main image's scan data is never read.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party tools/jpg_thumbnail.cpp -o jpg-thumbnail
+// Usage: jpg-thumbnail <file.jpg> [output file]
+
+#include <cstdio>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_EXIF_DETAIL
+#include <exif.hpp>
+
+#define IMAGE_JPG_DETAIL
+#include <jpg.hpp>
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <file.jpg> [output file]\n", argv[0]);
+    return 1;
+  }
+
+  namespace jpg = doors::image::jpg;
+
+  scoped_file file(argv[1]);
+  if (!file.valid()) {
+    std::fprintf(stderr, "Couldn't open %s\n", argv[1]);
+    return 1;
+  }
+
+  jpg::JPG_thumbnail_t thumbnail;
+  if (jpg::get_thumbnail(&thumbnail, file) != doors::error_t::None) {
+    std::fprintf(stderr, "Couldn't read %s\n", argv[1]);
+    return 1;
+  }
+
+  static const char *formats[] = { "none", "JPEG", "RGB", "palette" };
+  std::printf("%s\t%ux%u\toffset=%llu\tlength=%u\n",
+    formats[(size_t) thumbnail.format],
+    thumbnail.width,
+    thumbnail.height,
+    (unsigned long long) thumbnail.offset,
+    thumbnail.length
+  );
+
+  if (thumbnail.format == jpg::JPG_thumbnail_format_t::none || argc < 3)
+    return thumbnail.format == jpg::JPG_thumbnail_format_t::none ? 2 : 0;
+
+  std::vector<uint8_t> data;
+  if (jpg::read_thumbnail(thumbnail, file, &data) != doors::error_t::None) {
+    std::fprintf(stderr, "Couldn't read the thumbnail of %s\n", argv[1]);
+    return 1;
+  }
+
+  std::FILE *output = std::fopen(argv[2], "wb");
+  if (output == nullptr) {
+    std::fprintf(stderr, "Couldn't create %s\n", argv[2]);
+    return 1;
+  }
+
+  bool written;
+  if (thumbnail.format == jpg::JPG_thumbnail_format_t::JPEG)
+    written = std::fwrite(data.data(), size::u8, data.size(), output) == data.size();
+  else {
+    std::vector<uint8_t> rgb;
+    written = jpg::get_thumbnail_pixels(thumbnail, data, &rgb) == doors::error_t::None &&
+      std::fprintf(output, "P6\n%u %u\n255\n", thumbnail.width, thumbnail.height) > 0 &&
+      std::fwrite(rgb.data(), size::u8, rgb.size(), output) == rgb.size();
+  }
+
+  if (std::fclose(output) != 0 || !written) {
+    std::fprintf(stderr, "Couldn't write %s\n", argv[2]);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+// Lossless JPEG rotation, flipping and cropping (see include/jpg_transform.hpp): the quantized DCT coefficients get
+// moved around and coded again, never decoded to pixels. --auto turns the image upright according to its EXIF
+// orientation and resets that to 1.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party tools/jpg_transform.cpp -o jpg-transform -pthread
+// Usage: jpg-transform [options] <in.jpg> <out.jpg>
+//   --rotate <n>       90, 180 or 270, clockwise
+//   --flip <h|v>       Horizontally or vertically
+//   --transpose        Across the top-left to bottom-right diagonal
+//   --transverse       Across the other one
+//   --auto             Whatever the EXIF orientation asks for
+//   --crop WxH+X+Y     Once transformed, X and Y rounded down to an MCU boundary (W or H 0: up to the edge)
+//   --no-trim          Fail rather than drop partial MCUs the transform can't move
+//   --optimize         Huffman tables built for the output
+//   --strip            APPn and COM segments left out
+//   --threads <n>      Restart intervals permitting (1, 0 for as many as there are cores)
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_EXIF_DETAIL
+#include <exif.hpp>
+
+#define IMAGE_JPG_DECODE_DETAIL
+#include <jpg_decode.hpp>
+
+#define IMAGE_JPG_TRANSFORM_DETAIL
+#include <jpg_transform.hpp>
+
+namespace jpg = doors::image::jpg;
+
+int main(int argc, char *argv[])
+{
+  jpg::transform_options_t options;
+  bool automatic = false;
+  size_t threads = 1;
+  std::vector<const char *> names;
+  bool valid = true;
+
+  for (int i = 1; i < argc && valid; ++i) {
+    if (std::strcmp(argv[i], "--rotate") == 0 && i + 1 < argc) {
+      const unsigned long degrees = std::strtoul(argv[++i], nullptr, 10);
+      options.transform = degrees == 90 ? jpg::transform_t::rotate_90 : degrees == 180 ? jpg::transform_t::rotate_180 :
+        jpg::transform_t::rotate_270;
+      valid = degrees == 90 || degrees == 180 || degrees == 270;
+    }
+    else if (std::strcmp(argv[i], "--flip") == 0 && i + 1 < argc) {
+      ++i;
+      options.transform = argv[i][0] == 'v' ? jpg::transform_t::flip_vertical : jpg::transform_t::flip_horizontal;
+      valid = std::strcmp(argv[i], "h") == 0 || std::strcmp(argv[i], "v") == 0;
+    }
+    else if (std::strcmp(argv[i], "--transpose") == 0)
+      options.transform = jpg::transform_t::transpose;
+    else if (std::strcmp(argv[i], "--transverse") == 0)
+      options.transform = jpg::transform_t::transverse;
+    else if (std::strcmp(argv[i], "--auto") == 0)
+      automatic = true;
+    else if (std::strcmp(argv[i], "--crop") == 0 && i + 1 < argc)
+      valid = std::sscanf(argv[++i], "%ux%u+%u+%u", &options.crop_width, &options.crop_height, &options.crop_x,
+        &options.crop_y) == 4;
+    else if (std::strcmp(argv[i], "--no-trim") == 0)
+      options.trim = false;
+    else if (std::strcmp(argv[i], "--optimize") == 0)
+      options.optimize = true;
+    else if (std::strcmp(argv[i], "--strip") == 0)
+      options.metadata = false;
+    else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threads = std::strtoul(argv[++i], nullptr, 10);
+    else
+      names.push_back(argv[i]);
+  }
+
+  if (!valid || names.size() != 2) {
+    std::fprintf(stderr, "Usage: %s [--rotate 90|180|270] [--flip h|v] [--transpose] [--transverse] [--auto] "
+      "[--crop WxH+X+Y] [--no-trim] [--optimize] [--strip] [--threads <n>] <in.jpg> <out.jpg>\n", argv[0]);
+    return 1;
+  }
+
+  scoped_file file(names[0]);
+  if (!file.valid()) {
+    std::fprintf(stderr, "Couldn't open %s\n", names[0]);
+    return 1;
+  }
+
+  std::vector<uint8_t> data((size_t) file.size());
+  if (file.read(data.data(), size::u8, data.size()) != data.size()) {
+    std::fprintf(stderr, "Couldn't read %s\n", names[0]);
+    return 1;
+  }
+
+  if (automatic) {
+    options.transform = jpg::get_transform(jpg::get_orientation(data.data(), data.size()));
+    options.reset_orientation = true;
+  }
+
+  jpg::transformer_t transformer;
+  std::vector<uint8_t> out;
+  const doors::error_t error = transformer.transform(data.data(), data.size(), options, &out, threads);
+  if (error != doors::error_t::None) {
+    std::fprintf(stderr, "Couldn't transform %s: %s\n", names[0],
+      error == doors::error_t::InvalidRequest ? "not on MCU boundaries" : "not a JPEG file it can handle");
+    return 1;
+  }
+
+  std::FILE *output = std::fopen(names[1], "wb");
+  if (output == nullptr) {
+    std::fprintf(stderr, "Couldn't create %s\n", names[1]);
+    return 1;
+  }
+
+  const bool written = std::fwrite(out.data(), size::u8, out.size(), output) == out.size();
+  if (std::fclose(output) != 0 || !written) {
+    std::fprintf(stderr, "Couldn't write %s\n", names[1]);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,61 @@
+// Minimal shared-memory ring consumer (see include/ring.hpp), prints every record until the producer is done.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party tools/ring_dump.cpp -o ring-dump -pthread -lrt
+// Usage: ring-dump <name>
+//
+// The ring has to exist already: start `doors-scan --ring <name> ...` first.
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define RING_DETAIL
+#include <ring.hpp>
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <name>\n", argv[0]);
+    return 1;
+  }
+
+  doors::ring::ring_t ring;
+  if (ring.open(argv[1]) != doors::error_t::None) {
+    std::fprintf(stderr, "Couldn't open ring %s\n", argv[1]);
+    return 1;
+  }
+
+  uint64_t count = 0;
+  const auto print = [&count] (const doors::ring::slot_t &slot) {
+    const int length = slot.truncated() ? (int) doors::ring::path_capacity : (int) slot.path_length;
+
+    std::printf("%.*s%s\t%s\t%ux%u\terror=%u\n",
+      length, slot.path,
+      slot.truncated() ? "..." : "",
+      doors::get_format_sanitized((doors::format_t) slot.record.format),
+      slot.record.width,
+      slot.record.height,
+      slot.record.error
+    );
+
+    ++count;
+  };
+
+  for (;;) {
+    if (ring.pop(print))
+      continue;
+
+    // finished() has to be checked before emptiness, otherwise the last records could slip through
+    if (ring.finished() && ring.empty())
+      break;
+
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+
+  std::fprintf(stderr, "%llu record(s)\n", (unsigned long long) count);
+}
@@ -0,0 +1,294 @@
+// Directory scanner, prints (or hands over) one record per image found under the given roots.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party tools/scan.cpp -o doors-scan -pthread -lrt
+// Usage: doors-scan [options] <root>...
+//   --threads <n>            Worker threads (defaults to the hardware concurrency)
+//   --ring <name>            Push records into the named shared-memory ring (see include/ring.hpp) instead of
+//                            printing them; the ring is created by the scanner and removed once it exits
+//   --capacity <n>           Ring capacity in slots (65536)
+//   --cache <name>           Persistent metadata cache (see include/store.hpp): unchanged files aren't re-read
+//   --prune                  Drop cache entries for files that weren't seen by this scan
+//   --dedup                  Parse byte-identical files only once (see include/dedup.hpp)
+//   --state <file>           Incremental scan (see include/incremental.hpp): directories unchanged since the run
+//                            that saved the state aren't listed again, their files' records are reused
+//   --verify                 Along with --state, stat reused files too (catches files rewritten in place)
+//   --fields <list>          What to find out (see include/system/fields.hpp), e.g. "basic" or "dimensions,frames"
+//                            (defaults: all but preview)
+//   --filter <expression>    Only report files matching it (see include/filter.hpp), e.g. "width >= 2048 || frames > 1";
+//                            parsing stops as soon as a file is known not to
+//   --aggregate              Print corpus statistics (see include/aggregate.hpp) once done instead of a line per file
+//   --similar <file>         Fingerprint JPEGs off their DC coefficients (see include/system/phash.hpp) and save the
+//                            hashes there as a near-duplicate index (see include/similar.hpp, tools/similar.cpp)
+//   --max-bytes <n>          Per-file budget (see include/compiler.hpp): files needing more bytes read, seeks or
+//   --max-seeks <n>          milliseconds than that are given up on with error_t::BudgetExceeded (unlimited)
+//   --deadline <ms>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/phash.hpp>
+
+#define IMAGE_GIF_DETAIL
+#include <gif.hpp>
+
+#define IMAGE_EXIF_DETAIL
+#include <exif.hpp>
+
+#define IMAGE_JPG_DETAIL
+#include <jpg.hpp>
+
+#define IMAGE_BMP_DETAIL
+#include <bmp.hpp>
+
+#define IMAGE_PNG_DETAIL
+#include <png.hpp>
+
+#define IMAGE_TGA_DETAIL
+#include <tga.hpp>
+
+#define IMAGE_PSD_DETAIL
+#include <psd.hpp>
+
+#define PROBE_DETAIL
+#include <probe.hpp>
+
+#define DEDUP_DETAIL
+#include <dedup.hpp>
+
+#define STORE_DETAIL
+#include <store.hpp>
+
+#define FILTER_DETAIL
+#include <filter.hpp>
+
+#define SCAN_DETAIL
+#include <scan.hpp>
+
+#define INCREMENTAL_DETAIL
+#include <incremental.hpp>
+
+#define RING_DETAIL
+#include <ring.hpp>
+
+#define AGGREGATE_DETAIL
+#include <aggregate.hpp>
+
+#define IMAGE_JPG_DECODE_DETAIL
+#include <jpg_decode.hpp>
+
+#define SIMILAR_DETAIL
+#include <similar.hpp>
+
+static void print(size_t, const char *name, const doors::record_t &record)
+{
+  // A single printf() per line, stdio locks the stream for us
+  std::printf("%s\t%s\t%ux%u\tbpp=%u\tframes=%u\tlayers=%u\tflags=%u\torientation=%u\tquality=%u\tsubsampling=%u\tpreview=%u\terror=%u\n",
+    name,
+    doors::get_format_sanitized((doors::format_t) record.format),
+    record.width,
+    record.height,
+    record.bpp,
+    record.frames,
+    record.layers,
+    record.flags,
+    record.orientation,
+    record.quality,
+    doors::get_subsampling_sanitized(record.subsampling),
+    record.preview,
+    record.error
+  );
+}
+
+int main(int argc, char *argv[])
+{
+  doors::scan::options_t options;
+  std::vector<std::string> roots;
+  const char *ring_name = nullptr;
+  uint64_t capacity = 65536;
+  const char *cache_name = nullptr;
+  bool prune = false;
+  bool deduplicate = false;
+  const char *state_name = nullptr;
+  bool verify = false;
+  bool aggregate = false;
+  const char *similar_name = nullptr;
+  doors::filter::filter_t filter;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      options.threads = std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--ring") == 0 && i + 1 < argc)
+      ring_name = argv[++i];
+    else if (std::strcmp(argv[i], "--capacity") == 0 && i + 1 < argc)
+      capacity = std::strtoull(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+      cache_name = argv[++i];
+    else if (std::strcmp(argv[i], "--prune") == 0)
+      prune = true;
+    else if (std::strcmp(argv[i], "--dedup") == 0)
+      deduplicate = true;
+    else if (std::strcmp(argv[i], "--state") == 0 && i + 1 < argc)
+      state_name = argv[++i];
+    else if (std::strcmp(argv[i], "--verify") == 0)
+      verify = true;
+    else if (std::strcmp(argv[i], "--fields") == 0 && i + 1 < argc) {
+      if (!doors::parse_fields(argv[++i], &options.fields)) {
+        std::fprintf(stderr, "Unknown field(s) in %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (std::strcmp(argv[i], "--aggregate") == 0)
+      aggregate = true;
+    else if (std::strcmp(argv[i], "--similar") == 0 && i + 1 < argc)
+      similar_name = argv[++i];
+    else if (std::strcmp(argv[i], "--max-bytes") == 0 && i + 1 < argc)
+      options.budget.bytes = std::strtoull(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--max-seeks") == 0 && i + 1 < argc)
+      options.budget.seeks = std::strtoull(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--deadline") == 0 && i + 1 < argc)
+      options.budget.time = std::chrono::milliseconds(std::strtoull(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      size_t position = 0;
+      if (filter.compile(argv[++i], &position) != doors::error_t::None) {
+        std::fprintf(stderr, "Invalid filter at %zu: %s\n", position, argv[i]);
+        return 1;
+      }
+
+      options.filter = &filter;
+    }
+    else
+      roots.emplace_back(argv[i]);
+  }
+
+  if (roots.empty()) {
+    std::fprintf(stderr, "Usage: %s [--threads <n>] [--ring <name> [--capacity <n>]] [--cache <name> [--prune]] [--dedup] [--state <file> [--verify]] [--fields <list>] [--filter <expression>] [--aggregate] [--similar <file>] [--max-bytes <n>] [--max-seeks <n>] [--deadline <ms>] <root>...\n", argv[0]);
+    return 1;
+  }
+
+  doors::store::store_t store;
+  if (cache_name != nullptr) {
+    if (store.open(cache_name) != doors::error_t::None) {
+      std::fprintf(stderr, "Couldn't open cache %s\n", cache_name);
+      return 1;
+    }
+
+    options.store = &store;
+  }
+
+  doors::dedup::table_t table;
+  if (deduplicate)
+    options.dedup = &table;
+
+  doors::incremental::state_t state;
+  doors::incremental::statistics_t statistics;
+  if (state_name != nullptr)
+    state.load(state_name);
+
+  // Decoders keep their buffers from one file to the next, one per worker
+  doors::similar::index_t similar;
+  std::vector<doors::image::jpg::decoder_t> decoders(similar_name != nullptr ? doors::scan::get_thread_count(options) : 0);
+
+  const auto walk = [&] (const doors::scan::sink_t &output) {
+    doors::scan::sink_t sink = output;
+
+    if (similar_name != nullptr) {
+      sink = [&] (size_t worker, const char *name, const doors::record_t &record) {
+        if (record.format == (uint8_t) doors::format_t::JPG && record.error == (uint8_t) doors::error_t::None) {
+          scoped_file file(name);
+          doors::image::jpg::dc_grid_t grid;
+
+          if (decoders[worker].decode_dc(file, &grid) == doors::error_t::None)
+            similar.insert(doors::phash::get_dhash(grid.luma.data(), grid.columns, 1, grid.width, grid.height,
+              grid.cell_width, grid.cell_height), name);
+        }
+
+        output(worker, name, record);
+      };
+    }
+
+    if (state_name == nullptr)
+      return doors::scan::run(roots, options, sink);
+
+    doors::incremental::options_t incremental;
+    incremental.scan = options;
+    incremental.verify = verify;
+
+    return doors::incremental::run(roots, incremental, &state, sink, &statistics);
+  };
+
+  doors::error_t error;
+
+  if (ring_name != nullptr) {
+    doors::ring::ring_t ring;
+    if (ring.create(ring_name, capacity) != doors::error_t::None) {
+      std::fprintf(stderr, "Couldn't create ring %s\n", ring_name);
+      return 1;
+    }
+
+    error = walk([&ring] (size_t, const char *name, const doors::record_t &record) {
+      ring.push_wait(name, record);
+    });
+
+    ring.finish();
+
+    // The consumer may still be draining: the name goes away with `ring`, its mapping doesn't.
+    while (!ring.empty())
+      std::this_thread::yield();
+  }
+  else if (aggregate) {
+    doors::aggregate::aggregator_t aggregator(doors::scan::get_thread_count(options));
+
+    error = walk([&aggregator] (size_t worker, const char *, const doors::record_t &record) {
+      aggregator.add(worker, record);
+    });
+
+    doors::aggregate::print(stdout, aggregator.merge());
+  }
+  else
+    error = walk(print);
+
+  if (state_name != nullptr) {
+    std::fprintf(stderr, "State: %llu director(y/ies), %llu listed, %llu record(s) reused, %llu parsed\n",
+      (unsigned long long) statistics.directories,
+      (unsigned long long) statistics.listed,
+      (unsigned long long) statistics.reused,
+      (unsigned long long) statistics.parsed
+    );
+
+    if (state.save(state_name) != doors::error_t::None)
+      std::fprintf(stderr, "Couldn't save state %s\n", state_name);
+  }
+
+  if (options.store != nullptr) {
+    std::fprintf(stderr, "Cache: %llu hit(s), %llu miss(es)\n",
+      (unsigned long long) store.hits(),
+      (unsigned long long) store.misses()
+    );
+
+    if (prune)
+      store.compact(true);
+  }
+
+  if (similar_name != nullptr) {
+    if (similar.build() != doors::error_t::None || similar.save(similar_name) != doors::error_t::None)
+      std::fprintf(stderr, "Couldn't save near-duplicate index %s\n", similar_name);
+    else
+      std::fprintf(stderr, "Similar: %zu fingerprint(s)\n", similar.size());
+  }
+
+  if (options.dedup != nullptr) {
+    std::fprintf(stderr, "Dedup: %llu duplicate(s), %llu full hash(es)\n",
+      (unsigned long long) table.duplicates(),
+      (unsigned long long) table.full_hashes()
+    );
+  }
+
+  return error == doors::error_t::None ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+// Near-duplicate lookup in an index saved by doors-scan --similar (see include/similar.hpp): entries within a
+// Hamming distance of the perceptual hashes given, as hex or as JPEG files to fingerprint (see
+// include/system/phash.hpp). With --all, every entry of the index gets looked up as one batch instead, pairs of
+// near-duplicates printed once each.
+//
+// Build (POSIX): g++ -std=c++17 -O2 -Iinclude -Ithird_party tools/similar.cpp -o doors-similar -pthread
+// Usage: doors-similar [--radius <n>] [--threads <n>] <index> (--all | <hash|file.jpg>...)
+//   --radius <n>   Hamming distance (6)
+//   --threads <n>  For the batch (0, as many as there are cores)
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+#include <system/phash.hpp>
+
+#define IMAGE_JPG_DECODE_DETAIL
+#include <jpg_decode.hpp>
+
+#define SIMILAR_DETAIL
+#include <similar.hpp>
+
+namespace similar = doors::similar;
+
+// 16 hex digits, or a JPEG to fingerprint
+static bool get_hash(const char *query, doors::image::jpg::decoder_t &decoder, uint64_t *hash)
+{
+  char *end = nullptr;
+  if (std::strlen(query) == 16) {
+    *hash = std::strtoull(query, &end, 16);
+    if (end != nullptr && *end == '\0')
+      return true;
+  }
+
+  scoped_file file(query);
+  doors::image::jpg::dc_grid_t grid;
+  if (!file.valid() || decoder.decode_dc(file, &grid) != doors::error_t::None)
+    return false;
+
+  *hash = doors::phash::get_dhash(grid.luma.data(), grid.columns, 1, grid.width, grid.height, grid.cell_width,
+    grid.cell_height);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned radius = 6;
+  size_t threads = 0;
+  bool all = false;
+  std::vector<const char *> arguments;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+      radius = (unsigned) std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threads = std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--all") == 0)
+      all = true;
+    else
+      arguments.push_back(argv[i]);
+  }
+
+  if (arguments.empty() || (arguments.size() == 1) != all) {
+    std::fprintf(stderr, "Usage: %s [--radius <n>] [--threads <n>] <index> (--all | <hash|file.jpg>...)\n", argv[0]);
+    return 1;
+  }
+
+  similar::index_t index;
+  if (index.open(arguments[0]) != doors::error_t::None) {
+    std::fprintf(stderr, "Couldn't open %s\n", arguments[0]);
+    return 1;
+  }
+
+  std::vector<uint64_t> queries;
+  if (all) {
+    queries.resize(index.size());
+    for (size_t i = 0; i < queries.size(); ++i)
+      queries[i] = index.get_hash((uint32_t) i);
+  }
+  else {
+    doors::image::jpg::decoder_t decoder;
+
+    for (size_t i = 1; i < arguments.size(); ++i) {
+      uint64_t hash;
+      if (!get_hash(arguments[i], decoder, &hash)) {
+        std::fprintf(stderr, "Couldn't fingerprint %s\n", arguments[i]);
+        return 1;
+      }
+
+      queries.push_back(hash);
+    }
+  }
+
+  std::vector<std::vector<similar::match_t>> matches;
+  index.query(queries.data(), queries.size(), radius, &matches, threads);
+
+  for (size_t i = 0; i < queries.size(); ++i) {
+    if (!all)
+      std::printf("%s\t%016llx\t%zu match(es)\n", arguments[i + 1], (unsigned long long) queries[i], matches[i].size());
+
+    for (const auto &match : matches[i]) {
+      // Each pair once, and not an entry with itself
+      if (all && match.id <= i)
+        continue;
+
+      if (all)
+        std::printf("%s\t%s\t%u\n", index.get_name((uint32_t) i).c_str(), index.get_name(match.id).c_str(),
+          match.distance);
+      else
+        std::printf("\t%u\t%016llx\t%s\n", match.distance, (unsigned long long) index.get_hash(match.id),
+          index.get_name(match.id).c_str());
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,138 @@
+// Live metadata index, prints every record once and then every change as it happens (see include/watch.hpp).
+//
+// Build (Linux): g++ -std=c++17 -O2 -Iinclude -Ithird_party tools/watch.cpp -o doors-watch -pthread
+// Usage: doors-watch [options] <root>...
+//   --threads <n>            Workers of the initial scan (defaults to the hardware concurrency)
+//   --debounce <ms>          Quiet time before a changed file gets re-parsed (250)
+//   --cache <name>           Persistent metadata cache (see include/store.hpp), warms up the initial scan
+//
+// Lines start with '+' for new or modified files and '-' for removed ones. SIGINT/SIGTERM stop watching.
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include <compiler.hpp>
+using namespace compiler;
+
+#include <system/error.hpp>
+
+#define IMAGE_GIF_DETAIL
+#include <gif.hpp>
+
+#define IMAGE_EXIF_DETAIL
+#include <exif.hpp>
+
+#define IMAGE_JPG_DETAIL
+#include <jpg.hpp>
+
+#define IMAGE_BMP_DETAIL
+#include <bmp.hpp>
+
+#define IMAGE_PNG_DETAIL
+#include <png.hpp>
+
+#define IMAGE_TGA_DETAIL
+#include <tga.hpp>
+
+#define IMAGE_PSD_DETAIL
+#include <psd.hpp>
+
+#define PROBE_DETAIL
+#include <probe.hpp>
+
+#define DEDUP_DETAIL
+#include <dedup.hpp>
+
+#define STORE_DETAIL
+#include <store.hpp>
+
+#define FILTER_DETAIL
+#include <filter.hpp>
+
+#define SCAN_DETAIL
+#include <scan.hpp>
+
+#define WATCH_DETAIL
+#include <watch.hpp>
+
+static void print(doors::watch::change_kind_t kind, const char *name, const doors::record_t &record)
+{
+  std::printf("%c %s\t%s\t%ux%u\tbpp=%u\tframes=%u\tlayers=%u\tflags=%u\terror=%u\n",
+    kind == doors::watch::change_kind_t::updated ? '+' : '-',
+    name,
+    doors::get_format_sanitized((doors::format_t) record.format),
+    record.width,
+    record.height,
+    record.bpp,
+    record.frames,
+    record.layers,
+    record.flags,
+    record.error
+  );
+  std::fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  doors::watch::options_t options;
+  std::vector<std::string> roots;
+  const char *cache_name = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      options.scan.threads = std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--debounce") == 0 && i + 1 < argc)
+      options.debounce = (uint32_t) std::strtoul(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+      cache_name = argv[++i];
+    else
+      roots.emplace_back(argv[i]);
+  }
+
+  if (roots.empty()) {
+    std::fprintf(stderr, "Usage: %s [--threads <n>] [--debounce <ms>] [--cache <name>] <root>...\n", argv[0]);
+    return 1;
+  }
+
+  doors::store::store_t store;
+  if (cache_name != nullptr) {
+    if (store.open(cache_name) != doors::error_t::None) {
+      std::fprintf(stderr, "Couldn't open cache %s\n", cache_name);
+      return 1;
+    }
+
+    options.scan.store = &store;
+  }
+
+  // Blocked before any thread is spawned, so that every thread inherits the mask and only sigwait() sees them.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  doors::watch::watcher_t watcher;
+  if (watcher.start(roots, options, print) != doors::error_t::None) {
+    std::fprintf(stderr, "Couldn't watch the given roots\n");
+    return 1;
+  }
+
+  int signal;
+  sigwait(&signals, &signal);
+
+  watcher.stop();
+  watcher.wait();
+
+  std::fprintf(stderr, "Watched %zu file(s): %llu event(s), %llu parse(s), %llu resync(s)\n",
+    watcher.size(),
+    (unsigned long long) watcher.events(),
+    (unsigned long long) watcher.parses(),
+    (unsigned long long) watcher.resyncs()
+  );
+}